@@ -0,0 +1,312 @@
+#include "batch.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "dosvm.hpp"
+
+namespace {
+
+struct BatchJob {
+    int line;
+    std::string dir;
+    std::string program;
+    std::string args;
+};
+
+/*
+ * Host side of one job: files are opened relative to its directory and only
+ * its own handles can be used, handles 1 and 2 and the console are
+ * captured, and there is no input.
+ */
+struct JobIO : HostIO {
+    int dir_fd = -1;
+    std::string out;      // console and handle 1
+    std::string err;      // handle 2
+    std::set<int> files;  // open host fds, closed after the job
+
+    ssize_t console_writev(int fd, const struct iovec *iov, int n) override {
+        std::string &dst = fd == 2 ? err : out;
+        ssize_t total = 0;
+        for (int i = 0; i < n; i++) {
+            dst.append((const char *)iov[i].iov_base, iov[i].iov_len);
+            total += iov[i].iov_len;
+        }
+        return total;
+    }
+    int console_getc() override { return EOF; }
+    bool console_poll() override { return false; }
+
+    int open(const char *path, int flags, mode_t mode) override {
+        return take(::openat(dir_fd, path, flags | O_CLOEXEC, mode));
+    }
+    int openat(int dirfd, const char *path, int flags, mode_t mode) override {
+        return take(open_beneath(dirfd, path, flags | O_CLOEXEC, mode));
+    }
+    ssize_t read(int fd, void *p, size_t len) override {
+        if (fd <= 2) {
+            return 0;
+        }
+        return owned(fd) ? ::read(fd, p, len) : -1;
+    }
+    ssize_t write(int fd, const void *p, size_t len) override {
+        if (fd == 1 || fd == 2) {
+            (fd == 2 ? err : out).append((const char *)p, len);
+            return len;
+        }
+        return owned(fd) ? ::write(fd, p, len) : -1;
+    }
+    off_t lseek(int fd, off_t off, int whence) override {
+        return owned(fd) ? ::lseek(fd, off, whence) : -1;
+    }
+    int close(int fd) override {
+        if (fd <= 2) {
+            return 0;
+        }
+        if (!owned(fd)) {
+            return -1;
+        }
+        files.erase(fd);
+        return ::close(fd);
+    }
+
+    /* fd, just opened, is the job's from now on */
+    int take(int fd) {
+        if (fd >= 0) {
+            files.insert(fd);
+        }
+        return fd;
+    }
+    /* fds of other jobs and of the runner are not the guest's */
+    bool owned(int fd) {
+        if (files.count(fd)) {
+            return true;
+        }
+        errno = EBADF;
+        return false;
+    }
+    void close_all() {
+        for (int fd : files) {
+            ::close(fd);
+        }
+        files.clear();
+    }
+};
+
+/* s as a JSON string; bytes above 7Fh are taken as Latin-1 */
+void json_string(std::string *dst, const std::string &s) {
+    *dst += '"';
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\') {
+            *dst += '\\';
+            *dst += c;
+        } else if (c == '\n') {
+            *dst += "\\n";
+        } else if (c == '\r') {
+            *dst += "\\r";
+        } else if (c == '\t') {
+            *dst += "\\t";
+        } else if (c < 0x20 || c >= 0x7f) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            *dst += buf;
+        } else {
+            *dst += c;
+        }
+    }
+    *dst += '"';
+}
+
+struct Batch {
+    std::vector<BatchJob> jobs;
+    std::atomic<size_t> next{0};
+    Backend backend;
+    bool pin = false;
+    std::vector<int> cpus;  // allowed CPUs, for --pin
+
+    std::mutex out_lock;
+    FILE *results = nullptr;
+    int failed = 0;
+
+    void report(size_t index, int status, const char *stop, uint64_t ns,
+                const JobIO &io) {
+        const BatchJob &job = jobs[index];
+        std::string line;
+        char buf[128];
+        snprintf(buf, sizeof(buf), "{\"job\":%zu,\"line\":%d,\"dir\":", index,
+                 job.line);
+        line += buf;
+        json_string(&line, job.dir);
+        line += ",\"program\":";
+        json_string(&line, job.program);
+        line += ",\"args\":";
+        json_string(&line, job.args);
+        snprintf(buf, sizeof(buf),
+                 ",\"status\":%d,\"stop\":\"%s\",\"ms\":%.3f,\"stdout\":",
+                 status, stop, ns / 1e6);
+        line += buf;
+        json_string(&line, io.out);
+        line += ",\"stderr\":";
+        json_string(&line, io.err);
+        line += "}\n";
+
+        std::lock_guard<std::mutex> lk(out_lock);
+        fputs(line.c_str(), results);
+        fflush(results);
+        if (status != 0) {
+            failed++;
+        }
+    }
+
+    void worker(int index) {
+        if (pin && !cpus.empty()) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpus[index % cpus.size()], &set);
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        }
+
+        std::string error;
+        auto vm = create_vm(backend, &error);
+        bool fresh = true;
+        for (size_t i; (i = next++) < jobs.size();) {
+            const BatchJob &job = jobs[i];
+            JobIO io;
+            int status = 1;
+            const char *stop = "not_loaded";
+            uint64_t start = stats_now_ns();
+
+            io.dir_fd = ::open(job.dir.c_str(),
+                               O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (!vm) {
+                io.err = error + "\n";
+            } else if (io.dir_fd < 0) {
+                io.err = job.dir + ": " + strerror(errno) + "\n";
+            } else {
+                if (!fresh) {
+                    vm->reset();
+                }
+                fresh = false;
+                std::string path = job.program[0] == '/'
+                                       ? job.program
+                                       : job.dir + "/" + job.program;
+                vm->set_io(&io);
+                if (load_program(vm.get(), path.c_str(), job.args,
+                                 RunOptions())) {
+                    stop = stop_reason_name(run_vm(vm.get()));
+                    status = vm->exit_status;
+                }
+                vm->console.flush();
+                vm->set_io(nullptr);
+            }
+            io.close_all();
+            if (io.dir_fd >= 0) {
+                ::close(io.dir_fd);
+            }
+            report(i, status, stop, stats_now_ns() - start, io);
+        }
+    }
+};
+
+bool read_jobs(const std::string &path, std::vector<BatchJob> *jobs) {
+    FILE *fp = fopen(path.c_str(), "r");
+    if (!fp) {
+        perror(path.c_str());
+        return false;
+    }
+    char buf[4096];
+    int line = 0;
+    bool ok = true;
+    while (fgets(buf, sizeof(buf), fp)) {
+        line++;
+        buf[strcspn(buf, "\r\n")] = '\0';
+        char *p = buf + strspn(buf, " \t");
+        if (*p == '\0' || *p == '#') {
+            continue;
+        }
+        BatchJob job;
+        job.line = line;
+        size_t n = strcspn(p, " \t");
+        job.dir.assign(p, n);
+        p += n;
+        p += strspn(p, " \t");
+        n = strcspn(p, " \t");
+        job.program.assign(p, n);
+        p += n;
+        p += strspn(p, " \t");
+        job.args = p;
+        if (job.program.empty()) {
+            fprintf(stderr, "%s:%d: expected DIR PROGRAM [ARGS]\n",
+                    path.c_str(), line);
+            ok = false;
+            continue;
+        }
+        jobs->push_back(job);
+    }
+    fclose(fp);
+    return ok;
+}
+
+}  // namespace
+
+int batch_main(const std::string &jobs_path, int num_threads, bool pin,
+               Backend backend) {
+    Batch b;
+    b.backend = backend;
+    b.pin = pin;
+    if (!read_jobs(jobs_path, &b.jobs)) {
+        return 1;
+    }
+
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int c = 0; c < CPU_SETSIZE; c++) {
+            if (CPU_ISSET(c, &allowed)) {
+                b.cpus.push_back(c);
+            }
+        }
+    }
+    if (num_threads < 1) {
+        num_threads = b.cpus.empty() ? 1 : b.cpus.size();
+    }
+    if ((size_t)num_threads > b.jobs.size()) {
+        num_threads = std::max<size_t>(b.jobs.size(), 1);
+    }
+
+    /* results keep stdout to themselves, diagnostics go to stderr */
+    fflush(stdout);
+    int results_fd = dup(1);
+    if (results_fd < 0 || !(b.results = fdopen(results_fd, "w"))) {
+        perror("stdout");
+        return 1;
+    }
+    dup2(2, 1);
+
+    uint64_t start = stats_now_ns();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < num_threads; i++) {
+        threads.emplace_back(&Batch::worker, &b, i);
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    double s = (stats_now_ns() - start) / 1e9;
+
+    fclose(b.results);
+    fprintf(stderr, "%zu jobs, %d failed, %d threads, %.3f s, %.1f jobs/s\n",
+            b.jobs.size(), b.failed, num_threads, s,
+            s > 0 ? b.jobs.size() / s : 0.0);
+    return b.failed ? 1 : 0;
+}
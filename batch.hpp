@@ -0,0 +1,22 @@
+#pragma once
+
+#include <string>
+
+enum class Backend;
+
+/*
+ * vm --batch=FILE [-j N] [--pin] runs every job in FILE on a pool of N
+ * threads, each with one VM that is reset() between jobs.  A job is a line
+ *
+ *     DIR PROGRAM [ARGS]
+ *
+ * run with DIR as its current directory and the rest of the line as its
+ * command tail; blank lines and lines starting with '#' are skipped.  Each
+ * finished job is printed at once as a JSON line on stdout with its exit
+ * status, stop reason, wall time and captured output.  Guest stdin is
+ * empty.
+ */
+
+/* 0 if every job exited 0 */
+int batch_main(const std::string &jobs_path, int num_threads, bool pin,
+               Backend backend);
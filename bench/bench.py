@@ -0,0 +1,191 @@
+#!/usr/bin/env python3
+# Micro and macro benchmarks of the VM, results as JSON.
+#
+#   bench/bench.py [-o FILE] [--backends kvm,jit,interp] [--runs N]
+#                  [--scale F]
+#
+# micro  INT 21h round trip per function, INT 13h and DOSIO_READ (INT 25h)
+#        sector throughput, console output and host file I/O throughput,
+#        run by the guests in this directory
+# macro  the dos-1.25 MSDOS.SYS and COMMAND.COM builds, boot to the prompt
+#
+# Every number is the best of --runs runs.  Per-call and throughput numbers
+# subtract the same guest run with no work, so VM startup is not counted.
+# The disk and boot benchmarks need the floppy, which needs mkfs.fat and
+# mcopy like dos-1.25 does; they are skipped without it.  Compare two
+# result files with bench/compare.py.
+
+import argparse
+import datetime
+import json
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+BENCH = os.path.dirname(os.path.abspath(__file__))
+ROOT = os.path.dirname(BENCH)
+VM = os.path.join(ROOT, "vm")
+
+INT21_FUNCTIONS = ["19", "2A", "30", "37"]
+DISK_BYTES = 640 * 512  # one pass over the 320K floppy
+
+
+def usable(backend):
+    return backend != "kvm" or os.access("/dev/kvm", os.W_OK)
+
+
+def run_time(cmd, cwd, stdin=b""):
+    """wall seconds of one run of cmd, which must succeed"""
+    start = time.perf_counter()
+    r = subprocess.run(cmd, cwd=cwd, input=stdin, stdout=subprocess.DEVNULL,
+                       stderr=subprocess.PIPE)
+    end = time.perf_counter()
+    if r.returncode != 0:
+        raise RuntimeError("%s: exit %d\n%s" % (
+            " ".join(cmd), r.returncode, r.stderr.decode(errors="replace")))
+    return end - start
+
+
+class Bench:
+    def __init__(self, args, tmp):
+        self.runs = args.runs
+        self.scale = args.scale
+        self.tmp = tmp
+        self.results = []
+
+    def best(self, cmd, stdin=b"", setup=None):
+        t = None
+        for _ in range(self.runs):
+            if setup:
+                setup()
+            s = run_time(cmd, self.tmp, stdin)
+            t = s if t is None else min(t, s)
+        return t
+
+    def count(self, n):
+        return max(1, int(n * self.scale))
+
+    def record(self, backend, kind, name, value, unit, better):
+        self.results.append({"backend": backend, "kind": kind, "name": name,
+                             "value": value, "unit": unit, "better": better})
+        print("%-8s %-6s %-20s %14.3f %s" % (backend, kind, name, value, unit),
+              flush=True)
+
+    def guest(self, backend, program, tail):
+        return self.best([VM, "--backend=" + backend,
+                          os.path.join(BENCH, program), tail])
+
+    def micro(self, backend):
+        calls = self.count(20000)
+        for fn in INT21_FUNCTIONS:
+            t = self.guest(backend, "H21.EXE", "%s %d" % (fn, calls))
+            t0 = self.guest(backend, "H21.EXE", "%s 0" % fn)
+            self.record(backend, "micro", "int21_%sh" % fn.lower(),
+                        max(t - t0, 0) / calls * 1e9, "ns/call", "lower")
+
+        lines = self.count(20000)
+        t = self.guest(backend, "CONOUT.EXE", str(lines))
+        t0 = self.guest(backend, "CONOUT.EXE", "0")
+        self.record(backend, "micro", "console_write",
+                    lines * 512 / max(t - t0, 1e-9) / 1e6, "MB/s", "higher")
+
+        blocks = self.count(1024)
+        t = self.guest(backend, "FILEIO.EXE", str(blocks))
+        t0 = self.guest(backend, "FILEIO.EXE", "0")
+        self.record(backend, "micro", "file_write_read",
+                    2 * blocks * 32768 / max(t - t0, 1e-9) / 1e6, "MB/s",
+                    "higher")
+
+    def boot(self, backend, typed):
+        image = os.path.join(self.tmp, "floppy")
+
+        def fresh_floppy():
+            shutil.copyfile(os.path.join(BENCH, "floppy"), image)
+
+        # answer the date and time prompts, then EOF ends the session
+        return self.best([VM, "--backend=" + backend, image],
+                         b"\r\r" + typed, fresh_floppy)
+
+    def disk(self, backend):
+        t0 = self.boot(backend, b"")
+        self.record(backend, "macro", "boot_to_prompt", t0, "s", "lower")
+        passes = self.count(200)
+        for fn, name in (("13", "int13_read"), ("25", "dosio_read")):
+            t = self.boot(backend, b"DISK %s %d\r" % (fn.encode(), passes))
+            self.record(backend, "micro", name,
+                        passes * DISK_BYTES / max(t - t0, 1e-9) / 1e6, "MB/s",
+                        "higher")
+
+    def dos_build(self, backend):
+        src = os.path.join(ROOT, "dos-1.25")
+        work = os.path.join(self.tmp, "dos-1.25")
+        if not os.path.exists(work):
+            os.mkdir(work)
+            for f in os.listdir(src):
+                if f.endswith("_ORIG.ASM") or f in ("STDDOS.ASM", "MSDOS.ASM",
+                                                   "fixzero.py", "Makefile"):
+                    shutil.copy(os.path.join(src, f), work)
+            os.symlink(os.path.join(ROOT, "dos-2.0-bin"),
+                       os.path.join(self.tmp, "dos-2.0-bin"))
+        vm = "VM=%s --backend=%s" % (VM, backend)
+        for target, name in (("MSDOS.SYS", "build_msdos_sys"),
+                             ("COMMAND.COM", "build_command_com")):
+            t = None
+            for _ in range(self.runs):
+                subprocess.run(["make", "-s", "clean"], cwd=work,
+                               stdout=subprocess.DEVNULL)
+                s = run_time(["make", "-s", vm, target], work)
+                t = s if t is None else min(t, s)
+            self.record(backend, "macro", name, t, "s", "lower")
+
+
+def main():
+    p = argparse.ArgumentParser()
+    p.add_argument("-o", "--output", default=os.path.join(BENCH,
+                                                          "results.json"))
+    p.add_argument("--backends", default="kvm,jit,interp")
+    p.add_argument("--runs", type=int, default=3)
+    p.add_argument("--scale", type=float, default=1.0,
+                   help="multiply the amount of work in micro benchmarks")
+    args = p.parse_args()
+
+    backends = [b for b in args.backends.split(",") if usable(b)]
+    if not backends:
+        sys.exit("no usable backend")
+
+    # the guests are built by the VM, with the first backend
+    build_vm = "VM=../vm --backend=" + backends[0]
+    r = subprocess.run(["make", "-s", "-C", BENCH, build_vm, "guests"],
+                       stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    if r.returncode != 0:
+        sys.exit(r.stdout.decode(errors="replace"))
+    have_floppy = subprocess.run(["make", "-s", "-C", BENCH, build_vm,
+                                  "floppy"], stdout=subprocess.DEVNULL,
+                                 stderr=subprocess.DEVNULL).returncode == 0
+    if not have_floppy:
+        print("no floppy (mkfs.fat and mcopy?), skipping disk and boot",
+              file=sys.stderr)
+
+    with tempfile.TemporaryDirectory() as tmp:
+        b = Bench(args, tmp)
+        for backend in backends:
+            b.micro(backend)
+            if have_floppy:
+                b.disk(backend)
+            b.dos_build(backend)
+
+    commit = subprocess.run(["git", "-C", ROOT, "rev-parse", "--short",
+                             "HEAD"], stdout=subprocess.PIPE,
+                            stderr=subprocess.DEVNULL).stdout.decode().strip()
+    with open(args.output, "w") as f:
+        now = datetime.datetime.now().isoformat(timespec="seconds")
+        json.dump({"date": now, "commit": commit, "runs": args.runs, "scale": args.scale,
+                   "results": b.results}, f, indent=2)
+        f.write("\n")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,62 @@
+#!/usr/bin/env python3
+# Compare two bench/bench.py result files and flag regressions.
+#
+#   bench/compare.py BASELINE CURRENT [--threshold PERCENT]
+#
+# A benchmark regresses when it got worse than the baseline by more than
+# PERCENT (10) in its "better" direction.  Exits 1 if any did, so it can
+# gate a change.
+
+import argparse
+import json
+import sys
+
+
+def load(path):
+    with open(path) as f:
+        return {(r["backend"], r["name"]): r for r in json.load(f)["results"]}
+
+
+def main():
+    p = argparse.ArgumentParser()
+    p.add_argument("baseline")
+    p.add_argument("current")
+    p.add_argument("--threshold", type=float, default=10.0,
+                   help="percent change that counts as a regression")
+    args = p.parse_args()
+
+    base = load(args.baseline)
+    cur = load(args.current)
+
+    regressions = 0
+    print("%-8s %-20s %14s %14s %8s" % ("backend", "name", "baseline",
+                                        "current", "change"))
+    for key, r in cur.items():
+        b = base.get(key)
+        if b is None:
+            print("%-8s %-20s %14s %14.3f %8s  new" % (key[0], key[1], "-",
+                                                        r["value"], ""))
+            continue
+        change = (r["value"] - b["value"]) / b["value"] * 100 if b["value"] \
+            else 0.0
+        worse = change if r["better"] == "lower" else -change
+        flag = ""
+        if worse > args.threshold:
+            flag = "  REGRESSION"
+            regressions += 1
+        elif worse < -args.threshold:
+            flag = "  improved"
+        print("%-8s %-20s %14.3f %14.3f %+7.1f%%%s" % (
+            key[0], key[1], b["value"], r["value"], change, flag))
+    for key in base:
+        if key not in cur:
+            print("%-8s %-20s %14.3f %14s %8s  missing" % (
+                key[0], key[1], base[key]["value"], "-", ""))
+
+    if regressions:
+        print("%d regression(s) over %.0f%%" % (regressions, args.threshold))
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,27 @@
+#!/bin/sh
+# Time the dos-1.25 build (MASM, LINK and EXE2BIN of MSDOS.SYS and
+# COMMAND.COM, all run in the VM) once per backend, and check that every
+# backend produces the same files.
+#
+#   ./bench_backends.sh [BACKEND...]    default: kvm jit interp
+
+cd "$(dirname "$0")/dos-1.25" || exit 1
+backends=${*:-"kvm jit interp"}
+
+printf '%-8s %10s  %s\n' backend seconds 'md5 of MSDOS.SYS + COMMAND.COM'
+for b in $backends; do
+    if [ "$b" = kvm ] && [ ! -w /dev/kvm ]; then
+        printf '%-8s %10s\n' "$b" 'no kvm'
+        continue
+    fi
+    rm -f *.OBJ *.EXE *.BIN MSDOS.SYS COMMAND.COM
+    start=$(date +%s.%N)
+    if ! make -s VM="../vm --backend=$b" MSDOS.SYS COMMAND.COM >/dev/null 2>&1
+    then
+        printf '%-8s %10s\n' "$b" failed
+        continue
+    fi
+    end=$(date +%s.%N)
+    sum=$(cat MSDOS.SYS COMMAND.COM | md5sum | cut -d' ' -f1)
+    printf '%-8s %10.3f  %s\n' "$b" "$(awk "BEGIN { print $end - $start }")" "$sum"
+done
@@ -0,0 +1,459 @@
+#include "cache.hpp"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <map>
+#include <set>
+#include <vector>
+
+#include "dosvm.hpp"
+
+namespace {
+
+/* input sets kept per program and arguments, newest first */
+constexpr size_t MAX_ENTRIES = 16;
+
+struct Input {
+    std::string name;  // as the guest opened it
+    int64_t size;      // -1: could not be opened
+    uint64_t hash;
+};
+
+uint64_t fnv1a(const void *p, size_t len, uint64_t h = 0xcbf29ce484222325) {
+    auto b = (const uint8_t *)p;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ b[i]) * 0x100000001b3;
+    }
+    return h;
+}
+
+std::string hex(uint64_t h) {
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016" PRIx64, h);
+    return buf;
+}
+
+std::string upper(const std::string &s) {
+    std::string u;
+    for (char c : s) {
+        u += toupper((unsigned char)c);
+    }
+    return u;
+}
+
+/* size and hash of what fd has now; false if it is no plain file */
+bool hash_fd(int fd, Input *in) {
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        return false;
+    }
+    in->size = st.st_size;
+    in->hash = fnv1a(nullptr, 0);
+    if (st.st_size > 0) {
+        std::shared_lock<std::shared_mutex> lk(mapping_lock());
+        auto map = map_file(fd);
+        if (!map) {
+            return false;
+        }
+        in->size = map->size;
+        in->hash = fnv1a(map->data, map->size);
+    }
+    return true;
+}
+
+/* name as a run would see it now */
+Input hash_name(const std::string &name) {
+    Input in = {name, -1, 0};
+    int fd = ::open(name.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        if (!hash_fd(fd, &in)) {
+            in.size = -2;  // never matches a recorded input
+        }
+        ::close(fd);
+    }
+    return in;
+}
+
+bool read_file(const std::string &path, std::string *data) {
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (!fp) {
+        return false;
+    }
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        data->append(buf, n);
+    }
+    bool ok = !ferror(fp);
+    fclose(fp);
+    return ok;
+}
+
+/* path with data, or as it was if that fails */
+bool write_file(const std::string &path, const std::string &data) {
+    std::string tmp = path + ".tmp" + std::to_string(getpid());
+    FILE *fp = fopen(tmp.c_str(), "wb");
+    if (!fp) {
+        perror(tmp.c_str());
+        return false;
+    }
+    bool ok = fwrite(data.data(), 1, data.size(), fp) == data.size();
+    if (fclose(fp) != 0) {
+        ok = false;
+    }
+    if (!ok || rename(tmp.c_str(), path.c_str()) < 0) {
+        perror(path.c_str());
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Host side of a run being recorded: everything goes to the host as usual,
+ * with the console output kept and every open noted.
+ */
+struct RecordingIO : HostIO {
+    std::vector<Input> inputs;
+    std::vector<std::string> outputs;
+    std::set<std::string> opened;   // upper-case names, read
+    std::set<std::string> created;  // and written
+    std::string out;
+    std::string err;
+    bool cacheable = true;
+
+    ssize_t console_writev(int fd, const struct iovec *iov, int n) override {
+        std::string &dst = fd == 2 ? err : out;
+        for (int i = 0; i < n; i++) {
+            dst.append((const char *)iov[i].iov_base, iov[i].iov_len);
+        }
+        return HostIO::console_writev(fd, iov, n);
+    }
+    int console_getc() override {
+        cacheable = false;
+        return HostIO::console_getc();
+    }
+    bool console_poll() override {
+        cacheable = false;
+        return HostIO::console_poll();
+    }
+
+    int open(const char *path, int flags, mode_t mode) override {
+        return note(path, flags, HostIO::open(path, flags, mode));
+    }
+    int openat(int dirfd, const char *path, int flags, mode_t mode) override {
+        return note(beneath_path(dirfd, path), flags,
+                    HostIO::openat(dirfd, path, flags, mode));
+    }
+    /* fd, path opened with flags, as an input or an output */
+    int note(const std::string &path, int flags, int fd) {
+        std::string k = upper(path);
+        if (flags & O_CREAT) {
+            if (fd >= 0 && created.insert(k).second) {
+                outputs.push_back(path);
+            }
+        } else if ((flags & O_ACCMODE) != O_RDONLY) {
+            cacheable = false;  // changes a file in place
+        } else if (!created.count(k) && opened.insert(k).second) {
+            Input in = {path, -1, 0};
+            if (fd >= 0 && !hash_fd(fd, &in)) {
+                cacheable = false;
+            }
+            inputs.push_back(in);
+        }
+        return fd;
+    }
+    ssize_t read(int fd, void *p, size_t len) override {
+        if (fd == 0) {
+            cacheable = false;
+        }
+        return HostIO::read(fd, p, len);
+    }
+    ssize_t write(int fd, const void *p, size_t len) override {
+        if (fd == 1 || fd == 2) {
+            (fd == 2 ? err : out).append((const char *)p, len);
+        }
+        return HostIO::write(fd, p, len);
+    }
+};
+
+/* the result a set of inputs gives under key */
+uint64_t result_id(uint64_t key, const std::vector<Input> &inputs) {
+    uint64_t h = fnv1a(&key, sizeof(key));
+    for (const auto &in : inputs) {
+        h = fnv1a(in.name.c_str(), in.name.size() + 1, h);
+        h = fnv1a(&in.size, sizeof(in.size), h);
+        h = fnv1a(&in.hash, sizeof(in.hash), h);
+    }
+    return h;
+}
+
+/*
+ * A manifest is a list of entries
+ *
+ *     RESULT N
+ *     SIZE HASH NAME    (N of them, SIZE -1 for a name that wasn't there)
+ */
+struct Entry {
+    std::string result;
+    std::vector<Input> inputs;
+};
+
+std::vector<Entry> parse_manifest(const std::string &text) {
+    std::vector<Entry> entries;
+    size_t at = 0;
+    auto next_line = [&](std::string *line) {
+        if (at >= text.size()) {
+            return false;
+        }
+        size_t end = text.find('\n', at);
+        if (end == std::string::npos) {
+            end = text.size();
+        }
+        *line = text.substr(at, end - at);
+        at = end + 1;
+        return true;
+    };
+    std::string line;
+    while (next_line(&line)) {
+        char result[17];
+        unsigned n;
+        if (sscanf(line.c_str(), "%16s %u", result, &n) != 2) {
+            break;
+        }
+        Entry e;
+        e.result = result;
+        for (unsigned i = 0; i < n && next_line(&line); i++) {
+            Input in;
+            int name_at;
+            if (sscanf(line.c_str(), "%" SCNd64 " %" SCNx64 " %n", &in.size,
+                       &in.hash, &name_at) != 2) {
+                return entries;
+            }
+            in.name = line.substr(name_at);
+            e.inputs.push_back(in);
+        }
+        if (e.inputs.size() != n) {
+            break;
+        }
+        entries.push_back(e);
+    }
+    return entries;
+}
+
+/*
+ * A result is
+ *
+ *     status N
+ *     stdout LEN      then LEN bytes
+ *     stderr LEN      then LEN bytes
+ *     file LEN NAME   then LEN bytes, once per output
+ */
+struct Result {
+    int status = 0;
+    std::string out;
+    std::string err;
+    std::vector<std::pair<std::string, std::string>> files;
+};
+
+bool parse_result(const std::string &text, Result *r) {
+    size_t at = 0;
+    auto header = [&](std::string *line) {
+        size_t end = text.find('\n', at);
+        if (end == std::string::npos) {
+            return false;
+        }
+        *line = text.substr(at, end - at);
+        at = end + 1;
+        return true;
+    };
+    auto body = [&](size_t len, std::string *dst) {
+        if (len > text.size() - at) {
+            return false;
+        }
+        *dst = text.substr(at, len);
+        at += len;
+        return true;
+    };
+    std::string line;
+    size_t len;
+    if (!header(&line) || sscanf(line.c_str(), "status %d", &r->status) != 1) {
+        return false;
+    }
+    if (!header(&line) || sscanf(line.c_str(), "stdout %zu", &len) != 1 ||
+        !body(len, &r->out)) {
+        return false;
+    }
+    if (!header(&line) || sscanf(line.c_str(), "stderr %zu", &len) != 1 ||
+        !body(len, &r->err)) {
+        return false;
+    }
+    while (at < text.size()) {
+        int name_at;
+        std::string data;
+        if (!header(&line) ||
+            sscanf(line.c_str(), "file %zu %n", &len, &name_at) != 1 ||
+            !body(len, &data)) {
+            return false;
+        }
+        r->files.emplace_back(line.substr(name_at), data);
+    }
+    return true;
+}
+
+void write_all(int fd, const std::string &data) {
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+}
+
+/* put back what the run did; false if the result is unusable */
+bool replay(const std::string &path, int *status,
+            std::vector<std::string> *outputs) {
+    std::string text;
+    Result r;
+    if (!read_file(path, &text) || !parse_result(text, &r)) {
+        return false;
+    }
+    for (const auto &f : r.files) {
+        if (!write_file(f.first, f.second)) {
+            return false;
+        }
+        outputs->push_back(f.first);
+    }
+    write_all(1, r.out);
+    write_all(2, r.err);
+    *status = r.status;
+    return true;
+}
+
+void store(const std::string &dir, uint64_t key, const RecordingIO &io,
+           int status, std::vector<Entry> entries) {
+    std::string result;
+    result += "status " + std::to_string(status) + "\n";
+    result += "stdout " + std::to_string(io.out.size()) + "\n" + io.out;
+    result += "stderr " + std::to_string(io.err.size()) + "\n" + io.err;
+    for (const auto &name : io.outputs) {
+        std::string data;
+        if (!read_file(name, &data)) {
+            return;  // gone already, keep nothing
+        }
+        result += "file " + std::to_string(data.size()) + " " + name + "\n";
+        result += data;
+    }
+    std::string id = hex(result_id(key, io.inputs));
+    if (!write_file(dir + "/" + id + ".result", result)) {
+        return;
+    }
+
+    Entry e;
+    e.result = id;
+    e.inputs = io.inputs;
+    entries.insert(entries.begin(), e);
+    if (entries.size() > MAX_ENTRIES) {
+        entries.resize(MAX_ENTRIES);
+    }
+    std::string manifest;
+    for (const auto &entry : entries) {
+        manifest += entry.result + " " + std::to_string(entry.inputs.size()) +
+                    "\n";
+        for (const auto &in : entry.inputs) {
+            char buf[64];
+            snprintf(buf, sizeof(buf), "%" PRId64 " %016" PRIx64 " ", in.size,
+                     in.hash);
+            manifest += buf + in.name + "\n";
+        }
+    }
+    write_file(dir + "/" + hex(key) + ".manifest", manifest);
+}
+
+}  // namespace
+
+int cached_run(const std::string &cache_dir, Backend backend,
+               const char *path, const std::string &dos_argv,
+               const RunOptions &opts) {
+    /* the program and its arguments pick the manifest */
+    std::string image;
+    uint64_t key = 0;
+    bool usable = read_file(path, &image);
+    if (usable) {
+        const char tag[] = "dosvm result cache 1";
+        key = fnv1a(tag, sizeof(tag));
+        key = fnv1a(image.data(), image.size(), key);
+        key = fnv1a(dos_argv.c_str(), dos_argv.size() + 1, key);
+    }
+
+    std::vector<Entry> entries;
+    std::string manifest;
+    if (usable && read_file(cache_dir + "/" + hex(key) + ".manifest",
+                            &manifest)) {
+        entries = parse_manifest(manifest);
+    }
+    std::map<std::string, Input> now;  // each name hashed once
+    for (const auto &e : entries) {
+        bool hit = true;
+        for (const auto &in : e.inputs) {
+            auto it = now.find(in.name);
+            if (it == now.end()) {
+                it = now.emplace(in.name, hash_name(in.name)).first;
+            }
+            if (it->second.size != in.size || it->second.hash != in.hash) {
+                hit = false;
+                break;
+            }
+        }
+        int status;
+        std::vector<std::string> outputs;
+        if (hit && replay(cache_dir + "/" + e.result + ".result", &status,
+                          &outputs)) {
+            if (!opts.deps.empty()) {
+                /* what the run would have noted */
+                DepsFile deps(opts.deps);
+                deps.input(path);
+                for (const auto &in : e.inputs) {
+                    if (in.size >= 0) {
+                        deps.input(in.name);
+                    }
+                }
+                for (const auto &name : outputs) {
+                    deps.output(name);
+                }
+            }
+            return status;
+        }
+    }
+
+    std::string error;
+    auto vm = create_vm(backend, &error);
+    if (!vm) {
+        fprintf(stderr, "%s\n", error.c_str());
+        return 1;
+    }
+    RecordingIO io;
+    vm->set_io(&io);
+    int status = run_program(vm.get(), path, dos_argv, opts);
+    vm->set_io(nullptr);
+
+    /* a booted floppy reads sectors, which are not recorded */
+    if (usable && io.cacheable && vm->stop_reason == StopReason::DOS_EXIT &&
+        vm->run_mode != RUN_MODE::DOS_KERNEL) {
+        if (mkdir(cache_dir.c_str(), 0755) < 0 && errno != EEXIST) {
+            perror(cache_dir.c_str());
+        } else {
+            store(cache_dir, key, io, status, entries);
+        }
+    }
+    return status;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <string>
+
+#include "vm.hpp"
+
+/*
+ * vm --cache=DIR PROGRAM [ARGS] remembers what a run of PROGRAM did, as
+ * ccache does for a compiler.  A run is known by the program image, its
+ * arguments and every file it opened to read (AH=3Dh), by name and content
+ * hash, including the ones it looked for and did not find.  For it the
+ * cache keeps the files it created (AH=3Ch), its stdout and stderr and its
+ * exit status.
+ *
+ * DIR holds, per program and arguments, a manifest of the input sets seen
+ * so far, and per input set the result.  When every input of one set still
+ * hashes the same, the result is written back and no VM is created.
+ *
+ * Runs that read the console, open an existing file to write or do not end
+ * with a DOS exit are not kept.  Hashes are 64-bit FNV-1a with the size
+ * alongside, not cryptographic; cache only trusted trees.
+ */
+
+/* as run_program() */
+int cached_run(const std::string &cache_dir, Backend backend,
+               const char *path, const std::string &dos_argv,
+               const RunOptions &opts);
@@ -0,0 +1,208 @@
+#include "console.hpp"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <mutex>
+
+#include "hostio.hpp"
+#include "stats.hpp"
+#include "timeline.hpp"
+
+namespace {
+
+std::mutex live_lock;
+Console *live_head = nullptr;
+bool atexit_installed = false;
+
+size_t round_up_pow2(size_t n) {
+    size_t r = 256;
+    while (r < n) {
+        r <<= 1;
+    }
+    return r;
+}
+
+}  // namespace
+
+bool parse_console_policy(const std::string &spec, ConsolePolicy *policy) {
+    ConsolePolicy p = *policy;
+    p.on_input = false;
+    p.on_newline = false;
+    p.size = 0;
+    p.timeout_ms = 0;
+
+    size_t pos = 0;
+    while (pos <= spec.size()) {
+        size_t end = spec.find(',', pos);
+        if (end == std::string::npos) {
+            end = spec.size();
+        }
+        std::string tok = spec.substr(pos, end - pos);
+        pos = end + 1;
+
+        if (tok == "input") {
+            p.on_input = true;
+        } else if (tok == "newline") {
+            p.on_newline = true;
+        } else if (tok.compare(0, 5, "size=") == 0) {
+            p.size = strtoul(tok.c_str() + 5, nullptr, 0);
+        } else if (tok.compare(0, 8, "timeout=") == 0) {
+            p.timeout_ms = atoi(tok.c_str() + 8);
+        } else if (tok == "none" || tok.empty()) {
+        } else {
+            return false;
+        }
+    }
+
+    *policy = p;
+    return true;
+}
+
+Console::Console(int fd) : fd(fd) {
+    is_tty = isatty(fd);
+    set_policy(ConsolePolicy());
+
+    std::lock_guard<std::mutex> lk(live_lock);
+    if (!atexit_installed) {
+        atexit(Console::flush_all);
+        atexit_installed = true;
+    }
+    next_live = live_head;
+    if (live_head) {
+        live_head->prev_live = this;
+    }
+    live_head = this;
+}
+
+Console::~Console() {
+    flush();
+
+    std::lock_guard<std::mutex> lk(live_lock);
+    if (prev_live) {
+        prev_live->next_live = next_live;
+    } else {
+        live_head = next_live;
+    }
+    if (next_live) {
+        next_live->prev_live = prev_live;
+    }
+}
+
+void Console::set_policy(const ConsolePolicy &p) {
+    flush();
+    policy = p;
+    flush_newline = policy.on_newline && is_tty;
+    buf.assign(round_up_pow2(policy.capacity), 0);
+    mask = buf.size() - 1;
+    head = 0;
+    used = 0;
+}
+
+void Console::flush_all() {
+    std::lock_guard<std::mutex> lk(live_lock);
+    for (Console *c = live_head; c; c = c->next_live) {
+        c->flush();
+    }
+}
+
+void Console::append(const uint8_t *src, size_t len) {
+    while (len > 0) {
+        if (used == buf.size()) {
+            flush();
+        }
+        if (used == 0) {
+            clock_gettime(CLOCK_MONOTONIC_COARSE, &oldest);
+        }
+        size_t tail = (head + used) & mask;
+        size_t n = std::min(len, std::min(buf.size() - used, buf.size() - tail));
+        memcpy(&buf[tail], src, n);
+        used += n;
+        src += n;
+        len -= n;
+    }
+}
+
+void Console::write(const void *p, size_t len) {
+    auto src = (const uint8_t *)p;
+
+    if (flush_newline) {
+        /* keep the tty line discipline: everything up to the last '\n' now */
+        auto last = (const uint8_t *)memrchr(src, '\n', len);
+        if (last) {
+            size_t n = last - src + 1;
+            append(src, n);
+            flush();
+            src += n;
+            len -= n;
+        }
+    }
+    append(src, len);
+
+    if (policy.size && used >= policy.size) {
+        flush();
+    }
+}
+
+size_t Console::write_dollar(const uint8_t *p, size_t max) {
+    auto end = (const uint8_t *)memchr(p, '$', max);
+    size_t n = end ? end - p : max;
+    write(p, n);
+    return n;
+}
+
+void Console::tick() {
+    if (used == 0 || policy.timeout_ms == 0) {
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    long ms = (now.tv_sec - oldest.tv_sec) * 1000 +
+              (now.tv_nsec - oldest.tv_nsec) / 1000000;
+    if (ms >= policy.timeout_ms) {
+        flush();
+    }
+}
+
+void Console::flush() {
+    if (used == 0) {
+        return;
+    }
+    uint64_t start = flush_stats ? stats_now_ns() : 0;
+    while (used > 0) {
+        struct iovec iov[2];
+        int n = 1;
+        size_t first = std::min(used, buf.size() - head);
+        iov[0].iov_base = &buf[head];
+        iov[0].iov_len = first;
+        if (first < used) {
+            iov[1].iov_base = &buf[0];
+            iov[1].iov_len = used - first;
+            n = 2;
+        }
+
+        TimelineSpan span(timeline, "writev", "host");
+        span.arg("fd", fd);
+        span.arg("bytes", used);
+        ssize_t r = io ? io->console_writev(fd, iov, n) : writev(fd, iov, n);
+        span.arg("ret", r);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            /* nobody is listening, drop the output */
+            head = 0;
+            used = 0;
+            break;
+        }
+        head = (head + r) & mask;
+        used -= r;
+    }
+    if (flush_stats) {
+        flush_stats->add(stats_now_ns() - start);
+    }
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+
+struct Histogram;
+struct HostIO;
+class Timeline;
+
+/*
+ * Guest console output. Every text path (INT 10h AH=0Eh, INT 21h AH=02h/09h,
+ * AH=40h to stdout, the DOS driver's DOSIO_OUTP) appends to a ring buffer that
+ * is drained to the host fd with writev() according to ConsolePolicy.
+ * Buffers still pending at exit() are drained from an atexit hook.
+ */
+
+struct ConsolePolicy {
+    bool on_input = true;    // before the guest waits for keyboard input
+    bool on_newline = true;  // after '\n', only when the fd is a tty
+    size_t size = 4096;      // when this many bytes are pending, 0 = never
+    int timeout_ms = 50;     // pending bytes older than this, 0 = never
+    size_t capacity = 64 * 1024;
+};
+
+/* "input,newline,size=N,timeout=MS" or "none"; false on a bad token */
+bool parse_console_policy(const std::string &spec, ConsolePolicy *policy);
+
+class Console {
+   public:
+    explicit Console(int fd = 1);
+    ~Console();
+    Console(const Console &) = delete;
+    Console &operator=(const Console &) = delete;
+
+    void set_policy(const ConsolePolicy &policy);
+
+    void put(uint8_t c) {
+        if (used == buf.size()) {
+            flush();
+        }
+        if (used == 0) {
+            clock_gettime(CLOCK_MONOTONIC_COARSE, &oldest);
+        }
+        buf[(head + used) & mask] = c;
+        used++;
+
+        if ((c == '\n' && flush_newline) ||
+            (policy.size && used >= policy.size)) {
+            flush();
+        }
+    }
+
+    void write(const void *p, size_t len);
+
+    /*
+     * Write the '$'-terminated string at p, looking at no more than max
+     * bytes. Returns the number of bytes written (without the '$').
+     */
+    size_t write_dollar(const uint8_t *p, size_t max);
+
+    /* guest is about to read the keyboard */
+    void before_input() {
+        if (policy.on_input && used) {
+            flush();
+        }
+    }
+
+    /* called once per VM exit, handles the timeout policy */
+    void tick();
+
+    void flush();
+
+    /* time each flush() that writes into h, null to stop */
+    void set_stats(Histogram *h) { flush_stats = h; }
+    /* record each writev(2) on tl, null to stop */
+    void set_timeline(Timeline *tl) { timeline = tl; }
+    /* write through io instead of writev(2), null for writev(2) again */
+    void set_io(HostIO *h) { io = h; }
+
+    /* drain every live Console, installed with atexit() */
+    static void flush_all();
+
+   private:
+    void append(const uint8_t *src, size_t len);
+
+    int fd;
+    bool is_tty;
+    bool flush_newline;
+    ConsolePolicy policy;
+
+    std::vector<uint8_t> buf;
+    size_t mask;
+    size_t head = 0;  // oldest pending byte
+    size_t used = 0;
+    struct timespec oldest = {};
+    Histogram *flush_stats = nullptr;
+    Timeline *timeline = nullptr;
+    HostIO *io = nullptr;
+
+    Console *next_live = nullptr;  // for the atexit drain
+    Console *prev_live = nullptr;
+};
@@ -1,3 +1,5 @@
+#include <errno.h>
+
 #include "vm.hpp"
 
 void CPU::setup(const AddrConfig &config, RUN_MODE mode) {
@@ -30,8 +32,8 @@ void CPU::setup(const AddrConfig &config, RUN_MODE mode) {
     }
 }
 
-static void handle_exit_hlt(const AddrConfig &config, CPU *cpu,
-                            ExitReason *ret) {
+/* rip points past the hlt: tell which hypercall the guest made */
+void decode_hlt_exit(const AddrConfig &config, CPU *cpu, ExitReason *ret) {
     auto &regs = cpu->regs;
     auto &sregs = cpu->sregs;
     uint32_t rip = regs.rip;
@@ -55,55 +57,111 @@ static void handle_exit_hlt(const AddrConfig &config, CPU *cpu,
         fprintf(stderr, "unknown hlt %04x:%04x\n", (int)sregs.cs.base,
                 (int)regs.rip);
         dump_regs(cpu);
-        exit(1);
+        ret->code = ExitCode::FAULT;
     }
 }
 
-ExitReason run(VM *vm, bool single_step) {
+bool handle_kick(VM *vm) {
+    CPU *cpu = vm->cpu.get();
+    /* the signals are sent to this thread, so they can't slip in between */
+    int kicks = __atomic_exchange_n(&cpu->kick_pending, 0, __ATOMIC_SEQ_CST);
+    if ((kicks & KICK_SAMPLE) && vm->profiler) {
+        vm->profiler->sample(vm);
+    }
+    return kicks & KICK_DEADLINE;
+}
+
+/* a KVM exit the VM can't handle */
+static ExitReason kvm_fault(VM *vm, StopReason why) {
+    vm->stop(why, 1);
+    ExitReason ret;
+    ret.code = ExitCode::FAULT;
+    return ret;
+}
+
+ExitReason KvmCPU::run(VM *vm, bool single_step) {
     const AddrConfig &config = vm->addr_config;
-    vm->cpu->restore_regs_to_vm();
+    Stats *stats = vm->stats.get();
+    uint64_t t = stats ? stats_now_ns() : 0;
+    restore_regs_to_vm();
+    if (stats) {
+        uint64_t now = stats_now_ns();
+        stats->regs_set.add(now - t);
+        t = now;
+    }
 
     if (single_step) {
         struct kvm_guest_debug single_step = {};
         single_step.control = KVM_GUESTDBG_ENABLE | KVM_GUESTDBG_SINGLESTEP;
-        ioctl(vm->cpu->vcpu_fd, KVM_SET_GUEST_DEBUG, &single_step);
-        disasm(vm);
+        ioctl(vcpu_fd, KVM_SET_GUEST_DEBUG, &single_step);
     }
-    int r = ioctl(vm->cpu->vcpu_fd, KVM_RUN, NULL);
-    if (r < 0) {
-        perror("kvm run");
-        exit(1);
+    while (true) {
+        int r;
+        {
+            TimelineSpan span(vm->timeline.get(), "KVM_RUN", "kvm");
+            r = ioctl(vcpu_fd, KVM_RUN, NULL);
+            span.arg("exit_reason", r < 0 ? -1 : run_data->exit_reason);
+        }
+        if (r < 0 && errno == EINTR) {
+            run_data->immediate_exit = 0;
+            if (kick_pending) {
+                load_regs_from_vm();
+                if (handle_kick(vm)) {
+                    ExitReason ret;
+                    ret.code = ExitCode::KICKED;
+                    return ret;
+                }
+            }
+            continue;
+        }
+        if (r < 0) {
+            perror("kvm run");
+            return kvm_fault(vm, StopReason::HOST_ERROR);
+        }
+        if (stats) {
+            uint64_t now = stats_now_ns();
+            stats->kvm_run.add(now - t);
+            t = now;
+        }
+        drain_console_device(vm);
+
+        /* console ring was full, KVM passed the write through */
+        if (run_data->exit_reason == KVM_EXIT_IO &&
+            run_data->io.port == CONSOLE_PORT &&
+            run_data->io.direction == KVM_EXIT_IO_OUT) {
+            console_device_io(vm);
+            continue;
+        }
+        break;
     }
 
-    vm->cpu->load_regs_from_vm();
+    load_regs_from_vm();
+    if (stats) {
+        stats->regs_get.add(stats_now_ns() - t);
+    }
     ExitReason ret;
 
-    auto run_data = vm->cpu->run_data;
     switch (run_data->exit_reason) {
         case KVM_EXIT_HLT:
-            handle_exit_hlt(config, vm->cpu.get(), &ret);
+            decode_hlt_exit(config, this, &ret);
             break;
 
         case KVM_EXIT_INTERNAL_ERROR:
-            printf("exit internal error : %d [",
+            printf("exit internal error : %d\n",
                    (int)run_data->internal.suberror);
-            exit(1);
-            break;
+            return kvm_fault(vm, StopReason::CPU_FAULT);
         case KVM_EXIT_MMIO:
             printf("reference unmapped region : addr=%16llx\n",
                    (long long)run_data->mmio.phys_addr);
-            exit(1);
-            break;
+            return kvm_fault(vm, StopReason::CPU_FAULT);
         case KVM_EXIT_SHUTDOWN:
             printf("kvm exit shutdown\n");
-            exit(1);
-            break;
+            return kvm_fault(vm, StopReason::CPU_FAULT);
         case KVM_EXIT_FAIL_ENTRY:
             printf(
                 "fail entry : reason=%llx\n",
                 (long long)run_data->fail_entry.hardware_entry_failure_reason);
-            exit(1);
-            break;
+            return kvm_fault(vm, StopReason::CPU_FAULT);
         case KVM_EXIT_DEBUG:
             ret.code = ExitCode::SINGLE_STEP;
             break;
@@ -111,20 +169,76 @@ ExitReason run(VM *vm, bool single_step) {
             printf("reference unconnected io %x %x %x\n",
                    run_data->io.direction, run_data->io.port,
                    run_data->io.size);
-            exit(1);
-            break;
+            return kvm_fault(vm, StopReason::UNSUPPORTED);
         default:
             printf("unknown exit %d\n", run_data->exit_reason);
-            exit(1);
-            break;
+            return kvm_fault(vm, StopReason::CPU_FAULT);
     }
 
     return ret;
 }
 
+ExitReason run(VM *vm, bool single_step) {
+    return vm->cpu->run(vm, single_step);
+}
+
+/* where the time of handling exit r goes, null if it isn't a hypercall */
+static Histogram *handler_histogram(VM *vm, Stats *stats,
+                                    const ExitReason &r) {
+    switch (r.code) {
+        case ExitCode::HLT_BIOS_CALL:
+            return &stats->bios[r.bios_nr & 0xff];
+        case ExitCode::HLT_DOS_INT:
+            return &stats->dos_int[(vm->cpu->regs.rax >> 8) & 0xff];
+        case ExitCode::HLT_DOS_DRIVER:
+            if (r.dos_driver_call >= 0 &&
+                r.dos_driver_call < Stats::NUM_DRIVER_CALLS) {
+                return &stats->dos_driver[r.dos_driver_call];
+            }
+            return nullptr;
+        default:
+            return nullptr;
+    }
+}
+
+/* RunLimits, only checked where run_vm() can resume: the outermost
+ * run_with_handler() between two exits */
+static bool over_budget(VM *vm) {
+    if (vm->steps_left && --vm->steps_left == 0) {
+        return true;
+    }
+    return vm->deadline_ns && stats_now_ns() >= vm->deadline_ns;
+}
+
 void run_with_handler(VM *vm) {
-    while (1) {
-        auto r = run(vm, false);
+    bool single_step = vm->single_step || vm->trace;
+    vm->handler_depth++;
+    while (!vm->stopped()) {
+        if (vm->single_step) {
+            disasm(vm);
+        }
+        if (vm->trace) {
+            vm->trace->begin_step(vm->cpu.get());
+        }
+        Stats *stats = vm->stats.get();
+        uint64_t t = stats ? stats_now_ns() : 0;
+        ExitReason r;
+        {
+            TimelineSpan span(vm->timeline.get(), "run", "guest");
+            r = run(vm, single_step);
+            span.arg("exit", (int)r.code);
+        }
+        if (vm->trace) {
+            vm->trace->end_step(r);
+        }
+        Histogram *handler = nullptr;
+        if (stats) {
+            uint64_t now = stats_now_ns();
+            stats->run[(int)r.code].add(now - t);
+            t = now;
+            handler = handler_histogram(vm, stats, r);
+        }
+        vm->console.tick();
         switch (r.code) {
             case ExitCode::HLT_BIOS_CALL:
                 handle_bios_call(vm, &r);
@@ -133,17 +247,31 @@ void run_with_handler(VM *vm) {
                 handle_dos_system_call(vm, &r);
                 break;
             case ExitCode::HLT_DOS_EXIT:
-                exit(0);
+                vm->console.flush();  // while --stats can still see it
+                vm->stop(StopReason::DOS_EXIT, 0);
                 break;
             case ExitCode::HLT_DOS_DRIVER:
                 handle_dos_driver_call(vm, &r);
                 break;
             case ExitCode::HLT_INVOKE_RETURN:
+                vm->handler_depth--;
                 return;
             case ExitCode::SINGLE_STEP:
+            case ExitCode::KICKED:
+                break;
+            case ExitCode::FAULT:
+                vm->stop(StopReason::CPU_FAULT, 1);  // unless run() said why
                 break;
         }
+        /* includes guest code the handler ran through invoke_intr */
+        if (handler) {
+            handler->add(stats_now_ns() - t);
+        }
+        if (vm->handler_depth == 1 && over_budget(vm)) {
+            vm->stop(StopReason::BUDGET, vm->exit_status);
+        }
     }
+    vm->handler_depth--;
 }
 
 void invoke_intr(VM *vm, int intr_nr) {
@@ -0,0 +1,77 @@
+#include "deps.hpp"
+
+#include <stdio.h>
+
+namespace {
+
+/* name as one word for make */
+std::string escape(const std::string &name) {
+    std::string s;
+    for (char c : name) {
+        if (c == ' ' || c == '#' || c == '\\') {
+            s += '\\';
+        } else if (c == '$') {
+            s += '$';
+        }
+        s += c;
+    }
+    return s;
+}
+
+}  // namespace
+
+DepsFile::DepsFile(const std::string &path) : path(path) {}
+
+DepsFile::~DepsFile() {
+    if (!write()) {
+        perror(path.c_str());
+    }
+}
+
+void DepsFile::input(const std::string &name) {
+    if (seen_inputs.insert(name).second) {
+        inputs.push_back(name);
+    }
+}
+
+void DepsFile::output(const std::string &name) {
+    if (seen_outputs.insert(name).second) {
+        outputs.push_back(name);
+    }
+}
+
+bool DepsFile::write() const {
+    std::string text;
+    if (outputs.empty()) {
+        text = escape(path);
+    }
+    for (const auto &name : outputs) {
+        text += (text.empty() ? "" : " ") + escape(name);
+    }
+    text += ":";
+    /* a file the run wrote itself is no prerequisite, even if read first */
+    std::vector<std::string> prereqs;
+    for (const auto &name : inputs) {
+        if (!seen_outputs.count(name)) {
+            prereqs.push_back(name);
+        }
+    }
+    for (const auto &name : prereqs) {
+        text += " " + escape(name);
+    }
+    text += "\n";
+    /* so a prerequisite that goes away is not an error */
+    for (const auto &name : prereqs) {
+        text += "\n" + escape(name) + ":\n";
+    }
+
+    FILE *fp = fopen(path.c_str(), "w");
+    if (!fp) {
+        return false;
+    }
+    bool ok = fwrite(text.data(), 1, text.size(), fp) == text.size();
+    if (fclose(fp) != 0) {
+        ok = false;
+    }
+    return ok;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <set>
+#include <string>
+#include <vector>
+
+/*
+ * Make rules for vm --deps=FILE: the files the run created or opened to
+ * write are the targets, the program and the files it only read are their
+ * prerequisites, as gcc -MD -MP would write them:
+ *
+ *     X.OBJ: ../dos-2.0-bin/MASM.EXE X.ASM DEFS.ASM
+ *     X.ASM:
+ *     DEFS.ASM:
+ *
+ * A run that wrote nothing has FILE itself as the target.  Names are as the
+ * guest opened them, relative to the current directory.
+ */
+class DepsFile {
+   public:
+    /* write FILE when the DepsFile is destroyed */
+    explicit DepsFile(const std::string &path);
+    ~DepsFile();
+    DepsFile(const DepsFile &) = delete;
+    DepsFile &operator=(const DepsFile &) = delete;
+
+    void input(const std::string &name);
+    void output(const std::string &name);
+
+   private:
+    bool write() const;
+
+    std::string path;
+    std::vector<std::string> inputs;
+    std::vector<std::string> outputs;
+    std::set<std::string> seen_inputs;
+    std::set<std::string> seen_outputs;
+};
@@ -1,32 +1,449 @@
+#include "disasm.hpp"
+
+#include <stdio.h>
+#include <string.h>
+
 #include "vm.hpp"
 
+namespace {
+
+enum Operand : uint8_t {
+    O_NONE,
+    O_EB,   // r/m byte
+    O_EW,   // r/m word
+    O_GB,   // reg field, byte
+    O_GW,   // reg field, word
+    O_SW,   // reg field, segment register
+    O_M,    // r/m without a size (lea, les, far pointers, esc)
+    O_IB,
+    O_IW,
+    O_IBS,  // byte immediate sign-extended to a word
+    O_JB,
+    O_JW,
+    O_AP,   // seg:off immediate
+    O_OB,   // [moffs] byte
+    O_OW,   // [moffs] word
+    O_AL,
+    O_AX,
+    O_CL,
+    O_DX,
+    O_ONE,
+    O_ZB,   // register in the low opcode bits, byte
+    O_ZW,   // register in the low opcode bits, word
+    O_ES,
+    O_CS,
+    O_SS,
+    O_DS,
+};
+
+enum Group : uint8_t { G_NONE, G_1, G_2, G_3, G_4, G_5, G_PREFIX, G_BAD };
+
+struct Opcode {
+    const char *name;
+    Group group;
+    Operand a, b, c;
+};
+
+#define ALU(n)                                                     \
+    {n, G_NONE, O_EB, O_GB}, {n, G_NONE, O_EW, O_GW},              \
+        {n, G_NONE, O_GB, O_EB}, {n, G_NONE, O_GW, O_EW},          \
+        {n, G_NONE, O_AL, O_IB}, {n, G_NONE, O_AX, O_IW}
+#define PREFIX {nullptr, G_PREFIX}
+#define BAD {nullptr, G_BAD}
+#define X8(n, a, b)                                                \
+    {n, G_NONE, a, b}, {n, G_NONE, a, b}, {n, G_NONE, a, b},       \
+        {n, G_NONE, a, b}, {n, G_NONE, a, b}, {n, G_NONE, a, b},   \
+        {n, G_NONE, a, b}, {n, G_NONE, a, b}
+#define J(n) {n, G_NONE, O_JB}
+#define N(n) {n, G_NONE}
+#define ESC {"esc", G_NONE, O_M}
+
+const Opcode opcodes[256] = {
+    /* 00 */ ALU("add"), {"push", G_NONE, O_ES}, {"pop", G_NONE, O_ES},
+    /* 08 */ ALU("or"), {"push", G_NONE, O_CS}, {"pop", G_NONE, O_CS},
+    /* 10 */ ALU("adc"), {"push", G_NONE, O_SS}, {"pop", G_NONE, O_SS},
+    /* 18 */ ALU("sbb"), {"push", G_NONE, O_DS}, {"pop", G_NONE, O_DS},
+    /* 20 */ ALU("and"), PREFIX, N("daa"),
+    /* 28 */ ALU("sub"), PREFIX, N("das"),
+    /* 30 */ ALU("xor"), PREFIX, N("aaa"),
+    /* 38 */ ALU("cmp"), PREFIX, N("aas"),
+    /* 40 */ X8("inc", O_ZW, O_NONE),
+    /* 48 */ X8("dec", O_ZW, O_NONE),
+    /* 50 */ X8("push", O_ZW, O_NONE),
+    /* 58 */ X8("pop", O_ZW, O_NONE),
+    /* 60 */ N("pusha"), N("popa"), {"bound", G_NONE, O_GW, O_M}, BAD,
+    /* 64 */ BAD, BAD, BAD, BAD,
+    /* 68 */ {"push", G_NONE, O_IW}, {"imul", G_NONE, O_GW, O_EW, O_IW},
+    /* 6a */ {"push", G_NONE, O_IBS}, {"imul", G_NONE, O_GW, O_EW, O_IBS},
+    /* 6c */ N("insb"), N("insw"), N("outsb"), N("outsw"),
+    /* 70 */ J("jo"), J("jno"), J("jc"), J("jnc"),
+    /* 74 */ J("jz"), J("jnz"), J("jna"), J("ja"),
+    /* 78 */ J("js"), J("jns"), J("jpe"), J("jpo"),
+    /* 7c */ J("jl"), J("jnl"), J("jng"), J("jg"),
+    /* 80 */ {nullptr, G_1, O_EB, O_IB}, {nullptr, G_1, O_EW, O_IW},
+    /* 82 */ {nullptr, G_1, O_EB, O_IB}, {nullptr, G_1, O_EW, O_IBS},
+    /* 84 */ {"test", G_NONE, O_EB, O_GB}, {"test", G_NONE, O_EW, O_GW},
+    /* 86 */ {"xchg", G_NONE, O_EB, O_GB}, {"xchg", G_NONE, O_EW, O_GW},
+    /* 88 */ {"mov", G_NONE, O_EB, O_GB}, {"mov", G_NONE, O_EW, O_GW},
+    /* 8a */ {"mov", G_NONE, O_GB, O_EB}, {"mov", G_NONE, O_GW, O_EW},
+    /* 8c */ {"mov", G_NONE, O_EW, O_SW}, {"lea", G_NONE, O_GW, O_M},
+    /* 8e */ {"mov", G_NONE, O_SW, O_EW}, {"pop", G_NONE, O_EW},
+    /* 90 */ N("nop"), {"xchg", G_NONE, O_AX, O_ZW},
+    /* 92 */ {"xchg", G_NONE, O_AX, O_ZW}, {"xchg", G_NONE, O_AX, O_ZW},
+    /* 94 */ {"xchg", G_NONE, O_AX, O_ZW}, {"xchg", G_NONE, O_AX, O_ZW},
+    /* 96 */ {"xchg", G_NONE, O_AX, O_ZW}, {"xchg", G_NONE, O_AX, O_ZW},
+    /* 98 */ N("cbw"), N("cwd"), {"call", G_NONE, O_AP}, N("wait"),
+    /* 9c */ N("pushf"), N("popf"), N("sahf"), N("lahf"),
+    /* a0 */ {"mov", G_NONE, O_AL, O_OB}, {"mov", G_NONE, O_AX, O_OW},
+    /* a2 */ {"mov", G_NONE, O_OB, O_AL}, {"mov", G_NONE, O_OW, O_AX},
+    /* a4 */ N("movsb"), N("movsw"), N("cmpsb"), N("cmpsw"),
+    /* a8 */ {"test", G_NONE, O_AL, O_IB}, {"test", G_NONE, O_AX, O_IW},
+    /* aa */ N("stosb"), N("stosw"), N("lodsb"), N("lodsw"),
+    /* ae */ N("scasb"), N("scasw"),
+    /* b0 */ X8("mov", O_ZB, O_IB),
+    /* b8 */ X8("mov", O_ZW, O_IW),
+    /* c0 */ {nullptr, G_2, O_EB, O_IB}, {nullptr, G_2, O_EW, O_IB},
+    /* c2 */ {"ret", G_NONE, O_IW}, N("ret"),
+    /* c4 */ {"les", G_NONE, O_GW, O_M}, {"lds", G_NONE, O_GW, O_M},
+    /* c6 */ {"mov", G_NONE, O_EB, O_IB}, {"mov", G_NONE, O_EW, O_IW},
+    /* c8 */ {"enter", G_NONE, O_IW, O_IB}, N("leave"),
+    /* ca */ {"retf", G_NONE, O_IW}, N("retf"),
+    /* cc */ N("int3"), {"int", G_NONE, O_IB}, N("into"), N("iret"),
+    /* d0 */ {nullptr, G_2, O_EB, O_ONE}, {nullptr, G_2, O_EW, O_ONE},
+    /* d2 */ {nullptr, G_2, O_EB, O_CL}, {nullptr, G_2, O_EW, O_CL},
+    /* d4 */ {"aam", G_NONE, O_IB}, {"aad", G_NONE, O_IB}, N("salc"),
+    /* d7 */ N("xlatb"),
+    /* d8 */ ESC, ESC, ESC, ESC, ESC, ESC, ESC, ESC,
+    /* e0 */ J("loopne"), J("loope"), J("loop"), J("jcxz"),
+    /* e4 */ {"in", G_NONE, O_AL, O_IB}, {"in", G_NONE, O_AX, O_IB},
+    /* e6 */ {"out", G_NONE, O_IB, O_AL}, {"out", G_NONE, O_IB, O_AX},
+    /* e8 */ {"call", G_NONE, O_JW}, {"jmp", G_NONE, O_JW},
+    /* ea */ {"jmp", G_NONE, O_AP}, {"jmp short", G_NONE, O_JB},
+    /* ec */ {"in", G_NONE, O_AL, O_DX}, {"in", G_NONE, O_AX, O_DX},
+    /* ee */ {"out", G_NONE, O_DX, O_AL}, {"out", G_NONE, O_DX, O_AX},
+    /* f0 */ PREFIX, BAD, PREFIX, PREFIX,
+    /* f4 */ N("hlt"), N("cmc"), {nullptr, G_3, O_EB}, {nullptr, G_3, O_EW},
+    /* f8 */ N("clc"), N("stc"), N("cli"), N("sti"),
+    /* fc */ N("cld"), N("std"), {nullptr, G_4, O_EB}, {nullptr, G_5, O_EW},
+};
+
+#undef ALU
+#undef PREFIX
+#undef BAD
+#undef X8
+#undef J
+#undef N
+#undef ESC
+
+const char *const group_names[5][8] = {
+    {"add", "or", "adc", "sbb", "and", "sub", "xor", "cmp"},
+    {"rol", "ror", "rcl", "rcr", "shl", "shr", "sal", "sar"},
+    {"test", "test", "not", "neg", "mul", "imul", "div", "idiv"},
+    {"inc", "dec", nullptr, nullptr, nullptr, nullptr, nullptr, nullptr},
+    {"inc", "dec", "call", "call far", "jmp", "jmp far", "push", nullptr},
+};
+
+const char *const reg8[8] = {"al", "cl", "dl", "bl", "ah", "ch", "dh", "bh"};
+const char *const reg16[8] = {"ax", "cx", "dx", "bx", "sp", "bp", "si", "di"};
+const char *const sreg[8] = {"es", "cs", "ss", "ds", "es", "cs", "ss", "ds"};
+const char *const ea_base[8] = {"bx+si", "bx+di", "bp+si", "bp+di",
+                                "si",    "di",    "bp",    "bx"};
+
+struct Decoder {
+    const uint8_t *code;
+    uint16_t ip;
+    int pos = 0;
+    int seg = -1;  // segment override, if any
+    bool seg_used = false;
+
+    bool have_modrm = false;
+    uint8_t modrm = 0;
+    char mem[32];  // "[seg:base+disp]" once modrm is decoded
+
+    uint8_t u8() { return code[pos++]; }
+    uint16_t u16() {
+        uint16_t v = code[pos] | (code[pos + 1] << 8);
+        pos += 2;
+        return v;
+    }
+
+    /* the segment override part of a memory operand */
+    const char *seg_prefix() {
+        if (seg < 0) {
+            return "";
+        }
+        seg_used = true;
+        static const char *const names[4] = {"es:", "cs:", "ss:", "ds:"};
+        return names[seg];
+    }
+
+    void decode_modrm() {
+        if (have_modrm) {
+            return;
+        }
+        have_modrm = true;
+        modrm = u8();
+        int mod = modrm >> 6, rm = modrm & 7;
+        if (mod == 3) {
+            return;
+        }
+        const char *sp = seg_prefix();
+        if (mod == 0 && rm == 6) {
+            snprintf(mem, sizeof(mem), "[%s0x%x]", sp, u16());
+        } else if (mod == 0) {
+            snprintf(mem, sizeof(mem), "[%s%s]", sp, ea_base[rm]);
+        } else if (mod == 1) {
+            int8_t d = (int8_t)u8();
+            snprintf(mem, sizeof(mem), "[%s%s%c0x%x]", sp, ea_base[rm],
+                     d < 0 ? '-' : '+', d < 0 ? -d : d);
+        } else {
+            snprintf(mem, sizeof(mem), "[%s%s+0x%x]", sp, ea_base[rm], u16());
+        }
+    }
+
+    int reg() {
+        decode_modrm();
+        return (modrm >> 3) & 7;
+    }
+};
+
+bool is_register(Operand o) {
+    switch (o) {
+        case O_GB:
+        case O_GW:
+        case O_SW:
+        case O_AL:
+        case O_AX:
+        case O_ZB:
+        case O_ZW:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* Appends operand o to out; sized says whether a memory operand needs an
+ * explicit byte/word, because no register operand gives the size. */
+void format_operand(Decoder *d, uint8_t op, Operand o, bool sized, char *out,
+                    size_t size) {
+    int mod;
+    switch (o) {
+        case O_NONE:
+            out[0] = 0;
+            break;
+        case O_EB:
+        case O_EW:
+        case O_M:
+            d->decode_modrm();
+            mod = d->modrm >> 6;
+            if (mod == 3) {
+                snprintf(out, size, "%s",
+                         o == O_EB ? reg8[d->modrm & 7] : reg16[d->modrm & 7]);
+            } else if (sized && o != O_M) {
+                snprintf(out, size, "%s %s", o == O_EB ? "byte" : "word",
+                         d->mem);
+            } else {
+                snprintf(out, size, "%s", d->mem);
+            }
+            break;
+        case O_GB:
+            snprintf(out, size, "%s", reg8[d->reg()]);
+            break;
+        case O_GW:
+            snprintf(out, size, "%s", reg16[d->reg()]);
+            break;
+        case O_SW:
+            snprintf(out, size, "%s", sreg[d->reg()]);
+            break;
+        case O_IB:
+            snprintf(out, size, "0x%x", d->u8());
+            break;
+        case O_IW:
+            snprintf(out, size, "0x%x", d->u16());
+            break;
+        case O_IBS: {
+            int8_t v = (int8_t)d->u8();
+            snprintf(out, size, "byte %c0x%x", v < 0 ? '-' : '+',
+                     v < 0 ? -v : v);
+            break;
+        }
+        case O_JB: {
+            int8_t rel = (int8_t)d->u8();
+            snprintf(out, size, "0x%x", (uint16_t)(d->ip + d->pos + rel));
+            break;
+        }
+        case O_JW: {
+            uint16_t rel = d->u16();
+            snprintf(out, size, "0x%x", (uint16_t)(d->ip + d->pos + rel));
+            break;
+        }
+        case O_AP: {
+            uint16_t off = d->u16();
+            snprintf(out, size, "0x%x:0x%x", d->u16(), off);
+            break;
+        }
+        case O_OB:
+        case O_OW: {
+            const char *sp = d->seg_prefix();
+            snprintf(out, size, "[%s0x%x]", sp, d->u16());
+            break;
+        }
+        case O_AL:
+            snprintf(out, size, "al");
+            break;
+        case O_AX:
+            snprintf(out, size, "ax");
+            break;
+        case O_CL:
+            snprintf(out, size, "cl");
+            break;
+        case O_DX:
+            snprintf(out, size, "dx");
+            break;
+        case O_ONE:
+            snprintf(out, size, "1");
+            break;
+        case O_ZB:
+            snprintf(out, size, "%s", reg8[op & 7]);
+            break;
+        case O_ZW:
+            snprintf(out, size, "%s", reg16[op & 7]);
+            break;
+        case O_ES:
+        case O_CS:
+        case O_SS:
+        case O_DS:
+            snprintf(out, size, "%s", sreg[o - O_ES]);
+            break;
+    }
+}
+
+}  // namespace
+
+int disasm_insn(const uint8_t *code, uint16_t ip, char *buf, size_t size) {
+    Decoder d;
+    d.code = code;
+    d.ip = ip;
+
+    const char *rep = "";
+    const char *lock = "";
+    uint8_t op;
+    /* the 8086 accepts any number of prefixes; stop at the longest
+     * instruction the 286 would accept */
+    while (opcodes[op = code[d.pos]].group == G_PREFIX && d.pos < 10) {
+        d.pos++;
+        switch (op) {
+            case 0x26:
+            case 0x2e:
+            case 0x36:
+            case 0x3e:
+                d.seg = (op >> 3) & 3;
+                break;
+            case 0xf0:
+                lock = "lock ";
+                break;
+            case 0xf2:
+                rep = "repne ";
+                break;
+            case 0xf3:
+                rep = "rep ";
+                break;
+        }
+    }
+    d.pos++;
+
+    Opcode e = opcodes[op];
+    const char *name = e.name;
+    if (e.group == G_BAD || e.group == G_PREFIX) {
+        snprintf(buf, size, "db 0x%x", op);
+        return d.pos;
+    }
+    if (e.group != G_NONE) {
+        int sub = d.reg();
+        name = group_names[e.group - G_1][sub];
+        if (!name) {
+            snprintf(buf, size, "db 0x%x", op);
+            return d.pos;
+        }
+        if (e.group == G_3 && sub < 2) {
+            e.b = e.a == O_EB ? O_IB : O_IW;
+        }
+        if (e.group == G_5 && (sub == 3 || sub == 5)) {
+            e.a = O_M;
+        }
+    }
+    if (op >= 0xd8 && op <= 0xdf) {
+        /* the coprocessor opcode spans the low opcode bits and reg */
+        char operand[48];
+        int fop = ((op & 7) << 3) | d.reg();
+        format_operand(&d, op, O_M, false, operand, sizeof(operand));
+        snprintf(buf, size, "esc 0x%x,%s", fop, operand);
+        return d.pos;
+    }
+
+    bool sized = !is_register(e.a) && !is_register(e.b) && !is_register(e.c);
+    char operands[3][48];
+    format_operand(&d, op, e.a, sized, operands[0], sizeof(operands[0]));
+    format_operand(&d, op, e.b, sized, operands[1], sizeof(operands[1]));
+    format_operand(&d, op, e.c, sized, operands[2], sizeof(operands[2]));
+
+    /* an override that no memory operand consumed, e.g. on a string op */
+    char seg_text[4] = "";
+    if (d.seg >= 0 && !d.seg_used) {
+        snprintf(seg_text, sizeof(seg_text), "%s ", sreg[d.seg]);
+    }
+
+    int n = snprintf(buf, size, "%s%s%s%s", lock, rep, seg_text, name);
+    for (int i = 0; i < 3 && operands[i][0]; i++) {
+        if (n >= 0 && (size_t)n < size) {
+            n += snprintf(buf + n, size - n, "%s%s", i ? "," : " ",
+                          operands[i]);
+        }
+    }
+    return d.pos;
+}
+
+namespace {
+
+/* Decoded text of recently traced instructions, keyed by linear address
+ * and checked against the current bytes so rewritten code is decoded
+ * again. */
+struct CachedInsn {
+    uint32_t lin = UINT32_MAX;
+    uint16_t ip;
+    uint8_t len;
+    uint8_t bytes[16];
+    char text[64];
+};
+
+constexpr size_t DISASM_CACHE_SIZE = 1024;
+
+thread_local CachedInsn disasm_cache[DISASM_CACHE_SIZE];
+
+}  // namespace
+
 void disasm(const VM *vm) {
     auto &sregs = vm->cpu->sregs;
     auto &regs = vm->cpu->regs;
-    auto full_mem = vm->full_mem;
 
-    unsigned char *code = &full_mem[regs.rip + sregs.cs.base];
-    if (code[0] == 0xf3 && code[1] == 0xa4) {
-        puts("rep movsb");
-    } else if (code[0] == 0xf3 && code[1] == 0xa5) {
-        puts("rep movsw");
-    } else if (code[0] == 0xf3 && code[1] == 0xab) {
-        puts("rep stosw");
-    } else {
-        FILE *fp = fopen("out.bin", "wb");
-        fwrite(&full_mem[regs.rip + sregs.cs.base], 1, 16, fp);
-        fclose(fp);
+    uint32_t lin = (uint32_t)(sregs.cs.base + regs.rip);
+    const uint8_t *code = &vm->full_mem[lin];
+    uint16_t ip = (uint16_t)regs.rip;
 
-        fflush(stdout);
-        int r = system("ndisasm out.bin|head -n2");
-        if (r != 0) {
-            exit(1);
-        }
-        fflush(stdout);
+    CachedInsn &c = disasm_cache[lin % DISASM_CACHE_SIZE];
+    if (c.lin != lin || c.ip != ip || memcmp(c.bytes, code, c.len) != 0) {
+        c.lin = lin;
+        c.ip = ip;
+        c.len = disasm_insn(code, ip, c.text, sizeof(c.text));
+        memcpy(c.bytes, code, c.len);
     }
 
+    char hex[2 * sizeof(c.bytes) + 1];
+    for (int i = 0; i < c.len; i++) {
+        snprintf(hex + 2 * i, 3, "%02X", c.bytes[i]);
+    }
+    printf("%04X:%04X  %-14s  %s\n", (int)sregs.cs.selector, ip, hex, c.text);
     printf("rip=%x, cs=%x, ds=%x ss=%x flags=%08x\n", (int)regs.rip,
-           (int)sregs.cs.base, (int)sregs.ds.base, (int)sregs.ss.base, (int)regs.rflags);
-
-    fflush(stdout);
+           (int)sregs.cs.base, (int)sregs.ds.base, (int)sregs.ss.base,
+           (int)regs.rflags);
 }
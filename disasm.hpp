@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Table-driven 8086/80186 disassembler, NASM syntax.  Decodes the
+ * instruction at code (located at offset ip of its code segment, for
+ * relative branch targets) into buf and returns its length in bytes.
+ */
+int disasm_insn(const uint8_t *code, uint16_t ip, char *buf, size_t size);
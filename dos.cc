@@ -1,10 +1,13 @@
 #include "dos.hpp"
 
+#include <errno.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <time.h>
 
+#include <algorithm>
 #include <cstdint>
+#include <mutex>
 
 #include "dosdriver.h"
 #include "vm.hpp"
@@ -19,7 +22,8 @@ struct datetime {
 };
 datetime dos_gettime() {
     time_t now = time(NULL);
-    auto tm = localtime(&now);
+    struct tm tm_buf;
+    auto tm = localtime_r(&now, &tm_buf);
 
     datetime ret;
 
@@ -31,6 +35,36 @@ datetime dos_gettime() {
     return ret;
 }
 
+/* DS:DX, the buffer or path of most INT 21h calls */
+size_t ds_dx(const VM *vm) {
+    return vm->cpu->sregs.ds.base + (uint16_t)vm->cpu->regs.rdx;
+}
+
+/* CF and the DOS error code in AX */
+void set_error(VM *vm, uint16_t code) {
+    vm->cpu->regs.rax = code;
+    vm->inthandler_set_cf();
+}
+
+/* the DOS 2 error for a failed host call */
+uint16_t dos_error(int err) {
+    switch (err) {
+        case ENOENT:
+            return 0x02;  // file not found
+        case ENOTDIR:
+            return 0x03;  // path not found
+        case EMFILE:
+        case ENFILE:
+            return 0x04;  // too many open files
+        case EBADF:
+            return 0x06;  // invalid handle
+        case EINVAL:
+            return 0x01;  // invalid function
+        default:
+            return 0x05;  // access denied
+    }
+}
+
 const char *truncate_drive(const char *p) {
     if (p[0] == '\0' || p[1] == '\0') {
         return p;
@@ -47,17 +81,25 @@ const char *truncate_drive(const char *p) {
 void handle_dos_driver_call(VM *vm, const ExitReason *r) {
     auto &regs = vm->cpu->regs;
     auto &sregs = vm->cpu->sregs;
-    auto full_mem = vm->full_mem;
 
     bool zf = 0;
     bool cf = 0;
 
+    TimelineSpan span(vm->timeline.get(), "dosio", "hypercall",
+                      r->dos_driver_call);
     switch (r->dos_driver_call) {
         case DOSIO_STATUS:
             zf = 1;
             break;
         case DOSIO_INP: {
-            int a = getchar();
+            vm->console.before_input();
+            int a = vm->io->console_getc();
+            if (a == EOF) {
+                /* nothing more to type, the session is over */
+                vm->console.flush();
+                vm->stop(StopReason::INPUT_EOF, 0);
+                return;
+            }
             if (a == '\n') {
                 a = '\r';
             }
@@ -65,56 +107,37 @@ void handle_dos_driver_call(VM *vm, const ExitReason *r) {
             zf = 0;
         } break;
         case DOSIO_OUTP:
-            // puts("print");
-            putchar(regs.rax & 0xff);
-            break;
-
-        case DOSIO_READ:  // disk read
-            /*
-             * AL = Disk I/O driver number
-             * BX = Disk transfer address in DS
-             * CX = Number of sectors to transfer
-             * DX = Logical record number of transfer
-             */
-
-            {
-                auto addr = &full_mem[sregs.ds.base + regs.rbx];
-                pread(vm->floppy->image_fd, addr, regs.rcx * 512,
-                      regs.rdx * 512);
-                if (0) {
-                    printf(
-                        "disk read addr=0x%08x, "
-                        "sector=0x%08x(byte=0x%08x), "
-                        "count=%x\n",
-                        (int)(uintptr_t)(sregs.ds.base + regs.rbx),
-                        (int)regs.rdx, (int)regs.rdx * 512,
-                        (int)regs.rcx * 512);
-                }
-            }
-            regs.rax = 0;
-            cf = 0;
+            vm->console.put(regs.rax & 0xff);
             break;
 
-        case DOSIO_WRITE:  // disk read
+        case DOSIO_READ:
+        case DOSIO_WRITE:
             /*
              * AL = Disk I/O driver number
              * BX = Disk transfer address in DS
              * CX = Number of sectors to transfer
              * DX = Logical record number of transfer
              */
-
             {
-                auto addr = &full_mem[sregs.ds.base + regs.rbx];
-                pwrite(vm->floppy->image_fd, addr, regs.rcx * 512,
-                       regs.rdx * 512);
-                if (0) {
-                    printf(
-                        "disk read addr=0x%08x, "
-                        "sector=0x%08x(byte=0x%08x), "
-                        "count=%x\n",
-                        (int)(uintptr_t)(sregs.ds.base + regs.rbx),
-                        (int)regs.rdx, (int)regs.rdx * 512,
-                        (int)regs.rcx * 512);
+                bool is_read = r->dos_driver_call == DOSIO_READ;
+                size_t count = regs.rcx & 0xffff;
+                size_t lba = regs.rdx & 0xffff;
+                span.arg("sector", lba);
+                span.arg("count", count);
+                uint8_t *addr = vm->guest_ptr(
+                    sregs.ds.base + (regs.rbx & 0xffff), count * 512);
+                Floppy *floppy = vm->floppy.get();
+                size_t len = count * 512;
+                bool ok = floppy && addr &&
+                          (is_read ? vm->io->disk_read(floppy, addr, len,
+                                                       lba * 512)
+                                   : vm->io->disk_write(floppy, addr, len,
+                                                        lba * 512)) ==
+                              (ssize_t)len;
+                if (!ok) {
+                    regs.rax = 8;  // sector not found
+                    cf = 1;
+                    break;
                 }
             }
             regs.rax = 0;
@@ -125,7 +148,11 @@ void handle_dos_driver_call(VM *vm, const ExitReason *r) {
             regs.rax = 0;
             break;
         case DOSIO_FLUSH:
-            fflush(stdout);
+            vm->console.flush();
+            if (vm->floppy) {
+                TimelineSpan io(vm->timeline.get(), "msync", "host");
+                vm->floppy->sync();
+            }
             break;
 
         case DOSIO_MAPDEV:
@@ -141,8 +168,8 @@ void handle_dos_driver_call(VM *vm, const ExitReason *r) {
 
         default:
             printf("unknown dos driver call %02x\n", r->dos_driver_call);
-            exit(1);
-            break;
+            vm->stop(StopReason::UNSUPPORTED, 1);
+            return;
     }
 
     regs.rflags &= ~((1 << 6) | (1 << 0));  // clear zf, cf
@@ -158,31 +185,39 @@ void handle_dos_driver_call(VM *vm, const ExitReason *r) {
 
 void handle_dos_system_call(VM *vm, const ExitReason *r) {
     uint8_t ah = (vm->cpu->regs.rax >> 8) & 0xff;
+    Timeline *tl = vm->timeline.get();
+    TimelineSpan span(tl, "int21", "hypercall", ah);
     vm->inthandler_clear_cf();
     // printf("dos call %x\n", ah);
     // dump_regs(vm->cpu.get());
     switch (ah) {
         case 0x2: {
             uint8_t dl = vm->cpu->regs.rdx & 0xff;
-            putchar(dl);
-            fflush(stdout);
+            vm->console.put(dl);
         } break;
 
         case 0x09: {
-            char *p = (char *)(vm->full_mem + vm->cpu->sregs.ds.base +
-                               vm->cpu->regs.rdx);
-            while ((*p) != '$') {
-                putchar(*p);
-                p++;
+            size_t linear = ds_dx(vm);
+            if (linear < VM::MEM_SIZE) {
+                vm->console.write_dollar(vm->full_mem + linear,
+                                         VM::MEM_SIZE - linear);
             }
-            putchar('\n');
+            vm->console.put('\n');
             vm->cpu->regs.rax = 0x0024;
         } break;
         case 0x0a: {
-            uint8_t *p = (uint8_t *)(vm->full_mem + vm->cpu->sregs.ds.base +
-                                     vm->cpu->regs.rdx);
+            uint8_t *p = vm->guest_ptr(ds_dx(vm), 2);
+            if (!p || !(p = vm->guest_ptr(ds_dx(vm), 2 + p[0]))) {
+                vm->inthandler_set_cf();
+                break;
+            }
             uint8_t len = p[0];
-            ssize_t rdsz = read(0, p + 2, len);
+            vm->console.before_input();
+            TimelineSpan io(tl, "read", "host");
+            io.arg("fd", 0);
+            io.arg("bytes", len);
+            ssize_t rdsz = vm->io->read(0, p + 2, len);
+            io.arg("ret", rdsz);
             p[1] = rdsz;
         } break;
 
@@ -214,102 +249,163 @@ void handle_dos_system_call(VM *vm, const ExitReason *r) {
             vm->cpu->regs.rbx = 0x00000000;
             vm->inthandler_set_cf();
             break;
-        case 0x37:
-            vm->cpu->regs.rdx = 1;
+        case 0x37:  // switch character, so LINK sees /M
+            vm->cpu->regs.rax &= ~0xff;
+            vm->cpu->regs.rdx = '/';
             break;
 
-        case 0x3c: {
-            const char *p = (char *)(vm->full_mem + vm->cpu->sregs.ds.base +
-                                     vm->cpu->regs.rdx);
-            p = truncate_drive(p);
-            int fd = creat(p, 0644);
-            if (fd < 0) {
-                vm->inthandler_set_cf();
-            } else {
-                vm->cpu->regs.rax = fd;
-            }
-        } break;
-
+        case 0x3c:
         case 0x3d: {
-            const char *p = (char *)(vm->full_mem + vm->cpu->sregs.ds.base +
-                                     vm->cpu->regs.rdx);
-            p = truncate_drive(p);
-            int mode = 0;
-            uint8_t al = vm->cpu->regs.rax & 0xff;
-            if (al == 0) {
-                mode = O_RDONLY;
-            } else if (al == 1) {
-                mode = O_WRONLY;
+            const char *p = vm->guest_str(ds_dx(vm));
+            if (!p) {
+                set_error(vm, 0x03);  // path not found
+                break;
+            }
+            DriveMap::HostPath host;
+            bool on_drive = !vm->drives.empty();
+            if (on_drive) {
+                if (!vm->drives.resolve(p, &host)) {
+                    set_error(vm, dos_error(errno));
+                    break;
+                }
+                p = host.full.c_str();
             } else {
-                mode = O_RDWR;
+                p = truncate_drive(p);
+            }
+            /* DOS opens a new file for reading as well */
+            int mode = O_RDWR | O_CREAT | O_TRUNC;
+            if (ah == 0x3d) {
+                uint8_t access = vm->cpu->regs.rax & 0x07;
+                if (access > 2) {
+                    set_error(vm, 0x0c);  // invalid access code
+                    break;
+                }
+                mode = access == 0 ? O_RDONLY
+                                   : access == 1 ? O_WRONLY : O_RDWR;
             }
-            int fd = open(p, mode);
+            if (!vm->handles.has_free()) {
+                set_error(vm, 0x04);  // too many open files
+                break;
+            }
+            TimelineSpan io(tl, ah == 0x3c ? "creat" : "open", "host");
+            io.arg("flags", mode);
+            int fd;
+            {
+                /* no copy from a mapping of p while it is cut short */
+                std::unique_lock<std::shared_mutex> lk(mapping_lock(),
+                                                       std::defer_lock);
+                if (mode & O_TRUNC) {
+                    lk.lock();
+                }
+                fd = on_drive ? vm->io->openat(host.dirfd, host.path.c_str(),
+                                               mode, 0644)
+                              : vm->io->open(p, mode, 0644);
+                if (fd >= 0 && (mode & O_TRUNC)) {
+                    forget_file(fd);
+                }
+            }
+            io.arg("ret", fd);
             if (fd < 0) {
-                vm->inthandler_set_cf();
-            } else {
-                vm->cpu->regs.rax = fd;
+                set_error(vm, dos_error(errno));
+                break;
+            }
+            if (on_drive && (mode & O_CREAT)) {
+                vm->drives.created(host);
+            }
+            if (vm->deps && mode != O_WRONLY) {
+                vm->deps->input(p);
             }
+            if (vm->deps && mode != O_RDONLY) {
+                vm->deps->output(p);
+            }
+            std::shared_ptr<const MappedFile> map;
+            uint64_t gen = 0;
+            if (mode == O_RDONLY) {
+                TimelineSpan mio(tl, "mmap", "host");
+                std::shared_lock<std::shared_mutex> lk(mapping_lock());
+                gen = mapping_generation();
+                map = vm->io->map(fd);
+                mio.arg("bytes", map ? map->size : 0);
+            }
+            int h = vm->handles.add(fd, std::move(map), gen);
+            span.arg("handle", h);
+            vm->cpu->regs.rax = h;
         } break;
 
         case 0x3e: {
-            close(vm->cpu->regs.rbx);
+            int h = vm->cpu->regs.rbx & 0xffff;
+            span.arg("handle", h);
+            if (vm->handles.close(vm, h) < 0) {
+                set_error(vm, dos_error(errno));
+            }
             break;
         }
 
         case 0x3f:
         case 0x40: {
-            char *p = (char *)(vm->full_mem + vm->cpu->sregs.ds.base +
-                               vm->cpu->regs.rdx);
-            ssize_t sz;
-            if (ah == 0x3f) {
-                sz = read(vm->cpu->regs.rbx, p, vm->cpu->regs.rcx);
-            } else {
-                sz = write(vm->cpu->regs.rbx, p, vm->cpu->regs.rcx);
+            uint16_t len = vm->cpu->regs.rcx;
+            char *p = (char *)vm->guest_ptr(ds_dx(vm), len);
+            int h = vm->cpu->regs.rbx & 0xffff;
+            span.arg("handle", h);
+            span.arg("bytes", len);
+            if (!p) {
+                set_error(vm, 0x05);  // the buffer runs past memory
+                break;
             }
+            ssize_t sz = ah == 0x3f ? vm->handles.read(vm, h, p, len)
+                                    : vm->handles.write(vm, h, p, len);
             if (sz < 0) {
-                vm->inthandler_set_cf();
+                set_error(vm, dos_error(errno));
             } else {
                 vm->cpu->regs.rax = sz;
             }
         } break;
 
         case 0x42: {
-            size_t off = (vm->cpu->regs.rcx << 16) | (vm->cpu->regs.rdx);
             uint8_t al = vm->cpu->regs.rax & 0xff;
-            int whence = 0;
-            if (al == 0) {
-                whence = SEEK_SET;
-            } else if (al == 1) {
-                whence = SEEK_CUR;
-            } else {
-                whence = SEEK_END;
+            if (al > 2) {
+                set_error(vm, 0x01);  // invalid function
+                break;
             }
-            int r = lseek(vm->cpu->regs.rbx, off, whence);
-            if (r < 0) {
-                vm->inthandler_set_cf();
+            int h = vm->cpu->regs.rbx & 0xffff;
+            uint32_t cx_dx = (vm->cpu->regs.rcx & 0xffff) << 16 |
+                             (vm->cpu->regs.rdx & 0xffff);
+            /* signed from the current position or the end */
+            int64_t off = al == 0 ? (int64_t)cx_dx : (int64_t)(int32_t)cx_dx;
+            span.arg("handle", h);
+            span.arg("offset", off);
+            span.arg("whence", al);
+            int64_t pos = vm->handles.seek(
+                vm, h, off, al == 0 ? SEEK_SET : al == 1 ? SEEK_CUR : SEEK_END);
+            if (pos < 0) {
+                set_error(vm, dos_error(errno));
+            } else {
+                /* the new position in DX:AX */
+                vm->cpu->regs.rax = pos & 0xffff;
+                vm->cpu->regs.rdx = (pos >> 16) & 0xffff;
             }
         } break;
 
-        case 0x4c: {
-            exit(vm->cpu->regs.rax & 0xff);
-            break;
-        }
+        case 0x4c:
+            vm->console.flush();  // while --stats can still see it
+            vm->stop(StopReason::DOS_EXIT, vm->cpu->regs.rax & 0xff);
+            return;
 
         default:
             printf("unknown dos system call ah=0x%x\n", ah);
             dump_regs(vm->cpu.get());
             vm->inthandler_set_cf();
-            exit(1);
-            break;
+            vm->stop(StopReason::UNSUPPORTED, 1);
+            return;
     }
     vm->emu_reti();
 }
 
-void install_dos_driver(VM *vm) {
+bool install_dos_driver(VM *vm) {
     auto dos = vm->floppy->read("MSDOS", "SYS");
     if (!dos) {
-        perror("unable to load MSDOS.SYS");
-        exit(1);
+        fprintf(stderr, "unable to load MSDOS.SYS\n");
+        return false;
     }
     auto full_mem = vm->full_mem;
     memcpy(full_mem + vm->addr_config.dos_seg * 16, dos->data(), dos->size());
@@ -327,6 +423,7 @@ void install_dos_driver(VM *vm) {
 
     auto bpb = (struct dos_bpb *)&full_mem[dos_io_seg * 16 + drv_param + 0];
     *bpb = vm->floppy->bpb;
+    return true;
 }
 
 namespace {
@@ -348,42 +445,35 @@ struct __attribute__((packed)) MZ {
 };
 };  // namespace
 
-int load_mz(VM *vm, const std::string &path, const std::string &argv) {
-    const char *cp = path.c_str();
-    int fd = open(cp, O_RDONLY);
-    if (fd == -1) {
-        perror(cp);
-        return -1;
+const char *load_mz_image(VM *vm, const uint8_t *image, size_t sz,
+                          const std::string &argv) {
+    /* everything in the header comes from the file, check it first */
+    const MZ *mz = (const MZ *)image;
+    if (sz < sizeof(MZ) || (memcmp(mz->sig, "MZ", 2) != 0 &&
+                            memcmp(mz->sig, "ZM", 2) != 0)) {
+        return "not an MZ executable";
     }
-
-    struct stat st;
-    fstat(fd, &st);
-    size_t sz = st.st_size;
-
-    void *mapped = mmap(0, sz, PROT_READ, MAP_PRIVATE, fd, 0);
-    if (mapped == MAP_FAILED) {
-        perror("mmap");
-        close(fd);
-        return -1;
+    size_t header_bytes = mz->header_size * 16;
+    if (header_bytes < sizeof(MZ) || header_bytes > sz) {
+        return "MZ header size out of range";
     }
-
-    MZ *mz = (MZ *)mapped;
-    if (0) {
-        printf("minimum_allocation:%x\n", mz->minimum_allocation);
-        printf("maximum_allocation:%x\n", mz->maximum_allocation);
-
-        printf("initial_ip:%x\n", mz->initial_ip);
-        printf("initial_cs:%x\n", mz->initial_cs);
-        printf("initial_ip:%x\n", mz->initial_sp);
-        printf("initial_ss:%x\n", mz->initial_ss);
+    if (mz->reloc_table + mz->reloc_items * 4ul > sz) {
+        return "MZ relocation table past the end of the file";
     }
 
-    uint8_t *ptr = (uint8_t *)mapped;
-    uint8_t *load_data = ptr + mz->header_size * 16;
-    size_t ldsz = sz - mz->header_size * 16;
+    const uint8_t *load_data = image + header_bytes;
+    size_t ldsz = sz - header_bytes;
     size_t psp_offset = 0x1000;
     size_t psp_seg = 0x100;
 
+    /* the image and its minimum allocation stay below the BIOS at F000h */
+    size_t exe_seg = EXE_LOAD_SEG;
+    size_t load_limit = 0xf0000 - exe_seg * 16;
+    size_t bss = mz->minimum_allocation * 16;
+    if (ldsz > load_limit || bss > load_limit - ldsz) {
+        return "MZ image does not fit in memory";
+    }
+
     char *psp = (char *)(vm->full_mem + psp_offset);
     memset(vm->full_mem + psp_offset, 0, 256);
     {
@@ -392,37 +482,59 @@ int load_mz(VM *vm, const std::string &path, const std::string &argv) {
         psp[0x02] = 0xff;
         psp[0x03] = 0x7f;
 
-        psp[0x80] = argv.size();
-        strcpy(psp + 0x81, argv.c_str());
-        psp[0x81 + argv.size()] = 0x0d;
+        /* the command tail holds 127 bytes with its CR */
+        size_t tail = std::min<size_t>(argv.size(), 126);
+        psp[0x80] = tail;
+        memcpy(psp + 0x81, argv.data(), tail);
+        psp[0x81 + tail] = 0x0d;
     }
 
-    size_t exe_seg = 0x110;  // 1100:0000
     uint8_t *dst = vm->full_mem + exe_seg * 16;
     memcpy(dst, load_data, ldsz);
-    memset(dst + ldsz, 0, mz->minimum_allocation * 16);
+    memset(dst + ldsz, 0, bss);
     set_seg(vm->cpu->sregs.ds, psp_seg);
     set_seg(vm->cpu->sregs.es, psp_seg);
-    set_seg(vm->cpu->sregs.cs, exe_seg + mz->initial_cs);
-    set_seg(vm->cpu->sregs.ss, exe_seg + mz->initial_ss);
+    set_seg(vm->cpu->sregs.cs, (uint16_t)(exe_seg + mz->initial_cs));
+    set_seg(vm->cpu->sregs.ss, (uint16_t)(exe_seg + mz->initial_ss));
     vm->cpu->regs.rip = mz->initial_ip;
     vm->cpu->regs.rsp = mz->initial_sp;
 
-    uint16_t *reloc = (uint16_t *)(ptr + mz->reloc_table);
+    const uint8_t *reloc = image + mz->reloc_table;
     for (size_t r = 0; r < mz->reloc_items; r++) {
-        uint16_t reloc_offset = reloc[r * 2 + 0];
-        uint16_t reloc_seg = reloc[r * 2 + 1];
-        uint16_t *reloc_dst = (uint16_t *)(dst + reloc_seg * 16 + reloc_offset);
+        uint16_t reloc_offset = reloc[r * 4 + 0] | reloc[r * 4 + 1] << 8;
+        uint16_t reloc_seg = reloc[r * 4 + 2] | reloc[r * 4 + 3] << 8;
+        size_t at = exe_seg * 16 + reloc_seg * 16 + reloc_offset;
+        vm->poke16(at, vm->peek16(at) + exe_seg);
+    }
+    return nullptr;
+}
 
-        // printf("%d: off:%x seg:%x, %x->%x\n", (int)r, reloc[r * 2 + 0],
-        //        reloc[r * 2 + 1], (*reloc_dst), (int)((*reloc_dst) +
-        //        exe_seg));
+int load_mz(VM *vm, const std::string &path, const std::string &argv) {
+    const char *cp = path.c_str();
+    int fd = open(cp, O_RDONLY);
+    if (fd == -1) {
+        perror(cp);
+        return -1;
+    }
+
+    struct stat st;
+    fstat(fd, &st);
+    size_t sz = st.st_size;
+
+    void *mapped = mmap(0, sz, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED) {
+        perror("mmap");
+        close(fd);
+        return -1;
+    }
 
-        (*reloc_dst) += exe_seg;
+    const char *error = load_mz_image(vm, (const uint8_t *)mapped, sz, argv);
+    if (error) {
+        fprintf(stderr, "%s: %s\n", cp, error);
     }
 
     munmap(mapped, sz);
     close(fd);
 
-    return 0;
+    return error ? -1 : 0;
 }
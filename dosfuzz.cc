@@ -0,0 +1,357 @@
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <random>
+#include <set>
+#include <utility>
+#include <vector>
+
+#include "fuzz.hpp"
+#include "snapshot.hpp"
+
+/*
+ * dosfuzz: a mutational fuzzer around FuzzTarget that needs no libFuzzer.
+ * Guests fault all the time, into the HLT filler or on opcodes nobody
+ * implements; what counts is the host.  Inputs that end in a host error are
+ * saved as snapshots, and an input that crashes dosfuzz itself is written
+ * out by the signal handler before the process dies.
+ */
+
+namespace {
+
+void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [options] PROGRAM.EXE [INPUT...]\n"
+            "       %s [options] --replay=SNAPSHOT\n"
+            "  --backend=NAME    kvm, jit or interp (default interp)\n"
+            "  --runs=N          stop after N inputs, 0 for never (default)\n"
+            "  --exits=N         hypercalls per input (default 10000)\n"
+            "  --us=N            wall time per input (default 1000)\n"
+            "  --seed=N          for the mutator\n"
+            "  --findings=DIR    where findings go (default findings)\n"
+            "With INPUTs, run each once and print why it stopped.\n",
+            prog, prog);
+}
+
+/* progress and findings; stdout and stderr get the guest's diagnostics */
+FILE *log_fp = stderr;
+int log_fd = 2;
+
+/* the input being run, for the crash handler */
+const uint8_t *current_data;
+size_t current_size;
+char crash_path[4096];
+
+void on_crash(int sig) {
+    int fd = open(crash_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+        ssize_t ignored = write(fd, current_data, current_size);
+        (void)ignored;
+        close(fd);
+    }
+    static const char msg[] = "dosfuzz: crashed, input saved to ";
+    ssize_t ignored = write(log_fd, msg, sizeof(msg) - 1);
+    ignored = write(log_fd, crash_path, strlen(crash_path));
+    ignored = write(log_fd, "\n", 1);
+    (void)ignored;
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+void catch_crashes(const std::string &dir) {
+    snprintf(crash_path, sizeof(crash_path), "%s/crash-%d.in", dir.c_str(),
+             (int)getpid());
+    for (int sig : {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT}) {
+        signal(sig, on_crash);
+    }
+}
+
+bool read_file(const char *path, std::vector<uint8_t> *data) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        perror(path);
+        return false;
+    }
+    int c;
+    while ((c = getc(fp)) != EOF) {
+        data->push_back(c);
+    }
+    fclose(fp);
+    return true;
+}
+
+bool write_file(const std::string &path, const std::vector<uint8_t> &data) {
+    FILE *fp = fopen(path.c_str(), "wb");
+    if (!fp) {
+        perror(path.c_str());
+        return false;
+    }
+    bool ok = fwrite(data.data(), 1, data.size(), fp) == data.size();
+    if (fclose(fp) != 0) {
+        ok = false;
+    }
+    return ok;
+}
+
+uint64_t fnv1a(const std::vector<uint8_t> &data) {
+    uint64_t h = 0xcbf29ce484222325;
+    for (uint8_t b : data) {
+        h = (h ^ b) * 0x100000001b3;
+    }
+    return h;
+}
+
+/* bytes that tend to matter to a length, pointer or segment */
+const uint8_t interesting[] = {0x00, 0x01, 0x02, 0x0f, 0x10, 0x7f,
+                               0x80, 0xfe, 0xff, 0x21, 0xcd, 0x3c};
+
+/* a few random edits; the first byte keeps its meaning */
+void mutate(std::vector<uint8_t> *in, std::mt19937_64 &rng) {
+    int edits = 1 + rng() % 8;
+    for (int e = 0; e < edits; e++) {
+        size_t n = in->size();
+        size_t at = n > 1 ? 1 + rng() % (n - 1) : 1;
+        switch (rng() % 6) {
+            case 0:
+                if (at < n) {
+                    (*in)[at] ^= 1 << (rng() % 8);
+                }
+                break;
+            case 1:
+                if (at < n) {
+                    (*in)[at] = rng();
+                }
+                break;
+            case 2:
+                if (at < n) {
+                    (*in)[at] = interesting[rng() % sizeof(interesting)];
+                }
+                break;
+            case 3:
+                if (at + 1 < n) {  // a whole word: 0000, FFFF, 8000 ...
+                    uint16_t w = rng() % 2 ? 0xffff : (rng() % 2 ? 0 : 0x8000);
+                    (*in)[at] = w;
+                    (*in)[at + 1] = w >> 8;
+                }
+                break;
+            case 4:
+                if (n < 65536) {
+                    in->insert(in->begin() + std::min(at, n), 1 + rng() % 16,
+                               rng());
+                }
+                break;
+            case 5:
+                if (at < n) {
+                    size_t len = std::min<size_t>(1 + rng() % 16, n - at);
+                    in->erase(in->begin() + at, in->begin() + at + len);
+                }
+                break;
+        }
+    }
+}
+
+struct Fuzzer {
+    FuzzTarget target;
+    std::string findings = "findings";
+    uint64_t runs = 0;
+    std::mt19937_64 rng;
+
+    std::vector<std::vector<uint8_t>> corpus;
+    /* where and why inputs stopped: a new pair keeps the input */
+    std::set<std::pair<int, uint32_t>> seen;
+    std::set<std::pair<int, uint32_t>> found;
+
+    void keep_if_new(const std::vector<uint8_t> &in, StopReason why) {
+        if (why == StopReason::NONE) {
+            return;  // the loader refused it
+        }
+        auto &sregs = target.vm()->cpu->sregs;
+        auto &regs = target.vm()->cpu->regs;
+        uint32_t where = sregs.cs.selector << 16 | (uint16_t)regs.rip;
+        auto key = std::make_pair((int)why, where);
+        if (seen.insert(key).second && corpus.size() < 4096) {
+            corpus.push_back(in);
+        }
+        if (why == StopReason::HOST_ERROR && found.insert(key).second) {
+            save_finding(in, why);
+        }
+    }
+
+    void save_finding(const std::vector<uint8_t> &in, StopReason why) {
+        char name[64];
+        snprintf(name, sizeof(name), "/%s-%016llx", stop_reason_name(why),
+                 (unsigned long long)fnv1a(in));
+        std::string base = findings + name;
+        write_file(base + ".in", in);
+        target.save(in.data(), in.size(), base + ".snap");
+        fprintf(log_fp, "finding: %s.snap\n", base.c_str());
+    }
+
+    int fuzz() {
+        corpus = target.seeds();
+        mkdir(findings.c_str(), 0755);
+        catch_crashes(findings);
+
+        uint64_t start = stats_now_ns();
+        uint64_t last_report = start;
+        std::vector<uint8_t> in;
+        for (uint64_t n = 1; runs == 0 || n <= runs; n++) {
+            in = corpus[rng() % corpus.size()];
+            mutate(&in, rng);
+            current_data = in.data();
+            current_size = in.size();
+            keep_if_new(in, target.run(in.data(), in.size()));
+
+            uint64_t now = stats_now_ns();
+            if (now - last_report >= 1000000000 || n == runs) {
+                last_report = now;
+                double s = (now - start) / 1e9;
+                fprintf(log_fp,
+                        "#%llu  %.0f execs/s  corpus %zu  findings %zu\n",
+                        (unsigned long long)n, n / s, corpus.size(),
+                        found.size());
+            }
+        }
+        return found.empty() ? 0 : 1;
+    }
+};
+
+/* run a snapshot saved for a finding */
+int replay(const std::string &path, Backend backend, const FuzzLimits &fl) {
+    std::string error;
+    auto vm = create_vm(backend, &error);
+    if (!vm) {
+        fprintf(stderr, "%s\n", error.c_str());
+        return 1;
+    }
+    auto io = fuzz_io();
+    vm->set_io(io.get());
+    if (!restore_snapshot(vm.get(), path)) {
+        return 1;
+    }
+    RunLimits limits;
+    limits.max_steps = fl.max_exits;
+    limits.max_ns = fl.max_ns;
+    StopReason why = run_vm(vm.get(), limits);
+    fprintf(log_fp, "%s: %s, status %d at %04llX:%04llX\n", path.c_str(),
+            stop_reason_name(why), vm->exit_status,
+            (unsigned long long)vm->cpu->sregs.cs.selector,
+            (unsigned long long)vm->cpu->regs.rip);
+    vm->set_io(nullptr);
+    return 0;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    enum {
+        OPT_BACKEND = 256,
+        OPT_RUNS,
+        OPT_EXITS,
+        OPT_US,
+        OPT_SEED,
+        OPT_FINDINGS,
+        OPT_REPLAY,
+    };
+    static const struct option long_options[] = {
+        {"backend", required_argument, nullptr, OPT_BACKEND},
+        {"runs", required_argument, nullptr, OPT_RUNS},
+        {"exits", required_argument, nullptr, OPT_EXITS},
+        {"us", required_argument, nullptr, OPT_US},
+        {"seed", required_argument, nullptr, OPT_SEED},
+        {"findings", required_argument, nullptr, OPT_FINDINGS},
+        {"replay", required_argument, nullptr, OPT_REPLAY},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    Fuzzer f;
+    Backend backend = Backend::INTERP;
+    FuzzLimits limits;
+    uint64_t seed = 1;
+    std::string replay_path;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case OPT_BACKEND:
+                if (strcmp(optarg, "kvm") == 0) {
+                    backend = Backend::KVM;
+                } else if (strcmp(optarg, "jit") == 0) {
+                    backend = Backend::JIT;
+                } else if (strcmp(optarg, "interp") == 0) {
+                    backend = Backend::INTERP;
+                } else {
+                    fprintf(stderr, "bad --backend: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_RUNS:
+                f.runs = strtoull(optarg, nullptr, 0);
+                break;
+            case OPT_EXITS:
+                limits.max_exits = strtoull(optarg, nullptr, 0);
+                break;
+            case OPT_US:
+                limits.max_ns = strtoull(optarg, nullptr, 0) * 1000;
+                break;
+            case OPT_SEED:
+                seed = strtoull(optarg, nullptr, 0);
+                break;
+            case OPT_FINDINGS:
+                f.findings = optarg;
+                break;
+            case OPT_REPLAY:
+                replay_path = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    f.rng.seed(seed);
+
+    if (!replay_path.empty()) {
+        return replay(replay_path, backend, limits);
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!f.target.init(argv[optind], backend, limits)) {
+        return 1;
+    }
+
+    /* the guest's diagnostics would drown the progress lines */
+    fflush(stdout);
+    log_fd = dup(2);
+    int devnull = open("/dev/null", O_WRONLY);
+    if (log_fd < 0 || devnull < 0 || !(log_fp = fdopen(log_fd, "w"))) {
+        perror("dosfuzz");
+        return 1;
+    }
+    setvbuf(log_fp, nullptr, _IOLBF, 0);
+    dup2(devnull, 1);
+    dup2(devnull, 2);
+    close(devnull);
+
+    if (optind + 1 < argc) {
+        for (int i = optind + 1; i < argc; i++) {
+            std::vector<uint8_t> in;
+            if (!read_file(argv[i], &in)) {
+                return 1;
+            }
+            StopReason why = f.target.run(in.data(), in.size());
+            fprintf(log_fp, "%s: %s, status %d\n", argv[i],
+                    stop_reason_name(why), f.target.vm()->exit_status);
+        }
+        return 0;
+    }
+    return f.fuzz();
+}
@@ -0,0 +1,220 @@
+#include "dosvm.hpp"
+
+#include <signal.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "snapshot.hpp"
+
+namespace {
+
+/* the CPU run_vm() is running on this thread, for its deadline */
+thread_local CPU *deadline_cpu = nullptr;
+
+void on_deadline(int) {
+    CPU *cpu = deadline_cpu;
+    if (cpu) {
+        cpu->kick_pending |= KICK_DEADLINE;
+        if (cpu->immediate_exit) {
+            *cpu->immediate_exit = 1;
+        }
+    }
+}
+
+/* one-shot SIGALRM to the calling thread in ns; false if there is no timer,
+ * then the deadline is only checked between exits */
+bool arm_deadline(uint64_t ns, timer_t *timer) {
+    struct sigaction sa = {};
+    sa.sa_handler = on_deadline;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGALRM, &sa, nullptr);
+
+    struct sigevent sev = {};
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = SIGALRM;
+    sev._sigev_un._tid = syscall(SYS_gettid);  // sigev_notify_thread_id
+    if (timer_create(CLOCK_MONOTONIC, &sev, timer) < 0) {
+        perror("timer_create");
+        return false;
+    }
+    struct itimerspec its = {};
+    its.it_value.tv_sec = ns / 1000000000;
+    its.it_value.tv_nsec = ns % 1000000000;
+    timer_settime(*timer, 0, &its, nullptr);
+    return true;
+}
+
+}  // namespace
+
+std::unique_ptr<VM> create_vm(Backend backend, std::string *error) {
+    auto vm = std::make_unique<VM>(backend);
+    if (!vm->error.empty()) {
+        *error = vm->error;
+        return nullptr;
+    }
+    setup_ivt(vm.get());
+    return vm;
+}
+
+bool load_program(VM *vm, const char *path, const std::string &dos_argv,
+                  const RunOptions &opts) {
+    size_t path_len = strlen(path);
+
+    vm->single_step = opts.single_step;
+    vm->console.set_policy(opts.console_policy);
+    if (opts.stats || !opts.stats_json.empty()) {
+        vm->stats = std::make_unique<Stats>(opts.stats, opts.stats_json);
+        vm->console.set_stats(&vm->stats->console_flush);
+    }
+    if (!opts.timeline.empty()) {
+        vm->timeline = std::make_unique<Timeline>(opts.timeline);
+        vm->console.set_timeline(vm->timeline.get());
+    }
+    for (const auto &d : opts.drives) {
+        if (!vm->drives.mount(d.first, d.second)) {
+            fprintf(stderr, "%c: %s: %s\n", d.first, d.second.c_str(),
+                    strerror(errno));
+            return false;
+        }
+    }
+    if (!opts.deps.empty()) {
+        vm->deps = std::make_unique<DepsFile>(opts.deps);
+        vm->deps->input(path);
+    }
+    if (!opts.profile.empty()) {
+        vm->profiler = std::make_unique<Profiler>(opts.profile_hz,
+                                                  opts.profile, opts.symbols);
+        if (!vm->profiler->start(vm->cpu.get())) {
+            return false;
+        }
+    }
+    if (!opts.trace.empty()) {
+        vm->trace = std::make_unique<TraceWriter>(opts.trace);
+        if (!vm->trace->ok()) {
+            return false;
+        }
+    }
+
+    vm->run_mode = RUN_MODE::DOS_KERNEL;
+    if (path_len > 4) {
+        if ((path[path_len - 4] == '.') && (path[path_len - 3] == 'E') &&
+            (path[path_len - 2] == 'X') && (path[path_len - 1] == 'E')) {
+            vm->run_mode = RUN_MODE::DOS_EXE;
+        } else if ((path[path_len - 4] == '.') &&
+                   (path[path_len - 3] == 'C') &&
+                   (path[path_len - 2] == 'O') &&
+                   (path[path_len - 1] == 'M')) {
+            vm->run_mode = RUN_MODE::DOS_COM;
+        }
+    }
+
+    if (vm->run_mode == RUN_MODE::DOS_KERNEL) {
+        if (!vm->set_floppy(path)) {
+            return false;
+        }
+
+        if (!opts.restore_snapshot.empty() &&
+            restore_snapshot(vm, opts.restore_snapshot)) {
+            return true;  // already at the COMMAND.COM entry point
+        }
+        if (vm->stopped() || !install_dos_driver(vm)) {
+            return false;
+        }
+    }
+    if (opts.console_device) {
+        install_console_stubs(vm);
+    }
+    vm->cpu->setup(vm->addr_config, vm->run_mode);
+
+    if (vm->run_mode == RUN_MODE::DOS_EXE) {
+        if (load_mz(vm, path, dos_argv) == -1) {
+            return false;
+        }
+    } else if (vm->run_mode == RUN_MODE::DOS_KERNEL) {
+        set_seg(vm->cpu->sregs.es, vm->addr_config.dos_seg);
+        set_seg(vm->cpu->sregs.ds, vm->addr_config.dos_io_seg);
+        /* dos init */
+        vm->emu_far_call(vm->addr_config.dos_seg, 0);
+        if (vm->stopped()) {
+            return true;  // run_vm() reports why
+        }
+
+        int addr = vm->cpu->sregs.ds.base;
+
+        auto command_com = vm->floppy->read("COMMAND ", "COM");
+        if (!command_com) {
+            fprintf(stderr, "unable to read COMMAND.COM\n");
+            return false;
+        }
+        memcpy(vm->full_mem + addr + 0x100, command_com->data(),
+               command_com->size());
+
+        set_seg(vm->cpu->sregs.es, vm->cpu->sregs.ds.selector);
+        set_seg(vm->cpu->sregs.ss, vm->cpu->sregs.ds.selector);
+        set_seg(vm->cpu->sregs.cs, vm->cpu->sregs.ds.selector);
+        vm->cpu->regs.rsp = 0x5c;
+        vm->cpu->regs.rip = 0x100;  // command com start
+
+        if (!opts.save_snapshot.empty()) {
+            save_snapshot(vm, opts.save_snapshot);
+        }
+    }
+    return true;
+}
+
+StopReason run_vm(VM *vm, const RunLimits &limits) {
+    if (vm->stop_reason == StopReason::BUDGET) {
+        vm->stop_reason = StopReason::NONE;
+    }
+    if (vm->stopped()) {
+        return vm->stop_reason;
+    }
+
+    vm->steps_left = limits.max_steps;
+    vm->deadline_ns = limits.max_ns ? stats_now_ns() + limits.max_ns : 0;
+    timer_t timer;
+    bool armed = false;
+    if (limits.max_ns) {
+        deadline_cpu = vm->cpu.get();
+        armed = arm_deadline(limits.max_ns, &timer);
+    }
+
+    run_with_handler(vm);
+
+    if (armed) {
+        timer_delete(timer);
+    }
+    deadline_cpu = nullptr;
+    /* a late kick must not end the next run_vm() */
+    __atomic_and_fetch(&vm->cpu->kick_pending, ~KICK_DEADLINE,
+                       __ATOMIC_SEQ_CST);
+    vm->steps_left = 0;
+    vm->deadline_ns = 0;
+
+    if (!vm->stopped()) {
+        /* the outermost far call returned, as a program that ends in RETF */
+        vm->stop(StopReason::DOS_EXIT, 0);
+    }
+    if (vm->stop_reason == StopReason::BUDGET) {
+        vm->handles.flush_all(vm);  // the host sees what it wrote so far
+    } else {
+        vm->handles.close_all(vm);  // the program is over
+        if (vm->floppy) {
+            vm->floppy->sync();
+        }
+    }
+    vm->console.flush();
+    return vm->stop_reason;
+}
+
+int run_program(VM *vm, const char *path, const std::string &dos_argv,
+                const RunOptions &opts) {
+    if (!load_program(vm, path, dos_argv, opts)) {
+        return vm->stopped() ? vm->exit_status : 1;
+    }
+    run_vm(vm);
+    return vm->exit_status;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+
+#include "vm.hpp"
+
+/*
+ * libdosvm: the VM without the command line.  All guest state lives in the
+ * VM, so a process can hold any number of them and run each on its own
+ * thread.  Nothing in the library calls exit(); the guest ends with a
+ * StopReason and VM::exit_status, and host I/O goes through VM::io.
+ *
+ *     std::string error;
+ *     auto vm = create_vm(Backend::AUTO, &error);
+ *     vm->set_io(&my_io);  // optional
+ *     if (load_program(vm.get(), "T.EXE", "ARGS", RunOptions())) {
+ *         RunLimits limits;
+ *         limits.max_ns = 1000000000;
+ *         while (run_vm(vm.get(), limits) == StopReason::BUDGET) {
+ *             ...
+ *         }
+ *     }
+ *     return vm->exit_status;
+ *
+ * To run many programs on one VM, VM::reset() between them; it only puts
+ * back the pages the last one wrote.  VM::take_baseline() and
+ * VM::reset_to() do the same for any other starting point.
+ */
+
+/* how far one run_vm() may go, 0 for no limit */
+struct RunLimits {
+    uint64_t max_steps = 0;  // exits, instructions with single_step
+    uint64_t max_ns = 0;     // wall time, kicked by SIGALRM to this thread
+};
+
+/* a VM with its IVT installed, or null and the reason in *error */
+std::unique_ptr<VM> create_vm(Backend backend, std::string *error);
+
+/*
+ * Set up opts and load PROGRAM.EXE, or boot DOS from a floppy image up to
+ * the COMMAND.COM entry point.  false, with the reason on stderr, if it
+ * can't be run.
+ */
+bool load_program(VM *vm, const char *path, const std::string &dos_argv,
+                  const RunOptions &opts);
+
+/*
+ * Run the guest until it stops or limits run out.  After BUDGET another
+ * run_vm() goes on where this one left; any other reason is final.
+ */
+StopReason run_vm(VM *vm, const RunLimits &limits = RunLimits());
+
+/* load_program() and run_vm() to the end, VM::exit_status */
+int run_program(VM *vm, const char *path, const std::string &dos_argv,
+                const RunOptions &opts);
@@ -0,0 +1,239 @@
+#include "drives.hpp"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/openat2.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <vector>
+
+namespace {
+
+/* name as DOS keeps it, "" if nothing of it is left */
+std::string dos_name(const std::string &name) {
+    std::string base;
+    std::string ext;
+    size_t dot = name.find('.');
+    for (size_t i = 0; i < name.size() && i < dot && base.size() < 8; i++) {
+        base += toupper((unsigned char)name[i]);
+    }
+    for (size_t i = dot + 1; dot != std::string::npos && i < name.size() &&
+                             name[i] != '.' && ext.size() < 3;
+         i++) {
+        ext += toupper((unsigned char)name[i]);
+    }
+    if (base.empty()) {
+        return "";
+    }
+    return ext.empty() ? base : base + "." + ext;
+}
+
+/* a host name DOS can see: already 8.3, whatever its case */
+bool is_dos_name(const std::string &name) {
+    std::string upper;
+    for (char c : name) {
+        upper += toupper((unsigned char)c);
+    }
+    return upper == dos_name(name);
+}
+
+}  // namespace
+
+DriveMap::DriveMap() {
+    for (int &fd : root_fds) {
+        fd = -1;
+    }
+}
+
+DriveMap::~DriveMap() { clear(); }
+
+bool DriveMap::mount(char letter, const std::string &root) {
+    int d = toupper((unsigned char)letter) - 'A';
+    if (d < 0 || d >= NUM_DRIVES) {
+        errno = EINVAL;
+        return false;
+    }
+    char real[PATH_MAX];
+    if (!realpath(root.c_str(), real)) {
+        return false;
+    }
+    int fd = open(real, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    if (roots[d].empty()) {
+        num_mounted++;
+    } else {
+        close(root_fds[d]);
+    }
+    roots[d] = real;
+    root_fds[d] = fd;
+    return true;
+}
+
+void DriveMap::clear() {
+    for (int d = 0; d < NUM_DRIVES; d++) {
+        if (root_fds[d] >= 0) {
+            close(root_fds[d]);
+            root_fds[d] = -1;
+        }
+        roots[d].clear();
+    }
+    num_mounted = 0;
+    dirs.clear();
+}
+
+DriveMap::Dir *DriveMap::list(int d, const std::string &path, bool again) {
+    std::string full = path.empty() ? roots[d] : roots[d] + "/" + path;
+    auto it = dirs.find(full);
+    if (it != dirs.end() && !again) {
+        return &it->second;
+    }
+    int fd = open_beneath(root_fds[d], path.empty() ? "." : path.c_str(),
+                          O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0);
+    DIR *dp = fd < 0 ? nullptr : fdopendir(fd);
+    if (!dp) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return nullptr;
+    }
+    Dir &dir = dirs[full];
+    dir = Dir();
+    while (struct dirent *de = readdir(dp)) {
+        std::string name = de->d_name;
+        if (name == "." || name == ".." || !is_dos_name(name)) {
+            continue;
+        }
+        unsigned char type = de->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+                continue;
+            }
+            type = S_ISDIR(st.st_mode) ? DT_DIR
+                   : S_ISREG(st.st_mode) ? DT_REG : DT_LNK;
+        }
+        if (type == DT_DIR) {
+            dir.dirs[dos_name(name)] = name;
+        } else if (type == DT_REG) {
+            dir.files[dos_name(name)] = name;
+        }
+    }
+    closedir(dp);
+    return &dir;
+}
+
+bool DriveMap::resolve(const char *p, HostPath *host) {
+    int d = current;
+    if (p[0] != '\0' && p[1] == ':') {
+        d = toupper((unsigned char)p[0]) - 'A';
+        p += 2;
+    }
+    if (d < 0 || d >= NUM_DRIVES || roots[d].empty()) {
+        errno = ENOTDIR;  // path not found
+        return false;
+    }
+
+    std::vector<std::string> names;
+    std::string name;
+    for (const char *c = p;; c++) {
+        if (*c == '\\' || *c == '/' || *c == '\0') {
+            if (name == "..") {
+                if (!names.empty()) {
+                    names.pop_back();
+                }
+            } else if (!name.empty() && name != ".") {
+                names.push_back(name);
+            }
+            name.clear();
+            if (*c == '\0') {
+                break;
+            }
+        } else {
+            name += *c;
+        }
+    }
+    if (names.empty()) {
+        errno = ENOENT;
+        return false;
+    }
+
+    std::string path;
+    for (size_t i = 0; i < names.size(); i++) {
+        bool last = i + 1 == names.size();
+        std::string want = dos_name(names[i]);
+        if (want.empty()) {
+            errno = last ? ENOENT : ENOTDIR;
+            return false;
+        }
+        Dir *dir = list(d, path, false);
+        if (!dir) {
+            return false;
+        }
+        auto &found = last ? dir->files : dir->dirs;
+        auto it = found.find(want);
+        if (it == found.end()) {
+            /* made since the listing, by someone else? */
+            dir = list(d, path, true);
+            if (!dir) {
+                return false;
+            }
+            auto &again = last ? dir->files : dir->dirs;
+            it = again.find(want);
+            if (it == again.end()) {
+                if (!last) {
+                    errno = ENOTDIR;
+                    return false;
+                }
+                if (dir->dirs.count(want)) {
+                    errno = EACCES;  // a directory, DOS can't open it
+                    return false;
+                }
+                path += (path.empty() ? "" : "/") + want;
+                break;
+            }
+        }
+        path += (path.empty() ? "" : "/") + it->second;
+    }
+    host->dirfd = root_fds[d];
+    host->path = path;
+    host->full = roots[d] + "/" + path;
+    return true;
+}
+
+void DriveMap::created(const HostPath &host) {
+    size_t slash = host.full.rfind('/');
+    auto it = dirs.find(host.full.substr(0, slash));
+    if (it != dirs.end()) {
+        std::string name = host.full.substr(slash + 1);
+        it->second.files[dos_name(name)] = name;
+    }
+}
+
+int open_beneath(int dirfd, const char *path, int flags, mode_t mode) {
+    struct open_how how = {};
+    how.flags = flags;
+    how.mode = flags & (O_CREAT | O_TMPFILE) ? mode : 0;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS;
+    return syscall(SYS_openat2, dirfd, path, &how, sizeof(how));
+}
+
+std::string beneath_path(int dirfd, const char *path) {
+    char proc[32];
+    char dir[PATH_MAX];
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", dirfd);
+    ssize_t n = readlink(proc, dir, sizeof(dir) - 1);
+    if (n < 0) {
+        return path;
+    }
+    dir[n] = '\0';
+    return std::string(dir) + "/" + path;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <map>
+#include <string>
+
+/*
+ * Host directories as DOS drives, for vm --drive A=/path.  A DOS path is
+ * taken apart here rather than handed to the host: each name is cut to 8.3
+ * and upper-cased, then looked up case-insensitively in a listing of its
+ * directory.  Listings are read once and kept, and read again only when a
+ * name is missing, so a lookup costs no system call.  Host names that are
+ * not valid 8.3 and symbolic links are not seen at all, and ".." stops at
+ * the root.
+ *
+ * A listing can be stale and a missing name can be anything by the time it
+ * is opened, so the guest stays inside its drives by how files are opened:
+ * relative to the root's fd with open_beneath(), which follows no symbolic
+ * link.
+ *
+ * Without any drive, paths are the host's, relative to the current
+ * directory, and the drive letter is ignored.
+ */
+class DriveMap {
+   public:
+    static constexpr int NUM_DRIVES = 26;
+
+    /* where a DOS path is on the host */
+    struct HostPath {
+        int dirfd = -1;    // the drive's root
+        std::string path;  // under it
+        std::string full;  // the two together, for names and messages
+    };
+
+    DriveMap();
+    ~DriveMap();
+    DriveMap(const DriveMap &) = delete;
+    DriveMap &operator=(const DriveMap &) = delete;
+
+    /* letter as host directory root; false with errno if it is not one */
+    bool mount(char letter, const std::string &root);
+    void clear();
+    bool empty() const { return num_mounted == 0; }
+
+    /* DOS path p, false with errno; a last name that is not there yet
+     * comes back as DOS would create it */
+    bool resolve(const char *p, HostPath *host);
+    /* host path was just created, so later lookups find it */
+    void created(const HostPath &host);
+
+   private:
+    struct Dir {
+        std::map<std::string, std::string> files;  // 8.3 name to host name
+        std::map<std::string, std::string> dirs;
+    };
+    Dir *list(int d, const std::string &path, bool again);
+
+    std::string roots[NUM_DRIVES];
+    int root_fds[NUM_DRIVES];  // O_PATH, -1 when not mounted
+    int num_mounted = 0;
+    int current = 0;  // A:, as AH=19h says
+    std::map<std::string, Dir> dirs;  // by whole host path
+};
+
+/* path under the directory dirfd, as openat(); fails with ELOOP or EXDEV
+ * rather than follow a symbolic link or ".." out of dirfd */
+int open_beneath(int dirfd, const char *path, int flags, mode_t mode);
+/* path under dirfd as one host path, for names */
+std::string beneath_path(int dirfd, const char *path);
@@ -0,0 +1,94 @@
+#include "filemap.hpp"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <map>
+#include <mutex>
+#include <tuple>
+
+namespace {
+
+/* mappings kept with no handle on them, and how much they may hold */
+constexpr size_t MAX_IDLE = 64;
+constexpr size_t MAX_IDLE_BYTES = 256 * 1024 * 1024;
+
+using Key = std::tuple<dev_t, ino_t>;
+
+std::mutex cache_lock;
+std::shared_mutex truncate_lock;
+uint64_t generation = 0;  // truncate_lock held to change it
+std::map<Key, std::shared_ptr<const MappedFile>> cache;
+
+/* drop idle mappings until the limits hold; cache_lock held */
+void trim_cache() {
+    size_t idle = 0;
+    size_t idle_bytes = 0;
+    for (auto &e : cache) {
+        if (e.second.use_count() == 1) {
+            idle++;
+            idle_bytes += e.second->size;
+        }
+    }
+    for (auto it = cache.begin();
+         it != cache.end() && (idle > MAX_IDLE || idle_bytes > MAX_IDLE_BYTES);) {
+        if (it->second.use_count() == 1) {
+            idle--;
+            idle_bytes -= it->second->size;
+            it = cache.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+}  // namespace
+
+MappedFile::~MappedFile() {
+    if (data) {
+        munmap((void *)data, size);
+    }
+}
+
+std::shared_ptr<const MappedFile> map_file(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        return nullptr;
+    }
+    int64_t mtime_ns = st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec;
+    Key key(st.st_dev, st.st_ino);
+
+    std::lock_guard<std::mutex> lk(cache_lock);
+    auto it = cache.find(key);
+    if (it != cache.end() && it->second->size == (size_t)st.st_size &&
+        it->second->mtime_ns == mtime_ns) {
+        return it->second;
+    }
+
+    /* new, or changed since: handles on the old one keep it */
+    void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+        return nullptr;
+    }
+    auto m = std::make_shared<MappedFile>();
+    m->data = (const uint8_t *)p;
+    m->size = st.st_size;
+    m->mtime_ns = mtime_ns;
+    cache[key] = m;
+    trim_cache();
+    return m;
+}
+
+void forget_file(int fd) {
+    generation++;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> lk(cache_lock);
+    cache.erase(Key(st.st_dev, st.st_ino));
+}
+
+std::shared_mutex &mapping_lock() { return truncate_lock; }
+
+uint64_t mapping_generation() { return generation; }
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <memory>
+#include <shared_mutex>
+
+/*
+ * Read-only mappings of whole files for DOS handles opened with AH=3Dh
+ * AL=0, so AH=3Fh is a memcpy().  Mappings are shared by every handle and
+ * every VM in the process: a cache keyed by device, inode, size and mtime
+ * hands out the same one until the file changes, and keeps a few that
+ * nobody holds for the next open of the same include file.
+ */
+struct MappedFile {
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+    int64_t mtime_ns = 0;
+
+    MappedFile() = default;
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    ~MappedFile();
+};
+
+/* fd's file as it is now, null if it is empty or can't be mapped */
+std::shared_ptr<const MappedFile> map_file(int fd);
+/* drop the cached mapping of fd's file, just created or truncated, and
+ * move mapping_generation() on; mapping_lock() held exclusively */
+void forget_file(int fd);
+
+/*
+ * A file cut short under a mapping makes copies past its new end SIGBUS.
+ * Opens that truncate hold this exclusively and call forget_file(); copies
+ * hold it shared and map the file again only when mapping_generation() has
+ * moved since they last did, so a read costs no system call.  This covers
+ * the VMs of one process, not a file truncated by another.
+ */
+std::shared_mutex &mapping_lock();
+uint64_t mapping_generation();
@@ -1,5 +1,6 @@
 #include "floppy.hpp"
 
+#include <sys/file.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <algorithm>
@@ -8,12 +9,32 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "stats.hpp"
+
 Floppy::Floppy(const std::string &path) {
+    this->image_fd = -1;
+    this->mapped_image = nullptr;
+    this->last_sync_ns = stats_now_ns();
+
+    std::string image_path = path;
+    int probe = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (probe >= 0) {
+        bool is_overlay = Overlay::detect(probe);
+        close(probe);
+        if (is_overlay) {
+            this->overlay = Overlay::open(path);
+            if (!this->overlay) {
+                return;
+            }
+            image_path = this->overlay->base();
+        }
+    }
+
     struct stat st_buf;
-    int r = stat(path.c_str(), &st_buf);
+    int r = stat(image_path.c_str(), &st_buf);
     if (r < 0) {
-        perror(path.c_str());
-        exit(1);
+        perror(image_path.c_str());
+        return;
     }
 
     if (st_buf.st_size == (512*2*40*8)) {
@@ -28,20 +49,43 @@ Floppy::Floppy(const std::string &path) {
         this->num_cylinder = 80;
     } else {
         fprintf(stderr, "unknown floppy size %d\n", (int)st_buf.st_size);
-        exit(1);
+        return;
     }
 
-    this->image_fd = open(path.c_str(), O_RDWR);
+    /* the base of an overlay is shared by every session, never written */
+    this->image_fd = open(image_path.c_str(),
+                          this->overlay ? O_RDONLY : O_RDWR);
     if (this->image_fd < 0) {
-        perror(path.c_str());
-        exit(1);
+        perror(image_path.c_str());
+        return;
+    }
+    /* held while the image is mapped, so no overlay commits into it */
+    if (flock(this->image_fd, LOCK_SH | LOCK_NB) < 0) {
+        fprintf(stderr, "%s: being committed to\n", image_path.c_str());
+        return;
     }
 
     this->byte_size = st_buf.st_size;
-    this->mapped_image = (uint8_t*)mmap(0, this->byte_size, PROT_READ|PROT_WRITE, MAP_SHARED, this->image_fd, 0);
+    this->mapped_image = (uint8_t*)mmap(0, this->byte_size, PROT_READ|PROT_WRITE,
+                                        this->overlay ? MAP_PRIVATE : MAP_SHARED,
+                                        this->image_fd, 0);
     if (this->mapped_image == MAP_FAILED) {
         perror("mmap floppy image");
-        exit(1);
+        this->mapped_image = nullptr;
+        return;
+    }
+    if (this->overlay) {
+        bool ok = image_hash(this->mapped_image, this->byte_size) ==
+                  this->overlay->base_hash();
+        if (!ok) {
+            fprintf(stderr, "%s: changed since %s was made\n",
+                    image_path.c_str(), path.c_str());
+        }
+        if (!ok || !this->overlay->apply(this->mapped_image, this->byte_size)) {
+            munmap(this->mapped_image, this->byte_size);
+            this->mapped_image = nullptr;
+            return;
+        }
     }
 
     auto bytes = (char*)this->mapped_image;
@@ -61,8 +105,84 @@ Floppy::Floppy(const std::string &path) {
 }
 
 Floppy::~Floppy() {
-    close(this->image_fd);
-    munmap(this->mapped_image, this->byte_size);
+    if (this->mapped_image) {
+        sync();
+    }
+    if (this->image_fd >= 0) {
+        close(this->image_fd);
+    }
+    if (this->mapped_image) {
+        munmap(this->mapped_image, this->byte_size);
+    }
+}
+
+bool Floppy::read_sectors(size_t lba, size_t count, void *p) const {
+    if (lba > byte_size / 512 || count > byte_size / 512 - lba) {
+        return false;
+    }
+    memcpy(p, mapped_image + lba * 512, count * 512);
+    return true;
+}
+
+bool Floppy::write_sectors(size_t lba, size_t count, const void *p) {
+    if (lba > byte_size / 512 || count > byte_size / 512 - lba) {
+        return false;
+    }
+    if (count == 0) {
+        return true;
+    }
+    memcpy(mapped_image + lba * 512, p, count * 512);
+    if (overlay) {
+        overlay->mark(lba, count);
+    } else if (dirty_lo == dirty_hi) {
+        dirty_lo = lba * 512;
+        dirty_hi = (lba + count) * 512;
+    } else {
+        dirty_lo = std::min(dirty_lo, lba * 512);
+        dirty_hi = std::max(dirty_hi, (lba + count) * 512);
+    }
+    if (stats_now_ns() - last_sync_ns >= SYNC_INTERVAL_NS) {
+        sync();
+    }
+    return true;
+}
+
+bool Floppy::sync() {
+    last_sync_ns = stats_now_ns();
+    if (overlay) {
+        return overlay->sync(mapped_image);
+    }
+    if (dirty_lo == dirty_hi) {
+        return true;
+    }
+    /* msync() wants a page-aligned start */
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t lo = dirty_lo & ~(page - 1);
+    size_t hi = dirty_hi;
+    dirty_lo = dirty_hi = 0;
+    if (msync(mapped_image + lo, hi - lo, MS_SYNC) < 0) {
+        perror("msync floppy image");
+        return false;
+    }
+    return true;
+}
+
+uint64_t Floppy::content_hash() const {
+    return image_hash(this->mapped_image, this->byte_size);
+}
+
+uint64_t image_hash(const uint8_t *image, size_t size) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    const uint64_t *p = (const uint64_t *)image;
+    size_t n = size / 8;
+
+    /* a word per step where FNV-1a takes a byte, the image size is always
+     * a multiple of 512 */
+    for (size_t i = 0; i < n; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ull;
+    }
+    return h;
 }
 
 namespace {
@@ -1,10 +1,16 @@
 #pragma once 
 
+#include <memory>
 #include <optional>
 #include <stdint.h>
 #include <vector>
 #include <string>
 #include "dos.hpp"
+#include "overlay.hpp"
+
+/* a 64-bit hash of an image's contents, with FNV's basis and prime but one
+ * 8-byte word per step, so not FNV-1a; size is a multiple of 8 */
+uint64_t image_hash(const uint8_t *image, size_t size);
 
 struct Floppy {
   int image_fd;
@@ -17,10 +23,34 @@ struct Floppy {
 
   dos_bpb bpb;
   uint8_t *mapped_image;
+  /* path was an overlay: image_fd is its base, mapped copy-on-write, and
+   * sync() writes to the overlay */
+  std::unique_ptr<Overlay> overlay;
+
+  static constexpr uint64_t SYNC_INTERVAL_NS = 1000000000;
+  /* bytes written and not synced yet, lo == hi for none */
+  size_t dirty_lo = 0;
+  size_t dirty_hi = 0;
+  uint64_t last_sync_ns = 0;
 
+  /* check ok(), the image may be missing or of an unknown size */
   Floppy(const std::string &path);
   ~Floppy();
 
+  bool ok() const { return mapped_image != nullptr; }
+
+  /* sectors [lba, lba + count) to or from p, false if they are not all on
+   * the disk, for HostIO's default disk_read/disk_write.  Both are a
+   * memcpy() on mapped_image; what is written reaches the image at sync() */
+  bool read_sectors(size_t lba, size_t count, void *p) const;
+  bool write_sectors(size_t lba, size_t count, const void *p);
+  /* msync() what was written since the last sync(); write_sectors() also
+   * does it once SYNC_INTERVAL_NS have passed, and so does the destructor */
+  bool sync();
+
+  /* image_hash() of the whole image, identifies the disk contents */
+  uint64_t content_hash() const;
+
   std::optional<std::vector<uint8_t>> read(const std::string &filename,
                                            const std::string &ext);
 };
@@ -0,0 +1,247 @@
+#include "fuzz.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "snapshot.hpp"
+
+namespace {
+
+/* code copied to CS:IP for a FUZZ_GUEST_STATE input */
+constexpr size_t MAX_CODE = 4096;
+constexpr size_t NUM_STATE_REGS = 11;
+
+/*
+ * Host side of a fuzzed guest: no files, no input, output thrown away.  The
+ * handlers still check the guest's pointers and lengths before they get
+ * here, which is what is being fuzzed.
+ */
+struct NullIO : HostIO {
+    ssize_t console_writev(int, const struct iovec *iov, int n) override {
+        ssize_t total = 0;
+        for (int i = 0; i < n; i++) {
+            total += iov[i].iov_len;
+        }
+        return total;
+    }
+    int console_getc() override { return EOF; }
+    bool console_poll() override { return false; }
+
+    int open(const char *, int, mode_t) override {
+        errno = EACCES;
+        return -1;
+    }
+    int openat(int, const char *, int, mode_t) override {
+        errno = EACCES;
+        return -1;
+    }
+    ssize_t read(int fd, void *, size_t) override {
+        return fd == 0 ? 0 : bad_handle();
+    }
+    ssize_t write(int fd, const void *, size_t len) override {
+        return fd == 1 || fd == 2 ? (ssize_t)len : bad_handle();
+    }
+    off_t lseek(int, off_t, int) override { return bad_handle(); }
+    int close(int fd) override { return fd <= 2 ? 0 : bad_handle(); }
+    ssize_t disk_read(Floppy *, void *, size_t, off_t) override {
+        return bad_handle();
+    }
+    ssize_t disk_write(Floppy *, const void *, size_t, off_t) override {
+        return bad_handle();
+    }
+
+    static int bad_handle() {
+        errno = EBADF;
+        return -1;
+    }
+};
+
+uint16_t get16(const uint8_t *p) { return p[0] | p[1] << 8; }
+
+void put16(std::vector<uint8_t> *v, uint16_t val) {
+    v->push_back(val);
+    v->push_back(val >> 8);
+}
+
+bool read_file(const std::string &path, std::vector<uint8_t> *data) {
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (!fp) {
+        perror(path.c_str());
+        return false;
+    }
+    uint8_t buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        data->insert(data->end(), buf, buf + n);
+    }
+    bool ok = !ferror(fp);
+    fclose(fp);
+    return ok;
+}
+
+}  // namespace
+
+std::unique_ptr<HostIO> fuzz_io() { return std::make_unique<NullIO>(); }
+
+FuzzTarget::~FuzzTarget() {
+    if (vm_) {
+        vm_->set_io(nullptr);
+    }
+}
+
+bool FuzzTarget::init(const std::string &program, Backend backend,
+                      const FuzzLimits &limits) {
+    limits_ = limits;
+    if (program.size() < 4 ||
+        strcasecmp(program.c_str() + program.size() - 4, ".EXE") != 0) {
+        fprintf(stderr, "%s: the base program must be an .EXE\n",
+                program.c_str());
+        return false;
+    }
+    if (!read_file(program, &image_)) {
+        return false;
+    }
+
+    std::string error;
+    vm_ = create_vm(backend, &error);
+    if (!vm_) {
+        fprintf(stderr, "%s\n", error.c_str());
+        return false;
+    }
+    io_ = fuzz_io();
+    vm_->set_io(io_.get());
+
+    empty_ = vm_->take_baseline();
+    if (!empty_) {
+        return false;
+    }
+    if (!load_program(vm_.get(), program.c_str(), "", RunOptions())) {
+        return false;
+    }
+    loaded_ = vm_->take_baseline();
+    return loaded_ != nullptr;
+}
+
+bool FuzzTarget::prepare(const uint8_t *data, size_t size) {
+    VM *vm = vm_.get();
+    if (size == 0) {
+        return false;
+    }
+    vm->handles.close_all(vm);  // the last input may have closed 0-4
+
+    if ((data[0] & 1) == FUZZ_MZ_IMAGE) {
+        /* as load_program() would, from memory */
+        if (!vm->reset_to(*empty_)) {
+            return false;
+        }
+        vm->run_mode = RUN_MODE::DOS_EXE;
+        install_console_stubs(vm);
+        vm->cpu->setup(vm->addr_config, vm->run_mode);
+        return load_mz_image(vm, data + 1, size - 1, "") == nullptr;
+    }
+
+    if (!vm->reset_to(*loaded_)) {
+        return false;
+    }
+    data++;
+    size--;
+    auto &regs = vm->cpu->regs;
+    auto &sregs = vm->cpu->sregs;
+    __u64 *gpr[] = {&regs.rax, &regs.rbx, &regs.rcx, &regs.rdx,
+                    &regs.rsi, &regs.rdi, &regs.rbp, &regs.rsp};
+    struct kvm_segment *seg[] = {&sregs.ds, &sregs.es, &sregs.ss};
+    for (size_t i = 0; i < NUM_STATE_REGS && size >= 2; i++) {
+        uint16_t val = get16(data);
+        if (i < 8) {
+            *gpr[i] = val;
+        } else {
+            set_seg(*seg[i - 8], val);
+        }
+        data += 2;
+        size -= 2;
+    }
+    size_t code = sregs.cs.base + (uint16_t)regs.rip;
+    for (size_t i = 0; i < size && i < MAX_CODE; i++) {
+        vm->full_mem[(code + i) & (VM::MEM_SIZE - 1)] = data[i];
+    }
+    return true;
+}
+
+StopReason FuzzTarget::run(const uint8_t *data, size_t size) {
+    if (!prepare(data, size)) {
+        return StopReason::NONE;  // refused before the guest ran
+    }
+    RunLimits limits;
+    limits.max_steps = limits_.max_exits;
+    limits.max_ns = limits_.max_ns;
+    return run_vm(vm_.get(), limits);
+}
+
+bool FuzzTarget::save(const uint8_t *data, size_t size,
+                      const std::string &path) {
+    if (!prepare(data, size)) {
+        return false;
+    }
+    return save_snapshot(vm_.get(), path);
+}
+
+std::vector<std::vector<uint8_t>> FuzzTarget::seeds() const {
+    std::vector<uint8_t> mz;
+    mz.push_back(FUZZ_MZ_IMAGE);
+    mz.insert(mz.end(), image_.begin(), image_.end());
+
+    /* the registers and code at entry, as loaded_ has them */
+    std::vector<uint8_t> state;
+    state.push_back(FUZZ_GUEST_STATE);
+    const auto &regs = loaded_->regs;
+    const auto &sregs = loaded_->sregs;
+    for (__u64 r : {regs.rax, regs.rbx, regs.rcx, regs.rdx, regs.rsi,
+                    regs.rdi, regs.rbp, regs.rsp}) {
+        put16(&state, r);
+    }
+    for (__u16 s : {sregs.ds.selector, sregs.es.selector, sregs.ss.selector}) {
+        put16(&state, s);
+    }
+    size_t code = sregs.cs.base + (uint16_t)regs.rip;
+    for (size_t i = 0; i < 256; i++) {
+        state.push_back(vm_->full_mem[(code + i) & (VM::MEM_SIZE - 1)]);
+    }
+    return {mz, state};
+}
+
+/*
+ * libFuzzer entry points, for a build with clang -fsanitize=fuzzer (make
+ * dosfuzz-libfuzzer).  The base program comes from DOSFUZZ_PROGRAM, the
+ * backend from DOSFUZZ_BACKEND (interp by default).
+ */
+namespace {
+FuzzTarget *libfuzzer_target;
+}
+
+extern "C" int LLVMFuzzerInitialize(int *, char ***) {
+    const char *program = getenv("DOSFUZZ_PROGRAM");
+    if (!program) {
+        fprintf(stderr, "set DOSFUZZ_PROGRAM to the base .EXE\n");
+        exit(1);
+    }
+    const char *name = getenv("DOSFUZZ_BACKEND");
+    Backend backend = Backend::INTERP;
+    if (name && strcmp(name, "kvm") == 0) {
+        backend = Backend::KVM;
+    } else if (name && strcmp(name, "jit") == 0) {
+        backend = Backend::JIT;
+    }
+    libfuzzer_target = new FuzzTarget;
+    if (!libfuzzer_target->init(program, backend, FuzzLimits())) {
+        exit(1);
+    }
+    return 0;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    libfuzzer_target->run(data, size);
+    return 0;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "dosvm.hpp"
+
+/*
+ * In-process fuzz target for the two surfaces untrusted programs reach: the
+ * MZ loader and the INT 21h handlers.  One VM is kept per target; every
+ * input starts from a baseline with VM::reset_to(), so an execution costs
+ * the pages the last one dirtied, not a new VM.
+ *
+ * The first byte of an input picks what the rest is:
+ *
+ *     even  an MZ image, loaded over the VM as create_vm() left it
+ *     odd   AX BX CX DX SI DI BP SP DS ES SS as little-endian words, then
+ *           code for CS:IP, over the base program as load_program() left
+ *           it; a short input keeps the registers it doesn't reach
+ *
+ * and the guest runs until it stops or FuzzLimits run out.
+ */
+
+struct FuzzLimits {
+    uint64_t max_exits = 10000;   // hypercalls per input
+    uint64_t max_ns = 1000000;    // so loops without exits end too
+};
+
+/* the first byte of an input */
+enum : uint8_t {
+    FUZZ_MZ_IMAGE = 0,
+    FUZZ_GUEST_STATE = 1,
+};
+
+/* host I/O for a fuzzed guest: no files, no input, output discarded */
+std::unique_ptr<HostIO> fuzz_io();
+
+struct FuzzTarget {
+    /* false, with the reason on stderr, if program can't be run */
+    bool init(const std::string &program, Backend backend,
+              const FuzzLimits &limits);
+
+    /* run one input; why the guest stopped */
+    StopReason run(const uint8_t *data, size_t size);
+
+    /* input as a snapshot of the machine just before it runs, which
+     * dosfuzz --replay runs again */
+    bool save(const uint8_t *data, size_t size, const std::string &path);
+
+    /* a starting corpus: the program's image and its state at entry */
+    std::vector<std::vector<uint8_t>> seeds() const;
+
+    VM *vm() { return vm_.get(); }
+
+    FuzzTarget() = default;
+    FuzzTarget(const FuzzTarget &) = delete;
+    FuzzTarget &operator=(const FuzzTarget &) = delete;
+    ~FuzzTarget();
+
+   private:
+    /* reset and apply data, without running; false if it can't start */
+    bool prepare(const uint8_t *data, size_t size);
+
+    std::unique_ptr<VM> vm_;
+    std::unique_ptr<HostIO> io_;
+    std::unique_ptr<Baseline> empty_;   // after create_vm()
+    std::unique_ptr<Baseline> loaded_;  // after load_program()
+    std::vector<uint8_t> image_;        // the program file
+    FuzzLimits limits_;
+};
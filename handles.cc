@@ -0,0 +1,367 @@
+#include "handles.hpp"
+
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "vm.hpp"
+
+DosHandles::DosHandles() { wire_std(); }
+
+void DosHandles::wire_std() {
+    const Kind std_kinds[NUM_STD] = {Kind::CON, Kind::CON, Kind::CON_ERR,
+                                     Kind::NUL, Kind::NUL};
+    for (int h = 0; h < NUM_STD; h++) {
+        table[h] = Handle();
+        table[h].kind = std_kinds[h];
+    }
+}
+
+bool DosHandles::has_free() const {
+    for (const auto &f : table) {
+        if (f.kind == Kind::FREE) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int DosHandles::add(int fd, std::shared_ptr<const MappedFile> map,
+                    uint64_t map_gen) {
+    for (int h = 0; h < MAX_HANDLES; h++) {
+        if (table[h].kind == Kind::FREE) {
+            table[h] = Handle();
+            table[h].kind = Kind::FILE;
+            table[h].fd = fd;
+            table[h].map = std::move(map);
+            table[h].map_gen = map_gen;
+            return h;
+        }
+    }
+    errno = EMFILE;
+    return -1;
+}
+
+DosHandles::Handle *DosHandles::file(int h) {
+    if (h < 0 || h >= MAX_HANDLES || table[h].kind == Kind::FREE) {
+        errno = EBADF;
+        return nullptr;
+    }
+    return &table[h];
+}
+
+/* double the window while the guest keeps going where it left off */
+void DosHandles::grow_window(Handle &f, int64_t at) {
+    if (at == f.seq_end) {
+        f.window = std::min(f.window * 2, MAX_WINDOW);
+    } else {
+        f.window = MIN_WINDOW;
+    }
+}
+
+ssize_t DosHandles::host_read(VM *vm, Handle &f, int64_t at, void *p,
+                              size_t len) {
+    if (f.host_pos != at) {
+        f.host_pos = -1;
+        if (vm->io->lseek(f.fd, at, SEEK_SET) < 0) {
+            return -1;
+        }
+    }
+    TimelineSpan io(vm->timeline.get(), "read", "host");
+    io.arg("fd", f.fd);
+    io.arg("bytes", len);
+    ssize_t r = vm->io->read(f.fd, p, len);
+    io.arg("ret", r);
+    if (r < 0 && errno == EBADF) {
+        errno = EACCES;  // the handle is fine, the file is write-only
+    }
+    if (r >= 0) {
+        f.host_pos = at + r;
+        f.seq_end = at + r;
+    }
+    return r;
+}
+
+ssize_t DosHandles::host_write(VM *vm, Handle &f, int64_t at, const void *p,
+                               size_t len) {
+    if (f.host_pos != at) {
+        f.host_pos = -1;
+        if (vm->io->lseek(f.fd, at, SEEK_SET) < 0) {
+            return -1;
+        }
+    }
+    TimelineSpan io(vm->timeline.get(), "write", "host");
+    io.arg("fd", f.fd);
+    io.arg("bytes", len);
+    ssize_t r = vm->io->write(f.fd, p, len);
+    io.arg("ret", r);
+    if (r < 0 && errno == EBADF) {
+        errno = EACCES;  // the handle is fine, the file is read-only
+    }
+    if (r >= 0) {
+        f.host_pos = at + r;
+        f.seq_end = at + r;
+    }
+    return r;
+}
+
+/* write back what the guest wrote; the buffer is empty after */
+bool DosHandles::flush(VM *vm, Handle &f) {
+    if (!f.dirty) {
+        f.buf_len = 0;
+        return true;
+    }
+    bool ok = true;
+    size_t done = 0;
+    while (done < f.buf_len) {
+        ssize_t r = host_write(vm, f, f.buf_off + done, f.buf.data() + done,
+                               f.buf_len - done);
+        if (r <= 0) {
+            if (r == 0) {
+                errno = ENOSPC;
+            }
+            ok = false;
+            break;
+        }
+        done += r;
+    }
+    f.dirty = false;
+    f.buf_len = 0;
+    return ok;
+}
+
+ssize_t DosHandles::read(VM *vm, int h, void *p, size_t len) {
+    Handle *f = file(h);
+    if (!f) {
+        return -1;
+    }
+    switch (f->kind) {
+        case Kind::CON:
+        case Kind::CON_ERR: {
+            vm->console.before_input();
+            TimelineSpan io(vm->timeline.get(), "read", "host");
+            io.arg("fd", 0);
+            io.arg("bytes", len);
+            ssize_t r = vm->io->read(0, p, len);
+            io.arg("ret", r);
+            return r;
+        }
+        case Kind::NUL:
+            return 0;
+        default:
+            break;
+    }
+
+    if (f->map) {
+        return read_mapped(vm, *f, (uint8_t *)p, len);
+    }
+    if (f->dirty && !flush(vm, *f)) {
+        return -1;
+    }
+    auto dst = (uint8_t *)p;
+    size_t done = 0;
+    while (done < len) {
+        if (f->pos >= f->buf_off && f->pos < f->buf_off + (int64_t)f->buf_len) {
+            size_t n = std::min<size_t>(len - done,
+                                        f->buf_off + f->buf_len - f->pos);
+            memcpy(dst + done, f->buf.data() + (f->pos - f->buf_off), n);
+            f->pos += n;
+            done += n;
+            continue;
+        }
+
+        grow_window(*f, f->pos);
+        ssize_t r;
+        if (len - done >= f->window) {
+            /* no point in copying it twice */
+            r = host_read(vm, *f, f->pos, dst + done, len - done);
+            if (r > 0) {
+                f->pos += r;
+                done += r;
+            }
+        } else {
+            f->buf.resize(f->window);
+            f->buf_off = f->pos;
+            f->buf_len = 0;
+            r = host_read(vm, *f, f->pos, f->buf.data(), f->window);
+            if (r > 0) {
+                f->buf_len = r;
+                continue;
+            }
+        }
+        if (r < 0 && done == 0) {
+            return -1;
+        }
+        break;  // end of file, or the data before the error
+    }
+    return done;
+}
+
+ssize_t DosHandles::read_mapped(VM *vm, Handle &f, uint8_t *dst,
+                                size_t len) {
+    /* copying past the end of a file cut short is SIGBUS: map it again if
+     * it has been truncated here since, or if this read runs off the end
+     * and the file may have grown */
+    std::shared_lock<std::shared_mutex> lk(mapping_lock());
+    if (f.map_gen != mapping_generation() ||
+        f.pos + (int64_t)len > (int64_t)f.map->size) {
+        f.map_gen = mapping_generation();
+        f.map = vm->io->map(f.fd);
+    }
+    if (!f.map) {
+        /* empty, or can't map it any more: go on with read() */
+        lk.unlock();
+        f.host_pos = -1;
+        return read(vm, &f - table, dst, len);
+    }
+    size_t avail = f.pos < (int64_t)f.map->size ? f.map->size - f.pos : 0;
+    size_t n = std::min(len, avail);
+    memcpy(dst, f.map->data + f.pos, n);
+    f.pos += n;
+    return n;
+}
+
+ssize_t DosHandles::write(VM *vm, int h, const void *p, size_t len) {
+    Handle *f = file(h);
+    if (!f) {
+        return -1;
+    }
+    switch (f->kind) {
+        case Kind::CON:
+            vm->console.write(p, len);
+            return len;
+        case Kind::CON_ERR: {
+            vm->console.flush();  // keep stdout/stderr ordering
+            TimelineSpan io(vm->timeline.get(), "write", "host");
+            io.arg("fd", 2);
+            io.arg("bytes", len);
+            ssize_t r = vm->io->write(2, p, len);
+            io.arg("ret", r);
+            return r;
+        }
+        case Kind::NUL:
+            return len;
+        default:
+            break;
+    }
+    if (f->map) {
+        errno = EACCES;  // opened to read
+        return -1;
+    }
+
+    /* only appends to what is already pending */
+    bool append = f->dirty && f->pos == f->buf_off + (int64_t)f->buf_len &&
+                  f->buf_len + len <= f->buf.size();
+    if (!append && !flush(vm, *f)) {
+        return -1;
+    }
+    if (!f->dirty) {
+        grow_window(*f, f->pos);
+        if (len >= f->window) {
+            ssize_t r = host_write(vm, *f, f->pos, p, len);
+            if (r > 0) {
+                f->pos += r;
+            }
+            return r;
+        }
+        f->buf.resize(f->window);
+        f->buf_off = f->pos;
+        f->buf_len = 0;
+        f->dirty = true;
+    }
+    memcpy(f->buf.data() + f->buf_len, p, len);
+    f->buf_len += len;
+    f->pos += len;
+    return len;
+}
+
+int64_t DosHandles::seek(VM *vm, int h, int64_t off, int whence) {
+    Handle *f = file(h);
+    if (!f) {
+        return -1;
+    }
+    if (f->kind != Kind::FILE) {
+        return 0;  // devices have no position
+    }
+    int64_t base = 0;
+    if (whence == SEEK_CUR) {
+        base = f->pos;
+    } else if (whence == SEEK_END) {
+        if (f->map) {
+            /* the size as it is now; read() from here on if it is empty */
+            std::shared_lock<std::shared_mutex> lk(mapping_lock());
+            f->map_gen = mapping_generation();
+            f->map = vm->io->map(f->fd);
+            f->host_pos = -1;
+        }
+        if (f->map) {
+            base = f->map->size;
+        } else {
+            /* the size includes what is still pending */
+            if (!flush(vm, *f)) {
+                return -1;
+            }
+            f->host_pos = -1;
+            base = vm->io->lseek(f->fd, 0, SEEK_END);
+            if (base < 0) {
+                return -1;
+            }
+            f->host_pos = base;
+        }
+    }
+    if (base + off < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    f->pos = base + off;
+    return f->pos;
+}
+
+int DosHandles::close(VM *vm, int h) {
+    Handle *f = file(h);
+    if (!f) {
+        return -1;
+    }
+    int ret = 0;
+    if (f->kind == Kind::FILE) {
+        int err = 0;
+        if (!flush(vm, *f)) {
+            err = errno;
+        }
+        TimelineSpan io(vm->timeline.get(), "close", "host");
+        io.arg("fd", f->fd);
+        if (vm->io->close(f->fd) < 0 && !err) {
+            err = errno;
+        }
+        if (err) {
+            errno = err;
+            ret = -1;
+        }
+    }
+    *f = Handle();
+    if (h == 1) {
+        console_stub_stdout(vm, false);  // a file may get handle 1 next
+    }
+    return ret;
+}
+
+bool DosHandles::flush_all(VM *vm) {
+    bool ok = true;
+    for (auto &f : table) {
+        if (f.kind == Kind::FILE && !flush(vm, f)) {
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+void DosHandles::close_all(VM *vm) {
+    for (int h = 0; h < MAX_HANDLES; h++) {
+        if (table[h].kind == Kind::FILE) {
+            close(vm, h);
+        }
+    }
+    wire_std();
+    console_stub_stdout(vm, true);
+}
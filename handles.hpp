@@ -0,0 +1,92 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <memory>
+#include <vector>
+
+#include "filemap.hpp"
+
+struct VM;
+
+/*
+ * The DOS handles of the running program.  The guest only ever sees these
+ * numbers, never a host fd: 0-2 are CON, 3 AUX and 4 PRN (both NUL here),
+ * and files opened with AH=3Ch/3Dh take the lowest free slot up to
+ * MAX_HANDLES.
+ *
+ * Each file handle buffers in one direction at a time: reads fill a
+ * read-ahead window, writes collect behind the position until they stop
+ * being contiguous.  The window starts small and doubles while access is
+ * sequential, so MASM reading its source 512 bytes at a time costs a few
+ * 64KiB read(2)s.  Transfers as large as the window go straight through.
+ * A handle opened to read with a MappedFile has no window: reads copy from
+ * the mapping, which is looked at again only at SEEK_END, at its end, or
+ * after a truncating open moves mapping_generation().
+ *
+ * Failures return -1 with errno set, as the system calls do.
+ */
+class DosHandles {
+   public:
+    static constexpr int MAX_HANDLES = 20;  // per process, as in DOS 2
+    static constexpr int NUM_STD = 5;
+
+    DosHandles();
+    DosHandles(const DosHandles &) = delete;
+    DosHandles &operator=(const DosHandles &) = delete;
+
+    /* add() would succeed; check before opening, DOS does */
+    bool has_free() const;
+    /* a handle for host fd, -1 with EMFILE when all are taken; with map,
+     * made at mapping_generation() map_gen, the handle is read-only and
+     * served from it */
+    int add(int fd, std::shared_ptr<const MappedFile> map = nullptr,
+            uint64_t map_gen = 0);
+
+    ssize_t read(VM *vm, int h, void *p, size_t len);
+    ssize_t write(VM *vm, int h, const void *p, size_t len);
+    /* the new position */
+    int64_t seek(VM *vm, int h, int64_t off, int whence);
+    int close(VM *vm, int h);
+
+    /* write back every file, as at the end of run_vm() */
+    bool flush_all(VM *vm);
+    /* close every file and wire 0-4 again, as at program exit */
+    void close_all(VM *vm);
+
+   private:
+    static constexpr size_t MIN_WINDOW = 4096;
+    static constexpr size_t MAX_WINDOW = 64 * 1024;
+
+    enum class Kind { FREE, CON, CON_ERR, NUL, FILE };
+
+    struct Handle {
+        Kind kind = Kind::FREE;
+        int fd = -1;
+        int64_t pos = 0;       // where the guest is
+        int64_t host_pos = 0;  // where fd is, -1 if unknown
+        /* buf holds the file at [buf_off, buf_off + buf_len); when dirty
+         * those bytes are not on the host yet */
+        std::vector<uint8_t> buf;
+        int64_t buf_off = 0;
+        size_t buf_len = 0;
+        bool dirty = false;
+        size_t window = MIN_WINDOW;
+        int64_t seq_end = -1;  // end of the last host transfer
+        std::shared_ptr<const MappedFile> map;
+        uint64_t map_gen = 0;  // mapping_generation() when map was made
+    };
+
+    Handle *file(int h);
+    ssize_t read_mapped(VM *vm, Handle &f, uint8_t *dst, size_t len);
+    void grow_window(Handle &f, int64_t at);
+    ssize_t host_read(VM *vm, Handle &f, int64_t at, void *p, size_t len);
+    ssize_t host_write(VM *vm, Handle &f, int64_t at, const void *p,
+                       size_t len);
+    bool flush(VM *vm, Handle &f);
+    void wire_std();
+
+    Handle table[MAX_HANDLES];
+};
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/select.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <memory>
+
+#include "drives.hpp"
+#include "filemap.hpp"
+#include "floppy.hpp"
+
+/*
+ * Everything the handlers ask of the host: console, DOS file and floppy
+ * sector I/O.  The defaults are the plain system calls, and for sectors a
+ * copy from the image's mapping; an embedder derives from HostIO and points
+ * VM::io at its own to capture output, feed input or keep files or disks
+ * in memory.  Return values follow the system calls, -1 on failure.
+ */
+struct HostIO {
+    virtual ~HostIO() {}
+
+    /* guest output, already buffered by Console */
+    virtual ssize_t console_writev(int fd, const struct iovec *iov, int n) {
+        return ::writev(fd, iov, n);
+    }
+    /* one key for DOS, EOF when there is no more input */
+    virtual int console_getc() { return getchar(); }
+    /* a key is waiting, for INT 16h AH=01h */
+    virtual bool console_poll() {
+        fd_set rfds;
+        FD_ZERO(&rfds);
+        FD_SET(0, &rfds);
+        struct timeval tv = {};
+        return select(1, &rfds, nullptr, nullptr, &tv) > 0;
+    }
+
+    /* files by host handle; 0-2 are the console */
+    virtual int open(const char *path, int flags, mode_t mode) {
+        return ::open(path, flags, mode);
+    }
+    /* path under dirfd, the root of a --drive; the default follows no
+     * symbolic link and no ".." out of it */
+    virtual int openat(int dirfd, const char *path, int flags, mode_t mode) {
+        return open_beneath(dirfd, path, flags, mode);
+    }
+    virtual ssize_t read(int fd, void *p, size_t len) {
+        return ::read(fd, p, len);
+    }
+    virtual ssize_t write(int fd, const void *p, size_t len) {
+        return ::write(fd, p, len);
+    }
+    virtual off_t lseek(int fd, off_t off, int whence) {
+        return ::lseek(fd, off, whence);
+    }
+    virtual int close(int fd) { return ::close(fd); }
+    /* the whole file read-only, for handles opened to read; null to make
+     * them use read() */
+    virtual std::shared_ptr<const MappedFile> map(int fd) {
+        return map_file(fd);
+    }
+
+    /* sectors of the floppy, by byte offset; len and off are whole sectors */
+    virtual ssize_t disk_read(Floppy *floppy, void *p, size_t len, off_t off) {
+        if (!floppy->read_sectors(off / 512, len / 512, p)) {
+            errno = EINVAL;
+            return -1;
+        }
+        return len;
+    }
+    virtual ssize_t disk_write(Floppy *floppy, const void *p, size_t len,
+                               off_t off) {
+        if (!floppy->write_sectors(off / 512, len / 512, p)) {
+            errno = EINVAL;
+            return -1;
+        }
+        return len;
+    }
+};
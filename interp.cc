@@ -0,0 +1,1065 @@
+/*
+ * Userspace real-mode 8086/80186 interpreter, the backend used when /dev/kvm
+ * is not available (or with --backend=interp).
+ *
+ * It behaves like the CPU KVM gives us in real mode where the two differ:
+ * faults push the address of the faulting instruction, PUSH SP pushes the old
+ * value, shift counts are masked to 5 bits and undefined opcodes raise #UD
+ * (INT 6) through the IVT. HLT stops execution and is decoded exactly like a
+ * KVM_EXIT_HLT, so the BIOS/DOS handlers cannot tell the backends apart.
+ *
+ * Decoded instructions are kept in a direct-mapped cache keyed by linear
+ * address. An entry is valid for the page generation it was decoded under;
+ * guest stores to a page holding decoded code bump that page's generation,
+ * and every return to the host starts a new epoch because the handlers write
+ * guest memory behind our back.
+ */
+#include "interp.hpp"
+
+#include <atomic>
+#include <mutex>
+
+namespace interp {
+
+namespace {
+
+/* opcode attributes used by the decoder */
+enum : uint8_t {
+    A_MODRM = 0x01,
+    A_IMM8 = 0x02,
+    A_IMM16 = 0x04,
+    A_PTR = 0x08,     // imm16 offset + imm16 segment
+    A_ENTER = 0x10,   // imm16 + imm8
+    A_GRP3 = 0x20,    // F6/F7: immediate only for TEST
+    A_PREFIX = 0x40,
+};
+
+struct OpTable {
+    uint8_t attr[256];
+
+    constexpr OpTable() : attr() {
+        for (int op = 0; op < 0x40; op++) {
+            int form = op & 7;
+            if (form < 4) {
+                attr[op] = A_MODRM;
+            } else if (form == 4) {
+                attr[op] = A_IMM8;
+            } else if (form == 5) {
+                attr[op] = A_IMM16;
+            }
+        }
+        attr[0x26] = attr[0x2e] = attr[0x36] = attr[0x3e] = A_PREFIX;
+        attr[0xf0] = attr[0xf2] = attr[0xf3] = A_PREFIX;
+
+        attr[0x62] = A_MODRM;
+        attr[0x68] = A_IMM16;
+        attr[0x69] = A_MODRM | A_IMM16;
+        attr[0x6a] = A_IMM8;
+        attr[0x6b] = A_MODRM | A_IMM8;
+        for (int op = 0x70; op < 0x80; op++) {
+            attr[op] = A_IMM8;
+        }
+        attr[0x80] = attr[0x82] = attr[0x83] = A_MODRM | A_IMM8;
+        attr[0x81] = A_MODRM | A_IMM16;
+        for (int op = 0x84; op < 0x90; op++) {
+            attr[op] = A_MODRM;
+        }
+        attr[0x9a] = A_PTR;
+        for (int op = 0xa0; op < 0xa4; op++) {
+            attr[op] = A_IMM16;  // moffs
+        }
+        attr[0xa8] = A_IMM8;
+        attr[0xa9] = A_IMM16;
+        for (int op = 0xb0; op < 0xb8; op++) {
+            attr[op] = A_IMM8;
+        }
+        for (int op = 0xb8; op < 0xc0; op++) {
+            attr[op] = A_IMM16;
+        }
+        attr[0xc0] = attr[0xc1] = A_MODRM | A_IMM8;
+        attr[0xc2] = A_IMM16;
+        attr[0xc4] = attr[0xc5] = A_MODRM;
+        attr[0xc6] = A_MODRM | A_IMM8;
+        attr[0xc7] = A_MODRM | A_IMM16;
+        attr[0xc8] = A_ENTER;
+        attr[0xca] = A_IMM16;
+        attr[0xcd] = A_IMM8;
+        for (int op = 0xd0; op < 0xd4; op++) {
+            attr[op] = A_MODRM;
+        }
+        attr[0xd4] = attr[0xd5] = A_IMM8;
+        for (int op = 0xd8; op < 0xe0; op++) {
+            attr[op] = A_MODRM;  // ESC, no FPU: decoded and ignored
+        }
+        for (int op = 0xe0; op < 0xe8; op++) {
+            attr[op] = A_IMM8;
+        }
+        attr[0xe8] = attr[0xe9] = A_IMM16;
+        attr[0xea] = A_PTR;
+        attr[0xeb] = A_IMM8;
+        attr[0xf6] = attr[0xf7] = A_MODRM | A_GRP3;
+        attr[0xfe] = attr[0xff] = A_MODRM;
+    }
+};
+constexpr OpTable op_table;
+
+}  // namespace
+
+
+void InterpCPU::decode(uint32_t a, Insn *in) {
+    uint32_t p = a;
+    auto next = [&]() { return mem[p++ & MEM_MASK]; };
+
+    in->lin = a;
+    in->rep = 0;
+    uint8_t seg_override = NO_SEG;
+    uint8_t op;
+    for (int n = 0;; n++) {
+        op = next();
+        if (!(op_table.attr[op] & A_PREFIX) || n == 14) {
+            break;
+        }
+        switch (op) {
+            case 0x26: seg_override = S_ES; break;
+            case 0x2e: seg_override = S_CS; break;
+            case 0x36: seg_override = S_SS; break;
+            case 0x3e: seg_override = S_DS; break;
+            case 0xf2:
+            case 0xf3: in->rep = op; break;
+            default: break;  // lock
+        }
+    }
+    in->op = op;
+    in->str_seg = seg_override == NO_SEG ? S_DS : seg_override;
+    in->seg = in->str_seg;
+    in->ea = EA_REG;
+    in->disp = 0;
+    in->imm = 0;
+    in->imm2 = 0;
+    in->modrm = 0;
+
+    uint8_t attr = op_table.attr[op];
+    if (attr & A_MODRM) {
+        uint8_t modrm = next();
+        int mod = modrm >> 6;
+        int rm = modrm & 7;
+        in->modrm = modrm;
+        if (mod != 3) {
+            if (mod == 0 && rm == 6) {
+                in->ea = EA_DIRECT;
+                in->disp = next();
+                in->disp |= next() << 8;
+            } else {
+                in->ea = rm;
+                if (mod == 1) {
+                    in->disp = (int8_t)next();
+                } else if (mod == 2) {
+                    in->disp = next();
+                    in->disp |= next() << 8;
+                }
+            }
+            bool bp_based = in->ea == 2 || in->ea == 3 || in->ea == 6;
+            in->seg = seg_override != NO_SEG ? seg_override
+                                             : (bp_based ? S_SS : S_DS);
+        }
+        if ((attr & A_GRP3) && ((modrm >> 3) & 6) == 0) {
+            attr |= (op & 1) ? A_IMM16 : A_IMM8;
+        }
+    }
+    if (attr & A_IMM8) {
+        in->imm = next();
+    } else if (attr & (A_IMM16 | A_PTR | A_ENTER)) {
+        in->imm = next();
+        in->imm |= next() << 8;
+    }
+    if (attr & A_PTR) {
+        in->imm2 = next();
+        in->imm2 |= next() << 8;
+    } else if (attr & A_ENTER) {
+        in->imm2 = next();
+    }
+    in->len = p - a;
+}
+
+void InterpCPU::unconnected_io(bool out, uint16_t port, int size) {
+    store();
+    printf("reference unconnected io %x %x %x\n", out ? 1 : 0, port, size);
+    kick_pending |= KICK_FAULT;  // execute() returns after this instruction
+}
+
+/* MOVS CMPS STOS LODS SCAS INS OUTS, with REP/REPE/REPNE */
+void InterpCPU::string_op(const Insn *in) {
+    bool w = in->op & 1;
+    int delta = (fl & F_DF) ? -(w ? 2 : 1) : (w ? 2 : 1);
+    bool rep = in->rep != 0;
+    int kind = in->op & 0xfe;
+
+    if (rep && r[R_CX] == 0) {
+        return;
+    }
+
+    /* fast paths for REP MOVSB/MOVSW/STOSB/STOSW going up, no wrap-around */
+    if (rep && delta > 0 && (kind == 0xa4 || kind == 0xaa)) {
+        uint32_t bytes = (uint32_t)r[R_CX] << w;
+        uint32_t dst = lin(S_ES, r[R_DI]);
+        if ((uint32_t)r[R_DI] + bytes <= 0x10000 && dst + bytes <= MEM_MASK) {
+            if (kind == 0xaa) {
+                if (w) {
+                    for (uint32_t i = 0; i < bytes; i += 2) {
+                        memcpy(mem + dst + i, &r[R_AX], 2);
+                    }
+                } else {
+                    memset(mem + dst, r[R_AX] & 0xff, bytes);
+                }
+                for (uint32_t i = 0; i < bytes; i += 4096) {
+                    touch(dst + i);
+                }
+                touch(dst + bytes - 1);
+                r[R_DI] += bytes;
+                r[R_CX] = 0;
+                return;
+            }
+            uint32_t src = lin(in->str_seg, r[R_SI]);
+            /* byte-by-byte semantics only matter if dst overlaps ahead */
+            if ((uint32_t)r[R_SI] + bytes <= 0x10000 &&
+                src + bytes <= MEM_MASK &&
+                (dst + bytes <= src || dst >= src + bytes || dst < src)) {
+                memmove(mem + dst, mem + src, bytes);
+                for (uint32_t i = 0; i < bytes; i += 4096) {
+                    touch(dst + i);
+                }
+                touch(dst + bytes - 1);
+                r[R_SI] += bytes;
+                r[R_DI] += bytes;
+                r[R_CX] = 0;
+                return;
+            }
+        }
+    }
+
+    while (true) {
+        switch (kind) {
+            case 0xa4:  // movs
+                if (w) {
+                    wr16(S_ES, r[R_DI], rd16(in->str_seg, r[R_SI]));
+                } else {
+                    wr8(S_ES, r[R_DI], rd8(in->str_seg, r[R_SI]));
+                }
+                r[R_SI] += delta;
+                r[R_DI] += delta;
+                break;
+            case 0xa6:  // cmps
+                if (w) {
+                    alu(7, rd16(in->str_seg, r[R_SI]), rd16(S_ES, r[R_DI]),
+                        true);
+                } else {
+                    alu(7, rd8(in->str_seg, r[R_SI]), rd8(S_ES, r[R_DI]),
+                        false);
+                }
+                r[R_SI] += delta;
+                r[R_DI] += delta;
+                break;
+            case 0xaa:  // stos
+                if (w) {
+                    wr16(S_ES, r[R_DI], r[R_AX]);
+                } else {
+                    wr8(S_ES, r[R_DI], r[R_AX]);
+                }
+                r[R_DI] += delta;
+                break;
+            case 0xac:  // lods
+                if (w) {
+                    r[R_AX] = rd16(in->str_seg, r[R_SI]);
+                } else {
+                    r8(0) = rd8(in->str_seg, r[R_SI]);
+                }
+                r[R_SI] += delta;
+                break;
+            case 0xae:  // scas
+                if (w) {
+                    alu(7, r[R_AX], rd16(S_ES, r[R_DI]), true);
+                } else {
+                    alu(7, r[R_AX] & 0xff, rd8(S_ES, r[R_DI]), false);
+                }
+                r[R_DI] += delta;
+                break;
+            case 0x6c:  // ins
+                unconnected_io(false, r[R_DX], w ? 2 : 1);
+                return;
+            default:  // 0x6e outs
+                if (r[R_DX] != CONSOLE_PORT) {
+                    unconnected_io(true, r[R_DX], w ? 2 : 1);
+                    return;
+                }
+                console->put(rd8(in->str_seg, r[R_SI]));
+                r[R_SI] += delta;
+                break;
+        }
+
+        if (!rep) {
+            return;
+        }
+        if (--r[R_CX] == 0) {
+            return;
+        }
+        if (kind == 0xa6 || kind == 0xae) {
+            bool zf = fl & F_ZF;
+            if ((in->rep == 0xf3 && !zf) || (in->rep == 0xf2 && zf)) {
+                return;
+            }
+        }
+    }
+}
+
+void InterpCPU::enter(VM *vm) {
+    mem = vm->full_mem;
+    console = &vm->console;
+    load();
+    epoch++;  // the host may have changed guest memory
+}
+
+ExitReason InterpCPU::run(VM *vm, bool single_step) {
+    ExitReason ret;
+
+    enter(vm);
+    bool hlt = execute(vm, single_step);
+    while (!hlt && !single_step && !(kick_pending & KICK_FAULT)) {
+        /* stopped early by a timer signal */
+        store();
+        if (handle_kick(vm)) {
+            ret.code = ExitCode::KICKED;
+            return ret;
+        }
+        hlt = execute(vm, false);
+    }
+    store();
+    if (kick_pending & KICK_FAULT) {
+        __atomic_and_fetch(&kick_pending, ~KICK_FAULT, __ATOMIC_SEQ_CST);
+        vm->stop(StopReason::UNSUPPORTED, 1);
+        ret.code = ExitCode::FAULT;
+    } else if (hlt) {
+        decode_hlt_exit(vm->addr_config, this, &ret);
+    } else {
+        ret.code = ExitCode::SINGLE_STEP;
+    }
+    return ret;
+}
+
+bool InterpCPU::execute(VM *vm, bool one) {
+    static void *dispatch[256];
+    /* filled by the first VM to get here, whichever thread it is on */
+    static std::atomic<bool> dispatch_ready{false};
+    static std::mutex dispatch_lock;
+    if (!dispatch_ready.load(std::memory_order_acquire)) {
+        std::lock_guard<std::mutex> lk(dispatch_lock);
+        for (int op = 0; op < 256; op++) {
+            dispatch[op] = &&op_ud;
+        }
+        for (int op = 0; op < 0x40; op++) {
+            if ((op & 7) < 6) {
+                dispatch[op] = &&op_alu;
+            }
+        }
+        dispatch[0x06] = dispatch[0x0e] = dispatch[0x16] = dispatch[0x1e] =
+            &&op_push_seg;
+        dispatch[0x07] = dispatch[0x17] = dispatch[0x1f] = &&op_pop_seg;
+        dispatch[0x27] = &&op_daa;
+        dispatch[0x2f] = &&op_das;
+        dispatch[0x37] = &&op_aaa;
+        dispatch[0x3f] = &&op_aas;
+        for (int op = 0x40; op < 0x50; op++) {
+            dispatch[op] = &&op_inc_dec_r16;
+        }
+        for (int op = 0x50; op < 0x58; op++) {
+            dispatch[op] = &&op_push_r16;
+        }
+        for (int op = 0x58; op < 0x60; op++) {
+            dispatch[op] = &&op_pop_r16;
+        }
+        dispatch[0x60] = &&op_pusha;
+        dispatch[0x61] = &&op_popa;
+        dispatch[0x62] = &&op_bound;
+        dispatch[0x68] = dispatch[0x6a] = &&op_push_imm;
+        dispatch[0x69] = dispatch[0x6b] = &&op_imul_imm;
+        dispatch[0x6c] = dispatch[0x6d] = dispatch[0x6e] = dispatch[0x6f] =
+            &&op_string;
+        for (int op = 0x70; op < 0x80; op++) {
+            dispatch[op] = &&op_jcc;
+        }
+        dispatch[0x80] = dispatch[0x81] = dispatch[0x82] = dispatch[0x83] =
+            &&op_grp1;
+        dispatch[0x84] = dispatch[0x85] = &&op_test_e;
+        dispatch[0x86] = dispatch[0x87] = &&op_xchg_e;
+        for (int op = 0x88; op < 0x8c; op++) {
+            dispatch[op] = &&op_mov_e;
+        }
+        dispatch[0x8c] = &&op_mov_from_seg;
+        dispatch[0x8d] = &&op_lea;
+        dispatch[0x8e] = &&op_mov_to_seg;
+        dispatch[0x8f] = &&op_pop_e;
+        for (int op = 0x90; op < 0x98; op++) {
+            dispatch[op] = &&op_xchg_ax;
+        }
+        dispatch[0x98] = &&op_cbw;
+        dispatch[0x99] = &&op_cwd;
+        dispatch[0x9a] = &&op_call_far;
+        dispatch[0x9b] = &&op_nop;  // wait
+        dispatch[0x9c] = &&op_pushf;
+        dispatch[0x9d] = &&op_popf;
+        dispatch[0x9e] = &&op_sahf;
+        dispatch[0x9f] = &&op_lahf;
+        for (int op = 0xa0; op < 0xa4; op++) {
+            dispatch[op] = &&op_mov_moffs;
+        }
+        for (int op = 0xa4; op < 0xb0; op++) {
+            dispatch[op] = &&op_string;
+        }
+        dispatch[0xa8] = dispatch[0xa9] = &&op_test_acc;
+        for (int op = 0xb0; op < 0xc0; op++) {
+            dispatch[op] = &&op_mov_imm_r;
+        }
+        dispatch[0xc0] = dispatch[0xc1] = &&op_shift;
+        dispatch[0xc2] = dispatch[0xc3] = &&op_ret;
+        dispatch[0xc4] = dispatch[0xc5] = &&op_les_lds;
+        dispatch[0xc6] = dispatch[0xc7] = &&op_mov_imm_e;
+        dispatch[0xc8] = &&op_enter;
+        dispatch[0xc9] = &&op_leave;
+        dispatch[0xca] = dispatch[0xcb] = &&op_retf;
+        dispatch[0xcc] = dispatch[0xcd] = dispatch[0xce] = &&op_int;
+        dispatch[0xcf] = &&op_iret;
+        for (int op = 0xd0; op < 0xd4; op++) {
+            dispatch[op] = &&op_shift;
+        }
+        dispatch[0xd4] = &&op_aam;
+        dispatch[0xd5] = &&op_aad;
+        dispatch[0xd6] = &&op_salc;
+        dispatch[0xd7] = &&op_xlat;
+        for (int op = 0xd8; op < 0xe0; op++) {
+            dispatch[op] = &&op_nop;  // esc
+        }
+        for (int op = 0xe0; op < 0xe4; op++) {
+            dispatch[op] = &&op_loop;
+        }
+        for (int op = 0xe4; op < 0xe8; op++) {
+            dispatch[op] = &&op_io;
+        }
+        for (int op = 0xec; op < 0xf0; op++) {
+            dispatch[op] = &&op_io;
+        }
+        dispatch[0xe8] = &&op_call;
+        dispatch[0xe9] = dispatch[0xeb] = &&op_jmp;
+        dispatch[0xea] = &&op_jmp_far;
+        dispatch[0xf4] = &&op_hlt;
+        dispatch[0xf5] = &&op_cmc;
+        dispatch[0xf6] = dispatch[0xf7] = &&op_grp3;
+        for (int op = 0xf8; op < 0xfe; op++) {
+            dispatch[op] = &&op_flag;
+        }
+        dispatch[0xfe] = &&op_grp4;
+        dispatch[0xff] = &&op_grp5;
+        dispatch_ready.store(true, std::memory_order_release);
+    }
+
+    const Insn *in;
+    uint16_t start_ip;
+    bool trap;
+
+#define NEXT goto next
+next_insn:
+    start_ip = ip;
+    trap = fl & F_TF;
+    in = fetch(lin(S_CS, ip));
+    ip += in->len;
+    goto *dispatch[in->op];
+
+op_alu: {
+    int kind = in->op >> 3;
+    bool w = in->op & 1;
+    switch ((in->op >> 1) & 3) {
+        case 0: {  // E, G
+            if (w) {
+                uint16_t res = alu(kind, get_e16(in), r[reg_of(in)], true);
+                if (kind != 7) set_e16(in, res);
+            } else {
+                uint8_t res = alu(kind, get_e8(in), r8(reg_of(in)), false);
+                if (kind != 7) set_e8(in, res);
+            }
+        } break;
+        case 1: {  // G, E
+            if (w) {
+                uint16_t res = alu(kind, r[reg_of(in)], get_e16(in), true);
+                if (kind != 7) r[reg_of(in)] = res;
+            } else {
+                uint8_t res = alu(kind, r8(reg_of(in)), get_e8(in), false);
+                if (kind != 7) r8(reg_of(in)) = res;
+            }
+        } break;
+        default: {  // AL/AX, imm
+            if (w) {
+                uint16_t res = alu(kind, r[R_AX], in->imm, true);
+                if (kind != 7) r[R_AX] = res;
+            } else {
+                uint8_t res = alu(kind, r[R_AX] & 0xff, in->imm, false);
+                if (kind != 7) r8(0) = res;
+            }
+        } break;
+    }
+    NEXT;
+}
+
+op_push_seg:
+    push(s[in->op >> 3]);
+    NEXT;
+op_pop_seg:
+    s[in->op >> 3] = pop();
+    NEXT;
+
+op_daa: {
+    uint8_t al = r[R_AX];
+    bool cf = fl & F_CF;
+    uint8_t old_al = al;
+    fl &= ~F_CF;
+    if ((al & 0xf) > 9 || (fl & F_AF)) {
+        al += 6;
+        fl |= F_AF;
+    } else {
+        fl &= ~F_AF;
+    }
+    if (old_al > 0x99 || cf) {
+        al += 0x60;
+        fl |= F_CF;
+    }
+    r8(0) = al;
+    set_szp(al, false);
+    NEXT;
+}
+op_das: {
+    uint8_t al = r[R_AX];
+    bool cf = fl & F_CF;
+    uint8_t old_al = al;
+    fl &= ~F_CF;
+    if ((al & 0xf) > 9 || (fl & F_AF)) {
+        if (al < 6) fl |= F_CF;
+        al -= 6;
+        fl |= F_AF;
+    } else {
+        fl &= ~F_AF;
+    }
+    if (old_al > 0x99 || cf) {
+        al -= 0x60;
+        fl |= F_CF;
+    }
+    r8(0) = al;
+    set_szp(al, false);
+    NEXT;
+}
+op_aaa:
+    if ((r[R_AX] & 0xf) > 9 || (fl & F_AF)) {
+        r[R_AX] += 0x106;
+        fl |= F_AF | F_CF;
+    } else {
+        fl &= ~(F_AF | F_CF);
+    }
+    r8(0) &= 0xf;
+    NEXT;
+op_aas:
+    if ((r[R_AX] & 0xf) > 9 || (fl & F_AF)) {
+        r[R_AX] -= 6;
+        r8(4) -= 1;
+        fl |= F_AF | F_CF;
+    } else {
+        fl &= ~(F_AF | F_CF);
+    }
+    r8(0) &= 0xf;
+    NEXT;
+
+op_inc_dec_r16:
+    r[in->op & 7] = inc_dec(r[in->op & 7], in->op & 8, true);
+    NEXT;
+op_push_r16: {
+    uint16_t v = r[in->op & 7];  // PUSH SP pushes the old value
+    push(v);
+    NEXT;
+}
+op_pop_r16: {
+    uint16_t v = pop();
+    r[in->op & 7] = v;
+    NEXT;
+}
+op_pusha: {
+    uint16_t sp = r[R_SP];
+    for (int i = 0; i < 8; i++) {
+        push(i == R_SP ? sp : r[i]);
+    }
+    NEXT;
+}
+op_popa:
+    for (int i = 7; i >= 0; i--) {
+        uint16_t v = pop();
+        if (i != R_SP) r[i] = v;
+    }
+    NEXT;
+op_bound: {
+    if (in->ea == EA_REG) goto op_ud;
+    int16_t idx = r[reg_of(in)];
+    uint16_t off = ea_off(in);
+    int16_t lo = rd16(in->seg, off);
+    int16_t hi = rd16(in->seg, off + 2);
+    if (idx < lo || idx > hi) {
+        interrupt(5, start_ip);
+    }
+    NEXT;
+}
+op_push_imm:
+    push(in->op == 0x6a ? (uint16_t)(int8_t)in->imm : in->imm);
+    NEXT;
+op_imul_imm: {
+    int32_t b = in->op == 0x6b ? (int8_t)in->imm : (int16_t)in->imm;
+    int32_t res = (int16_t)get_e16(in) * b;
+    r[reg_of(in)] = res;
+    fl &= ~(F_CF | F_OF);
+    if (res != (int16_t)res) fl |= F_CF | F_OF;
+    NEXT;
+}
+op_string:
+    string_op(in);
+    NEXT;
+op_jcc:
+    if (cond(in->op & 0xf)) {
+        ip += (int8_t)in->imm;
+    }
+    NEXT;
+
+op_grp1: {
+    int kind = reg_of(in);
+    if (in->op == 0x81) {
+        uint16_t res = alu(kind, get_e16(in), in->imm, true);
+        if (kind != 7) set_e16(in, res);
+    } else if (in->op == 0x83) {
+        uint16_t res = alu(kind, get_e16(in), (uint16_t)(int8_t)in->imm, true);
+        if (kind != 7) set_e16(in, res);
+    } else {
+        uint8_t res = alu(kind, get_e8(in), in->imm, false);
+        if (kind != 7) set_e8(in, res);
+    }
+    NEXT;
+}
+op_test_e:
+    if (in->op & 1) {
+        alu(4, get_e16(in), r[reg_of(in)], true);
+    } else {
+        alu(4, get_e8(in), r8(reg_of(in)), false);
+    }
+    NEXT;
+op_xchg_e:
+    if (in->op & 1) {
+        uint16_t v = get_e16(in);
+        set_e16(in, r[reg_of(in)]);
+        r[reg_of(in)] = v;
+    } else {
+        uint8_t v = get_e8(in);
+        set_e8(in, r8(reg_of(in)));
+        r8(reg_of(in)) = v;
+    }
+    NEXT;
+op_mov_e:
+    switch (in->op) {
+        case 0x88: set_e8(in, r8(reg_of(in))); break;
+        case 0x89: set_e16(in, r[reg_of(in)]); break;
+        case 0x8a: r8(reg_of(in)) = get_e8(in); break;
+        default: r[reg_of(in)] = get_e16(in); break;
+    }
+    NEXT;
+op_mov_from_seg:
+    if (reg_of(in) > 3) goto op_ud;
+    set_e16(in, s[reg_of(in)]);
+    NEXT;
+op_lea:
+    if (in->ea == EA_REG) goto op_ud;
+    r[reg_of(in)] = ea_off(in);
+    NEXT;
+op_mov_to_seg:
+    if (reg_of(in) > 3 || reg_of(in) == S_CS) goto op_ud;
+    s[reg_of(in)] = get_e16(in);
+    NEXT;
+op_pop_e: {
+    uint16_t v = pop();
+    set_e16(in, v);
+    NEXT;
+}
+op_xchg_ax: {
+    uint16_t v = r[in->op & 7];
+    r[in->op & 7] = r[R_AX];
+    r[R_AX] = v;
+    NEXT;
+}
+op_cbw:
+    r[R_AX] = (int8_t)r[R_AX];
+    NEXT;
+op_cwd:
+    r[R_DX] = (r[R_AX] & 0x8000) ? 0xffff : 0;
+    NEXT;
+op_call_far:
+    push(s[S_CS]);
+    push(ip);
+    s[S_CS] = in->imm2;
+    ip = in->imm;
+    NEXT;
+op_nop:
+    NEXT;
+op_pushf:
+    push(fl);
+    NEXT;
+op_popf:
+    fl = (pop() & F_WRITABLE) | F_FIXED_ONE;
+    NEXT;
+op_sahf:
+    fl = (fl & ~(F_SF | F_ZF | F_AF | F_PF | F_CF)) |
+         (r8(4) & (F_SF | F_ZF | F_AF | F_PF | F_CF));
+    NEXT;
+op_lahf:
+    r8(4) = fl & 0xff;
+    NEXT;
+op_mov_moffs:
+    switch (in->op) {
+        case 0xa0: r8(0) = rd8(in->str_seg, in->imm); break;
+        case 0xa1: r[R_AX] = rd16(in->str_seg, in->imm); break;
+        case 0xa2: wr8(in->str_seg, in->imm, r[R_AX]); break;
+        default: wr16(in->str_seg, in->imm, r[R_AX]); break;
+    }
+    NEXT;
+op_test_acc:
+    if (in->op & 1) {
+        alu(4, r[R_AX], in->imm, true);
+    } else {
+        alu(4, r[R_AX] & 0xff, in->imm, false);
+    }
+    NEXT;
+op_mov_imm_r:
+    if (in->op & 8) {
+        r[in->op & 7] = in->imm;
+    } else {
+        r8(in->op & 7) = in->imm;
+    }
+    NEXT;
+op_shift: {
+    int count;
+    if (in->op <= 0xc1) {
+        count = in->imm;
+    } else if (in->op <= 0xd1) {
+        count = 1;
+    } else {
+        count = r[R_CX] & 0xff;
+    }
+    if (in->op & 1) {
+        set_e16(in, shift(reg_of(in), get_e16(in), count, true));
+    } else {
+        set_e8(in, shift(reg_of(in), get_e8(in), count, false));
+    }
+    NEXT;
+}
+op_ret:
+    ip = pop();
+    if (in->op == 0xc2) r[R_SP] += in->imm;
+    NEXT;
+op_les_lds: {
+    if (in->ea == EA_REG) goto op_ud;
+    uint16_t off = ea_off(in);
+    r[reg_of(in)] = rd16(in->seg, off);
+    s[in->op == 0xc4 ? S_ES : S_DS] = rd16(in->seg, off + 2);
+    NEXT;
+}
+op_mov_imm_e:
+    if (in->op & 1) {
+        set_e16(in, in->imm);
+    } else {
+        set_e8(in, in->imm);
+    }
+    NEXT;
+op_enter: {
+    int level = in->imm2 & 31;
+    push(r[R_BP]);
+    uint16_t frame = r[R_SP];
+    if (level > 0) {
+        uint16_t bp = r[R_BP];
+        for (int i = 1; i < level; i++) {
+            bp -= 2;
+            push(rd16(S_SS, bp));
+        }
+        push(frame);
+    }
+    r[R_BP] = frame;
+    r[R_SP] -= in->imm;
+    NEXT;
+}
+op_leave:
+    r[R_SP] = r[R_BP];
+    r[R_BP] = pop();
+    NEXT;
+op_retf:
+    ip = pop();
+    s[S_CS] = pop();
+    if (in->op == 0xca) r[R_SP] += in->imm;
+    NEXT;
+op_int:
+    if (in->op == 0xcc) {
+        interrupt(3, ip);
+    } else if (in->op == 0xcd) {
+        interrupt(in->imm, ip);
+    } else if (fl & F_OF) {
+        interrupt(4, ip);
+    }
+    NEXT;
+op_iret:
+    ip = pop();
+    s[S_CS] = pop();
+    fl = (pop() & F_WRITABLE) | F_FIXED_ONE;
+    NEXT;
+op_aam: {
+    uint8_t base = in->imm;
+    if (base == 0) {
+        interrupt(0, start_ip);
+        NEXT;
+    }
+    uint8_t al = r[R_AX];
+    r8(4) = al / base;
+    r8(0) = al % base;
+    set_szp(r8(0), false);
+    NEXT;
+}
+op_aad: {
+    uint8_t al = r8(0) + r8(4) * (uint8_t)in->imm;
+    r[R_AX] = al;
+    set_szp(al, false);
+    NEXT;
+}
+op_salc:
+    r8(0) = (fl & F_CF) ? 0xff : 0;
+    NEXT;
+op_xlat:
+    r8(0) = rd8(in->str_seg, r[R_BX] + (r[R_AX] & 0xff));
+    NEXT;
+op_loop:
+    switch (in->op) {
+        case 0xe0:
+            if (--r[R_CX] != 0 && !(fl & F_ZF)) ip += (int8_t)in->imm;
+            break;
+        case 0xe1:
+            if (--r[R_CX] != 0 && (fl & F_ZF)) ip += (int8_t)in->imm;
+            break;
+        case 0xe2:
+            if (--r[R_CX] != 0) ip += (int8_t)in->imm;
+            break;
+        default:
+            if (r[R_CX] == 0) ip += (int8_t)in->imm;
+            break;
+    }
+    NEXT;
+op_io: {
+    bool out = in->op & 2;
+    uint16_t port = (in->op & 8) ? r[R_DX] : in->imm;
+    int size = (in->op & 1) ? 2 : 1;
+    if (!out || port != CONSOLE_PORT) {
+        ip = start_ip;
+        unconnected_io(out, port, size);
+        return false;
+    }
+    console->put(r[R_AX] & 0xff);
+    NEXT;
+}
+op_call:
+    push(ip);
+    ip += in->imm;
+    NEXT;
+op_jmp:
+    ip += in->op == 0xeb ? (int8_t)in->imm : (int16_t)in->imm;
+    NEXT;
+op_jmp_far:
+    s[S_CS] = in->imm2;
+    ip = in->imm;
+    NEXT;
+op_cmc:
+    fl ^= F_CF;
+    NEXT;
+op_flag:
+    switch (in->op) {
+        case 0xf8: fl &= ~F_CF; break;
+        case 0xf9: fl |= F_CF; break;
+        case 0xfa: fl &= ~F_IF; break;
+        case 0xfb: fl |= F_IF; break;
+        case 0xfc: fl &= ~F_DF; break;
+        default: fl |= F_DF; break;
+    }
+    NEXT;
+
+op_grp3: {
+    bool w = in->op & 1;
+    switch (reg_of(in)) {
+        case 0:
+        case 1:  // test
+            if (w) {
+                alu(4, get_e16(in), in->imm, true);
+            } else {
+                alu(4, get_e8(in), in->imm, false);
+            }
+            break;
+        case 2:  // not
+            if (w) {
+                set_e16(in, ~get_e16(in));
+            } else {
+                set_e8(in, ~get_e8(in));
+            }
+            break;
+        case 3: {  // neg
+            if (w) {
+                set_e16(in, alu(5, 0, get_e16(in), true));
+            } else {
+                set_e8(in, alu(5, 0, get_e8(in), false));
+            }
+        } break;
+        case 4:  // mul
+            fl &= ~(F_CF | F_OF);
+            if (w) {
+                uint32_t res = (uint32_t)r[R_AX] * get_e16(in);
+                r[R_AX] = res;
+                r[R_DX] = res >> 16;
+                if (r[R_DX]) fl |= F_CF | F_OF;
+            } else {
+                r[R_AX] = (uint16_t)(r[R_AX] & 0xff) * get_e8(in);
+                if (r[R_AX] & 0xff00) fl |= F_CF | F_OF;
+            }
+            break;
+        case 5:  // imul
+            fl &= ~(F_CF | F_OF);
+            if (w) {
+                int32_t res = (int32_t)(int16_t)r[R_AX] * (int16_t)get_e16(in);
+                r[R_AX] = res;
+                r[R_DX] = (uint32_t)res >> 16;
+                if (res != (int16_t)res) fl |= F_CF | F_OF;
+            } else {
+                int16_t res = (int16_t)(int8_t)r[R_AX] * (int8_t)get_e8(in);
+                r[R_AX] = res;
+                if (res != (int8_t)res) fl |= F_CF | F_OF;
+            }
+            break;
+        case 6:  // div
+            if (w) {
+                uint32_t num = ((uint32_t)r[R_DX] << 16) | r[R_AX];
+                uint16_t d = get_e16(in);
+                if (d == 0 || num / d > 0xffff) {
+                    interrupt(0, start_ip);
+                    break;
+                }
+                r[R_AX] = num / d;
+                r[R_DX] = num % d;
+            } else {
+                uint16_t num = r[R_AX];
+                uint8_t d = get_e8(in);
+                if (d == 0 || num / d > 0xff) {
+                    interrupt(0, start_ip);
+                    break;
+                }
+                r8(0) = num / d;
+                r8(4) = num % d;
+            }
+            break;
+        default:  // idiv
+            if (w) {
+                int32_t num = (int32_t)(((uint32_t)r[R_DX] << 16) | r[R_AX]);
+                int16_t d = get_e16(in);
+                if (d == 0 || (num == INT32_MIN && d == -1)) {
+                    interrupt(0, start_ip);
+                    break;
+                }
+                int32_t q = num / d;
+                if (q != (int16_t)q) {
+                    interrupt(0, start_ip);
+                    break;
+                }
+                r[R_AX] = q;
+                r[R_DX] = num % d;
+            } else {
+                int16_t num = r[R_AX];
+                int8_t d = get_e8(in);
+                if (d == 0) {
+                    interrupt(0, start_ip);
+                    break;
+                }
+                int16_t q = num / d;
+                if (q != (int8_t)q) {
+                    interrupt(0, start_ip);
+                    break;
+                }
+                r8(0) = q;
+                r8(4) = num % d;
+            }
+            break;
+    }
+    NEXT;
+}
+op_grp4:
+    if (reg_of(in) > 1) goto op_ud;
+    set_e8(in, inc_dec(get_e8(in), reg_of(in) == 1, false));
+    NEXT;
+op_grp5:
+    switch (reg_of(in)) {
+        case 0:
+        case 1:
+            set_e16(in, inc_dec(get_e16(in), reg_of(in) == 1, true));
+            break;
+        case 2: {
+            uint16_t target = get_e16(in);
+            push(ip);
+            ip = target;
+        } break;
+        case 3: {
+            if (in->ea == EA_REG) goto op_ud;
+            uint16_t off = ea_off(in);
+            uint16_t new_ip = rd16(in->seg, off);
+            uint16_t new_cs = rd16(in->seg, off + 2);
+            push(s[S_CS]);
+            push(ip);
+            s[S_CS] = new_cs;
+            ip = new_ip;
+        } break;
+        case 4:
+            ip = get_e16(in);
+            break;
+        case 5: {
+            if (in->ea == EA_REG) goto op_ud;
+            uint16_t off = ea_off(in);
+            uint16_t new_ip = rd16(in->seg, off);
+            s[S_CS] = rd16(in->seg, off + 2);
+            ip = new_ip;
+        } break;
+        case 6:
+            push(get_e16(in));
+            break;
+        default:
+            goto op_ud;
+    }
+    NEXT;
+
+op_ud:
+    interrupt(6, start_ip);
+    NEXT;
+
+op_hlt:
+    return true;
+
+next:
+    if (trap) {
+        interrupt(1, ip);
+    }
+    if (one || kick_pending) {
+        return false;
+    }
+    goto next_insn;
+#undef NEXT
+}
+
+}  // namespace interp
+
+std::unique_ptr<CPU> create_interp_cpu() {
+    return std::make_unique<interp::InterpCPU>();
+}
@@ -0,0 +1,407 @@
+#pragma once
+
+#include "vm.hpp"
+
+/*
+ * Interpreter core. InterpCPU is also the slow path of the JIT backend, which
+ * shares its working registers, decoder and page generations.
+ */
+namespace interp {
+
+enum { R_AX, R_CX, R_DX, R_BX, R_SP, R_BP, R_SI, R_DI };
+enum { S_ES, S_CS, S_SS, S_DS };
+
+constexpr uint16_t F_CF = 0x0001;
+constexpr uint16_t F_PF = 0x0004;
+constexpr uint16_t F_AF = 0x0010;
+constexpr uint16_t F_ZF = 0x0040;
+constexpr uint16_t F_SF = 0x0080;
+constexpr uint16_t F_TF = 0x0100;
+constexpr uint16_t F_IF = 0x0200;
+constexpr uint16_t F_DF = 0x0400;
+constexpr uint16_t F_OF = 0x0800;
+constexpr uint16_t F_ARITH = F_CF | F_PF | F_AF | F_ZF | F_SF | F_OF;
+/* bit 1 reads as 1, bits 3, 5 and 15 as 0 (286+ real mode) */
+constexpr uint16_t F_FIXED_ONE = 0x0002;
+constexpr uint16_t F_WRITABLE = 0x7fd5;
+
+constexpr uint32_t MEM_MASK = 0xfffff;  // 20 address lines, A20 wraps
+constexpr int NUM_PAGES = (MEM_MASK + 1) >> 12;
+/* stores are checked against code at this granularity, so that data or a
+ * stack sharing a page with code does not look like self-modifying code */
+constexpr int LINE_SHIFT = 6;
+constexpr int NUM_LINES = (MEM_MASK + 1) >> LINE_SHIFT;
+
+constexpr int EA_REG = 0xff;   // ModRM operand is a register
+constexpr int EA_DIRECT = 8;   // [disp16]
+constexpr uint8_t NO_SEG = 0xff;
+
+struct Insn {
+    uint32_t lin;    // linear address of the first prefix byte
+    uint32_t epoch;
+    uint32_t gen;    // page generation at decode time
+    uint8_t len;
+    uint8_t op;      // opcode after prefixes
+    uint8_t rep;     // 0, 0xf2 or 0xf3
+    uint8_t modrm;
+    uint8_t ea;      // rm 0-7, EA_DIRECT or EA_REG
+    uint8_t seg;     // segment of the memory operand (override applied)
+    uint8_t str_seg; // source segment of string ops / xlat / moffs
+    uint16_t disp;
+    uint16_t imm;
+    uint16_t imm2;
+};
+
+constexpr size_t CACHE_SIZE = 8192;
+
+inline bool parity8(uint32_t v) { return !__builtin_parity(v & 0xff); }
+
+struct InterpCPU : CPU {
+    uint8_t *mem = nullptr;
+    Console *console = nullptr;
+    uint16_t r[8];
+    uint16_t s[4];
+    uint16_t ip;
+    uint16_t fl;
+
+    uint32_t epoch = 0;
+    uint32_t page_gen[NUM_PAGES] = {};
+    bool code_page[NUM_PAGES] = {};  // the page has a code_line
+    bool code_line[NUM_LINES] = {};
+    bool code_written = false;  // a store hit a page holding decoded code
+    std::unique_ptr<Insn[]> cache{new Insn[CACHE_SIZE]()};
+
+    InterpCPU() {
+        regs.rflags = F_FIXED_ONE;
+        for (auto seg : {&sregs.cs, &sregs.ds, &sregs.es, &sregs.ss,
+                         &sregs.fs, &sregs.gs}) {
+            set_seg(*seg, 0);
+            seg->present = 1;
+            seg->s = 1;
+            seg->type = 3;
+        }
+        sregs.cs.type = 11;
+    }
+
+    ExitReason run(VM *vm, bool single_step) override;
+
+    /* take over the register state and memory for a run() */
+    void enter(VM *vm);
+    /*
+     * Interpret from CS:IP on the working registers until a HLT (returns
+     * true, IP past the HLT) or, with one, after a single instruction.
+     */
+    bool execute(VM *vm, bool one);
+
+    /* kvm_regs/kvm_sregs <-> working registers */
+    void load() {
+        r[R_AX] = regs.rax;
+        r[R_CX] = regs.rcx;
+        r[R_DX] = regs.rdx;
+        r[R_BX] = regs.rbx;
+        r[R_SP] = regs.rsp;
+        r[R_BP] = regs.rbp;
+        r[R_SI] = regs.rsi;
+        r[R_DI] = regs.rdi;
+        ip = regs.rip;
+        fl = (regs.rflags & F_WRITABLE) | F_FIXED_ONE;
+        s[S_ES] = sregs.es.selector;
+        s[S_CS] = sregs.cs.selector;
+        s[S_SS] = sregs.ss.selector;
+        s[S_DS] = sregs.ds.selector;
+    }
+    void store() {
+        regs.rax = r[R_AX];
+        regs.rcx = r[R_CX];
+        regs.rdx = r[R_DX];
+        regs.rbx = r[R_BX];
+        regs.rsp = r[R_SP];
+        regs.rbp = r[R_BP];
+        regs.rsi = r[R_SI];
+        regs.rdi = r[R_DI];
+        regs.rip = ip;
+        regs.rflags = fl;
+        set_seg(sregs.es, s[S_ES]);
+        set_seg(sregs.cs, s[S_CS]);
+        set_seg(sregs.ss, s[S_SS]);
+        set_seg(sregs.ds, s[S_DS]);
+    }
+
+    uint8_t &r8(int i) { return ((uint8_t *)&r[i & 3])[i >> 2]; }
+
+    /* memory */
+    uint32_t lin(int seg, uint16_t off) const {
+        return (((uint32_t)s[seg] << 4) + off) & MEM_MASK;
+    }
+    void touch(uint32_t a) {
+        if (code_line[a >> LINE_SHIFT]) {
+            uint32_t page = a >> 12;
+            code_line[a >> LINE_SHIFT] = false;
+            code_written = true;
+            page_gen[page]++;
+            /* an instruction may start on the previous page */
+            page_gen[(page - 1) & (NUM_PAGES - 1)]++;
+        }
+    }
+    /* guest bytes [a, a + len) hold decoded or translated code */
+    void mark_code(uint32_t a, uint32_t len) {
+        uint32_t end = a + len - 1;
+        for (uint32_t l = a >> LINE_SHIFT; l <= end >> LINE_SHIFT; l++) {
+            code_line[l & (NUM_LINES - 1)] = true;
+            code_page[(l >> (12 - LINE_SHIFT)) & (NUM_PAGES - 1)] = true;
+        }
+    }
+    uint8_t rd8(int seg, uint16_t off) const { return mem[lin(seg, off)]; }
+    uint16_t rd16(int seg, uint16_t off) const {
+        uint32_t a = lin(seg, off);
+        if (off == 0xffff || a == MEM_MASK) {
+            return mem[a] | (mem[lin(seg, off + 1)] << 8);
+        }
+        uint16_t v;
+        memcpy(&v, mem + a, 2);
+        return v;
+    }
+    void wr8(int seg, uint16_t off, uint8_t v) {
+        uint32_t a = lin(seg, off);
+        mem[a] = v;
+        touch(a);
+    }
+    void wr16(int seg, uint16_t off, uint16_t v) {
+        uint32_t a = lin(seg, off);
+        if (off == 0xffff || a == MEM_MASK) {
+            wr8(seg, off, v);
+            wr8(seg, off + 1, v >> 8);
+            return;
+        }
+        memcpy(mem + a, &v, 2);
+        touch(a);
+        touch(a + 1);
+    }
+    void push(uint16_t v) {
+        r[R_SP] -= 2;
+        wr16(S_SS, r[R_SP], v);
+    }
+    uint16_t pop() {
+        uint16_t v = rd16(S_SS, r[R_SP]);
+        r[R_SP] += 2;
+        return v;
+    }
+
+    /* ModRM operands */
+    uint16_t ea_off(const Insn *in) const {
+        uint16_t base;
+        switch (in->ea) {
+            case 0: base = r[R_BX] + r[R_SI]; break;
+            case 1: base = r[R_BX] + r[R_DI]; break;
+            case 2: base = r[R_BP] + r[R_SI]; break;
+            case 3: base = r[R_BP] + r[R_DI]; break;
+            case 4: base = r[R_SI]; break;
+            case 5: base = r[R_DI]; break;
+            case 6: base = r[R_BP]; break;
+            case 7: base = r[R_BX]; break;
+            default: base = 0; break;  // EA_DIRECT
+        }
+        return base + in->disp;
+    }
+    uint8_t get_e8(const Insn *in) {
+        if (in->ea == EA_REG) {
+            return r8(in->modrm & 7);
+        }
+        return rd8(in->seg, ea_off(in));
+    }
+    uint16_t get_e16(const Insn *in) {
+        if (in->ea == EA_REG) {
+            return r[in->modrm & 7];
+        }
+        return rd16(in->seg, ea_off(in));
+    }
+    void set_e8(const Insn *in, uint8_t v) {
+        if (in->ea == EA_REG) {
+            r8(in->modrm & 7) = v;
+        } else {
+            wr8(in->seg, ea_off(in), v);
+        }
+    }
+    void set_e16(const Insn *in, uint16_t v) {
+        if (in->ea == EA_REG) {
+            r[in->modrm & 7] = v;
+        } else {
+            wr16(in->seg, ea_off(in), v);
+        }
+    }
+    static int reg_of(const Insn *in) { return (in->modrm >> 3) & 7; }
+
+    /* flags */
+    void set_szp(uint32_t res, bool w) {
+        fl &= ~(F_SF | F_ZF | F_PF);
+        uint32_t mask = w ? 0xffff : 0xff;
+        uint32_t sign = w ? 0x8000 : 0x80;
+        if ((res & mask) == 0) fl |= F_ZF;
+        if (res & sign) fl |= F_SF;
+        if (parity8(res)) fl |= F_PF;
+    }
+
+    /* ADD OR ADC SBB AND SUB XOR CMP, in opcode order */
+    uint32_t alu(int op, uint32_t a, uint32_t b, bool w) {
+        uint32_t mask = w ? 0xffff : 0xff;
+        uint32_t sign = w ? 0x8000 : 0x80;
+        uint32_t res;
+        uint32_t carry = 0;
+
+        switch (op) {
+            case 2: carry = fl & F_CF; [[fallthrough]];
+            case 0:
+                res = a + b + carry;
+                fl &= ~F_ARITH;
+                if (res > mask) fl |= F_CF;
+                if ((a ^ res) & (b ^ res) & sign) fl |= F_OF;
+                if ((a ^ b ^ res) & 0x10) fl |= F_AF;
+                break;
+            case 3: carry = fl & F_CF; [[fallthrough]];
+            case 5:
+            case 7:
+                res = a - b - carry;
+                fl &= ~F_ARITH;
+                if (a < b + carry) fl |= F_CF;
+                if ((a ^ b) & (a ^ res) & sign) fl |= F_OF;
+                if ((a ^ b ^ res) & 0x10) fl |= F_AF;
+                break;
+            case 1: res = a | b; fl &= ~F_ARITH; break;
+            case 4: res = a & b; fl &= ~F_ARITH; break;
+            default: res = a ^ b; fl &= ~F_ARITH; break;
+        }
+        res &= mask;
+        set_szp(res, w);
+        return res;
+    }
+
+    uint32_t inc_dec(uint32_t a, bool dec, bool w) {
+        uint16_t cf = fl & F_CF;
+        uint32_t res = alu(dec ? 5 : 0, a, 1, w);
+        fl = (fl & ~F_CF) | cf;
+        return res;
+    }
+
+    /* ROL ROR RCL RCR SHL SHR SAL SAR */
+    uint32_t shift(int op, uint32_t a, int count, bool w) {
+        count &= 31;
+        if (count == 0) {
+            return a;
+        }
+        int bits = w ? 16 : 8;
+        uint32_t mask = w ? 0xffff : 0xff;
+        uint32_t sign = w ? 0x8000 : 0x80;
+        uint32_t res = a;
+        bool cf = fl & F_CF;
+
+        switch (op) {
+            case 0: {  // ROL
+                int c = count % bits;
+                res = ((a << c) | (a >> (bits - c))) & mask;
+                cf = res & 1;
+                fl = (fl & ~(F_CF | F_OF)) | (cf ? F_CF : 0);
+                if (((res & sign) != 0) != cf) fl |= F_OF;
+                return res;
+            }
+            case 1: {  // ROR
+                int c = count % bits;
+                res = ((a >> c) | (a << (bits - c))) & mask;
+                cf = res & sign;
+                fl = (fl & ~(F_CF | F_OF)) | (cf ? F_CF : 0);
+                if (((res ^ (res << 1)) & sign) != 0) fl |= F_OF;
+                return res;
+            }
+            case 2:  // RCL
+                for (int i = count % (bits + 1); i > 0; i--) {
+                    bool out = res & sign;
+                    res = ((res << 1) | cf) & mask;
+                    cf = out;
+                }
+                fl = (fl & ~(F_CF | F_OF)) | (cf ? F_CF : 0);
+                if (((res & sign) != 0) != cf) fl |= F_OF;
+                return res;
+            case 3:  // RCR
+                for (int i = count % (bits + 1); i > 0; i--) {
+                    bool out = res & 1;
+                    res = (res >> 1) | (cf ? sign : 0);
+                    cf = out;
+                }
+                fl = (fl & ~(F_CF | F_OF)) | (cf ? F_CF : 0);
+                if (((res ^ (res << 1)) & sign) != 0) fl |= F_OF;
+                return res;
+            case 4:
+            case 6:  // SHL/SAL
+                res = a << count;
+                cf = (res >> bits) & 1;
+                res &= mask;
+                fl &= ~(F_CF | F_OF | F_AF);
+                if (cf) fl |= F_CF;
+                if (((res & sign) != 0) != cf) fl |= F_OF;
+                break;
+            case 5:  // SHR
+                cf = (a >> (count - 1)) & 1;
+                res = a >> count;
+                fl &= ~(F_CF | F_OF | F_AF);
+                if (cf) fl |= F_CF;
+                if (a & sign) fl |= F_OF;
+                break;
+            default: {  // SAR
+                int32_t sa = w ? (int32_t)(int16_t)a : (int32_t)(int8_t)a;
+                cf = (sa >> (count - 1)) & 1;
+                res = (uint32_t)(sa >> count) & mask;
+                fl &= ~(F_CF | F_OF | F_AF);
+                if (cf) fl |= F_CF;
+                break;
+            }
+        }
+        set_szp(res, w);
+        return res;
+    }
+
+    bool cond(int cc) const {
+        bool v;
+        switch (cc >> 1) {
+            case 0: v = fl & F_OF; break;
+            case 1: v = fl & F_CF; break;
+            case 2: v = fl & F_ZF; break;
+            case 3: v = fl & (F_CF | F_ZF); break;
+            case 4: v = fl & F_SF; break;
+            case 5: v = fl & F_PF; break;
+            case 6: v = !(fl & F_SF) != !(fl & F_OF); break;
+            default:
+                v = (fl & F_ZF) || (!(fl & F_SF) != !(fl & F_OF));
+                break;
+        }
+        return (cc & 1) ? !v : v;
+    }
+
+    /* real-mode interrupt/exception delivery through the IVT */
+    void interrupt(int vec, uint16_t ret_ip) {
+        push(fl);
+        push(s[S_CS]);
+        push(ret_ip);
+        fl &= ~(F_IF | F_TF);
+        ip = mem[vec * 4] | (mem[vec * 4 + 1] << 8);
+        s[S_CS] = mem[vec * 4 + 2] | (mem[vec * 4 + 3] << 8);
+    }
+
+    void decode(uint32_t a, Insn *in);
+    const Insn *fetch(uint32_t a) {
+        Insn *in = &cache[(a ^ (a >> 13)) & (CACHE_SIZE - 1)];
+        uint32_t page = a >> 12;
+        if (in->lin == a && in->epoch == epoch && in->gen == page_gen[page]) {
+            return in;
+        }
+        decode(a, in);
+        in->epoch = epoch;
+        in->gen = page_gen[page];
+        mark_code(a, in->len);
+        return in;
+    }
+
+    void string_op(const Insn *in);
+    /* report it and make run() return FAULT */
+    void unconnected_io(bool out, uint16_t port, int size);
+};
+
+}  // namespace interp
@@ -0,0 +1,1187 @@
+/*
+ * Dynamic binary translator: real-mode 16-bit guest code to x86-64, the
+ * backend used instead of KVM when /dev/kvm is not available.
+ *
+ * Guest code is translated one basic block at a time into a translation
+ * cache keyed by CS:IP. The guest registers stay in the interpreter's working
+ * registers (rbx points at the CPU, r12 at guest memory) and arithmetic is
+ * done by the same host instruction, whose flags are merged into the guest
+ * FLAGS. Instructions that are rare or need the exception machinery (string
+ * ops, INT/IRET, far transfers, DIV, I/O, ...) call back into the interpreter
+ * for that one instruction.
+ *
+ * A block ending in a direct jump is chained to its successor once that has
+ * been translated. Every block starts by comparing the generation of the
+ * guest pages it was translated from. Guest stores into a 64-byte line
+ * holding translated code take the slow path, which bumps the page's
+ * generation and leaves the block; the host handlers may write anywhere,
+ * so all code pages are bumped on each run(). A stale block is compared
+ * with a copy of its guest bytes and either revalidated or retranslated,
+ * its old entry becoming a jump to the new one.
+ *
+ * HLT always leaves the translated code, so the hypercall addresses are
+ * decoded exactly as under KVM.
+ */
+#include "interp.hpp"
+
+#if defined(__x86_64__)
+
+#include <deque>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+using namespace interp;
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R13 = 13, R14, R15 };
+enum { CC_E = 4, CC_NE = 5 };
+enum { EXIT_CONTINUE, EXIT_HLT };
+/* store_mem() resume_ip for the last instruction of a block, whose exit
+ * reaches the next block's generation check anyway */
+constexpr int NO_RESUME = -1;
+
+constexpr size_t TC_SIZE = 32 << 20;
+constexpr size_t TC_RESERVE = 256 << 10;  // more than the largest block
+constexpr int MAX_BLOCK_INSNS = 64;
+constexpr uint32_t JUMP_CACHE_SIZE = 4096;
+constexpr uint16_t F_INC_DEC = F_ARITH & ~F_CF;
+
+struct Block {
+    uint32_t key;  // cs << 16 | ip
+    uint32_t lin;
+    uint32_t first_page;
+    int num_pages;
+    uint8_t *entry;
+    uint8_t *gen_imm[2];  // the generations compared in the prologue
+    std::vector<uint8_t> bytes;
+};
+
+struct JitCPU;
+using TcEnter = int (*)(JitCPU *cpu, uint8_t *mem, uint8_t *code);
+
+uint32_t jit_rd16(JitCPU *cpu, uint32_t seg, uint32_t off);
+uint32_t jit_wr8(JitCPU *cpu, uint32_t seg, uint32_t off, uint32_t v);
+uint32_t jit_wr16(JitCPU *cpu, uint32_t seg, uint32_t off, uint32_t v);
+uint32_t jit_step(JitCPU *cpu, uint32_t next_ip);
+
+/* ends a block: direct and indirect transfers, interrupts and HLT */
+bool ends_block(const Insn *in) {
+    uint8_t op = in->op;
+    if ((op >= 0x70 && op <= 0x7f) || (op >= 0xe0 && op <= 0xe3)) {
+        return true;
+    }
+    switch (op) {
+        case 0x9a:
+        case 0xc2:
+        case 0xc3:
+        case 0xca:
+        case 0xcb:
+        case 0xcc:
+        case 0xcd:
+        case 0xce:
+        case 0xcf:
+        case 0xe8:
+        case 0xe9:
+        case 0xea:
+        case 0xeb:
+        case 0xf4:
+            return true;
+        case 0xff: {
+            int reg = (in->modrm >> 3) & 7;
+            return reg >= 2 && reg <= 5;
+        }
+        default:
+            return false;
+    }
+}
+
+struct JitCPU : InterpCPU {
+    VM *vm = nullptr;
+    uint8_t *chain_site = nullptr;  // jmp rel32 of the exit just taken
+
+    uint8_t *tc;
+    uint8_t *tc_blocks;  // first byte after the glue code
+    uint8_t *tc_ptr;
+    TcEnter tc_enter;
+    uint8_t *tc_exit_chain;
+    uint8_t *tc_exit;
+    uint32_t tc_flushes = 0;
+    /* blocks test kick_pending on entry; off until something can kick */
+    bool kick_checks = false;
+
+    std::unordered_map<uint32_t, Block *> blocks;
+    std::deque<Block> block_pool;
+    Block *jump_cache[JUMP_CACHE_SIZE] = {};
+
+    /* guest state, relative to rbx */
+    int32_t off_r, off_s, off_ip, off_fl, off_gen, off_code_line,
+        off_chain_site, off_jump_cache, off_kick_pending;
+    int32_t off_block_key, off_block_entry;
+
+    /* emitter */
+    uint8_t *code;
+    std::vector<uint8_t *> chain_exits;
+
+    JitCPU();
+    ~JitCPU() {
+        if (tc) {
+            munmap(tc, TC_SIZE);
+        }
+    }
+
+    ExitReason run(VM *vm, bool single_step) override;
+
+    Block *lookup(uint16_t cs, uint16_t ip);
+    Block *translate(uint16_t cs, uint16_t ip);
+    bool translate_insn(const Insn *in, uint16_t ip, uint16_t next_ip);
+    void flush();
+
+    int32_t greg16(int i) const { return off_r + 2 * i; }
+    int32_t greg8(int i) const { return off_r + 2 * (i & 3) + (i >> 2); }
+    int32_t gseg(int i) const { return off_s + 2 * i; }
+
+    /* raw bytes */
+    void b(uint8_t v) { *code++ = v; }
+    void b(std::initializer_list<uint8_t> bytes) {
+        for (auto v : bytes) {
+            *code++ = v;
+        }
+    }
+    void w16(uint16_t v) {
+        memcpy(code, &v, 2);
+        code += 2;
+    }
+    void d32(uint32_t v) {
+        memcpy(code, &v, 4);
+        code += 4;
+    }
+    void q64(uint64_t v) {
+        memcpy(code, &v, 8);
+        code += 8;
+    }
+    static void patch(uint8_t *site, uint8_t *target) {
+        int32_t rel = target - (site + 4);
+        memcpy(site, &rel, 4);
+    }
+    void bind(uint8_t *site) { patch(site, code); }
+
+    /* ModRM for [rbx + disp32] */
+    void m_rbx(int reg, int32_t disp) {
+        b(0x80 | (reg & 7) << 3 | RBX);
+        d32(disp);
+    }
+    uint8_t *jcc(int cc) {
+        b({0x0f, (uint8_t)(0x80 | cc)});
+        d32(0);
+        return code - 4;
+    }
+    uint8_t *jmp() {
+        b(0xe9);
+        d32(0);
+        return code - 4;
+    }
+
+    /* movzx reg32, word/byte [rbx+disp] and the stores back */
+    void ld16(int reg, int32_t disp) {
+        if (reg >= 8) b(0x44);
+        b({0x0f, 0xb7});
+        m_rbx(reg, disp);
+    }
+    void ld8(int reg, int32_t disp) {
+        if (reg >= 8) b(0x44);
+        b({0x0f, 0xb6});
+        m_rbx(reg, disp);
+    }
+    void st16(int reg, int32_t disp) {
+        b(0x66);
+        if (reg >= 8) b(0x44);
+        b(0x89);
+        m_rbx(reg, disp);
+    }
+    void st8(int reg, int32_t disp) {
+        if (reg >= 8) b(0x44);
+        b(0x88);
+        m_rbx(reg, disp);
+    }
+    void st16_imm(int32_t disp, uint16_t imm) {
+        b({0x66, 0xc7});
+        m_rbx(0, disp);
+        w16(imm);
+    }
+    /* op word [rbx+disp], imm16 with op = /ext of 81 */
+    void op16_imm(int ext, int32_t disp, uint16_t imm) {
+        b({0x66, 0x81});
+        m_rbx(ext, disp);
+        w16(imm);
+    }
+    void mov_ri(int reg, uint32_t imm) {
+        if (reg >= 8) b(0x41);
+        b(0xb8 + (reg & 7));
+        d32(imm);
+    }
+    void ld_reg(int host, int i, bool w) {
+        w ? ld16(host, greg16(i)) : ld8(host, greg8(i));
+    }
+    void st_reg(int host, int i, bool w) {
+        w ? st16(host, greg16(i)) : st8(host, greg8(i));
+    }
+    void call(const void *fn) {
+        b({0x48, 0xb8});
+        q64((uint64_t)fn);
+        b({0xff, 0xd0});
+    }
+    void exit_plain(int kind) {
+        mov_ri(RAX, kind);
+        patch(jmp(), tc_exit);
+    }
+    void exit_chain(uint16_t ip) {
+        st16_imm(off_ip, ip);
+        chain_exits.push_back(jmp());
+    }
+    void exit_indirect();
+
+    /* guest flags <-> host flags */
+    void merge_flags(uint16_t mask) {
+        b({0x9c, 0x5a});  // pushfq; pop rdx
+        b({0x81, 0xe2});
+        d32(mask);
+        op16_imm(4, off_fl, ~mask);
+        b({0x66, 0x09});  // or [fl], dx
+        m_rbx(RDX, off_fl);
+    }
+    void load_flags() {
+        ld16(RDX, off_fl);
+        b({0x81, 0xe2});
+        d32(F_ARITH);
+        b({0x52, 0x9d});  // push rdx; popfq
+    }
+
+    /* memory operands: r13d holds the offset, the value goes through eax */
+    void emit_ea(const Insn *in);
+    void emit_lin(int seg);
+    void emit_word_checks(std::vector<uint8_t *> *slow);
+    void helper_args(int seg);
+    void load_mem(int seg, bool w);
+    void store_mem(int seg, bool w, int resume_ip);
+    void load_e(const Insn *in, bool w);
+    void store_e(const Insn *in, bool w, uint16_t next_ip);
+    void emit_push(int resume_ip);
+    void emit_pop();
+    uint8_t *emit_cond(int cc);
+    void emit_fallback(uint16_t ip, uint16_t next_ip, bool ends);
+};
+
+JitCPU::JitCPU() {
+    tc = (uint8_t *)mmap(nullptr, TC_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (tc == MAP_FAILED) {
+        perror("mmap translation cache");
+        tc = nullptr;  // create_jit_cpu() falls back to the interpreter
+        return;
+    }
+
+    auto offset = [this](const void *field) {
+        return (int32_t)((const uint8_t *)field - (const uint8_t *)this);
+    };
+    off_r = offset(r);
+    off_s = offset(s);
+    off_ip = offset(&ip);
+    off_fl = offset(&fl);
+    off_gen = offset(page_gen);
+    off_code_line = offset(code_line);
+    off_chain_site = offset(&chain_site);
+    off_jump_cache = offset(jump_cache);
+    off_kick_pending = offset((const void *)&kick_pending);
+    Block probe;
+    off_block_key = (uint8_t *)&probe.key - (uint8_t *)&probe;
+    off_block_entry = (uint8_t *)&probe.entry - (uint8_t *)&probe;
+
+    code = tc;
+    tc_enter = (TcEnter)code;
+    b({0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57});  // push
+    b({0x48, 0x89, 0xfb});  // mov rbx, rdi
+    b({0x49, 0x89, 0xf4});  // mov r12, rsi
+    b({0xff, 0xe2});        // jmp rdx
+
+    uint8_t *epilogue = code;
+    b({0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5b, 0xc3});
+
+    tc_exit_chain = code;  // rax = chain site
+    b({0x48, 0x89});
+    m_rbx(RAX, off_chain_site);
+    b({0x31, 0xc0});  // xor eax, eax
+    patch(jmp(), epilogue);
+
+    tc_exit = code;  // eax = exit kind
+    b({0x48, 0xc7});
+    m_rbx(0, off_chain_site);
+    d32(0);
+    patch(jmp(), epilogue);
+
+    tc_blocks = tc_ptr = code;
+}
+
+void JitCPU::flush() {
+    blocks.clear();
+    block_pool.clear();
+    memset(jump_cache, 0, sizeof(jump_cache));
+    tc_ptr = tc_blocks;
+    chain_site = nullptr;
+    tc_flushes++;
+}
+
+void JitCPU::emit_ea(const Insn *in) {
+    static const int8_t base[8] = {R_BX, R_BX, R_BP, R_BP,
+                                   R_SI, R_DI, R_BP, R_BX};
+    static const int8_t index[8] = {R_SI, R_DI, R_SI, R_DI, -1, -1, -1, -1};
+
+    if (in->ea == EA_DIRECT) {
+        mov_ri(R13, in->disp);
+        return;
+    }
+    ld16(R13, greg16(base[in->ea]));
+    if (index[in->ea] >= 0) {
+        b({0x66, 0x44, 0x03});  // add r13w, [rbx+idx]
+        m_rbx(R13, greg16(index[in->ea]));
+    }
+    if (in->disp) {
+        b({0x66, 0x41, 0x81, 0xc5});  // add r13w, imm16
+        w16(in->disp);
+    }
+}
+
+/* ecx = (seg << 4) + r13d, wrapped at 1MiB */
+void JitCPU::emit_lin(int seg) {
+    ld16(RCX, gseg(seg));
+    b({0xc1, 0xe1, 0x04});  // shl ecx, 4
+    b({0x44, 0x01, 0xe9});  // add ecx, r13d
+    b({0x81, 0xe1});
+    d32(MEM_MASK);
+}
+
+/* words wrapping the segment or crossing a page go to the helpers */
+void JitCPU::emit_word_checks(std::vector<uint8_t *> *slow) {
+    b({0x41, 0x81, 0xfd});  // cmp r13d, 0xffff
+    d32(0xffff);
+    slow->push_back(jcc(CC_E));
+    b({0x89, 0xca});  // mov edx, ecx
+    b({0x81, 0xe2});
+    d32(0xfff);
+    b({0x81, 0xfa});
+    d32(0xfff);
+    slow->push_back(jcc(CC_E));
+}
+
+void JitCPU::helper_args(int seg) {
+    b({0x48, 0x89, 0xdf});  // mov rdi, rbx
+    mov_ri(RSI, seg);
+    b({0x44, 0x89, 0xea});  // mov edx, r13d
+}
+
+void JitCPU::load_mem(int seg, bool w) {
+    emit_lin(seg);
+    if (!w) {
+        b({0x41, 0x0f, 0xb6, 0x04, 0x0c});  // movzx eax, byte [r12+rcx]
+        return;
+    }
+    std::vector<uint8_t *> slow;
+    emit_word_checks(&slow);
+    b({0x41, 0x0f, 0xb7, 0x04, 0x0c});  // movzx eax, word [r12+rcx]
+    uint8_t *done = jmp();
+    for (auto site : slow) {
+        bind(site);
+    }
+    helper_args(seg);
+    call((const void *)jit_rd16);
+    bind(done);
+}
+
+/*
+ * Stores into a page holding translated code go through the helper, which
+ * reports it; the block is left at resume_ip since it may just have been
+ * overwritten.
+ */
+void JitCPU::store_mem(int seg, bool w, int resume_ip) {
+    b({0x41, 0x89, 0xc6});  // mov r14d, eax
+    emit_lin(seg);
+    std::vector<uint8_t *> slow;
+    if (w) {
+        emit_word_checks(&slow);
+    }
+    b({0x89, 0xca});  // mov edx, ecx
+    b({0xc1, 0xea, LINE_SHIFT});  // shr edx, LINE_SHIFT
+    b({0x80, 0xbc, 0x13});  // cmp byte [rbx+rdx+code_line], 0
+    d32(off_code_line);
+    b(0);
+    slow.push_back(jcc(CC_NE));
+    if (w) {
+        b({0x8d, 0x51, 0x01});  // lea edx, [rcx+1]
+        b({0xc1, 0xea, LINE_SHIFT});
+        b({0x80, 0xbc, 0x13});
+        d32(off_code_line);
+        b(0);
+        slow.push_back(jcc(CC_NE));
+    }
+    if (w) {
+        b({0x66, 0x45, 0x89, 0x34, 0x0c});  // mov [r12+rcx], r14w
+    } else {
+        b({0x45, 0x88, 0x34, 0x0c});  // mov [r12+rcx], r14b
+    }
+    uint8_t *done = jmp();
+    for (auto site : slow) {
+        bind(site);
+    }
+    helper_args(seg);
+    b({0x44, 0x89, 0xf1});  // mov ecx, r14d
+    call(w ? (const void *)jit_wr16 : (const void *)jit_wr8);
+    if (resume_ip != NO_RESUME) {
+        b({0x85, 0xc0});  // test eax, eax
+        uint8_t *clean = jcc(CC_E);
+        st16_imm(off_ip, resume_ip);
+        exit_plain(EXIT_CONTINUE);
+        bind(clean);
+    }
+    bind(done);
+}
+
+void JitCPU::load_e(const Insn *in, bool w) {
+    if (in->ea == EA_REG) {
+        ld_reg(RAX, in->modrm & 7, w);
+    } else {
+        load_mem(in->seg, w);
+    }
+}
+
+void JitCPU::store_e(const Insn *in, bool w, uint16_t next_ip) {
+    if (in->ea == EA_REG) {
+        st_reg(RAX, in->modrm & 7, w);
+    } else {
+        store_mem(in->seg, w, next_ip);
+    }
+}
+
+void JitCPU::emit_push(int resume_ip) {
+    b({0x41, 0x89, 0xc7});  // mov r15d, eax
+    b({0x66, 0x83});        // sub word [sp], 2
+    m_rbx(5, greg16(R_SP));
+    b(2);
+    ld16(R13, greg16(R_SP));
+    b({0x44, 0x89, 0xf8});  // mov eax, r15d
+    store_mem(S_SS, true, resume_ip);
+}
+
+void JitCPU::emit_pop() {
+    ld16(R13, greg16(R_SP));
+    load_mem(S_SS, true);
+    b({0x66, 0x83});  // add word [sp], 2
+    m_rbx(0, greg16(R_SP));
+    b(2);
+}
+
+/* jump taken when the guest condition cc holds */
+uint8_t *JitCPU::emit_cond(int cc) {
+    static const uint16_t flag_tests[6] = {F_OF, F_CF, F_ZF,
+                                           F_CF | F_ZF, F_SF, F_PF};
+    int kind = cc >> 1;
+    bool negate = cc & 1;
+
+    if (kind < 6) {
+        b({0x66, 0xf7});  // test word [fl], imm16
+        m_rbx(0, off_fl);
+        w16(flag_tests[kind]);
+        return jcc(negate ? CC_E : CC_NE);
+    }
+    /* L/GE: SF != OF, LE/G: also ZF */
+    ld16(RDX, off_fl);
+    b({0x89, 0xd1});        // mov ecx, edx
+    b({0xc1, 0xe9, 0x04});  // shr ecx, 4 (OF -> SF)
+    b({0x31, 0xd1});        // xor ecx, edx
+    b({0x81, 0xe1});
+    d32(F_SF);
+    if (kind == 7) {
+        b({0x81, 0xe2});
+        d32(F_ZF);
+        b({0x09, 0xd1});  // or ecx, edx
+    }
+    return jcc(negate ? CC_E : CC_NE);
+}
+
+void JitCPU::emit_fallback(uint16_t ip, uint16_t next_ip, bool ends) {
+    st16_imm(off_ip, ip);
+    b({0x48, 0x89, 0xdf});  // mov rdi, rbx
+    mov_ri(RSI, next_ip);
+    call((const void *)jit_step);
+    if (ends) {
+        exit_plain(EXIT_CONTINUE);
+        return;
+    }
+    b({0x85, 0xc0});
+    uint8_t *cont = jcc(CC_E);
+    exit_plain(EXIT_CONTINUE);
+    bind(cont);
+}
+
+/* continue at CS:IP through the jump cache, the dispatcher on a miss */
+void JitCPU::exit_indirect() {
+    ld16(RAX, off_ip);
+    ld16(RCX, gseg(S_CS));
+    b({0xc1, 0xe1, 0x10});  // shl ecx, 16
+    b({0x09, 0xc8});        // or eax, ecx: eax = key
+    b({0x89, 0xc1});        // mov ecx, eax
+    b({0xc1, 0xe9, 0x0c});  // shr ecx, 12
+    b({0x31, 0xc1});        // xor ecx, eax
+    b({0x81, 0xe1});
+    d32(JUMP_CACHE_SIZE - 1);
+    b({0x48, 0x8b, 0x94, 0xcb});  // mov rdx, [rbx+rcx*8+jump_cache]
+    d32(off_jump_cache);
+    b({0x48, 0x85, 0xd2});  // test rdx, rdx
+    uint8_t *empty = jcc(CC_E);
+    b({0x39, 0x82});  // cmp [rdx+key], eax
+    d32(off_block_key);
+    uint8_t *other = jcc(CC_NE);
+    b({0xff, 0xa2});  // jmp [rdx+entry]
+    d32(off_block_entry);
+    bind(empty);
+    bind(other);
+    exit_plain(EXIT_CONTINUE);
+}
+
+/* returns true when the block has been closed by this instruction */
+bool JitCPU::translate_insn(const Insn *in, uint16_t ip, uint16_t next_ip) {
+    uint8_t op = in->op;
+    bool w = op & 1;
+    int reg = (in->modrm >> 3) & 7;
+    bool has_mem = in->ea != EA_REG;
+
+    /* opcodes taking a ModRM memory operand compute its offset first */
+    auto ea = [&]() {
+        if (has_mem) emit_ea(in);
+    };
+
+    if (op < 0x40 && (op & 7) < 6) {
+        int kind = op >> 3;
+        bool use_cf = kind == 2 || kind == 3;  // adc, sbb
+        switch ((op >> 1) & 3) {
+            case 0:  // E, G
+                ea();
+                load_e(in, w);
+                ld_reg(RCX, reg, w);
+                break;
+            case 1:  // G, E
+                ea();
+                load_e(in, w);
+                b({0x89, 0xc1});  // mov ecx, eax
+                ld_reg(RAX, reg, w);
+                break;
+            default:  // AL/AX, imm
+                ld_reg(RAX, R_AX, w);
+                mov_ri(RCX, in->imm);
+                break;
+        }
+        if (use_cf) load_flags();
+        if (w) b(0x66);
+        b({(uint8_t)(kind * 8 + w), 0xc8});  // op eax, ecx
+        merge_flags(F_ARITH);
+        if (kind != 7) {
+            if (((op >> 1) & 3) == 0) {
+                store_e(in, w, next_ip);
+            } else {
+                st_reg(RAX, ((op >> 1) & 3) == 1 ? reg : R_AX, w);
+            }
+        }
+        return false;
+    }
+
+    switch (op) {
+        case 0x06:
+        case 0x0e:
+        case 0x16:
+        case 0x1e:
+            ld16(RAX, gseg(op >> 3));
+            emit_push(next_ip);
+            return false;
+        case 0x07:
+        case 0x17:
+        case 0x1f:
+            emit_pop();
+            st16(RAX, gseg(op >> 3));
+            return false;
+
+        case 0x40 ... 0x4f:
+            ld16(RAX, greg16(op & 7));
+            b({0x66, 0xff, (uint8_t)(op & 8 ? 0xc8 : 0xc0)});  // inc/dec ax
+            merge_flags(F_INC_DEC);
+            st16(RAX, greg16(op & 7));
+            return false;
+        case 0x50 ... 0x57:
+            ld16(RAX, greg16(op & 7));
+            emit_push(next_ip);
+            return false;
+        case 0x58 ... 0x5f:
+            emit_pop();
+            st16(RAX, greg16(op & 7));
+            return false;
+        case 0x68:
+        case 0x6a:
+            mov_ri(RAX, op == 0x6a ? (uint16_t)(int8_t)in->imm : in->imm);
+            emit_push(next_ip);
+            return false;
+        case 0x69:
+        case 0x6b:
+            ea();
+            load_e(in, true);
+            b({0x66, 0x69, 0xc0});  // imul ax, ax, imm16
+            w16(op == 0x6b ? (uint16_t)(int8_t)in->imm : in->imm);
+            merge_flags(F_ARITH);
+            st16(RAX, greg16(reg));
+            return false;
+
+        case 0x70 ... 0x7f: {
+            uint8_t *taken = emit_cond(op & 0xf);
+            exit_chain(next_ip);
+            bind(taken);
+            exit_chain(next_ip + (int8_t)in->imm);
+            return true;
+        }
+
+        case 0x80 ... 0x83: {
+            ea();
+            load_e(in, w);
+            mov_ri(RCX, op == 0x83 ? (uint16_t)(int8_t)in->imm : in->imm);
+            if (reg == 2 || reg == 3) load_flags();
+            if (w) b(0x66);
+            b({(uint8_t)(reg * 8 + w), 0xc8});
+            merge_flags(F_ARITH);
+            if (reg != 7) store_e(in, w, next_ip);
+            return false;
+        }
+        case 0x84:
+        case 0x85:
+            ea();
+            load_e(in, w);
+            ld_reg(RCX, reg, w);
+            if (w) b(0x66);
+            b({(uint8_t)(0x84 + w), 0xc8});  // test eax, ecx
+            merge_flags(F_ARITH);
+            return false;
+        case 0x86:
+        case 0x87:
+            /* the register is written first: the store may leave the block */
+            ea();
+            load_e(in, w);
+            b({0x41, 0x89, 0xc7});  // mov r15d, eax
+            ld_reg(RAX, reg, w);
+            w ? st16(R15, greg16(reg)) : st8(R15, greg8(reg));
+            store_e(in, w, next_ip);
+            return false;
+        case 0x88:
+        case 0x89:
+            ea();
+            ld_reg(RAX, reg, w);
+            store_e(in, w, next_ip);
+            return false;
+        case 0x8a:
+        case 0x8b:
+            ea();
+            load_e(in, w);
+            st_reg(RAX, reg, w);
+            return false;
+        case 0x8c:
+            if (reg > 3) break;
+            ea();
+            ld16(RAX, gseg(reg));
+            store_e(in, true, next_ip);
+            return false;
+        case 0x8d:
+            if (!has_mem) break;
+            emit_ea(in);
+            b({0x44, 0x89, 0xe8});  // mov eax, r13d
+            st16(RAX, greg16(reg));
+            return false;
+        case 0x8e:
+            if (reg > 3 || reg == S_CS) break;
+            ea();
+            load_e(in, true);
+            st16(RAX, gseg(reg));
+            return false;
+        case 0x8f:
+            emit_pop();
+            b({0x41, 0x89, 0xc7});  // mov r15d, eax
+            ea();
+            b({0x44, 0x89, 0xf8});  // mov eax, r15d
+            store_e(in, true, next_ip);
+            return false;
+        case 0x90:
+            return false;
+        case 0x91 ... 0x97:
+            ld16(RAX, greg16(R_AX));
+            ld16(RCX, greg16(op & 7));
+            st16(RCX, greg16(R_AX));
+            st16(RAX, greg16(op & 7));
+            return false;
+        case 0x98:
+            b({0x0f, 0xbe});  // movsx eax, byte [al]
+            m_rbx(RAX, greg8(0));
+            st16(RAX, greg16(R_AX));
+            return false;
+        case 0x99:
+            b({0x0f, 0xbf});  // movsx eax, word [ax]
+            m_rbx(RAX, greg16(R_AX));
+            b({0xc1, 0xf8, 0x10});  // sar eax, 16
+            st16(RAX, greg16(R_DX));
+            return false;
+        case 0x9c:
+            ld16(RAX, off_fl);
+            emit_push(next_ip);
+            return false;
+        case 0x9e:
+            ld8(RAX, greg8(4));
+            b(0x25);  // and eax, imm32
+            d32(F_SF | F_ZF | F_AF | F_PF | F_CF);
+            ld16(RCX, off_fl);
+            b({0x81, 0xe1});
+            d32(0xffff & ~(F_SF | F_ZF | F_AF | F_PF | F_CF));
+            b({0x09, 0xc1});  // or ecx, eax
+            st16(RCX, off_fl);
+            return false;
+        case 0x9f:
+            ld8(RAX, off_fl);
+            st8(RAX, greg8(4));
+            return false;
+        case 0xa0 ... 0xa3:
+            mov_ri(R13, in->imm);
+            if (op & 2) {
+                ld_reg(RAX, R_AX, w);
+                store_mem(in->str_seg, w, next_ip);
+            } else {
+                load_mem(in->str_seg, w);
+                st_reg(RAX, R_AX, w);
+            }
+            return false;
+        case 0xa8:
+        case 0xa9:
+            ld_reg(RAX, R_AX, w);
+            mov_ri(RCX, in->imm);
+            if (w) b(0x66);
+            b({(uint8_t)(0x84 + w), 0xc8});
+            merge_flags(F_ARITH);
+            return false;
+        case 0xb0 ... 0xbf:
+            mov_ri(RAX, in->imm);
+            st_reg(RAX, op & 7, op & 8);
+            return false;
+
+        case 0xc0:
+        case 0xc1:
+        case 0xd0 ... 0xd3: {
+            ea();
+            load_e(in, w);
+            if (op <= 0xc1) {
+                mov_ri(RCX, in->imm);
+            } else if (op <= 0xd1) {
+                mov_ri(RCX, 1);
+            } else {
+                ld8(RCX, greg8(1));
+            }
+            /* a zero count or a rotate leaves flags alone */
+            load_flags();
+            int kind = reg == 6 ? 4 : reg;
+            if (w) b(0x66);
+            b({(uint8_t)(0xd2 + w), (uint8_t)(0xc0 | kind << 3)});
+            merge_flags(F_ARITH);
+            store_e(in, w, next_ip);
+            return false;
+        }
+        case 0xc2:
+        case 0xc3:
+        case 0xca:
+        case 0xcb:
+            emit_pop();
+            st16(RAX, off_ip);
+            if (op >= 0xca) {
+                emit_pop();
+                st16(RAX, gseg(S_CS));
+            }
+            if (!(op & 1)) {
+                op16_imm(0, greg16(R_SP), in->imm);
+            }
+            exit_indirect();
+            return true;
+        case 0xc6:
+        case 0xc7:
+            ea();
+            mov_ri(RAX, in->imm);
+            store_e(in, w, next_ip);
+            return false;
+        case 0xc9:
+            ld16(RAX, greg16(R_BP));
+            st16(RAX, greg16(R_SP));
+            emit_pop();
+            st16(RAX, greg16(R_BP));
+            return false;
+
+        case 0xe0:
+        case 0xe1:
+        case 0xe2:
+        case 0xe3: {
+            uint8_t *taken;
+            if (op == 0xe3) {
+                b({0x66, 0x83});  // cmp word [cx], 0
+                m_rbx(7, greg16(R_CX));
+                b(0);
+                taken = jcc(CC_E);
+            } else {
+                b({0x66, 0x83});  // sub word [cx], 1
+                m_rbx(5, greg16(R_CX));
+                b(1);
+                if (op == 0xe2) {
+                    taken = jcc(CC_NE);
+                } else {
+                    uint8_t *done = jcc(CC_E);
+                    b({0x66, 0xf7});  // test word [fl], ZF
+                    m_rbx(0, off_fl);
+                    w16(F_ZF);
+                    taken = jcc(op == 0xe1 ? CC_NE : CC_E);
+                    bind(done);
+                }
+            }
+            exit_chain(next_ip);
+            bind(taken);
+            exit_chain(next_ip + (int8_t)in->imm);
+            return true;
+        }
+        case 0xe8:
+            mov_ri(RAX, next_ip);
+            emit_push(NO_RESUME);
+            exit_chain(next_ip + in->imm);
+            return true;
+        case 0x9a:
+            ld16(RAX, gseg(S_CS));
+            emit_push(NO_RESUME);
+            mov_ri(RAX, next_ip);
+            emit_push(NO_RESUME);
+            [[fallthrough]];
+        case 0xea:
+            /* chained on CS:IP, so the new CS is set first */
+            st16_imm(gseg(S_CS), in->imm2);
+            exit_chain(in->imm);
+            return true;
+        case 0xe9:
+            exit_chain(next_ip + in->imm);
+            return true;
+        case 0xeb:
+            exit_chain(next_ip + (int8_t)in->imm);
+            return true;
+        case 0xf4:
+            st16_imm(off_ip, next_ip);
+            exit_plain(EXIT_HLT);
+            return true;
+        case 0xf5:
+            op16_imm(6, off_fl, F_CF);  // xor
+            return false;
+        case 0xf8:
+        case 0xfa:
+        case 0xfc: {
+            static const uint16_t bits[3] = {F_CF, F_IF, F_DF};
+            op16_imm(4, off_fl, ~bits[(op - 0xf8) >> 1]);  // and
+            return false;
+        }
+        case 0xf9:
+        case 0xfb:
+        case 0xfd: {
+            static const uint16_t bits[3] = {F_CF, F_IF, F_DF};
+            op16_imm(1, off_fl, bits[(op - 0xf9) >> 1]);  // or
+            return false;
+        }
+
+        case 0xf6:
+        case 0xf7:
+            if (reg >= 6) break;  // div, idiv: #DE
+            ea();
+            load_e(in, w);
+            if (reg <= 1) {
+                mov_ri(RCX, in->imm);
+                if (w) b(0x66);
+                b({(uint8_t)(0x84 + w), 0xc8});
+                merge_flags(F_ARITH);
+                return false;
+            }
+            if (reg <= 3) {
+                if (w) b(0x66);
+                b({(uint8_t)(0xf6 + w), (uint8_t)(0xc0 | reg << 3)});
+                if (reg == 3) merge_flags(F_ARITH);
+                store_e(in, w, next_ip);
+                return false;
+            }
+            b({0x89, 0xc1});  // mov ecx, eax
+            ld_reg(RAX, R_AX, w);
+            if (w) b(0x66);
+            b({(uint8_t)(0xf6 + w), (uint8_t)(0xc1 | reg << 3)});  // op cx
+            st16(RAX, greg16(R_AX));
+            if (w) st16(RDX, greg16(R_DX));
+            merge_flags(F_ARITH);
+            return false;
+        case 0xfe:
+        case 0xff:
+            if (reg <= 1) {
+                ea();
+                load_e(in, w);
+                if (w) b(0x66);
+                b({(uint8_t)(0xfe + w), (uint8_t)(0xc0 | reg << 3)});
+                merge_flags(F_INC_DEC);
+                store_e(in, w, next_ip);
+                return false;
+            }
+            if (op == 0xfe) break;
+            if (reg == 2 || reg == 4) {
+                ea();
+                load_e(in, true);
+                st16(RAX, off_ip);
+                if (reg == 2) {
+                    mov_ri(RAX, next_ip);
+                    emit_push(NO_RESUME);
+                }
+                exit_indirect();
+                return true;
+            }
+            if (reg == 6) {
+                ea();
+                load_e(in, true);
+                emit_push(next_ip);
+                return false;
+            }
+            break;
+        default:
+            break;
+    }
+
+    emit_fallback(ip, next_ip, ends_block(in));
+    return ends_block(in);
+}
+
+Block *JitCPU::translate(uint16_t cs, uint16_t ip0) {
+    if ((size_t)(tc + TC_SIZE - tc_ptr) < TC_RESERVE) {
+        flush();
+    }
+
+    Insn insns[MAX_BLOCK_INSNS];
+    uint32_t start = lin(S_CS, ip0);
+    uint32_t first_page = start >> 12;
+    uint32_t len = 0;
+    int n = 0;
+    while (n < MAX_BLOCK_INSNS) {
+        Insn *in = &insns[n];
+        decode(start + len, in);
+        uint32_t end = start + len + in->len;
+        if ((uint32_t)ip0 + len + in->len > 0x10000 || end > MEM_MASK + 1 ||
+            ((end - 1) >> 12) > first_page + 1) {
+            break;
+        }
+        len += in->len;
+        n++;
+        if (ends_block(in)) {
+            break;
+        }
+    }
+
+    Block &blk = block_pool.emplace_back();
+    blk.key = (uint32_t)cs << 16 | ip0;
+    blk.lin = start;
+    blk.first_page = first_page;
+    blk.num_pages = ((start + len - 1) >> 12) - first_page + 1;
+    blk.bytes.assign(mem + start, mem + start + len);
+
+    code = tc_ptr;
+    blk.entry = code;
+    std::vector<uint8_t *> misses;
+    for (int i = 0; i < blk.num_pages; i++) {
+        uint32_t page = first_page + i;
+        b(0x8b);  // mov eax, [rbx+gen]; cmp eax, imm32
+        m_rbx(RAX, off_gen + 4 * page);
+        b(0x3d);
+        blk.gen_imm[i] = code;
+        d32(page_gen[page]);
+        misses.push_back(jcc(CC_NE));
+    }
+    mark_code(start, len);
+    if (kick_checks) {
+        b(0x83);  // cmp dword [rbx+kick_pending], 0
+        m_rbx(7, off_kick_pending);
+        b(0);
+        misses.push_back(jcc(CC_NE));
+    }
+
+    chain_exits.clear();
+    uint16_t ip = ip0;
+    bool closed = false;
+    for (int i = 0; i < n; i++) {
+        uint16_t next_ip = ip + insns[i].len;
+        closed = translate_insn(&insns[i], ip, next_ip);
+        ip = next_ip;
+    }
+    if (!closed) {
+        exit_chain(ip);
+    }
+
+    for (auto site : misses) {
+        bind(site);
+    }
+    exit_plain(EXIT_CONTINUE);
+    for (auto site : chain_exits) {
+        bind(site);
+        b({0x48, 0xb8});  // mov rax, site
+        q64((uint64_t)site);
+        patch(jmp(), tc_exit_chain);
+    }
+    tc_ptr = code;
+    return &blk;
+}
+
+Block *JitCPU::lookup(uint16_t cs, uint16_t ip) {
+    uint32_t key = (uint32_t)cs << 16 | ip;
+    Block **slot = &jump_cache[(key ^ (key >> 12)) & (JUMP_CACHE_SIZE - 1)];
+    Block *blk = *slot;
+
+    if (!blk || blk->key != key) {
+        auto it = blocks.find(key);
+        blk = it == blocks.end() ? nullptr : it->second;
+    }
+    if (blk) {
+        bool valid = true;
+        for (int i = 0; i < blk->num_pages; i++) {
+            uint32_t gen;
+            memcpy(&gen, blk->gen_imm[i], 4);
+            valid = valid && gen == page_gen[blk->first_page + i];
+        }
+        if (valid) {
+            *slot = blk;
+            return blk;
+        }
+        if (memcmp(mem + blk->lin, blk->bytes.data(), blk->bytes.size()) ==
+            0) {
+            for (int i = 0; i < blk->num_pages; i++) {
+                uint32_t page = blk->first_page + i;
+                memcpy(blk->gen_imm[i], &page_gen[page], 4);
+            }
+            mark_code(blk->lin, blk->bytes.size());
+            *slot = blk;
+            return blk;
+        }
+    }
+
+    uint32_t flushes = tc_flushes;
+    Block *fresh = translate(cs, ip);
+    if (blk && flushes == tc_flushes) {
+        blk->entry[0] = 0xe9;  // chained callers land on the new code
+        patch(blk->entry + 1, fresh->entry);
+    }
+    blocks[key] = fresh;
+    jump_cache[(key ^ (key >> 12)) & (JUMP_CACHE_SIZE - 1)] = fresh;
+    return fresh;
+}
+
+ExitReason JitCPU::run(VM *vm, bool single_step) {
+    if (single_step) {
+        return InterpCPU::run(vm, true);
+    }
+
+    this->vm = vm;
+    if (!kick_checks && (vm->profiler || vm->deadline_ns)) {
+        flush();  // retranslate with the checks
+        kick_checks = true;
+    }
+    enter(vm);
+    for (int page = 0; page < NUM_PAGES; page++) {
+        if (code_page[page]) {
+            code_page[page] = false;
+            page_gen[page]++;
+            memset(&code_line[page << (12 - LINE_SHIFT)], 0,
+                   1 << (12 - LINE_SHIFT));
+        }
+    }
+    chain_site = nullptr;
+
+    while (true) {
+        if (kick_pending & KICK_FAULT) {
+            __atomic_and_fetch(&kick_pending, ~KICK_FAULT, __ATOMIC_SEQ_CST);
+            vm->stop(StopReason::UNSUPPORTED, 1);
+            ExitReason ret;
+            ret.code = ExitCode::FAULT;
+            return ret;
+        }
+        if (kick_pending) {
+            store();
+            if (handle_kick(vm)) {
+                ExitReason ret;
+                ret.code = ExitCode::KICKED;
+                return ret;
+            }
+        }
+        /* traps, and code too close to a wrap-around to translate */
+        if ((fl & F_TF) || ip > 0xffff - 32 || lin(S_CS, ip) > MEM_MASK - 32) {
+            chain_site = nullptr;
+            if (execute(vm, true)) {
+                break;
+            }
+            continue;
+        }
+        Block *blk = lookup(s[S_CS], ip);
+        if (chain_site) {
+            patch(chain_site, blk->entry);
+        }
+        if (tc_enter(this, mem, blk->entry) == EXIT_HLT) {
+            break;
+        }
+    }
+
+    ExitReason ret;
+    store();
+    decode_hlt_exit(vm->addr_config, this, &ret);
+    return ret;
+}
+
+uint32_t jit_rd16(JitCPU *cpu, uint32_t seg, uint32_t off) {
+    return cpu->rd16(seg, off);
+}
+
+uint32_t jit_wr8(JitCPU *cpu, uint32_t seg, uint32_t off, uint32_t v) {
+    cpu->code_written = false;
+    cpu->wr8(seg, off, v);
+    return cpu->code_written;
+}
+
+uint32_t jit_wr16(JitCPU *cpu, uint32_t seg, uint32_t off, uint32_t v) {
+    cpu->code_written = false;
+    cpu->wr16(seg, off, v);
+    return cpu->code_written;
+}
+
+/* one instruction in the interpreter; non-zero to leave the block */
+uint32_t jit_step(JitCPU *cpu, uint32_t next_ip) {
+    uint16_t cs = cpu->s[S_CS];
+
+    cpu->code_written = false;
+    if (cpu->execute(cpu->vm, true)) {
+        cpu->ip--;  // HLT is left to the translated code
+        return 1;
+    }
+    return cpu->code_written || cpu->ip != next_ip || cpu->s[S_CS] != cs ||
+           (cpu->fl & F_TF) || (cpu->kick_pending & KICK_FAULT);
+}
+
+}  // namespace
+
+std::unique_ptr<CPU> create_jit_cpu() {
+    auto cpu = std::make_unique<JitCPU>();
+    if (!cpu->tc) {
+        return create_interp_cpu();
+    }
+    return cpu;
+}
+
+#else
+
+std::unique_ptr<CPU> create_jit_cpu() { return create_interp_cpu(); }
+
+#endif
@@ -0,0 +1,287 @@
+#include "overlay.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "floppy.hpp"
+
+namespace {
+
+bool bit(const std::vector<uint8_t> &bitmap, size_t i) {
+    return bitmap[i / 8] & (1 << (i % 8));
+}
+
+/* the image at fd mapped, for a hash or a commit; null after perror() */
+uint8_t *map_image(int fd, size_t size, bool writable, const char *what) {
+    void *p = mmap(nullptr, size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                   MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        perror(what);
+        return nullptr;
+    }
+    return (uint8_t *)p;
+}
+
+}  // namespace
+
+bool Overlay::detect(int fd) {
+    char magic[8];
+    return pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+           memcmp(magic, OverlayHeader::MAGIC, sizeof(magic)) == 0;
+}
+
+std::unique_ptr<Overlay> Overlay::open(const std::string &path) {
+    std::unique_ptr<Overlay> o(new Overlay);
+    o->path = path;
+    o->fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (o->fd < 0) {
+        perror(path.c_str());
+        return nullptr;
+    }
+    auto &hdr = o->hdr;
+    if (pread(o->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        memcmp(hdr.magic, OverlayHeader::MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != OverlayHeader::VERSION ||
+        memchr(hdr.base, '\0', sizeof(hdr.base)) == nullptr) {
+        fprintf(stderr, "%s: not an overlay image\n", path.c_str());
+        return nullptr;
+    }
+    /* apply() writes every sector it has into an image of the base's size */
+    struct stat st;
+    if (stat(hdr.base, &st) < 0) {
+        perror(hdr.base);
+        return nullptr;
+    }
+    if (hdr.num_sectors == 0 ||
+        (uint64_t)st.st_size != (uint64_t)hdr.num_sectors * 512) {
+        fprintf(stderr, "%s: %s is not %u sectors\n", path.c_str(),
+                hdr.base, hdr.num_sectors);
+        return nullptr;
+    }
+    o->bitmap.resize((hdr.num_sectors + 7) / 8);
+    if (pread(o->fd, o->bitmap.data(), o->bitmap.size(), 512) !=
+        (ssize_t)o->bitmap.size()) {
+        fprintf(stderr, "%s: short overlay image\n", path.c_str());
+        return nullptr;
+    }
+    o->dirty.resize(hdr.num_sectors);
+    return o;
+}
+
+Overlay::~Overlay() {
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+size_t Overlay::data_offset() const {
+    /* the bitmap rounded up to whole sectors */
+    return 512 + (bitmap.size() + 511) / 512 * 512;
+}
+
+bool Overlay::apply(uint8_t *image, size_t size) const {
+    if (size != (size_t)hdr.num_sectors * 512) {
+        fprintf(stderr, "%s: base is not %u sectors\n", path.c_str(),
+                hdr.num_sectors);
+        return false;
+    }
+    for (size_t i = 0; i < hdr.num_sectors; i++) {
+        if (bit(bitmap, i) && pread(fd, image + i * 512, 512,
+                                    data_offset() + i * 512) != 512) {
+            perror(path.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+void Overlay::mark(size_t lba, size_t count) {
+    for (size_t i = lba; i < lba + count && i < dirty.size(); i++) {
+        if (!dirty[i]) {
+            dirty[i] = true;
+            num_dirty++;
+        }
+    }
+}
+
+bool Overlay::write_bitmap() {
+    if (pwrite(fd, bitmap.data(), bitmap.size(), 512) !=
+        (ssize_t)bitmap.size()) {
+        perror(path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool Overlay::sync(const uint8_t *image) {
+    if (num_dirty == 0) {
+        return true;
+    }
+    /* sectors first, so a set bit never points at a hole */
+    for (size_t i = 0; i < dirty.size();) {
+        if (!dirty[i]) {
+            i++;
+            continue;
+        }
+        size_t end = i;
+        while (end < dirty.size() && dirty[end]) {
+            dirty[end] = false;
+            bitmap[end / 8] |= 1 << (end % 8);
+            end++;
+        }
+        size_t len = (end - i) * 512;
+        if (pwrite(fd, image + i * 512, len, data_offset() + i * 512) !=
+            (ssize_t)len) {
+            perror(path.c_str());
+            return false;
+        }
+        i = end;
+    }
+    num_dirty = 0;
+    return fdatasync(fd) == 0 && write_bitmap();
+}
+
+bool Overlay::commit() {
+    int base_fd = ::open(hdr.base, O_RDWR | O_CLOEXEC);
+    if (base_fd < 0) {
+        perror(hdr.base);
+        return false;
+    }
+    /* every session on the base holds it shared, and maps it privately:
+     * pages it has not touched yet would change under it */
+    if (flock(base_fd, LOCK_EX | LOCK_NB) < 0) {
+        if (errno == EWOULDBLOCK) {
+            fprintf(stderr, "%s: in use by a session, not committed\n",
+                    hdr.base);
+        } else {
+            perror(hdr.base);
+        }
+        close(base_fd);
+        return false;
+    }
+    size_t size = (size_t)hdr.num_sectors * 512;
+    uint8_t *image = map_image(base_fd, size, true, hdr.base);
+    if (!image) {
+        close(base_fd);
+        return false;
+    }
+    bool ok = image_hash(image, size) == hdr.base_hash;
+    if (!ok) {
+        fprintf(stderr, "%s: changed since %s was made\n", hdr.base,
+                path.c_str());
+    }
+    ok = ok && apply(image, size);
+    if (ok && msync(image, size, MS_SYNC) < 0) {
+        perror(hdr.base);
+        ok = false;
+    }
+    munmap(image, size);
+    ok = ok && discard();
+    close(base_fd);  // and the lock with it
+    return ok;
+}
+
+bool Overlay::discard() {
+    std::fill(bitmap.begin(), bitmap.end(), 0);
+    std::fill(dirty.begin(), dirty.end(), false);
+    num_dirty = 0;
+    /* the bits first, then the sectors they pointed at */
+    if (!write_bitmap() || ftruncate(fd, data_offset()) < 0) {
+        perror(path.c_str());
+        return false;
+    }
+
+    /* empty, it fits the base as it is now */
+    int base_fd = ::open(hdr.base, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (base_fd < 0 || fstat(base_fd, &st) < 0) {
+        perror(hdr.base);
+        if (base_fd >= 0) {
+            close(base_fd);
+        }
+        return false;
+    }
+    if ((size_t)st.st_size != (size_t)hdr.num_sectors * 512) {
+        fprintf(stderr, "%s: no longer %u sectors\n", hdr.base,
+                hdr.num_sectors);
+        close(base_fd);
+        return false;
+    }
+    uint8_t *image = map_image(base_fd, st.st_size, false, hdr.base);
+    close(base_fd);
+    if (!image) {
+        return false;
+    }
+    hdr.base_hash = image_hash(image, st.st_size);
+    munmap(image, st.st_size);
+    if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+        perror(path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool create_overlay(const std::string &path, const std::string &base) {
+    char real[PATH_MAX];
+    if (!realpath(base.c_str(), real)) {
+        perror(base.c_str());
+        return false;
+    }
+    OverlayHeader hdr = {};
+    if (strlen(real) >= sizeof(hdr.base)) {
+        fprintf(stderr, "%s: path too long for an overlay\n", real);
+        return false;
+    }
+    int base_fd = ::open(real, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (base_fd < 0 || fstat(base_fd, &st) < 0) {
+        perror(real);
+        if (base_fd >= 0) {
+            close(base_fd);
+        }
+        return false;
+    }
+    if (st.st_size == 0 || st.st_size % 512 != 0 || Overlay::detect(base_fd)) {
+        fprintf(stderr, "%s: not a floppy image\n", real);
+        close(base_fd);
+        return false;
+    }
+    uint8_t *image = map_image(base_fd, st.st_size, false, real);
+    close(base_fd);
+    if (!image) {
+        return false;
+    }
+    memcpy(hdr.magic, OverlayHeader::MAGIC, sizeof(hdr.magic));
+    hdr.version = OverlayHeader::VERSION;
+    hdr.num_sectors = st.st_size / 512;
+    hdr.base_hash = image_hash(image, st.st_size);
+    strcpy(hdr.base, real);
+    munmap(image, st.st_size);
+
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                    0644);
+    if (fd < 0) {
+        perror(path.c_str());
+        return false;
+    }
+    /* the bitmap is all holes, that is all zeros */
+    size_t bitmap_size = (hdr.num_sectors + 7) / 8;
+    size_t data_offset = 512 + (bitmap_size + 511) / 512 * 512;
+    bool ok = pwrite(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+              ftruncate(fd, data_offset) == 0;
+    if (!ok) {
+        perror(path.c_str());
+    }
+    close(fd);
+    return ok;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+/*
+ * A copy-on-write floppy: a sparse file with the sectors written since it
+ * was made, over a base image that is only read.  Any number of sessions
+ * boot from one base, each with its own overlay, and pay only for the
+ * sectors they write.  Pass the overlay where an image goes.
+ *
+ *     sector 0    OverlayHeader
+ *     sector 1..  one bit per disk sector, set when the overlay has it
+ *     then        disk sector i at data_offset() + i * 512, holes elsewhere
+ *
+ * The header keeps the base's path, size and content hash; an overlay whose
+ * base has changed since does not open.
+ */
+struct OverlayHeader {
+    static constexpr char MAGIC[8] = {'D', 'O', 'S', 'V', 'M', 'O', 'V', 'L'};
+    static constexpr uint32_t VERSION = 1;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t num_sectors;
+    uint64_t base_hash;  // Floppy::content_hash() of the base
+    char base[488];      // absolute path, NUL-terminated
+};
+static_assert(sizeof(OverlayHeader) == 512, "one sector");
+
+class Overlay {
+   public:
+    /* null, with the reason on stderr, if path is no overlay */
+    static std::unique_ptr<Overlay> open(const std::string &path);
+    ~Overlay();
+    Overlay(const Overlay &) = delete;
+    Overlay &operator=(const Overlay &) = delete;
+
+    /* the first bytes of the file at fd are an overlay header */
+    static bool detect(int fd);
+
+    const char *base() const { return hdr.base; }
+    uint64_t base_hash() const { return hdr.base_hash; }
+
+    /* copy the overlay's sectors over image, the base's size bytes */
+    bool apply(uint8_t *image, size_t size) const;
+    /* sectors [lba, lba + count) of image were written */
+    void mark(size_t lba, size_t count);
+    /* write the marked sectors of image and their bits */
+    bool sync(const uint8_t *image);
+
+    /* write the overlay's sectors into the base and empty it; refused
+     * while any session has the base open (Floppy holds a shared flock) */
+    bool commit();
+    /* forget every sector written, and take the base as it is now */
+    bool discard();
+
+   private:
+    Overlay() = default;
+    size_t data_offset() const;
+    bool write_bitmap();
+
+    std::string path;
+    int fd = -1;
+    OverlayHeader hdr;
+    std::vector<uint8_t> bitmap;  // as on disk
+    std::vector<bool> dirty;      // written, not synced
+    size_t num_dirty = 0;
+};
+
+/* an empty overlay at path over base */
+bool create_overlay(const std::string &path, const std::string &base);
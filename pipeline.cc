@@ -0,0 +1,218 @@
+#include "pipeline.hpp"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <map>
+
+#include "dosvm.hpp"
+
+namespace {
+
+/*
+ * Host side of a pipeline: the console and files the stages only read are
+ * the host's, every file they write is a memfd.  Each open of one gets its
+ * own description through /proc/self/fd, so handles keep their own
+ * position and the guest closing them leaves the file.
+ */
+struct OverlayIO : HostIO {
+    struct File {
+        int memfd;
+        std::string name;  // as the guest first wrote it
+        int stage;         // that last opened it to write
+        int dirfd;         // name is under this --drive root, or AT_FDCWD
+        std::string path;  // and this is it there
+    };
+    std::map<std::string, File> files;  // by upper-case name
+    int stage = 0;
+
+    ~OverlayIO() {
+        for (auto &f : files) {
+            ::close(f.second.memfd);
+            if (f.second.dirfd >= 0) {
+                ::close(f.second.dirfd);
+            }
+        }
+    }
+
+    static std::string key(const std::string &path) {
+        std::string k;
+        for (char c : path) {
+            k += c == '\\' ? '/' : toupper((unsigned char)c);
+        }
+        return k;
+    }
+
+    /* the host's own file, only ever read or written out */
+    static int host_open(int dirfd, const char *path, int flags,
+                         mode_t mode) {
+        if (dirfd == AT_FDCWD) {
+            return ::open(path, flags | O_CLOEXEC, mode);
+        }
+        return open_beneath(dirfd, path, flags | O_CLOEXEC, mode);
+    }
+
+    int open(const char *path, int flags, mode_t mode) override {
+        return open_file(AT_FDCWD, path, path, flags, mode);
+    }
+    int openat(int dirfd, const char *path, int flags, mode_t mode) override {
+        return open_file(dirfd, path, beneath_path(dirfd, path), flags, mode);
+    }
+
+    int open_file(int dirfd, const char *path, const std::string &name,
+                  int flags, mode_t mode) {
+        std::string k = key(name);
+        auto it = files.find(k);
+        bool writing = (flags & O_ACCMODE) != O_RDONLY;
+        if (it == files.end()) {
+            if (!writing) {
+                return host_open(dirfd, path, flags, mode);
+            }
+            /* the host's file, if any, is only read from here on */
+            int memfd = memfd_create(k.c_str(), MFD_CLOEXEC);
+            if (memfd < 0) {
+                return -1;
+            }
+            int host = host_open(dirfd, path, O_RDONLY, 0);
+            if (host >= 0) {
+                bool ok = !(flags & O_TRUNC) ? copy(host, memfd) : true;
+                ::close(host);
+                if (!ok) {
+                    ::close(memfd);
+                    return -1;
+                }
+            } else if (!(flags & O_CREAT) || errno != ENOENT) {
+                ::close(memfd);
+                return -1;
+            }
+            /* kept to write it out, after the drive is gone */
+            int dir = dirfd == AT_FDCWD ? AT_FDCWD
+                                        : fcntl(dirfd, F_DUPFD_CLOEXEC, 0);
+            if (dirfd != AT_FDCWD && dir < 0) {
+                ::close(memfd);
+                return -1;
+            }
+            it = files.emplace(k, File{memfd, name, stage, dir, path}).first;
+        } else if (writing) {
+            if ((flags & O_TRUNC) && ftruncate(it->second.memfd, 0) < 0) {
+                return -1;
+            }
+            it->second.stage = stage;
+        }
+        char proc[32];
+        snprintf(proc, sizeof(proc), "/proc/self/fd/%d", it->second.memfd);
+        return ::open(proc, (flags & ~(O_CREAT | O_TRUNC)) | O_CLOEXEC);
+    }
+
+    /* all of from, from its start, appended to to */
+    static bool copy(int from, int to) {
+        char buf[65536];
+        off_t off = 0;
+        ssize_t n;
+        while ((n = pread(from, buf, sizeof(buf), off)) > 0) {
+            if (::write(to, buf, n) != n) {
+                return false;
+            }
+            off += n;
+        }
+        return n == 0;
+    }
+
+    /* put f on the disk under its name */
+    static bool write_out(const File &f) {
+        int fd = host_open(f.dirfd, f.path.c_str(),
+                           O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            perror(f.name.c_str());
+            return false;
+        }
+        bool ok = copy(f.memfd, fd);
+        if (!ok) {
+            perror(f.name.c_str());
+        }
+        if (::close(fd) < 0 && ok) {
+            perror(f.name.c_str());
+            ok = false;
+        }
+        return ok;
+    }
+};
+
+}  // namespace
+
+int pipeline_main(const std::vector<std::string> &stages,
+                  const std::vector<std::string> &outputs, Backend backend,
+                  const RunOptions &opts) {
+    std::string error;
+    auto vm = create_vm(backend, &error);
+    if (!vm) {
+        fprintf(stderr, "%s\n", error.c_str());
+        return 1;
+    }
+    OverlayIO io;
+    vm->set_io(&io);
+
+    int status = 0;
+    for (size_t i = 0; i < stages.size() && status == 0; i++) {
+        const std::string &stage = stages[i];
+        size_t n = stage.find_first_of(" \t");
+        std::string program = stage.substr(0, n);
+        size_t at = stage.find_first_not_of(" \t", n);
+        std::string args = at == std::string::npos ? "" : stage.substr(at);
+
+        if (i > 0) {
+            vm->reset();
+        }
+        io.stage = i;
+        status = 1;
+        if (load_program(vm.get(), program.c_str(), args, opts)) {
+            StopReason r = run_vm(vm.get());
+            status = vm->exit_status;
+            if (r != StopReason::DOS_EXIT && status == 0) {
+                status = 1;
+            }
+            if (status != 0) {
+                fprintf(stderr, "%s: stage %zu failed: %s, status %d\n",
+                        program.c_str(), i + 1, stop_reason_name(r), status);
+            }
+        }
+    }
+    vm->set_io(nullptr);
+    if (status != 0) {
+        return status;  // nothing written
+    }
+
+    if (outputs.empty()) {
+        for (auto &f : io.files) {
+            if (f.second.stage == (int)stages.size() - 1 &&
+                !OverlayIO::write_out(f.second)) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+    for (const auto &name : outputs) {
+        auto it = io.files.find(OverlayIO::key(name));
+        if (it == io.files.end()) {
+            fprintf(stderr, "%s: no stage created it\n", name.c_str());
+            return 1;
+        }
+        /* as the command line names it, not the guest */
+        OverlayIO::File &f = it->second;
+        if (f.dirfd >= 0) {
+            ::close(f.dirfd);
+        }
+        f.name = name;
+        f.dirfd = AT_FDCWD;
+        f.path = name;
+        if (!OverlayIO::write_out(f)) {
+            return 1;
+        }
+    }
+    return 0;
+}
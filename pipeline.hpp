@@ -0,0 +1,24 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "vm.hpp"
+
+/*
+ * vm --pipeline [--output=FILE]... 'PROGRAM [ARGS]'... runs the stages one
+ * after another on one VM, reset() between them, as a build step like
+ *
+ *     vm --pipeline 'MASM.EXE X;' 'LINK.EXE X;' 'EXE2BIN.EXE X'
+ *
+ * Files the stages create (AH=3Ch, or open to write) live in memory and
+ * shadow the host's for the later stages; nothing reaches the disk but the
+ * outputs, written once every stage has exited 0.  Without --output those
+ * are the files the last stage created.  --timeline, --stats and the like
+ * are per run, so they describe the last stage.
+ */
+
+/* 0, or the status of the first stage that failed */
+int pipeline_main(const std::vector<std::string> &stages,
+                  const std::vector<std::string> &outputs, Backend backend,
+                  const RunOptions &opts);
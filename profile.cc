@@ -0,0 +1,277 @@
+#include "profile.hpp"
+
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <mutex>
+#include <set>
+
+#include "vm.hpp"
+
+namespace {
+
+constexpr int MAX_DEPTH = 32;
+constexpr int SCAN_WORDS = 128;  // how far up the stack to look
+
+std::mutex live_lock;
+Profiler *live_head = nullptr;
+bool atexit_installed = false;
+
+thread_local CPU *profiled_cpu = nullptr;
+
+void on_sigprof(int) {
+    CPU *cpu = profiled_cpu;
+    if (cpu) {
+        cpu->kick_pending |= KICK_SAMPLE;
+        if (cpu->immediate_exit) {
+            *cpu->immediate_exit = 1;
+        }
+    }
+}
+
+uint8_t rd8(const VM *vm, uint16_t seg, uint16_t off) {
+    return vm->full_mem[((uint32_t)seg * 16 + off) & 0xfffff];
+}
+
+uint16_t rd16(const VM *vm, uint16_t seg, uint16_t off) {
+    return rd8(vm, seg, off) | rd8(vm, seg, off + 1) << 8;
+}
+
+/* length of an FF /n instruction with this ModRM, in bytes */
+int ff_len(uint8_t modrm) {
+    int mod = modrm >> 6;
+    if (mod == 3) {
+        return 2;
+    }
+    if (mod == 0) {
+        return (modrm & 7) == 6 ? 4 : 2;
+    }
+    return mod == 1 ? 3 : 4;
+}
+
+/* seg:off is right after a CALL FF with this /reg */
+bool after_ff_call(const VM *vm, uint16_t seg, uint16_t off, int reg) {
+    for (int len = 2; len <= 4; len++) {
+        uint8_t modrm = rd8(vm, seg, off - len + 1);
+        if (rd8(vm, seg, off - len) == 0xff && ((modrm >> 3) & 7) == reg &&
+            ff_len(modrm) == len && (reg == 2 || modrm >> 6 != 3)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool is_near_return(const VM *vm, uint16_t seg, uint16_t off) {
+    return rd8(vm, seg, off - 3) == 0xe8 || after_ff_call(vm, seg, off, 2);
+}
+
+bool is_far_return(const VM *vm, uint16_t seg, uint16_t off) {
+    return rd8(vm, seg, off - 5) == 0x9a || after_ff_call(vm, seg, off, 3);
+}
+
+}  // namespace
+
+bool load_dos_map(const std::string &path, uint16_t base_seg,
+                  std::map<int, std::string> *map) {
+    FILE *fp = fopen(path.c_str(), "r");
+    if (!fp) {
+        perror(path.c_str());
+        return false;
+    }
+    char line[256];
+    bool in_publics = false;
+    while (fgets(line, sizeof(line), fp)) {
+        if (strstr(line, "Publics by Value")) {
+            in_publics = true;
+            continue;
+        }
+        if (!in_publics) {
+            continue;
+        }
+        unsigned seg, off;
+        char name[128];
+        if (sscanf(line, " %x:%x %127s", &seg, &off, name) == 3) {
+            if (strcmp(name, "Abs") == 0) {
+                continue;  // absolute symbols are not code
+            }
+            (*map)[((base_seg + seg) * 16 + off) & 0xfffff] = name;
+        } else if (!map->empty() && strchr(line, ':')) {
+            break;  // "Program entry point at ..."
+        }
+    }
+    fclose(fp);
+    return true;
+}
+
+Profiler::Profiler(int hz, const std::string &folded_path,
+                   const std::map<int, std::string> &symbols)
+    : hz(hz), folded_path(folded_path) {
+    for (auto &s : symbols) {
+        index.push_back({(uint32_t)s.first, &s.second});
+    }
+    /* std::map iterates in key order, so index is already sorted */
+
+    std::lock_guard<std::mutex> lk(live_lock);
+    if (!atexit_installed) {
+        atexit(Profiler::finish_all);
+        atexit_installed = true;
+    }
+    next_live = live_head;
+    if (live_head) {
+        live_head->prev_live = this;
+    }
+    live_head = this;
+}
+
+Profiler::~Profiler() {
+    finish();
+
+    std::lock_guard<std::mutex> lk(live_lock);
+    if (prev_live) {
+        prev_live->next_live = next_live;
+    } else if (live_head == this) {
+        live_head = next_live;
+    }
+    if (next_live) {
+        next_live->prev_live = prev_live;
+    }
+}
+
+void Profiler::finish_all() {
+    std::lock_guard<std::mutex> lk(live_lock);
+    for (Profiler *p = live_head; p; p = p->next_live) {
+        p->finish();
+    }
+}
+
+bool Profiler::start(CPU *cpu) {
+    profiled_cpu = cpu;
+
+    struct sigaction sa = {};
+    sa.sa_handler = on_sigprof;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, nullptr);
+
+    struct sigevent sev = {};
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = SIGPROF;
+    sev._sigev_un._tid = syscall(SYS_gettid);  // sigev_notify_thread_id
+    timer_t t;
+    if (timer_create(CLOCK_MONOTONIC, &sev, &t) < 0) {
+        perror("timer_create");
+        profiled_cpu = nullptr;
+        return false;
+    }
+    long ns = 1000000000L / (hz > 0 ? hz : 1);
+    struct itimerspec its = {};
+    its.it_interval.tv_sec = ns / 1000000000L;
+    its.it_interval.tv_nsec = ns % 1000000000L;
+    its.it_value = its.it_interval;
+    timer_settime(t, 0, &its, nullptr);
+    timer = t;
+    armed = true;
+    return true;
+}
+
+void Profiler::sample(const VM *vm) {
+    const CPU *cpu = vm->cpu.get();
+
+    uint32_t frames[MAX_DEPTH];
+    int depth = 0;
+    uint16_t cs = cpu->sregs.cs.selector;
+    frames[depth++] = (uint32_t)cs << 16 | (uint16_t)cpu->regs.rip;
+
+    uint16_t ss = cpu->sregs.ss.selector;
+    uint16_t sp = (uint16_t)cpu->regs.rsp;
+    for (int i = 0; i < SCAN_WORDS && depth < MAX_DEPTH; i++) {
+        uint16_t off = rd16(vm, ss, sp + 2 * i);
+        uint16_t seg = rd16(vm, ss, sp + 2 * i + 2);
+        if (is_near_return(vm, cs, off)) {
+            frames[depth++] = (uint32_t)cs << 16 | off;
+        } else if (is_far_return(vm, seg, off)) {
+            frames[depth++] = (uint32_t)seg << 16 | off;
+            cs = seg;  // near returns beyond this are in the caller's CS
+            i++;
+        }
+    }
+
+    stacks[std::string((const char *)frames, depth * sizeof(frames[0]))]++;
+    total++;
+}
+
+std::string Profiler::symbolize(uint32_t frame) const {
+    uint32_t lin = ((frame >> 16) * 16 + (frame & 0xffff)) & 0xfffff;
+    auto it = std::upper_bound(
+        index.begin(), index.end(), lin,
+        [](uint32_t a, const std::pair<uint32_t, const std::string *> &s) {
+            return a < s.first;
+        });
+    if (it != index.begin() && lin - (it - 1)->first < 0x10000) {
+        return *(it - 1)->second;
+    }
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%04X:%04X", frame >> 16, frame & 0xffff);
+    return buf;
+}
+
+void Profiler::finish() {
+    if (finished) {
+        return;
+    }
+    finished = true;
+    if (armed) {
+        timer_delete((timer_t)timer);
+        profiled_cpu = nullptr;
+    }
+
+    std::map<std::string, uint64_t> self, inclusive, folded;
+    for (auto &s : stacks) {
+        const uint32_t *frames = (const uint32_t *)s.first.data();
+        int depth = s.first.size() / sizeof(uint32_t);
+
+        self[symbolize(frames[0])] += s.second;
+        std::set<std::string> seen;
+        std::string line;
+        for (int i = depth - 1; i >= 0; i--) {
+            std::string name = symbolize(frames[i]);
+            if (seen.insert(name).second) {
+                inclusive[name] += s.second;
+            }
+            line += name;
+            line += i ? ";" : "";
+        }
+        folded[line] += s.second;
+    }
+
+    std::vector<std::pair<uint64_t, std::string>> rows;
+    for (auto &s : self) {
+        rows.push_back({s.second, s.first});
+    }
+    std::sort(rows.begin(), rows.end(), std::greater<>());
+    fprintf(stderr, "%llu samples at %d Hz\n", (unsigned long long)total, hz);
+    fprintf(stderr, "%7s %9s %7s %9s  %s\n", "self%", "self", "total%",
+            "total", "symbol");
+    double pct = total ? 100.0 / total : 0;
+    for (size_t i = 0; i < rows.size() && i < 30; i++) {
+        uint64_t incl = inclusive[rows[i].second];
+        fprintf(stderr, "%6.2f%% %9llu %6.2f%% %9llu  %s\n",
+                rows[i].first * pct, (unsigned long long)rows[i].first,
+                incl * pct, (unsigned long long)incl, rows[i].second.c_str());
+    }
+
+    FILE *fp = fopen(folded_path.c_str(), "w");
+    if (!fp) {
+        perror(folded_path.c_str());
+        return;
+    }
+    for (auto &f : folded) {
+        fprintf(fp, "%s %llu\n", f.first.c_str(), (unsigned long long)f.second);
+    }
+    fclose(fp);
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+struct CPU;
+struct VM;
+
+/*
+ * Sampling profiler for guest code, vm --profile=FILE.  A CLOCK_MONOTONIC
+ * timer sends SIGPROF to the vCPU thread; the handler only raises
+ * CPU::sample_pending (and KVM's immediate_exit), and the backend calls
+ * sample() at the next instruction or block boundary.
+ *
+ * A sample is CS:IP plus the return addresses found by scanning the stack
+ * for words that point just past a CALL, so stacks are a heuristic.  At
+ * exit a flat profile goes to stderr and folded stacks ("a;b;c count",
+ * outermost frame first) to FILE, for flamegraph.pl and friends.
+ */
+
+/*
+ * Read the "Publics by Value" section of a LINK .MAP file into map, keyed
+ * by linear address with the image loaded at base_seg.  false if the file
+ * can't be read.
+ */
+bool load_dos_map(const std::string &path, uint16_t base_seg,
+                  std::map<int, std::string> *map);
+
+class Profiler {
+   public:
+    Profiler(int hz, const std::string &folded_path,
+             const std::map<int, std::string> &symbols);
+    ~Profiler();
+    Profiler(const Profiler &) = delete;
+    Profiler &operator=(const Profiler &) = delete;
+
+    /* arm the timer for the calling thread, which runs cpu; false if it
+     * can't be created */
+    bool start(CPU *cpu);
+    void sample(const VM *vm);
+
+    /* stop the timer and write the reports, once */
+    void finish();
+    /* finish every live Profiler, installed with atexit() */
+    static void finish_all();
+
+   private:
+    std::string symbolize(uint32_t frame) const;
+
+    int hz;
+    std::string folded_path;
+    /* sorted by address, built from the symbol map */
+    std::vector<std::pair<uint32_t, const std::string *>> index;
+    std::unordered_map<std::string, uint64_t> stacks;  // packed frames
+    uint64_t total = 0;
+    bool armed = false;
+    bool finished = false;
+    void *timer = nullptr;  // timer_t
+
+    Profiler *next_live = nullptr;  // for the atexit drain
+    Profiler *prev_live = nullptr;
+};
@@ -0,0 +1,193 @@
+/*
+ * Paravirtual console device.
+ *
+ * Guest text output is written with OUT to CONSOLE_PORT. The port is
+ * registered as a coalesced PIO zone, so KVM queues the writes in the
+ * coalesced ring instead of exiting; the ring is drained into vm->console
+ * after every KVM_RUN. If the ring fills up, KVM falls back to a normal
+ * KVM_EXIT_IO which run() hands to console_device_io(). The interpreter
+ * backend puts the byte straight into vm->console.
+ *
+ * The writers are small ROM stubs at F000:1000 that take over the
+ * text-output functions of INT 10h and INT 21h and jump to the usual
+ * F000:00nn hlt for everything else, and two 3-byte stubs in the DOS
+ * driver's jump table for BIOSSTAT and BIOSOUT.  AH=40h writes of more
+ * than 16 bytes take the hlt: an OUT per byte would overrun the ring.
+ * Once handle 1 is closed, all of them do, until the handles are wired again.
+ */
+#include "dosdriver.h"
+#include "vm.hpp"
+
+namespace {
+
+constexpr uintptr_t ROM_SEG = 0xf000;
+constexpr uintptr_t ROM_STUB_OFFSET = 0x1000;
+constexpr uintptr_t ROM_INT10_OFFSET = 0x1000;
+constexpr uintptr_t ROM_INT21_OFFSET = 0x1020;
+constexpr size_t C40_JNE = 0x54;  // jne slow after cmp bx, 1
+
+// clang-format off
+constexpr uint8_t rom_stub[] = {
+    /* F000:1000 int 10h */
+    0x80, 0xfc, 0x0e,        // cmp  ah, 0eh
+    0x75, 0x04,              // jne  1009
+    0xe6, 0xe9,              // out  CONSOLE_PORT, al
+    0xeb, 0x62,              // jmp  done
+    0xe9, 0x04, 0xf0,        // jmp  0010                 ; hlt, int 10h
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00,
+    /* F000:1020 int 21h */
+    0x80, 0xfc, 0x02,        // cmp  ah, 02h
+    0x74, 0x0d,              // je   c02
+    0x80, 0xfc, 0x09,        // cmp  ah, 09h
+    0x74, 0x10,              // je   c09
+    0x80, 0xfc, 0x40,        // cmp  ah, 40h
+    0x74, 0x22,              // je   c40
+    0xe9, 0xef, 0xef,        // slow: jmp 0021            ; hlt, int 21h
+    0x50,                    // c02: push ax
+    0x88, 0xd0,              //      mov  al, dl
+    0xe6, 0xe9,              //      out  CONSOLE_PORT, al
+    0x58,                    //      pop  ax
+    0xeb, 0x31,              //      jmp  done
+    0x56,                    // c09: push si
+    0x89, 0xd6,              //      mov  si, dx
+    0xfc,                    //      cld
+    0xac,                    // 1:   lodsb
+    0x3c, 0x24,              //      cmp  al, '$'
+    0x74, 0x04,              //      je   2f
+    0xe6, 0xe9,              //      out  CONSOLE_PORT, al
+    0xeb, 0xf7,              //      jmp  1b
+    0xb0, 0x0a,              // 2:   mov  al, 0ah         ; as the host does
+    0xe6, 0xe9,              //      out  CONSOLE_PORT, al
+    0xb8, 0x24, 0x00,        //      mov  ax, 0024h
+    0x5e,                    //      pop  si
+    0xeb, 0x1a,              //      jmp  done
+    0x83, 0xfb, 0x01,        // c40: cmp  bx, 1           ; stdout only
+    0x75, 0xd9,              //      jne  slow
+    0x83, 0xf9, 0x10,        //      cmp  cx, 16          ; longer: one exit
+    0x77, 0xd4,              //      ja   slow
+    0x56,                    //      push si
+    0x51,                    //      push cx
+    0x89, 0xd6,              //      mov  si, dx
+    0xfc,                    //      cld
+    0xe3, 0x05,              //      jcxz 2f
+    0xac,                    // 1:   lodsb
+    0xe6, 0xe9,              //      out  CONSOLE_PORT, al
+    0xe2, 0xfb,              //      loop 1b
+    0x59,                    // 2:   pop  cx
+    0x5e,                    //      pop  si
+    0x89, 0xc8,              //      mov  ax, cx
+    0x55,                    // done: push bp
+    0x89, 0xe5,              //      mov  bp, sp
+    0x80, 0x66, 0x06, 0xfe,  //      and  byte [bp+6], 0feh  ; clear CF
+    0x5d,                    //      pop  bp
+    0xcf,                    //      iret
+};
+
+/* driver jump table entries are 3 bytes, just enough for these */
+const uint8_t drv_status_stub[3] = {
+    0x38, 0xc0,  // cmp al, al   ; ZF=1: no key pending, as the host answers
+    0xcb,        // retf
+};
+const uint8_t drv_outp_stub[3] = {
+    0xe6, 0xe9,  // out CONSOLE_PORT, al
+    0xcb,        // retf
+};
+// clang-format on
+
+static_assert(CONSOLE_PORT == 0xe9, "port is encoded in the stubs");
+static_assert(rom_stub[C40_JNE] == 0x75, "C40_JNE is the jne slow");
+
+}  // namespace
+
+void VM::enable_console_device() {
+    auto kvm_cpu = dynamic_cast<KvmCPU *>(cpu.get());
+    if (!kvm_cpu) {
+        console_device = true;  // the interpreter handles OUT itself
+        return;
+    }
+
+    int ring_page = ioctl(kvm_fd, KVM_CHECK_EXTENSION, KVM_CAP_COALESCED_MMIO);
+    if (ring_page <= 0 ||
+        ioctl(kvm_fd, KVM_CHECK_EXTENSION, KVM_CAP_COALESCED_PIO) <= 0) {
+        return;
+    }
+
+    long page_size = sysconf(_SC_PAGESIZE);
+    if ((size_t)(ring_page + 1) * page_size > kvm_cpu->vcpu_region_size) {
+        return;
+    }
+
+    struct kvm_coalesced_mmio_zone zone = {};
+    zone.addr = CONSOLE_PORT;
+    zone.size = 1;
+    zone.pio = 1;
+    if (ioctl(vm_fd, KVM_REGISTER_COALESCED_MMIO, &zone) < 0) {
+        return;
+    }
+
+    console_ring = (struct kvm_coalesced_mmio_ring *)((char *)kvm_cpu->run_data +
+                                                      ring_page * page_size);
+    console_ring_max =
+        (page_size - sizeof(struct kvm_coalesced_mmio_ring)) /
+        sizeof(struct kvm_coalesced_mmio);
+    console_device = true;
+}
+
+void install_console_stubs(VM *vm) {
+    if (!vm->console_device) {
+        return;  // every OUT would exit, the hlt path is just as fast
+    }
+
+    auto full_mem = vm->full_mem;
+    memcpy(full_mem + ROM_SEG * 16 + ROM_STUB_OFFSET, rom_stub,
+           sizeof(rom_stub));
+    *(uint16_t *)(full_mem + 0x10 * 4 + 0) = ROM_INT10_OFFSET;
+    *(uint16_t *)(full_mem + 0x21 * 4 + 0) = ROM_INT21_OFFSET;
+
+    if (vm->run_mode == RUN_MODE::DOS_KERNEL) {
+        auto drv = full_mem + vm->addr_config.dos_io_seg * 16;
+        memcpy(drv + DOSIO_STATUS * 3, drv_status_stub, 3);
+        memcpy(drv + DOSIO_OUTP * 3, drv_outp_stub, 3);
+    }
+}
+
+void console_stub_stdout(VM *vm, bool con) {
+    /* with handle 1 closed, or a file by now, AH=40h BX=1 is for DOS */
+    auto stub = vm->full_mem + ROM_SEG * 16 + ROM_STUB_OFFSET;
+    if (!vm->console_device || memcmp(stub, rom_stub, C40_JNE) != 0) {
+        return;  // stubs not installed
+    }
+    stub[C40_JNE] = con ? 0x75 : 0xeb;  // jne slow, or jmp slow
+}
+
+void drain_console_device(VM *vm) {
+    auto ring = vm->console_ring;
+    if (!ring) {
+        return;
+    }
+
+    uint32_t first = ring->first;
+    uint32_t last = __atomic_load_n(&ring->last, __ATOMIC_ACQUIRE);
+    while (first != last) {
+        auto &ent = ring->coalesced_mmio[first];
+        if (ent.pio && ent.phys_addr == CONSOLE_PORT) {
+            for (uint32_t i = 0; i < ent.len; i++) {
+                vm->console.put(ent.data[i]);
+            }
+        }
+        first = (first + 1) % vm->console_ring_max;
+    }
+    __atomic_store_n(&ring->first, first, __ATOMIC_RELEASE);
+}
+
+void console_device_io(VM *vm) {
+    auto run_data = static_cast<KvmCPU *>(vm->cpu.get())->run_data;
+    auto data = (const uint8_t *)run_data + run_data->io.data_offset;
+    size_t len = (size_t)run_data->io.size * run_data->io.count;
+
+    for (size_t i = 0; i < len; i += run_data->io.size) {
+        vm->console.put(data[i]);  // low byte of each access
+    }
+}
@@ -0,0 +1,599 @@
+#include "server.hpp"
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+#include "dosvm.hpp"
+
+namespace {
+
+constexpr uint32_t JOB_MAGIC = 0x4a534f44;  // "DOSJ"
+constexpr size_t JOB_MAX_PAYLOAD = 8192;
+constexpr int JOB_NUM_FDS = 3;  // stdin, stdout, stderr
+/* idle deaths in a row before a worker slot is taken as unable to start */
+constexpr int MAX_IDLE_DEATHS = 3;
+
+/* payload is "cwd\0program\0argv\0", then "option\0value\0" for each
+ * RunOptions field the client set and a worker can apply */
+struct JobHeader {
+    uint32_t magic;
+    uint32_t payload_size;
+};
+
+struct JobResult {
+    int32_t status;  // exit code, or 128+signal
+    uint32_t job_id;
+    uint64_t wall_usec;
+    uint64_t user_usec;
+    uint64_t sys_usec;
+};
+
+struct Job {
+    int conn_fd = -1;
+    int fds[JOB_NUM_FDS] = {-1, -1, -1};
+    std::vector<char> payload;
+};
+
+struct Worker {
+    pid_t pid = -1;
+    int ctl_fd = -1;
+    bool busy = false;
+    int conn_fd = -1;
+    uint32_t job_id = 0;
+    struct timespec start;
+    std::string program;
+    int idle_deaths = 0;  // exits without a job since the last one
+};
+
+uint64_t usec_since(const struct timespec &start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) * 1000000ull +
+           (now.tv_nsec - start.tv_nsec) / 1000;
+}
+
+uint64_t tv_usec(const struct timeval &tv) {
+    return tv.tv_sec * 1000000ull + tv.tv_usec;
+}
+
+bool write_full(int fd, const void *buf, size_t len) {
+    auto p = (const char *)buf;
+    while (len > 0) {
+        ssize_t r = write(fd, p, len);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return false;
+        }
+        p += r;
+        len -= r;
+    }
+    return true;
+}
+
+bool read_full(int fd, void *buf, size_t len) {
+    auto p = (char *)buf;
+    while (len > 0) {
+        ssize_t r = read(fd, p, len);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return false;
+        }
+        p += r;
+        len -= r;
+    }
+    return true;
+}
+
+/* header + payload in one message, stdio fds attached as SCM_RIGHTS */
+bool send_job(int sock, const std::vector<char> &payload, const int *fds) {
+    JobHeader hdr = {JOB_MAGIC, (uint32_t)payload.size()};
+    struct iovec iov[2] = {{&hdr, sizeof(hdr)},
+                           {(void *)payload.data(), payload.size()}};
+
+    char cbuf[CMSG_SPACE(sizeof(int) * JOB_NUM_FDS)] = {};
+    struct msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * JOB_NUM_FDS);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * JOB_NUM_FDS);
+
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) ==
+           (ssize_t)(sizeof(hdr) + payload.size());
+}
+
+bool recv_job(int sock, Job *job) {
+    JobHeader hdr;
+    job->payload.resize(JOB_MAX_PAYLOAD);
+    struct iovec iov[2] = {{&hdr, sizeof(hdr)},
+                           {job->payload.data(), job->payload.size()}};
+
+    char cbuf[CMSG_SPACE(sizeof(int) * JOB_NUM_FDS)] = {};
+    struct msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    ssize_t r = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (r <= 0) {
+        return false;
+    }
+
+    int nfds = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(job->fds, CMSG_DATA(cmsg),
+                   sizeof(int) * std::min(nfds, JOB_NUM_FDS));
+        }
+    }
+
+    bool ok = (size_t)r >= sizeof(hdr) && hdr.magic == JOB_MAGIC &&
+              hdr.payload_size <= JOB_MAX_PAYLOAD &&
+              (size_t)r == sizeof(hdr) + hdr.payload_size &&
+              nfds == JOB_NUM_FDS && (msg.msg_flags & MSG_CTRUNC) == 0;
+    if (!ok) {
+        for (int i = 0; i < std::min(nfds, JOB_NUM_FDS); i++) {
+            close(job->fds[i]);
+            job->fds[i] = -1;
+        }
+        return false;
+    }
+    job->payload.resize(hdr.payload_size);
+    return true;
+}
+
+/* split "cwd\0program\0argv\0" and the options after them */
+bool parse_payload(const std::vector<char> &payload, std::string *cwd,
+                   std::string *program, std::string *dos_argv,
+                   RunOptions *opts) {
+    std::vector<std::string> fields;
+    for (size_t pos = 0; pos < payload.size();) {
+        auto end = std::find(payload.begin() + pos, payload.end(), '\0');
+        if (end == payload.end()) {
+            return false;
+        }
+        fields.emplace_back(payload.begin() + pos, end);
+        pos = end - payload.begin() + 1;
+    }
+    if (fields.size() < 3 || fields.size() % 2 == 0) {
+        return false;
+    }
+    *cwd = fields[0];
+    *program = fields[1];
+    *dos_argv = fields[2];
+    for (size_t i = 3; i < fields.size(); i += 2) {
+        const std::string &name = fields[i];
+        const std::string &value = fields[i + 1];
+        if (name == "deps") {
+            opts->deps = value;
+        } else if (name == "trace") {
+            opts->trace = value;
+        } else if (name == "timeline") {
+            opts->timeline = value;
+        } else if (name == "stats-json") {
+            opts->stats_json = value;
+        } else if (name == "drive" && value.size() > 2 && value[1] == '=') {
+            opts->drives[value[0]] = value.substr(2);
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* the first option set in opts that a job can't carry, or null */
+const char *local_option(const RunOptions &opts) {
+    const RunOptions none;
+    const ConsolePolicy &p = opts.console_policy;
+    const ConsolePolicy &q = none.console_policy;
+    if (!opts.save_snapshot.empty()) {
+        return "--save-snapshot";
+    }
+    if (!opts.restore_snapshot.empty()) {
+        return "--restore-snapshot";
+    }
+    if (p.on_input != q.on_input || p.on_newline != q.on_newline ||
+        p.size != q.size || p.timeout_ms != q.timeout_ms) {
+        return "--console-flush";
+    }
+    if (opts.console_device != none.console_device) {
+        return "--no-console-device";
+    }
+    if (opts.stats) {
+        return "--stats";  // the report goes to the server's stderr
+    }
+    if (!opts.profile.empty()) {
+        return "--profile";
+    }
+    if (opts.single_step) {
+        return "--single-step";
+    }
+    if (!opts.symbols.empty()) {
+        return "--map";
+    }
+    return nullptr;
+}
+
+/*
+ * Worker process. The VM is created and its IVT installed before the job
+ * arrives, so a request only pays for chdir + load + run. The worker exits
+ * with the guest's status, and the server collects it with wait4().
+ */
+[[noreturn]] void worker_main(int ctl_fd, Backend backend) {
+    std::string error;
+    auto vm = create_vm(backend, &error);
+    if (!vm) {
+        fprintf(stderr, "%s\n", error.c_str());
+        _exit(1);
+    }
+
+    Job job;
+    if (!recv_job(ctl_fd, &job)) {
+        _exit(0);  // server went away
+    }
+    close(ctl_fd);
+
+    std::string cwd, program, dos_argv;
+    RunOptions opts;
+    parse_payload(job.payload, &cwd, &program, &dos_argv, &opts);
+
+    for (int i = 0; i < JOB_NUM_FDS; i++) {
+        dup2(job.fds[i], i);
+        close(job.fds[i]);
+    }
+    if (chdir(cwd.c_str()) < 0) {
+        perror(cwd.c_str());
+        exit(1);
+    }
+
+    int status = run_program(vm.get(), program.c_str(), dos_argv, opts);
+    vm.reset();  // writes what --deps, --timeline and the rest collected
+    exit(status);
+}
+
+struct Server {
+    int listen_fd = -1;
+    int sig_fd = -1;
+    sigset_t old_mask;
+    std::vector<Worker> workers;
+    std::deque<Job> pending;
+    uint32_t next_job_id = 1;
+    Backend backend = Backend::AUTO;
+
+    void spawn(Worker *w) {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+            perror("socketpair");
+            exit(1);
+        }
+
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            exit(1);
+        }
+        if (pid == 0) {
+            sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+            signal(SIGPIPE, SIG_DFL);
+            close(listen_fd);
+            close(sig_fd);
+            close(sv[0]);
+            for (auto &other : workers) {
+                if (other.ctl_fd >= 0) {
+                    close(other.ctl_fd);
+                }
+                if (other.conn_fd >= 0) {
+                    close(other.conn_fd);
+                }
+            }
+            for (auto &j : pending) {
+                close(j.conn_fd);
+                for (int fd : j.fds) {
+                    close(fd);  // or the client never sees EOF on them
+                }
+            }
+            worker_main(sv[1], backend);
+        }
+
+        close(sv[1]);
+        w->pid = pid;
+        w->ctl_fd = sv[0];
+        w->busy = false;
+        w->conn_fd = -1;
+    }
+
+    void dispatch() {
+        for (auto &w : workers) {
+            if (pending.empty()) {
+                return;
+            }
+            if (w.busy || w.pid < 0) {
+                continue;
+            }
+
+            Job job = std::move(pending.front());
+            pending.pop_front();
+
+            std::string cwd, program, dos_argv;
+            RunOptions opts;
+            parse_payload(job.payload, &cwd, &program, &dos_argv, &opts);
+
+            bool ok = send_job(w.ctl_fd, job.payload, job.fds);
+            for (int i = 0; i < JOB_NUM_FDS; i++) {
+                close(job.fds[i]);
+            }
+            if (!ok) {
+                /* the worker died while idle: the job is dropped, the
+                 * client sees the connection close, and reap() finds the
+                 * worker */
+                fprintf(stderr, "vm server: worker %d lost\n", (int)w.pid);
+                close(job.conn_fd);
+                continue;
+            }
+
+            w.busy = true;
+            w.conn_fd = job.conn_fd;
+            w.job_id = next_job_id++;
+            w.program = program + " " + dos_argv;
+            clock_gettime(CLOCK_MONOTONIC, &w.start);
+        }
+    }
+
+    void accept_job() {
+        int conn = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (conn < 0) {
+            return;
+        }
+
+        Job job;
+        if (!recv_job(conn, &job)) {
+            fprintf(stderr, "vm server: malformed request\n");
+            close(conn);
+            return;
+        }
+        std::string cwd, program, dos_argv;
+        RunOptions opts;
+        if (!parse_payload(job.payload, &cwd, &program, &dos_argv, &opts)) {
+            fprintf(stderr, "vm server: malformed request\n");
+            for (int i = 0; i < JOB_NUM_FDS; i++) {
+                close(job.fds[i]);
+            }
+            close(conn);
+            return;
+        }
+        job.conn_fd = conn;
+        pending.push_back(std::move(job));
+    }
+
+    bool reap() {
+        int status;
+        struct rusage ru;
+        pid_t pid;
+        while ((pid = wait4(-1, &status, WNOHANG, &ru)) > 0) {
+            for (auto &w : workers) {
+                if (w.pid != pid) {
+                    continue;
+                }
+
+                if (w.busy) {
+                    JobResult res = {};
+                    res.job_id = w.job_id;
+                    if (WIFEXITED(status)) {
+                        res.status = WEXITSTATUS(status);
+                    } else {
+                        res.status = 128 + WTERMSIG(status);
+                    }
+                    res.wall_usec = usec_since(w.start);
+                    res.user_usec = tv_usec(ru.ru_utime);
+                    res.sys_usec = tv_usec(ru.ru_stime);
+
+                    fprintf(stderr,
+                            "job %u: %s -> status=%d wall=%.3fms "
+                            "user=%.3fms sys=%.3fms\n",
+                            res.job_id, w.program.c_str(), res.status,
+                            res.wall_usec / 1000.0, res.user_usec / 1000.0,
+                            res.sys_usec / 1000.0);
+
+                    write_full(w.conn_fd, &res, sizeof(res));
+                    close(w.conn_fd);
+                    w.conn_fd = -1;
+                }
+
+                close(w.ctl_fd);
+                w.ctl_fd = -1;
+                if (w.busy) {
+                    w.idle_deaths = 0;
+                } else if (++w.idle_deaths >= MAX_IDLE_DEATHS) {
+                    /* never lives to take a job: VM setup itself fails */
+                    fprintf(stderr, "vm server: worker %d failed to start\n",
+                            (int)pid);
+                    return false;
+                } else {
+                    fprintf(stderr, "vm server: idle worker %d exited\n",
+                            (int)pid);
+                }
+                spawn(&w);
+            }
+        }
+        return true;
+    }
+};
+
+}  // namespace
+
+std::string default_server_socket() {
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    if (dir && dir[0]) {
+        return std::string(dir) + "/dosvm.sock";
+    }
+    return "/tmp/dosvm-" + std::to_string(getuid()) + ".sock";
+}
+
+int server_main(const std::string &socket_path, int pool_size,
+                Backend backend) {
+    Server s;
+    s.backend = backend;
+
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket path too long: %s\n", socket_path.c_str());
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path.c_str());
+
+    s.listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (s.listen_fd < 0) {
+        perror("socket");
+        return 1;
+    }
+    unlink(socket_path.c_str());
+    if (bind(s.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(s.listen_fd, 64) < 0) {
+        perror(socket_path.c_str());
+        return 1;
+    }
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, &s.old_mask);
+    s.sig_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    signal(SIGPIPE, SIG_IGN);
+
+    s.workers.resize(pool_size);
+    for (auto &w : s.workers) {
+        s.spawn(&w);
+    }
+    fprintf(stderr, "vm server: listening on %s, %d workers\n",
+            socket_path.c_str(), pool_size);
+
+    while (true) {
+        struct pollfd pfd[2] = {{s.listen_fd, POLLIN, 0}, {s.sig_fd, POLLIN, 0}};
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+
+        if (pfd[1].revents & POLLIN) {
+            bool stop = false;
+            struct signalfd_siginfo si;
+            while (read(s.sig_fd, &si, sizeof(si)) == sizeof(si)) {
+                if (si.ssi_signo != SIGCHLD) {
+                    stop = true;
+                }
+            }
+            if (stop || !s.reap()) {
+                break;
+            }
+        }
+        if (pfd[0].revents & POLLIN) {
+            s.accept_job();
+        }
+        s.dispatch();
+    }
+
+    for (auto &w : s.workers) {
+        if (w.pid > 0) {
+            kill(w.pid, SIGTERM);
+        }
+    }
+    unlink(socket_path.c_str());
+    return 0;
+}
+
+int client_main(const std::string &socket_path, const std::string &program,
+                const std::string &dos_argv, const RunOptions &opts) {
+    if (const char *opt = local_option(opts)) {
+        fprintf(stderr, "%s: not passed on by --client\n", opt);
+        return 1;
+    }
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == nullptr) {
+        perror("getcwd");
+        return 1;
+    }
+
+    std::vector<char> payload;
+    std::vector<std::string> fields = {cwd, program, dos_argv};
+    const std::pair<const char *, const std::string *> named[] = {
+        {"deps", &opts.deps},
+        {"trace", &opts.trace},
+        {"timeline", &opts.timeline},
+        {"stats-json", &opts.stats_json},
+    };
+    for (const auto &n : named) {
+        if (!n.second->empty()) {
+            fields.insert(fields.end(), {n.first, *n.second});
+        }
+    }
+    for (const auto &d : opts.drives) {
+        fields.insert(fields.end(), {"drive", d.first + ("=" + d.second)});
+    }
+    for (const auto &s : fields) {
+        payload.insert(payload.end(), s.begin(), s.end());
+        payload.push_back('\0');
+    }
+    if (payload.size() > JOB_MAX_PAYLOAD) {
+        fprintf(stderr, "request too long\n");
+        return 1;
+    }
+
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket path too long: %s\n", socket_path.c_str());
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path.c_str());
+
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror(socket_path.c_str());
+        return 1;
+    }
+
+    int fds[JOB_NUM_FDS] = {0, 1, 2};
+    if (!send_job(sock, payload, fds)) {
+        perror("send job");
+        return 1;
+    }
+
+    JobResult res;
+    if (!read_full(sock, &res, sizeof(res))) {
+        fprintf(stderr, "vm server closed the connection\n");
+        return 1;
+    }
+    close(sock);
+
+    return res.status;
+}
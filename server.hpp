@@ -0,0 +1,21 @@
+#pragma once
+
+#include <string>
+
+enum class Backend;
+struct RunOptions;
+
+/*
+ * vm --server keeps a pool of worker processes, each holding a VM that is
+ * already constructed and has its IVT installed.  vm --client sends one job
+ * (cwd, program, argv and its stdin/stdout/stderr) over a unix socket and
+ * exits with the guest's exit status.  Of the RunOptions only --deps,
+ * --drive, --trace, --timeline and --stats-json go with the job; the
+ * client refuses to run with any other.
+ */
+
+std::string default_server_socket();
+int server_main(const std::string &socket_path, int pool_size,
+                Backend backend);
+int client_main(const std::string &socket_path, const std::string &program,
+                const std::string &dos_argv, const RunOptions &opts);
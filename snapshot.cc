@@ -0,0 +1,246 @@
+#include "snapshot.hpp"
+
+#include <sys/stat.h>
+
+#include <atomic>
+#include <type_traits>
+#include <vector>
+
+#include "vm.hpp"
+
+namespace {
+
+constexpr char SNAPSHOT_MAGIC[8] = {'D', 'O', 'S', 'V', 'M', 'S', 'N', 'P'};
+constexpr uint32_t SNAPSHOT_VERSION = 2;
+constexpr size_t SNAPSHOT_MEM_OFFSET = 4096;
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t mem_offset;
+    uint64_t mem_size;
+
+    /* floppy identity, all 0 without a floppy */
+    uint64_t image_size;
+    uint64_t image_hash;
+    int32_t floppy_type;
+    int32_t num_sector;
+    int32_t num_head;
+    int32_t num_cylinder;
+
+    AddrConfig addr_config;
+    int32_t run_mode;
+    struct kvm_regs regs;
+    struct kvm_sregs sregs;
+};
+static_assert(sizeof(SnapshotHeader) <= SNAPSHOT_MEM_OFFSET);
+static_assert(std::is_trivially_copyable<AddrConfig>::value);
+
+constexpr size_t PAGE_SIZE_4K = 4096;
+constexpr size_t NUM_PAGES = VM::MEM_SIZE / PAGE_SIZE_4K;
+
+/* /proc/self/pagemap entry bits */
+constexpr uint64_t PM_PRESENT = 1ull << 63;
+constexpr uint64_t PM_SWAP = 1ull << 62;
+constexpr uint64_t PM_FILE_OR_SHARED = 1ull << 61;
+
+std::atomic<uint64_t> next_baseline_serial{1};
+
+/* map full_mem copy-on-write from b's memfd, dropping every private page */
+bool map_baseline(VM *vm, const Baseline &b) {
+    void *mem = mmap(vm->full_mem, VM::MEM_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_FIXED, b.memfd, 0);
+    if (mem == MAP_FAILED) {
+        perror("mmap baseline");
+        vm->mapped_baseline = 0;
+        return false;
+    }
+    vm->mapped_baseline = b.serial;
+    return true;
+}
+
+/*
+ * Throw away the pages written since full_mem was mapped from its baseline;
+ * they fault back in from the memfd.  A written page is a private anonymous
+ * copy, which pagemap shows as present but not file-backed, or as swapped
+ * out.  false if pagemap can't be read.
+ */
+bool drop_dirty_pages(VM *vm) {
+    if (vm->pagemap_fd < 0) {
+        vm->pagemap_fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+        if (vm->pagemap_fd < 0) {
+            return false;
+        }
+    }
+    uint64_t entries[NUM_PAGES];
+    off_t off = (uintptr_t)vm->full_mem / PAGE_SIZE_4K * sizeof(uint64_t);
+    if (pread(vm->pagemap_fd, entries, sizeof(entries), off) !=
+        sizeof(entries)) {
+        return false;
+    }
+    auto dirty = [](uint64_t e) {
+        return (e & PM_SWAP) ||
+               (e & (PM_PRESENT | PM_FILE_OR_SHARED)) == PM_PRESENT;
+    };
+    for (size_t i = 0; i < NUM_PAGES;) {
+        if (!dirty(entries[i])) {
+            i++;
+            continue;
+        }
+        size_t first = i;
+        while (i < NUM_PAGES && dirty(entries[i])) {
+            i++;
+        }
+        if (madvise(vm->full_mem + first * PAGE_SIZE_4K,
+                    (i - first) * PAGE_SIZE_4K, MADV_DONTNEED) < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+}  // namespace
+
+bool save_snapshot(const VM *vm, const std::string &path) {
+    std::vector<uint8_t> head(SNAPSHOT_MEM_OFFSET, 0);
+    auto hdr = (SnapshotHeader *)head.data();
+    memcpy(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic));
+    hdr->version = SNAPSHOT_VERSION;
+    hdr->mem_offset = SNAPSHOT_MEM_OFFSET;
+    hdr->mem_size = VM::MEM_SIZE;
+    if (vm->floppy) {
+        hdr->image_size = vm->floppy->byte_size;
+        hdr->image_hash = vm->floppy->content_hash();
+        hdr->floppy_type = vm->floppy->type;
+        hdr->num_sector = vm->floppy->num_sector;
+        hdr->num_head = vm->floppy->num_head;
+        hdr->num_cylinder = vm->floppy->num_cylinder;
+    }
+    hdr->addr_config = vm->addr_config;
+    hdr->run_mode = (int32_t)vm->run_mode;
+    hdr->regs = vm->cpu->regs;
+    hdr->sregs = vm->cpu->sregs;
+
+    /* write to a temporary and rename, so a reader never sees half a file */
+    std::string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(tmp.c_str());
+        return false;
+    }
+    bool ok = write(fd, head.data(), head.size()) == (ssize_t)head.size() &&
+              write(fd, vm->full_mem, VM::MEM_SIZE) == (ssize_t)VM::MEM_SIZE;
+    if (close(fd) < 0) {
+        ok = false;
+    }
+    if (!ok || rename(tmp.c_str(), path.c_str()) < 0) {
+        perror(path.c_str());
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool restore_snapshot(VM *vm, const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        perror(path.c_str());
+        return false;
+    }
+
+    SnapshotHeader hdr;
+    struct stat st;
+    if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || fstat(fd, &st) < 0 ||
+        memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != SNAPSHOT_VERSION || hdr.mem_size != VM::MEM_SIZE ||
+        hdr.mem_offset % 4096 != 0 || hdr.run_mode < 0 ||
+        hdr.run_mode > (int32_t)RUN_MODE::NATIVE ||
+        (uint64_t)st.st_size < hdr.mem_offset + hdr.mem_size) {
+        fprintf(stderr, "%s: not a valid snapshot\n", path.c_str());
+        close(fd);
+        return false;
+    }
+
+    /* one taken without a floppy, as by dosfuzz, needs none */
+    auto floppy = vm->floppy.get();
+    bool same_disk =
+        hdr.image_size == 0 ||
+        (floppy && hdr.image_size == floppy->byte_size &&
+         hdr.floppy_type == floppy->type &&
+         hdr.num_sector == floppy->num_sector &&
+         hdr.num_head == floppy->num_head &&
+         hdr.num_cylinder == floppy->num_cylinder &&
+         hdr.image_hash == floppy->content_hash());
+    if (!same_disk) {
+        fprintf(stderr, "%s: stale snapshot, disk image has changed\n",
+                path.c_str());
+        close(fd);
+        return false;
+    }
+
+    void *mem = mmap(vm->full_mem, VM::MEM_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_FIXED, fd, hdr.mem_offset);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        perror("mmap snapshot");
+        /* full_mem may be gone: put fresh memory back and boot normally */
+        mem = mmap(vm->full_mem, VM::MEM_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+        if (mem == MAP_FAILED) {
+            perror("mmap");
+            vm->stop(StopReason::HOST_ERROR, 1);
+            return false;
+        }
+        memset(vm->full_mem, 0xf4, VM::MEM_SIZE);
+        setup_ivt(vm);
+        return false;
+    }
+
+    vm->mapped_baseline = 0;
+    vm->addr_config = hdr.addr_config;
+    vm->run_mode = (RUN_MODE)hdr.run_mode;
+    vm->cpu->regs = hdr.regs;
+    vm->cpu->sregs = hdr.sregs;
+    return true;
+}
+
+std::unique_ptr<Baseline> VM::take_baseline() {
+    auto b = std::make_unique<Baseline>();
+    b->memfd = memfd_create("dosvm-baseline", MFD_CLOEXEC);
+    if (b->memfd < 0) {
+        perror("memfd_create");
+        return nullptr;
+    }
+    if (ftruncate(b->memfd, MEM_SIZE) < 0 ||
+        pwrite(b->memfd, full_mem, MEM_SIZE, 0) != (ssize_t)MEM_SIZE) {
+        perror("baseline");
+        return nullptr;
+    }
+    b->serial = next_baseline_serial++;
+    b->regs = cpu->regs;
+    b->sregs = cpu->sregs;
+    b->addr_config = addr_config;
+    b->run_mode = run_mode;
+
+    /* same contents, now with the memfd behind them */
+    if (!map_baseline(this, *b)) {
+        return nullptr;
+    }
+    return b;
+}
+
+bool VM::reset_to(const Baseline &b) {
+    if (mapped_baseline != b.serial || !drop_dirty_pages(this)) {
+        if (!map_baseline(this, b)) {
+            return false;
+        }
+    }
+    addr_config = b.addr_config;
+    run_mode = b.run_mode;
+    cpu->regs = b.regs;
+    cpu->sregs = b.sregs;
+    cpu->kick_pending = 0;
+    stop_reason = StopReason::NONE;
+    exit_status = 0;
+    return true;
+}
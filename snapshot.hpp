@@ -0,0 +1,17 @@
+#pragma once
+
+#include <string>
+
+struct VM;
+
+/*
+ * Full-machine snapshot: 1MiB guest memory, vCPU registers, AddrConfig, run
+ * mode and the identity (geometry + content hash) of the floppy image it was
+ * taken with, if any. Memory starts on a page boundary so that restore is a single
+ * copy-on-write mmap over VM::full_mem.
+ */
+
+bool save_snapshot(const VM *vm, const std::string &path);
+
+/* false if the file is unusable or was taken with a different disk image */
+bool restore_snapshot(VM *vm, const std::string &path);
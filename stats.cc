@@ -0,0 +1,207 @@
+#include "stats.hpp"
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <functional>
+#include <mutex>
+
+#include "dosdriver.h"
+
+namespace {
+
+std::mutex live_lock;
+Stats *live_head = nullptr;
+bool atexit_installed = false;
+
+/* indexed by ExitCode */
+const char *const exit_names[Stats::NUM_EXIT_CODES] = {
+    "bios",     "dos_driver",  "invoke_return", "dos_int",
+    "dos_exit", "single_step", "kicked",        "fault",
+};
+
+const char *driver_name(int call) {
+    switch (call) {
+        case DOSIO_STATUS:
+            return "STATUS";
+        case DOSIO_INP:
+            return "INP";
+        case DOSIO_OUTP:
+            return "OUTP";
+        case DOSIO_PRINT:
+            return "PRINT";
+        case DOSIO_AUXIN:
+            return "AUXIN";
+        case DOSIO_AUXOUT:
+            return "AUXOUT";
+        case DOSIO_READ:
+            return "READ";
+        case DOSIO_WRITE:
+            return "WRITE";
+        case DOSIO_DSKCHG:
+            return "DSKCHG";
+        case DOSIO_SETDATE:
+            return "SETDATE";
+        case DOSIO_SETTIME:
+            return "SETTIME";
+        case DOSIO_GETTIME:
+            return "GETTIME";
+        case DOSIO_FLUSH:
+            return "FLUSH";
+        case DOSIO_MAPDEV:
+            return "MAPDEV";
+        default:
+            return nullptr;
+    }
+}
+
+/* calls f(group, name, histogram) for every row that saw an event */
+void for_each_row(
+    const Stats &s,
+    const std::function<void(const char *, const char *, const Histogram &)>
+        &f) {
+    char name[32];
+    for (int i = 0; i < Stats::NUM_EXIT_CODES; i++) {
+        if (s.run[i].count) {
+            f("run", exit_names[i], s.run[i]);
+        }
+    }
+    if (s.kvm_run.count) {
+        f("kvm", "KVM_RUN", s.kvm_run);
+        f("kvm", "set_regs", s.regs_set);
+        f("kvm", "get_regs", s.regs_get);
+    }
+    for (int i = 0; i < 256; i++) {
+        if (s.bios[i].count) {
+            snprintf(name, sizeof(name), "%02Xh", i);
+            f("bios", name, s.bios[i]);
+        }
+    }
+    for (int i = 0; i < 256; i++) {
+        if (s.dos_int[i].count) {
+            snprintf(name, sizeof(name), "AH=%02Xh", i);
+            f("int21", name, s.dos_int[i]);
+        }
+    }
+    for (int i = 0; i < Stats::NUM_DRIVER_CALLS; i++) {
+        if (s.dos_driver[i].count) {
+            const char *n = driver_name(i);
+            if (!n) {
+                snprintf(name, sizeof(name), "%d", i);
+                n = name;
+            }
+            f("dosio", n, s.dos_driver[i]);
+        }
+    }
+    if (s.console_flush.count) {
+        f("console", "write", s.console_flush);
+    }
+}
+
+}  // namespace
+
+uint64_t Histogram::percentile(double p) const {
+    uint64_t want = (uint64_t)(count * p);
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen > want) {
+            return std::min(max_ns, (uint64_t)2 << i);
+        }
+    }
+    return max_ns;
+}
+
+Stats::Stats(bool print, const std::string &json_path)
+    : print(print), json_path(json_path) {
+    std::lock_guard<std::mutex> lk(live_lock);
+    if (!atexit_installed) {
+        atexit(Stats::finish_all);
+        atexit_installed = true;
+    }
+    next_live = live_head;
+    if (live_head) {
+        live_head->prev_live = this;
+    }
+    live_head = this;
+}
+
+Stats::~Stats() {
+    finish();
+
+    std::lock_guard<std::mutex> lk(live_lock);
+    if (prev_live) {
+        prev_live->next_live = next_live;
+    } else if (live_head == this) {
+        live_head = next_live;
+    }
+    if (next_live) {
+        next_live->prev_live = prev_live;
+    }
+}
+
+void Stats::finish_all() {
+    std::lock_guard<std::mutex> lk(live_lock);
+    for (Stats *s = live_head; s; s = s->next_live) {
+        s->finish();
+    }
+}
+
+void Stats::finish() {
+    if (finished) {
+        return;
+    }
+    finished = true;
+    if (print) {
+        report(stderr);
+    }
+    if (!json_path.empty()) {
+        write_json(json_path);
+    }
+}
+
+void Stats::report(FILE *fp) const {
+    uint64_t wall = stats_now_ns() - start_ns;
+    fprintf(fp, "wall time %.3f ms\n", wall / 1e6);
+    fprintf(fp, "%-7s %-13s %10s %11s %9s %9s %9s %9s\n", "group", "name",
+            "count", "total ms", "mean us", "p50 us", "p99 us", "max us");
+    for_each_row(*this, [fp](const char *group, const char *name,
+                             const Histogram &h) {
+        fprintf(fp, "%-7s %-13s %10llu %11.3f %9.2f %9.2f %9.2f %9.2f\n",
+                group, name, (unsigned long long)h.count, h.total_ns / 1e6,
+                h.total_ns / 1e3 / h.count, h.percentile(0.5) / 1e3,
+                h.percentile(0.99) / 1e3, h.max_ns / 1e3);
+    });
+}
+
+bool Stats::write_json(const std::string &path) const {
+    FILE *fp = fopen(path.c_str(), "w");
+    if (!fp) {
+        perror(path.c_str());
+        return false;
+    }
+    fprintf(fp, "{\n  \"wall_ns\": %llu,\n  \"rows\": [",
+            (unsigned long long)(stats_now_ns() - start_ns));
+    bool first = true;
+    for_each_row(*this, [fp, &first](const char *group, const char *name,
+                                     const Histogram &h) {
+        fprintf(fp,
+                "%s\n    {\"group\": \"%s\", \"name\": \"%s\", \"count\": "
+                "%llu, \"total_ns\": %llu, \"max_ns\": %llu, "
+                "\"log2_ns_buckets\": [",
+                first ? "" : ",", group, name, (unsigned long long)h.count,
+                (unsigned long long)h.total_ns, (unsigned long long)h.max_ns);
+        int last = Histogram::BUCKETS - 1;
+        while (last > 0 && h.buckets[last] == 0) {
+            last--;
+        }
+        for (int i = 0; i <= last; i++) {
+            fprintf(fp, "%s%llu", i ? ", " : "",
+                    (unsigned long long)h.buckets[i]);
+        }
+        fprintf(fp, "]}");
+        first = false;
+    });
+    fprintf(fp, "\n  ]\n}\n");
+    return fclose(fp) == 0;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <string>
+
+/*
+ * Exit and hypercall statistics collected with vm --stats.  Everything is
+ * timed with CLOCK_MONOTONIC (a vDSO call, ~20ns) into log2 histograms of
+ * nanoseconds, so collection costs two clock reads per timed event and
+ * nothing at all when VM::stats is null.
+ */
+
+inline uint64_t stats_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* bucket i counts events of [2^i, 2^(i+1)) ns, bucket 0 also takes 0ns */
+struct Histogram {
+    static constexpr int BUCKETS = 40;
+
+    uint64_t count = 0;
+    uint64_t total_ns = 0;
+    uint64_t max_ns = 0;
+    uint64_t buckets[BUCKETS] = {};
+
+    void add(uint64_t ns) {
+        int b = ns ? 63 - __builtin_clzll(ns) : 0;
+        buckets[b < BUCKETS ? b : BUCKETS - 1]++;
+        count++;
+        total_ns += ns;
+        if (ns > max_ns) {
+            max_ns = ns;
+        }
+    }
+    /* upper bound of the bucket holding the p-th fraction of events */
+    uint64_t percentile(double p) const;
+};
+
+struct Stats {
+    static constexpr int NUM_EXIT_CODES = 8;
+    static constexpr int NUM_DRIVER_CALLS = 64;
+
+    /* print the report to stderr and/or write JSON to json_path when the
+     * Stats is destroyed or the process exits, whichever comes first */
+    Stats(bool print, const std::string &json_path);
+    ~Stats();
+    Stats(const Stats &) = delete;
+    Stats &operator=(const Stats &) = delete;
+
+    bool print;
+    std::string json_path;
+    bool finished = false;
+    uint64_t start_ns = stats_now_ns();
+
+    /* guest execution: run() by the ExitCode it returned */
+    Histogram run[NUM_EXIT_CODES];
+    /* inside KvmCPU::run */
+    Histogram kvm_run;   // the KVM_RUN ioctl alone
+    Histogram regs_set;  // registers to KVM before KVM_RUN
+    Histogram regs_get;  // registers from KVM after it
+    /* handlers, by hypercall */
+    Histogram bios[256];                      // by interrupt number
+    Histogram dos_int[256];                   // int 21h by AH
+    Histogram dos_driver[NUM_DRIVER_CALLS];   // by DOSIO_* call
+    Histogram console_flush;                  // write(2)s of guest output
+
+    /* human-readable report; only rows that saw events */
+    void report(FILE *fp) const;
+    bool write_json(const std::string &path) const;
+
+    void finish();
+    /* finish every live Stats, installed with atexit() */
+    static void finish_all();
+
+    Stats *next_live = nullptr;
+    Stats *prev_live = nullptr;
+};
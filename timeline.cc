@@ -0,0 +1,145 @@
+#include "timeline.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+
+std::mutex live_lock;
+Timeline *live_head = nullptr;
+bool atexit_installed = false;
+uint64_t next_serial = 1;
+
+/* the arena this thread last recorded into, and whose it is; by serial
+ * since a new Timeline may reuse the address of a dead one */
+thread_local uint64_t cached_serial = 0;
+thread_local void *cached_arena = nullptr;
+
+}  // namespace
+
+Timeline::Timeline(const std::string &path) : path(path) {
+    std::lock_guard<std::mutex> lk(live_lock);
+    serial = next_serial++;
+    if (!atexit_installed) {
+        atexit(Timeline::finish_all);
+        atexit_installed = true;
+    }
+    next_live = live_head;
+    if (live_head) {
+        live_head->prev_live = this;
+    }
+    live_head = this;
+}
+
+Timeline::~Timeline() {
+    finish();
+
+    std::lock_guard<std::mutex> lk(live_lock);
+    if (prev_live) {
+        prev_live->next_live = next_live;
+    } else if (live_head == this) {
+        live_head = next_live;
+    }
+    if (next_live) {
+        next_live->prev_live = prev_live;
+    }
+}
+
+void Timeline::finish_all() {
+    std::lock_guard<std::mutex> lk(live_lock);
+    for (Timeline *t = live_head; t; t = t->next_live) {
+        t->finish();
+    }
+}
+
+Timeline::Arena *Timeline::arena_for_thread() {
+    if (cached_serial == serial) {
+        return (Arena *)cached_arena;
+    }
+    int tid = syscall(SYS_gettid);
+    std::lock_guard<std::mutex> lk(lock);
+    Arena *a = nullptr;
+    for (auto &p : arenas) {
+        if (p->tid == tid) {
+            a = p.get();
+        }
+    }
+    if (!a) {
+        arenas.push_back(std::make_unique<Arena>());
+        a = arenas.back().get();
+        a->tid = tid;
+    }
+    cached_serial = serial;
+    cached_arena = a;
+    return a;
+}
+
+void Timeline::add(const TimelineEvent &e) {
+    if (finished) {
+        return;  // an exit handler after the file was written
+    }
+    Arena *a = arena_for_thread();
+    if (a->used == CHUNK) {
+        /* not make_unique, which would zero the whole chunk */
+        a->chunks.emplace_back(new TimelineEvent[CHUNK]);
+        a->used = 0;
+    }
+    a->chunks.back()[a->used++] = e;
+}
+
+void Timeline::finish() {
+    if (finished) {
+        return;
+    }
+    finished = true;
+    write_json();
+}
+
+bool Timeline::write_json() const {
+    FILE *fp = fopen(path.c_str(), "w");
+    if (!fp) {
+        perror(path.c_str());
+        return false;
+    }
+    int pid = getpid();
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(fp,
+            "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+            "\"args\":{\"name\":\"vm\"}}",
+            pid, pid);
+    for (auto &a : arenas) {
+        size_t n_chunks = a->chunks.size();
+        for (size_t c = 0; c < n_chunks; c++) {
+            size_t n = c + 1 == n_chunks ? a->used : CHUNK;
+            for (size_t i = 0; i < n; i++) {
+                const TimelineEvent &e = a->chunks[c][i];
+                fprintf(fp, ",\n{\"name\":\"%s", e.name);
+                if (e.code >= 0) {
+                    fprintf(fp, " %02Xh", e.code);
+                }
+                /* microseconds, to the nanosecond */
+                uint64_t ts = e.start_ns - start_ns;
+                fprintf(fp,
+                        "\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%llu.%03u,"
+                        "\"dur\":%llu.%03u,\"pid\":%d,\"tid\":%d",
+                        e.cat, (unsigned long long)(ts / 1000),
+                        (unsigned)(ts % 1000),
+                        (unsigned long long)(e.dur_ns / 1000),
+                        (unsigned)(e.dur_ns % 1000), pid, a->tid);
+                if (e.num_args) {
+                    fprintf(fp, ",\"args\":{");
+                    for (int k = 0; k < e.num_args; k++) {
+                        fprintf(fp, "%s\"%s\":%lld", k ? "," : "", e.keys[k],
+                                (long long)e.values[k]);
+                    }
+                    fprintf(fp, "}");
+                }
+                fprintf(fp, "}");
+            }
+        }
+    }
+    fprintf(fp, "\n]}\n");
+    return fclose(fp) == 0;
+}
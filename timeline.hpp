@@ -0,0 +1,109 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "stats.hpp"
+
+/*
+ * Timeline of VM exits, hypercalls and host I/O for vm --timeline=FILE, in
+ * the Chrome Trace Event Format (chrome://tracing, ui.perfetto.dev).
+ *
+ * Every span becomes one complete ("ph":"X") event.  Spans are appended to
+ * an arena owned by the recording thread, so recording takes no lock and
+ * costs two clock reads and a copy; the JSON is only written at exit.
+ */
+
+struct TimelineEvent {
+    static constexpr int MAX_ARGS = 4;
+
+    const char *name;  // static strings only, they are kept until exit
+    const char *cat;
+    int code;  // >= 0 : shown after the name, as in "int21 3Fh"
+    int num_args;
+    uint64_t start_ns;
+    uint64_t dur_ns;
+    const char *keys[MAX_ARGS];
+    int64_t values[MAX_ARGS];
+};
+
+class Timeline {
+   public:
+    /* write FILE when the Timeline is destroyed or the process exits,
+     * whichever comes first */
+    explicit Timeline(const std::string &path);
+    ~Timeline();
+    Timeline(const Timeline &) = delete;
+    Timeline &operator=(const Timeline &) = delete;
+
+    /* append e to the calling thread's arena */
+    void add(const TimelineEvent &e);
+
+    void finish();
+    /* finish every live Timeline, installed with atexit() */
+    static void finish_all();
+
+   private:
+    static constexpr size_t CHUNK = 4096;  // events
+
+    struct Arena {
+        int tid;
+        std::vector<std::unique_ptr<TimelineEvent[]>> chunks;
+        size_t used = CHUNK;  // in the last chunk
+    };
+    Arena *arena_for_thread();
+    bool write_json() const;
+
+    std::string path;
+    uint64_t serial;
+    uint64_t start_ns = stats_now_ns();
+    bool finished = false;
+    std::mutex lock;  // arenas, not their contents
+    std::vector<std::unique_ptr<Arena>> arenas;
+
+    Timeline *next_live = nullptr;  // for the atexit drain
+    Timeline *prev_live = nullptr;
+};
+
+/*
+ * One span, from construction to destruction.  Does nothing, not even read
+ * the clock, when the timeline is null.
+ */
+class TimelineSpan {
+   public:
+    TimelineSpan(Timeline *tl, const char *name, const char *cat,
+                 int code = -1)
+        : tl(tl) {
+        if (tl) {
+            e.name = name;
+            e.cat = cat;
+            e.code = code;
+            e.num_args = 0;
+            e.start_ns = stats_now_ns();
+        }
+    }
+    ~TimelineSpan() {
+        if (tl) {
+            e.dur_ns = stats_now_ns() - e.start_ns;
+            tl->add(e);
+        }
+    }
+    TimelineSpan(const TimelineSpan &) = delete;
+    TimelineSpan &operator=(const TimelineSpan &) = delete;
+
+    /* key must be a static string; extra args are dropped */
+    void arg(const char *key, int64_t value) {
+        if (tl && e.num_args < TimelineEvent::MAX_ARGS) {
+            e.keys[e.num_args] = key;
+            e.values[e.num_args++] = value;
+        }
+    }
+
+   private:
+    Timeline *tl;
+    TimelineEvent e;
+};
@@ -0,0 +1,284 @@
+#include "trace.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <mutex>
+
+#include "vm.hpp"
+
+const char *const trace_reg_names[TR_COUNT] = {
+    "ax", "cx", "dx", "bx", "sp", "bp", "si", "di", "es", "ss", "ds", "fl",
+};
+
+namespace {
+
+constexpr size_t RING_SIZE = 16 * 1024 * 1024;
+constexpr size_t MAX_RECORD = 1 + 2 + 2 + 2 + 2 * TR_COUNT + 2;
+
+std::mutex live_lock;
+TraceWriter *live_head = nullptr;
+bool atexit_installed = false;
+
+void pause_briefly() {
+    struct timespec ts = {0, 200 * 1000};
+    nanosleep(&ts, nullptr);
+}
+
+}  // namespace
+
+TraceWriter::TraceWriter(const std::string &path) {
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror(path.c_str());
+        return;  // not ok(), nothing to close
+    }
+    ring.resize(RING_SIZE);
+    mask = RING_SIZE - 1;
+    push((const uint8_t *)TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    writer = std::thread(&TraceWriter::writer_loop, this);
+
+    std::lock_guard<std::mutex> lk(live_lock);
+    if (!atexit_installed) {
+        atexit(TraceWriter::close_all);
+        atexit_installed = true;
+    }
+    next_live = live_head;
+    if (live_head) {
+        live_head->prev_live = this;
+    }
+    live_head = this;
+}
+
+TraceWriter::~TraceWriter() {
+    close();
+
+    std::lock_guard<std::mutex> lk(live_lock);
+    if (prev_live) {
+        prev_live->next_live = next_live;
+    } else if (live_head == this) {
+        live_head = next_live;
+    }
+    if (next_live) {
+        next_live->prev_live = prev_live;
+    }
+}
+
+void TraceWriter::close_all() {
+    std::lock_guard<std::mutex> lk(live_lock);
+    for (TraceWriter *t = live_head; t; t = t->next_live) {
+        t->close();
+    }
+}
+
+void TraceWriter::close() {
+    if (fd < 0) {
+        return;
+    }
+    closing.store(true, std::memory_order_release);
+    writer.join();
+    ::close(fd);
+    fd = -1;
+}
+
+void TraceWriter::begin_step(const CPU *cpu) {
+    auto &r = cpu->regs;
+    auto &sr = cpu->sregs;
+    cs = sr.cs.selector;
+    ip = (uint16_t)r.rip;
+    regs[TR_AX] = (uint16_t)r.rax;
+    regs[TR_CX] = (uint16_t)r.rcx;
+    regs[TR_DX] = (uint16_t)r.rdx;
+    regs[TR_BX] = (uint16_t)r.rbx;
+    regs[TR_SP] = (uint16_t)r.rsp;
+    regs[TR_BP] = (uint16_t)r.rbp;
+    regs[TR_SI] = (uint16_t)r.rsi;
+    regs[TR_DI] = (uint16_t)r.rdi;
+    regs[TR_ES] = sr.es.selector;
+    regs[TR_SS] = sr.ss.selector;
+    regs[TR_DS] = sr.ds.selector;
+    regs[TR_FLAGS] = (uint16_t)r.rflags;
+}
+
+void TraceWriter::end_step(const ExitReason &r) {
+    uint8_t buf[MAX_RECORD];
+    size_t n = 1;
+    uint8_t tag = (uint8_t)r.code & TRACE_CODE_MASK;
+
+    if (first || cs != last_cs) {
+        tag |= TRACE_CS;
+        buf[n++] = cs;
+        buf[n++] = cs >> 8;
+    }
+    int16_t delta = (int16_t)(ip - last_ip);
+    if (!first && delta >= -128 && delta <= 127) {
+        tag |= TRACE_IP_DELTA;
+        buf[n++] = (uint8_t)delta;
+    } else {
+        buf[n++] = ip;
+        buf[n++] = ip >> 8;
+    }
+
+    uint16_t changed = 0;
+    for (int i = 0; i < TR_COUNT; i++) {
+        if (first || regs[i] != last_regs[i]) {
+            changed |= 1 << i;
+        }
+    }
+    if (changed) {
+        tag |= TRACE_REGS;
+        buf[n++] = changed;
+        if (changed >> 8) {
+            tag |= TRACE_WIDE_MASK;
+            buf[n++] = changed >> 8;
+        }
+        for (int i = 0; i < TR_COUNT; i++) {
+            if (changed & (1 << i)) {
+                buf[n++] = regs[i];
+                buf[n++] = regs[i] >> 8;
+            }
+        }
+    }
+
+    int nr = -1;
+    switch (r.code) {
+        case ExitCode::HLT_BIOS_CALL:
+            nr = r.bios_nr;
+            break;
+        case ExitCode::HLT_DOS_DRIVER:
+            nr = r.dos_driver_call;
+            break;
+        case ExitCode::HLT_DOS_INT:
+            nr = regs[TR_AX] >> 8;
+            break;
+        default:
+            break;
+    }
+    if (nr >= 0) {
+        tag |= TRACE_NR;
+        buf[n++] = nr;
+        buf[n++] = nr >> 8;
+    }
+
+    buf[0] = tag;
+    push(buf, n);
+
+    first = false;
+    last_cs = cs;
+    last_ip = ip;
+    memcpy(last_regs, regs, sizeof(regs));
+}
+
+void TraceWriter::push(const uint8_t *p, size_t len) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    /* the ring only fills up when the disk can't keep up */
+    while (ring.size() - (t - head.load(std::memory_order_acquire)) < len) {
+        pause_briefly();
+    }
+    size_t off = t & mask;
+    size_t first_part = std::min(len, ring.size() - off);
+    memcpy(&ring[off], p, first_part);
+    memcpy(&ring[0], p + first_part, len - first_part);
+    tail.store(t + len, std::memory_order_release);
+}
+
+void TraceWriter::writer_loop() {
+    size_t h = head.load(std::memory_order_relaxed);
+    while (true) {
+        bool done = closing.load(std::memory_order_acquire);
+        size_t t = tail.load(std::memory_order_acquire);
+        if (t == h) {
+            if (done) {
+                break;
+            }
+            pause_briefly();
+            continue;
+        }
+        size_t off = h & mask;
+        size_t len = std::min(t - h, ring.size() - off);
+        ssize_t w = write(fd, &ring[off], len);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("trace write");
+            /* drop the rest rather than stall the vCPU */
+            w = len;
+        }
+        h += w;
+        head.store(h, std::memory_order_release);
+    }
+}
+
+bool TraceReader::open(FILE *fp) {
+    char magic[sizeof(TRACE_MAGIC)];
+    if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic) ||
+        memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0) {
+        return false;
+    }
+    this->fp = fp;
+    state = {};
+    return true;
+}
+
+bool TraceReader::next(TraceRecord *rec) {
+    auto u8 = [this](uint16_t *v) {
+        int c = getc_unlocked(fp);
+        *v = (uint16_t)c;
+        return c != EOF;
+    };
+    auto u16 = [this](uint16_t *v) {
+        int lo = getc_unlocked(fp);
+        int hi = getc_unlocked(fp);
+        *v = (uint16_t)(lo | (hi << 8));
+        return hi != EOF;
+    };
+
+    uint16_t tag, v;
+    if (!u8(&tag)) {
+        return false;
+    }
+    state.code = tag & TRACE_CODE_MASK;
+    if ((tag & TRACE_CS) && !u16(&state.cs)) {
+        return false;
+    }
+    if (tag & TRACE_IP_DELTA) {
+        if (!u8(&v)) {
+            return false;
+        }
+        state.ip += (int8_t)v;
+    } else if (!u16(&state.ip)) {
+        return false;
+    }
+
+    state.changed = 0;
+    if (tag & TRACE_REGS) {
+        if (!u8(&state.changed)) {
+            return false;
+        }
+        if (tag & TRACE_WIDE_MASK) {
+            if (!u8(&v)) {
+                return false;
+            }
+            state.changed |= v << 8;
+        }
+        for (int i = 0; i < TR_COUNT; i++) {
+            if ((state.changed & (1 << i)) && !u16(&state.regs[i])) {
+                return false;
+            }
+        }
+    }
+
+    state.has_nr = tag & TRACE_NR;
+    if (state.has_nr && !u16(&state.nr)) {
+        return false;
+    }
+
+    *rec = state;
+    return true;
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct CPU;
+struct ExitReason;
+
+/*
+ * Execution trace, written by vm --trace=FILE and read by vmtrace.
+ *
+ * The file is TRACE_MAGIC followed by one record per run() of the vCPU,
+ * that is per single step or hypercall exit.  A record holds the CS:IP
+ * the step started at and the registers that differ from the previous
+ * record, both taken before the step, so the handlers' changes show up in
+ * the step after them:
+ *
+ *   u8 tag          exit code in bits 0-2 and the TRACE_* bits below
+ *   [u16 cs]        TRACE_CS
+ *   i8 ip delta     TRACE_IP_DELTA, otherwise u16 ip
+ *   [u8|u16 mask]   TRACE_REGS, 16 bits wide with TRACE_WIDE_MASK;
+ *                   then a u16 for each bit set, lowest bit first
+ *   [u16 nr]        TRACE_NR: bios_nr, dos_driver_call or AH of int21
+ *
+ * Everything is little-endian.
+ */
+
+static constexpr char TRACE_MAGIC[8] = {'D', 'O', 'S', 'V', 'M', 'T', 'R', '1'};
+
+enum : uint8_t {
+    TRACE_CODE_MASK = 0x07,
+    TRACE_CS = 0x08,
+    TRACE_IP_DELTA = 0x10,
+    TRACE_REGS = 0x20,
+    TRACE_NR = 0x40,
+    TRACE_WIDE_MASK = 0x80,
+};
+
+/* register order in the mask; segments other than CS get the high byte */
+enum TraceReg {
+    TR_AX,
+    TR_CX,
+    TR_DX,
+    TR_BX,
+    TR_SP,
+    TR_BP,
+    TR_SI,
+    TR_DI,
+    TR_ES,
+    TR_SS,
+    TR_DS,
+    TR_FLAGS,
+    TR_COUNT,
+};
+
+extern const char *const trace_reg_names[TR_COUNT];
+
+struct TraceRecord {
+    int code;  // ExitCode
+    uint16_t cs;
+    uint16_t ip;
+    uint16_t regs[TR_COUNT];  // full state, deltas already applied
+    uint16_t changed;         // mask of regs present in this record
+    bool has_nr;
+    uint16_t nr;
+};
+
+class TraceWriter {
+   public:
+    /* the file is created at once, check ok() */
+    explicit TraceWriter(const std::string &path);
+    ~TraceWriter();
+    TraceWriter(const TraceWriter &) = delete;
+    TraceWriter &operator=(const TraceWriter &) = delete;
+
+    bool ok() const { return fd >= 0; }
+
+    /* latch CS:IP and registers before run(), emit the record after it */
+    void begin_step(const CPU *cpu);
+    void end_step(const ExitReason &r);
+
+    /* drain the ring and stop the writer thread */
+    void close();
+
+    /* close every live TraceWriter, installed with atexit() */
+    static void close_all();
+
+   private:
+    void push(const uint8_t *p, size_t len);
+    void writer_loop();
+
+    int fd;
+    std::vector<uint8_t> ring;
+    size_t mask;
+    /*
+     * Single producer (the vCPU loop) and single consumer (the writer
+     * thread): tail is only stored by the producer, head only by the
+     * consumer.  Both count bytes and are never wrapped.
+     */
+    std::atomic<size_t> head{0};
+    std::atomic<size_t> tail{0};
+    std::atomic<bool> closing{false};
+    std::thread writer;
+
+    uint16_t cs = 0, ip = 0;
+    uint16_t regs[TR_COUNT];
+    uint16_t last_cs = 0, last_ip = 0;
+    uint16_t last_regs[TR_COUNT] = {};
+    bool first = true;
+
+    TraceWriter *next_live = nullptr;  // for the atexit drain
+    TraceWriter *prev_live = nullptr;
+};
+
+class TraceReader {
+   public:
+    /* fp must be positioned at the magic; false if it does not match */
+    bool open(FILE *fp);
+    /* false at end of file or on a truncated record */
+    bool next(TraceRecord *rec);
+
+   private:
+    FILE *fp = nullptr;
+    TraceRecord state = {};
+};
@@ -1,7 +1,9 @@
 
 #pragma once
 
+#include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <linux/kvm.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,9 +12,20 @@
 #include <sys/mman.h>
 #include <unistd.h>
 
+#include <map>
 #include <memory>
+#include <string>
 
+#include "console.hpp"
+#include "deps.hpp"
+#include "drives.hpp"
 #include "floppy.hpp"
+#include "handles.hpp"
+#include "hostio.hpp"
+#include "profile.hpp"
+#include "stats.hpp"
+#include "timeline.hpp"
+#include "trace.hpp"
 #include "x86.hpp"
 
 struct AddrConfig {
@@ -24,6 +37,8 @@ struct AddrConfig {
 };
 
 static constexpr int INVOKE_SYSTEM_RET_ADDR = 0x200;
+static constexpr uint16_t EXE_LOAD_SEG = 0x110;  // .EXE images start here
+static constexpr int CONSOLE_PORT = 0xe9;  // paravirtual console, OUT only
 enum class ExitCode {
     HLT_BIOS_CALL,
     HLT_DOS_DRIVER,
@@ -31,12 +46,45 @@ enum class ExitCode {
     HLT_DOS_INT,        // int21
     HLT_DOS_EXIT,       // int20
     SINGLE_STEP,
+    KICKED,  // left early for a timer signal, see CPU::kick_pending
+    FAULT,   // can't go on, VM::stop_reason says why
 };
 struct ExitReason {
     ExitCode code;
     int bios_nr;
     int dos_driver_call;
 };
+
+/* why the guest stopped, see VM::stop(); the exit status is separate */
+enum class StopReason {
+    NONE,         // still running
+    DOS_EXIT,     // INT 20h or AH=4Ch
+    INPUT_EOF,    // the console ran out of input for DOS
+    BUDGET,       // RunLimits ran out, run_vm() can go on from here
+    UNSUPPORTED,  // a call, instruction or I/O port the VM doesn't emulate
+    CPU_FAULT,    // KVM shutdown, internal error or unmapped memory
+    HOST_ERROR,   // a host call failed
+};
+const char *stop_reason_name(StopReason r);
+
+/* command line settings that apply to one load_program() */
+struct RunOptions {
+    std::string save_snapshot;     // write a snapshot at the DOS prompt
+    std::string restore_snapshot;  // start from a snapshot instead of init
+    ConsolePolicy console_policy;
+    bool console_device = true;  // serve text output from guest ROM stubs
+    std::string trace;           // record every step to this file
+    bool stats = false;          // report exit statistics at exit
+    std::string stats_json;      // and/or write them to this file
+    std::string profile;         // folded stacks of a sampling profile
+    int profile_hz = 1000;
+    std::string timeline;        // Chrome trace of exits and host I/O
+    std::string deps;            // make rules for the files the run used
+    std::map<char, std::string> drives;  // --drive, letter to host root
+    bool single_step = false;    // disassemble every instruction
+    std::map<int, std::string> symbols;  // --map, for the profiler
+};
+
 enum class RUN_MODE {
     DOS_KERNEL,  // install dos kernel & start dos
     DOS_EXE,     // load exe & run
@@ -45,43 +93,128 @@ enum class RUN_MODE {
     NATIVE       // FFFFFFF0
 };
 
+struct VM;
+
+enum class Backend {
+    AUTO,    // KVM if /dev/kvm is usable, JIT otherwise
+    KVM,
+    JIT,     // translation to host code, interpreter for the rare cases
+    INTERP,  // userspace 8086/80186 interpreter
+};
+
+/* CPU::kick_pending */
+enum {
+    KICK_SAMPLE = 1,    // the profiler's SIGPROF
+    KICK_DEADLINE = 2,  // run_vm()'s time budget
+    KICK_FAULT = 4,     // the backend itself, to leave run() with FAULT
+};
+
+/*
+ * Execution backend. Whatever the backend, the guest register state seen by
+ * the handlers is kept in regs/sregs in KVM's layout; run() executes until
+ * the next exit and reports it with the same ExitCodes.
+ */
 struct CPU {
+    struct kvm_sregs sregs = {};
+    struct kvm_regs regs = {};
+
+    /* KICK_* bits, raised by timer signals: stop at the next instruction
+     * or block boundary, store regs and call handle_kick() */
+    volatile sig_atomic_t kick_pending = 0;
+    volatile uint8_t *immediate_exit = nullptr;  // KVM's, so it leaves too
+
+    virtual ~CPU() {}
+
+    void setup(const AddrConfig &config, RUN_MODE mode);
+
+    virtual ExitReason run(VM *vm, bool single_step) = 0;
+};
+
+struct KvmCPU : CPU {
     int vcpu_fd;
-    struct kvm_sregs sregs;
-    struct kvm_regs regs;
     struct kvm_run *run_data;
+    size_t vcpu_region_size;
+
+    /* exchange registers through run_data->s.regs instead of ioctls */
+    bool use_sync_regs = false;
 
-    CPU(int kvm_fd, int vm_fd) {
+    /* run_data is null if the vCPU could not be set up */
+    KvmCPU(int kvm_fd, int vm_fd) {
+        run_data = nullptr;
         vcpu_fd = ioctl(vm_fd, KVM_CREATE_VCPU, (void *)0);
         if (vcpu_fd < 0) {
             perror("vcpu create");
-            exit(1);
+            return;
         }
-        load_regs_from_vm();
 
-        size_t vcpu_region_size = ioctl(kvm_fd, KVM_GET_VCPU_MMAP_SIZE, NULL);
+        vcpu_region_size = ioctl(kvm_fd, KVM_GET_VCPU_MMAP_SIZE, NULL);
 
         run_data =
             (struct kvm_run *)mmap(0, vcpu_region_size, PROT_READ | PROT_WRITE,
-                                   MAP_PRIVATE, vcpu_fd, 0);
+                                   MAP_SHARED, vcpu_fd, 0);
+        if (run_data == MAP_FAILED) {
+            perror("mmap vcpu");
+            run_data = nullptr;
+            return;
+        }
+        immediate_exit = &run_data->immediate_exit;
+
+        load_regs_from_vm();
+
+        int sync = ioctl(kvm_fd, KVM_CHECK_EXTENSION, KVM_CAP_SYNC_REGS);
+        int need = KVM_SYNC_X86_REGS | KVM_SYNC_X86_SREGS;
+        if (sync > 0 && (sync & need) == need) {
+            /* shared copy mirrors vcpu state from here on */
+            run_data->s.regs.regs = regs;
+            run_data->s.regs.sregs = sregs;
+            run_data->kvm_valid_regs = need;
+            run_data->kvm_dirty_regs = 0;
+            use_sync_regs = true;
+        }
     }
 
     void load_regs_from_vm() {
+        if (use_sync_regs) {
+            /* KVM stored them on exit */
+            regs = run_data->s.regs.regs;
+            sregs = run_data->s.regs.sregs;
+            return;
+        }
         ioctl(vcpu_fd, KVM_GET_SREGS, &sregs);
         ioctl(vcpu_fd, KVM_GET_REGS, &regs);
     }
     void restore_regs_to_vm() {
+        if (use_sync_regs) {
+            /* push back only the sets changed since the last exit */
+            if (memcmp(&run_data->s.regs.regs, &regs, sizeof(regs)) != 0) {
+                run_data->s.regs.regs = regs;
+                run_data->kvm_dirty_regs |= KVM_SYNC_X86_REGS;
+            }
+            if (memcmp(&run_data->s.regs.sregs, &sregs, sizeof(sregs)) != 0) {
+                run_data->s.regs.sregs = sregs;
+                run_data->kvm_dirty_regs |= KVM_SYNC_X86_SREGS;
+            }
+            return;
+        }
         ioctl(vcpu_fd, KVM_SET_SREGS, &sregs);
         ioctl(vcpu_fd, KVM_SET_REGS, &regs);
     }
 
-    ~CPU() { close(vcpu_fd); }
-
-    void setup(const AddrConfig &config, RUN_MODE mode);
+    ~KvmCPU() {
+        if (run_data) {
+            munmap(run_data, vcpu_region_size);
+        }
+        if (vcpu_fd >= 0) {
+            close(vcpu_fd);
+        }
+    }
 
-    ExitReason run(const AddrConfig &config, bool single_step);
+    ExitReason run(VM *vm, bool single_step) override;
 };
 
+std::unique_ptr<CPU> create_interp_cpu();
+std::unique_ptr<CPU> create_jit_cpu();  // the interpreter on non-x86-64
+
 inline void set_seg(struct kvm_segment &sreg, uintptr_t sel_val) {
     sreg.base = sel_val * 16;
     sreg.limit = 0xffff;
@@ -90,73 +223,224 @@ inline void set_seg(struct kvm_segment &sreg, uintptr_t sel_val) {
     sreg.l = 0;
 }
 
+/*
+ * Machine state to return to with VM::reset_to().  Guest memory is kept in
+ * a memfd that VM::full_mem is mapped copy-on-write from, so the pages
+ * changed since are exactly the private ones.
+ */
+struct Baseline {
+    int memfd = -1;
+    uint64_t serial = 0;  // which Baseline full_mem is mapped from
+    struct kvm_regs regs;
+    struct kvm_sregs sregs;
+    AddrConfig addr_config;
+    RUN_MODE run_mode;
+
+    Baseline() = default;
+    Baseline(const Baseline &) = delete;
+    Baseline &operator=(const Baseline &) = delete;
+    ~Baseline() {
+        if (memfd >= 0) {
+            close(memfd);
+        }
+    }
+};
+
 struct VM {
-    int kvm_fd;
-    int vm_fd;
+    static constexpr size_t MEM_SIZE = 1024 * 1024;
+
+    int kvm_fd = -1;  // both -1 without KVM
+    int vm_fd = -1;
     unsigned char *full_mem;
     std::unique_ptr<CPU> cpu;
     AddrConfig addr_config;
     std::unique_ptr<Floppy> floppy;
+    Console console;
+    /* DOS handles of the program, for INT 21h */
+    DosHandles handles;
+    /* where its paths lead, empty for the current directory */
+    DriveMap drives;
+
+    /* OUT to CONSOLE_PORT does not cost an exit */
+    bool console_device = false;
+    /* coalesced PIO ring of the console device, null when not on KVM */
+    struct kvm_coalesced_mmio_ring *console_ring = nullptr;
+    uint32_t console_ring_max = 0;
+
+    /* set by --trace; run_with_handler then single-steps */
+    std::unique_ptr<TraceWriter> trace;
+    /* set by --stats; null means nothing is timed */
+    std::unique_ptr<Stats> stats;
+    /* set by --profile */
+    std::unique_ptr<Profiler> profiler;
+    /* set by --timeline; null means no spans are recorded */
+    std::unique_ptr<Timeline> timeline;
+    /* set by --deps; null means opens are not noted */
+    std::unique_ptr<DepsFile> deps;
 
     RUN_MODE run_mode = RUN_MODE::MBR;
 
-    VM() {
-        kvm_fd = open("/dev/kvm", O_RDWR);
-        if (kvm_fd < 0) {
-            perror("/dev/kvm");
-            exit(1);
-        }
+    /* set by --single-step; run_with_handler disassembles every step */
+    bool single_step = false;
+
+    /* host side of the console and DOS files; see set_io() */
+    HostIO default_io;
+    HostIO *io = &default_io;
+
+    /* set once by stop(), until then NONE */
+    StopReason stop_reason = StopReason::NONE;
+    int exit_status = 0;  // for the process, DOS's AL on DOS_EXIT
+
+    /* what is left of run_vm()'s RunLimits, 0 for no limit */
+    uint64_t steps_left = 0;
+    uint64_t deadline_ns = 0;  // stats_now_ns() clock
+    int handler_depth = 0;     // nested run_with_handler() calls
+
+    /* why the constructor failed, empty when the VM is usable */
+    std::string error;
 
-        full_mem = (unsigned char *)mmap(0, 1024 * 1024, PROT_READ | PROT_WRITE,
+    /* the vCPU as created, for reset() */
+    struct kvm_regs boot_regs;
+    struct kvm_sregs boot_sregs;
+    /* memory and vCPU after create_vm(), taken by the first reset() */
+    std::unique_ptr<Baseline> pristine;
+    uint64_t mapped_baseline = 0;  // Baseline::serial of full_mem, 0 if none
+    int pagemap_fd = -1;           // /proc/self/pagemap, for reset_to()
+
+    explicit VM(Backend backend = Backend::AUTO) {
+        full_mem = (unsigned char *)mmap(0, MEM_SIZE, PROT_READ | PROT_WRITE,
                                          MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
         if (full_mem == MAP_FAILED) {
-            perror("mmap");
-            exit(1);
+            full_mem = nullptr;
+            error = std::string("mmap: ") + strerror(errno);
+            return;
         }
-        memset(full_mem, 0xf4, 1024 * 1024);  // fill by hlt(0xf4)
-
-        vm_fd = ioctl(kvm_fd, KVM_CREATE_VM, NULL);
+        memset(full_mem, 0xf4, MEM_SIZE);  // fill by hlt(0xf4)
 
-        struct kvm_userspace_memory_region mem = {0};
-        mem.slot = 0;
-        mem.flags = 0;
-        mem.guest_phys_addr = 0;
-        mem.memory_size = 1024 * 1024;
-        mem.userspace_addr = (__u64)full_mem;
-        int r = ioctl(vm_fd, KVM_SET_USER_MEMORY_REGION, &mem, NULL);
-        if (r < 0) {
-            perror("kvm set user memory region");
-            exit(1);
+        if (backend == Backend::AUTO || backend == Backend::KVM) {
+            kvm_fd = open("/dev/kvm", O_RDWR);
+            if (kvm_fd < 0 && backend == Backend::KVM) {
+                error = std::string("/dev/kvm: ") + strerror(errno);
+                return;
+            }
         }
 
-        cpu = std::make_unique<CPU>(kvm_fd, vm_fd);
+        if (kvm_fd >= 0) {
+            vm_fd = ioctl(kvm_fd, KVM_CREATE_VM, NULL);
+
+            struct kvm_userspace_memory_region mem = {0};
+            mem.slot = 0;
+            mem.flags = 0;
+            mem.guest_phys_addr = 0;
+            mem.memory_size = MEM_SIZE;
+            mem.userspace_addr = (__u64)full_mem;
+            int r = ioctl(vm_fd, KVM_SET_USER_MEMORY_REGION, &mem, NULL);
+            if (r < 0) {
+                error = std::string("kvm set user memory region: ") +
+                        strerror(errno);
+                return;
+            }
+
+            auto kvm_cpu = std::make_unique<KvmCPU>(kvm_fd, vm_fd);
+            if (!kvm_cpu->run_data) {
+                error = "unable to create the KVM vCPU";
+                return;
+            }
+            cpu = std::move(kvm_cpu);
+        } else if (backend == Backend::INTERP) {
+            cpu = create_interp_cpu();
+        } else {
+            cpu = create_jit_cpu();
+        }
+        boot_regs = cpu->regs;
+        boot_sregs = cpu->sregs;
+        enable_console_device();
+        console.set_io(io);
     }
 
     ~VM() {
-        close(vm_fd);
-        close(kvm_fd);
-        munmap(full_mem, 1024 * 1024);
+        handles.close_all(this);  // write back what the guest left open
+        /* console outlives stats and timeline, don't let it record into them */
+        console.flush();
+        console.set_stats(nullptr);
+        console.set_timeline(nullptr);
+        console.set_io(nullptr);
+        cpu.reset();
+        if (vm_fd >= 0) {
+            close(vm_fd);
+        }
+        if (kvm_fd >= 0) {
+            close(kvm_fd);
+        }
+        if (full_mem) {
+            munmap(full_mem, MEM_SIZE);
+        }
+        if (pagemap_fd >= 0) {
+            close(pagemap_fd);
+        }
+    }
+
+    /* end the run; only the first reason counts */
+    void stop(StopReason why, int status) {
+        if (stop_reason == StopReason::NONE) {
+            stop_reason = why;
+            exit_status = status;
+        }
+    }
+    bool stopped() const { return stop_reason != StopReason::NONE; }
+
+    /* route host I/O through h, which must outlive the VM; null for the
+     * plain system calls */
+    void set_io(HostIO *h) {
+        io = h ? h : &default_io;
+        console.set_io(io);
+    }
+
+    /*
+     * Guest memory as the handlers see it.  Registers come from the guest,
+     * so linear addresses wrap at 1MiB like the A20 line and SP at 64KiB;
+     * buffers that run past the end of memory are refused.
+     */
+    uint16_t peek16(size_t linear) const {
+        return full_mem[linear & (MEM_SIZE - 1)] |
+               full_mem[(linear + 1) & (MEM_SIZE - 1)] << 8;
+    }
+    void poke16(size_t linear, uint16_t val) {
+        full_mem[linear & (MEM_SIZE - 1)] = val;
+        full_mem[(linear + 1) & (MEM_SIZE - 1)] = val >> 8;
+    }
+    /* SS:SP+off */
+    size_t stack_addr(int off) const {
+        return cpu->sregs.ss.base + (uint16_t)(cpu->regs.rsp + off);
+    }
+    /* len bytes at linear, null if they don't fit in memory */
+    unsigned char *guest_ptr(size_t linear, size_t len) {
+        if (linear > MEM_SIZE || len > MEM_SIZE - linear) {
+            return nullptr;
+        }
+        return full_mem + linear;
+    }
+    /* the ASCIZ string at linear, null if memory ends first */
+    const char *guest_str(size_t linear) {
+        if (linear >= MEM_SIZE ||
+            !memchr(full_mem + linear, '\0', MEM_SIZE - linear)) {
+            return nullptr;
+        }
+        return (const char *)full_mem + linear;
     }
 
+    /* FLAGS pushed by the INT being handled */
     void inthandler_clear_cf() {
-        uint16_t &stack_flags =
-            *(uint16_t *)(full_mem + (cpu->sregs.ss.base + cpu->regs.rsp + 4));
-        stack_flags &= ~FLAGS_CF;
+        poke16(stack_addr(4), peek16(stack_addr(4)) & ~FLAGS_CF);
     }
     void inthandler_set_cf() {
-        uint16_t &stack_flags =
-            *(uint16_t *)(full_mem + (cpu->sregs.ss.base + cpu->regs.rsp + 4));
-        stack_flags |= FLAGS_CF;
+        poke16(stack_addr(4), peek16(stack_addr(4)) | FLAGS_CF);
     }
     void inthandler_clear_zf() {
-        uint16_t &stack_flags =
-            *(uint16_t *)(full_mem + (cpu->sregs.ss.base + cpu->regs.rsp + 4));
-        stack_flags &= ~FLAGS_ZF;
+        poke16(stack_addr(4), peek16(stack_addr(4)) & ~FLAGS_ZF);
     }
     void inthandler_set_zf() {
-        uint16_t &stack_flags =
-            *(uint16_t *)(full_mem + (cpu->sregs.ss.base + cpu->regs.rsp + 4));
-        stack_flags |= FLAGS_ZF;
+        poke16(stack_addr(4), peek16(stack_addr(4)) | FLAGS_ZF);
     }
 
     void emu_reti();
@@ -164,7 +448,20 @@ struct VM {
     void emu_far_ret();
     void emu_far_call(uintptr_t cs, uintptr_t ip);
 
-    void set_floppy(const std::string &image_path);
+    /* false if the image can't be used */
+    bool set_floppy(const std::string &image_path);
+    /*
+     * Back to the state create_vm() left it in, for another load_program():
+     * memory, registers, IVT and everything load_program() set up.  The KVM
+     * VM, vCPU and JIT translation cache are kept.
+     */
+    void reset();
+    /* remember memory and registers; null if no memfd can be made */
+    std::unique_ptr<Baseline> take_baseline();
+    /* back to b, rewriting only the pages changed since; false if the
+     * memory could not be restored */
+    bool reset_to(const Baseline &b);
+    void enable_console_device();
 };
 
 void setup_ivt(VM *vm);
@@ -175,9 +472,21 @@ void dump_ivt(const VM *vm);
 void handle_bios_call(VM *vm, const ExitReason *r);
 void handle_dos_driver_call(VM *vm, const ExitReason *r);
 void handle_dos_system_call(VM *vm, const ExitReason *r);
-void install_dos_driver(VM *vm);
+bool install_dos_driver(VM *vm);  // false without MSDOS.SYS
+void install_console_stubs(VM *vm);
+/* handle 1 is the console (con) or not: serve its AH=40h from the stub */
+void console_stub_stdout(VM *vm, bool con);
+void drain_console_device(VM *vm);
+void console_device_io(VM *vm);
 void disasm(const VM *vm);
 void invoke_intr(VM *vm, int intr_nr);
 void run_with_handler(VM *vm);
 ExitReason run(VM *vm, bool single_step);
+/* after CPU::kick_pending: sample for the profiler, true if the run_vm()
+ * deadline has passed and run() should return KICKED */
+bool handle_kick(VM *vm);
+void decode_hlt_exit(const AddrConfig &config, CPU *cpu, ExitReason *ret);
 int load_mz(VM *vm, const std::string &path, const std::string &argv);
+/* load_mz() from memory: null, or why the image was refused */
+const char *load_mz_image(VM *vm, const uint8_t *image, size_t sz,
+                          const std::string &argv);
@@ -20,8 +20,7 @@ void handle_10h(VM *vm) {
 
     switch ((regs.rax >> 8) & 0xff) {
         case 0x0e:
-            putchar(regs.rax & 0xff);
-            fflush(stdout);
+            vm->console.put(regs.rax & 0xff);
             break;
         case 1:  // set cursor shape
             break;
@@ -34,7 +33,8 @@ void handle_10h(VM *vm) {
     }
 }
 
-void handle_13h(VM *vm) {
+/* span is the handle_bios_call one, for the sector range */
+void handle_13h(VM *vm, TimelineSpan *span) {
     auto &regs = vm->cpu->regs;
     auto &sregs = vm->cpu->sregs;
 
@@ -53,35 +53,44 @@ void handle_13h(VM *vm) {
             int num_sector = regs.rax & 0xff;
             int cyl = (regs.rcx >> 8) | (((regs.rcx & 0xc0) << 2) & 0x300);
             int sector = (regs.rcx & 0x3f) - 1;
-            int head = (regs.rdx >> 8);
+            int head = (regs.rdx >> 8) & 0xff;
             int drive = regs.rdx & 0xff;
-            if (drive != 0) {
-                printf("%d\n", drive);
+            if (drive != 0 || !vm->floppy) {
                 vm->inthandler_set_cf();
                 regs.rax = 0x01 << 8;
+                break;
+            }
+            auto floppy = vm->floppy.get();
+            uint32_t buffer = sregs.es.base + (regs.rbx & 0xffff);
+            size_t lba = sector;
+            lba += head * floppy->num_sector;
+            lba += cyl * floppy->num_head * floppy->num_sector;
+
+            span->arg("lba", lba);
+            span->arg("count", num_sector);
+            bool is_read = (regs.rax >> 8 & 0xff) == 2;
+            size_t len = num_sector * 512;
+            uint8_t *addr = vm->guest_ptr(buffer, len);
+            bool ok = false;
+            if (!addr) {
+                regs.rax = 0x09 << 8;  // data boundary error
+            } else if (sector < 0 || sector >= floppy->num_sector ||
+                       head >= floppy->num_head ||
+                       cyl >= floppy->num_cylinder ||
+                       (is_read ? vm->io->disk_read(floppy, addr, len,
+                                                    lba * 512)
+                                : vm->io->disk_write(floppy, addr, len,
+                                                     lba * 512)) !=
+                           (ssize_t)len) {
+                regs.rax = 0x04 << 8;  // sector not found
             } else {
-                uint32_t buffer = sregs.es.base + regs.rbx;
-                int lba = sector;
-                lba += head * vm->floppy->num_sector;
-                lba += cyl * vm->floppy->num_head * vm->floppy->num_sector;
-
-                // dump_regs(fd);
-                // printf(
-                //    "lba=%x (byte=%x) addr=%x, num_sector=%d "
-                //    "cyl=%d sector=%d "
-                //    "head=%d  drive = %d %x\n",
-                //    lba, lba * 512, buffer, num_sector, cyl, sector,
-                //    head, drive, buffer);
-
-                if ((regs.rax >> 8 & 0xff) == 2) {
-                    pread(vm->floppy->image_fd, vm->full_mem + buffer,
-                          num_sector * 512, lba * 512);
-                } else {
-                    pwrite(vm->floppy->image_fd, vm->full_mem + buffer,
-                           num_sector * 512, lba * 512);
-                }
-                regs.rax = num_sector;
+                ok = true;
             }
+            if (!ok) {
+                vm->inthandler_set_cf();
+                break;
+            }
+            regs.rax = num_sector;
             break;
         }
 
@@ -129,8 +138,9 @@ void handle_16h(VM *vm) {
     switch (regs.rax >> 8) {
         case 0x00:
         case 0x10: {
-            char c;
-            read(0, &c, 1);
+            char c = 0;
+            vm->console.before_input();
+            vm->io->read(0, &c, 1);
             if (c == '\n') {
                 c = '\r';
             }
@@ -138,19 +148,7 @@ void handle_16h(VM *vm) {
         } break;
         case 0x01:
         case 0x11: {
-            fd_set rfds;
-            struct timeval tv = {0};
-            FD_ZERO(&rfds);
-
-            FD_SET(0, &rfds);  // stdin
-
-            int r = select(1, &rfds, nullptr, nullptr, &tv);
-            if (r < 0) {
-                perror("select");
-                exit(1);
-            }
-
-            if (FD_ISSET(0, &rfds)) {
+            if (vm->io->console_poll()) {
                 vm->inthandler_clear_zf();
             } else {
                 vm->inthandler_set_zf();
@@ -171,6 +169,8 @@ void handle_bios_call(VM *vm, const ExitReason *r) {
     //auto &sregs = vm->cpu->sregs;
     //auto full_mem = vm->full_mem;
 
+    TimelineSpan span(vm->timeline.get(), "int", "hypercall", r->bios_nr);
+    span.arg("ah", (regs.rax >> 8) & 0xff);
     vm->inthandler_clear_cf();
 
     switch (r->bios_nr) {
@@ -187,7 +187,7 @@ void handle_bios_call(VM *vm, const ExitReason *r) {
             break;
 
         case 0x13:  // disk
-            handle_13h(vm);
+            handle_13h(vm, &span);
             break;
 
         case 0x16:  // kbd
@@ -278,113 +278,3 @@ void handle_bios_call(VM *vm, const ExitReason *r) {
 
     vm->emu_reti();
 }
-
-void handle_dos_driver_call(VM *vm) {
-    auto &regs = vm->cpu->regs;
-    auto &sregs = vm->cpu->sregs;
-    auto full_mem = vm->full_mem;
-
-    bool zf = 0;
-    bool cf = 0;
-
-    /* dos dirver */
-    int dos_driver_call = (regs.rip - 1) / 3;
-    // printf("%x\n", dos_driver_call);
-
-    switch (dos_driver_call) {
-        case DOSIO_STATUS:
-            zf = 1;
-            break;
-        case DOSIO_INP:
-            {
-                int a = getchar();
-                if (a == '\n') {
-                    a = '\r';
-                }
-                regs.rax = a;
-                zf = 0;
-            }
-            break;
-        case DOSIO_OUTP:
-            // puts("print");
-            putchar(regs.rax & 0xff);
-            break;
-
-        case DOSIO_READ:  // disk read
-            /*
-             * AL = Disk I/O driver number
-             * BX = Disk transfer address in DS
-             * CX = Number of sectors to transfer
-             * DX = Logical record number of transfer
-             */
-
-            {
-                auto addr = &full_mem[sregs.ds.base + regs.rbx];
-                pread(vm->floppy->image_fd, addr, regs.rcx * 512, regs.rdx * 512);
-                if (0) {
-                    printf(
-                        "disk read addr=0x%08x, "
-                        "sector=0x%08x(byte=0x%08x), "
-                        "count=%x\n",
-                           (int)(uintptr_t)(sregs.ds.base + regs.rbx), (int)regs.rdx,
-                           (int)regs.rdx * 512, (int)regs.rcx * 512);
-                }
-            }
-            regs.rax = 0;
-            cf = 0;
-            break;
-
-        case DOSIO_WRITE:  // disk read
-            /*
-             * AL = Disk I/O driver number
-             * BX = Disk transfer address in DS
-             * CX = Number of sectors to transfer
-             * DX = Logical record number of transfer
-             */
-
-            {
-                auto addr = &full_mem[sregs.ds.base + regs.rbx];
-                pwrite(vm->floppy->image_fd, addr, regs.rcx * 512, regs.rdx * 512);
-                if (0) {
-                    printf(
-                        "disk read addr=0x%08x, "
-                        "sector=0x%08x(byte=0x%08x), "
-                        "count=%x\n",
-                           (int)(uintptr_t)(sregs.ds.base + regs.rbx), (int)regs.rdx,
-                           (int)regs.rdx * 512, (int)regs.rcx * 512);
-                }
-            }
-            regs.rax = 0;
-            cf = 0;
-            break;
-
-        case DOSIO_DSKCHG:
-            regs.rax = 0;
-            break;
-        case DOSIO_FLUSH:
-            fflush(stdout);
-            break;
-
-        case DOSIO_MAPDEV:
-            break;
-
-        case DOSIO_GETTIME:
-            regs.rax = 0;
-            break;
-
-        default:
-            printf("unknown dos driver call %02x\n", dos_driver_call);
-            exit(1);
-            break;
-    }
-
-    regs.rflags &= ~((1 << 6) | (1 << 0));  // clear zf, cf
-    if (zf) {
-        regs.rflags |= (1 << 6);
-    }
-    if (cf) {
-        regs.rflags |= (1 << 0);
-    }
-
-    vm->emu_far_ret();
-}
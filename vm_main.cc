@@ -1,3 +1,4 @@
+#include <ctype.h>
 #include <elf.h>
 #include <fcntl.h>
 #include <getopt.h>
@@ -13,79 +14,311 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
-#include <map>
-#include <optional>
 #include <string>
+#include <vector>
 
-#include "vm.hpp"
+#include "batch.hpp"
+#include "cache.hpp"
+#include "dosvm.hpp"
+#include "overlay.hpp"
+#include "pipeline.hpp"
+#include "server.hpp"
 
-bool debug = false;
-uint16_t dos21_seg = 0;
-uint16_t dos21_offset = 0;
-std::optional<char> key_queue;
-std::map<int, std::string> dos_map;
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [options] PROGRAM [ARGS]\n"
+            "       %s --server [--socket=PATH] [--pool=N]\n"
+            "       %s --client [--socket=PATH] PROGRAM [ARGS]\n"
+            "       %s --batch=FILE [-j N] [--pin]  lines of DIR PROGRAM "
+            "[ARGS]\n"
+            "       %s --pipeline [--output=FILE]... 'PROGRAM [ARGS]'...\n"
+            "       %s --overlay-create=IMAGE | --overlay-commit | "
+            "--overlay-discard  OVERLAY\n"
+            "options:\n"
+            "  --save-snapshot=FILE     save the machine at the DOS prompt\n"
+            "  --restore-snapshot=FILE  boot from FILE if it matches the "
+            "image\n"
+            "  --console-flush=SPEC     input,newline,size=N,timeout=MS or "
+            "none\n"
+            "  --no-console-device      output through hlt exits only\n"
+            "  --backend=NAME           auto, kvm, jit or interp\n"
+            "  --single-step            disassemble every instruction\n"
+            "  --trace=FILE             record every step to FILE, see "
+            "vmtrace\n"
+            "  --stats                  report exit and hypercall timings\n"
+            "  --stats-json=FILE        write that report to FILE as JSON\n"
+            "  --profile=FILE           sample CS:IP, folded stacks to FILE\n"
+            "  --profile-hz=N           samples per second (1000)\n"
+            "  --map=FILE[@SEG]         LINK .MAP symbols, image at SEG "
+            "(hex)\n"
+            "  --timeline=FILE          Chrome trace of exits, hypercalls and "
+            "host I/O\n"
+            "  --deps=FILE              make rules for the files the run "
+            "read and wrote\n"
+            "  --cache=DIR              reuse the results of identical runs\n"
+            "  --drive=X=DIR            DIR as drive X:, the only files the "
+            "guest sees\n",
+            prog, prog, prog, prog, prog, prog);
+}
 
 int main(int argc, char **argv) {
-    VM vm;
-    if (argc < 2) {
-        return 1;
-    }
+    enum {
+        OPT_SERVER = 256,
+        OPT_CLIENT,
+        OPT_SOCKET,
+        OPT_POOL,
+        OPT_SAVE_SNAPSHOT,
+        OPT_RESTORE_SNAPSHOT,
+        OPT_CONSOLE_FLUSH,
+        OPT_NO_CONSOLE_DEVICE,
+        OPT_BACKEND,
+        OPT_SINGLE_STEP,
+        OPT_TRACE,
+        OPT_STATS,
+        OPT_STATS_JSON,
+        OPT_PROFILE,
+        OPT_PROFILE_HZ,
+        OPT_MAP,
+        OPT_TIMELINE,
+        OPT_BATCH,
+        OPT_PIN,
+        OPT_PIPELINE,
+        OPT_OUTPUT,
+        OPT_CACHE,
+        OPT_DEPS,
+        OPT_DRIVE,
+        OPT_OVERLAY_CREATE,
+        OPT_OVERLAY_COMMIT,
+        OPT_OVERLAY_DISCARD,
+    };
+    static const struct option long_options[] = {
+        {"server", no_argument, nullptr, OPT_SERVER},
+        {"client", no_argument, nullptr, OPT_CLIENT},
+        {"socket", required_argument, nullptr, OPT_SOCKET},
+        {"pool", required_argument, nullptr, OPT_POOL},
+        {"save-snapshot", required_argument, nullptr, OPT_SAVE_SNAPSHOT},
+        {"restore-snapshot", required_argument, nullptr, OPT_RESTORE_SNAPSHOT},
+        {"console-flush", required_argument, nullptr, OPT_CONSOLE_FLUSH},
+        {"no-console-device", no_argument, nullptr, OPT_NO_CONSOLE_DEVICE},
+        {"backend", required_argument, nullptr, OPT_BACKEND},
+        {"single-step", no_argument, nullptr, OPT_SINGLE_STEP},
+        {"trace", required_argument, nullptr, OPT_TRACE},
+        {"stats", no_argument, nullptr, OPT_STATS},
+        {"stats-json", required_argument, nullptr, OPT_STATS_JSON},
+        {"profile", required_argument, nullptr, OPT_PROFILE},
+        {"profile-hz", required_argument, nullptr, OPT_PROFILE_HZ},
+        {"map", required_argument, nullptr, OPT_MAP},
+        {"timeline", required_argument, nullptr, OPT_TIMELINE},
+        {"batch", required_argument, nullptr, OPT_BATCH},
+        {"jobs", required_argument, nullptr, 'j'},
+        {"pin", no_argument, nullptr, OPT_PIN},
+        {"pipeline", no_argument, nullptr, OPT_PIPELINE},
+        {"output", required_argument, nullptr, OPT_OUTPUT},
+        {"cache", required_argument, nullptr, OPT_CACHE},
+        {"deps", required_argument, nullptr, OPT_DEPS},
+        {"drive", required_argument, nullptr, OPT_DRIVE},
+        {"overlay-create", required_argument, nullptr, OPT_OVERLAY_CREATE},
+        {"overlay-commit", no_argument, nullptr, OPT_OVERLAY_COMMIT},
+        {"overlay-discard", no_argument, nullptr, OPT_OVERLAY_DISCARD},
+        {nullptr, 0, nullptr, 0},
+    };
 
-    size_t argv_len = strlen(argv[1]);
-    setup_ivt(&vm);
+    bool server = false;
+    bool client = false;
+    std::string socket_path = default_server_socket();
+    int pool_size = 4;
+    std::string batch_path;
+    int batch_threads = 0;  // one per CPU
+    bool pin = false;
+    bool pipeline = false;
+    std::vector<std::string> outputs;
+    std::string cache_dir;
+    int overlay_op = 0;  // OPT_OVERLAY_*, on the image given as PROGRAM
+    std::string overlay_base;
+    RunOptions opts;
+    Backend backend = Backend::AUTO;
 
-    vm.run_mode = RUN_MODE::DOS_KERNEL;
-    if (argv_len > 4) {
-        if ((argv[1][argv_len - 4] == '.') && (argv[1][argv_len - 3] == 'E') &&
-            (argv[1][argv_len - 2] == 'X') && (argv[1][argv_len - 1] == 'E')) {
-            vm.run_mode = RUN_MODE::DOS_EXE;
-        } else if ((argv[1][argv_len - 4] == '.') &&
-                   (argv[1][argv_len - 3] == 'C') &&
-                   (argv[1][argv_len - 2] == 'O') &&
-                   (argv[1][argv_len - 1] == 'M')) {
-            vm.run_mode = RUN_MODE::DOS_COM;
+    int opt;
+    /* '+' : stop at PROGRAM, so its DOS arguments are left alone */
+    while ((opt = getopt_long(argc, argv, "+j:", long_options, nullptr)) !=
+           -1) {
+        switch (opt) {
+            case OPT_SERVER:
+                server = true;
+                break;
+            case OPT_CLIENT:
+                client = true;
+                break;
+            case OPT_SOCKET:
+                socket_path = optarg;
+                break;
+            case OPT_POOL:
+                pool_size = atoi(optarg);
+                if (pool_size < 1) {
+                    pool_size = 1;
+                }
+                break;
+            case OPT_SAVE_SNAPSHOT:
+                opts.save_snapshot = optarg;
+                break;
+            case OPT_RESTORE_SNAPSHOT:
+                opts.restore_snapshot = optarg;
+                break;
+            case OPT_CONSOLE_FLUSH:
+                if (!parse_console_policy(optarg, &opts.console_policy)) {
+                    fprintf(stderr, "bad --console-flush: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_NO_CONSOLE_DEVICE:
+                opts.console_device = false;
+                break;
+            case OPT_BACKEND:
+                if (strcmp(optarg, "auto") == 0) {
+                    backend = Backend::AUTO;
+                } else if (strcmp(optarg, "kvm") == 0) {
+                    backend = Backend::KVM;
+                } else if (strcmp(optarg, "jit") == 0) {
+                    backend = Backend::JIT;
+                } else if (strcmp(optarg, "interp") == 0) {
+                    backend = Backend::INTERP;
+                } else {
+                    fprintf(stderr, "bad --backend: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_SINGLE_STEP:
+                opts.single_step = true;
+                break;
+            case OPT_TRACE:
+                opts.trace = optarg;
+                break;
+            case OPT_STATS:
+                opts.stats = true;
+                break;
+            case OPT_STATS_JSON:
+                opts.stats_json = optarg;
+                break;
+            case OPT_PROFILE:
+                opts.profile = optarg;
+                break;
+            case OPT_PROFILE_HZ:
+                opts.profile_hz = atoi(optarg);
+                if (opts.profile_hz < 1) {
+                    opts.profile_hz = 1;
+                }
+                break;
+            case OPT_MAP: {
+                std::string path = optarg;
+                uint16_t seg = EXE_LOAD_SEG;
+                size_t at = path.rfind('@');
+                if (at != std::string::npos) {
+                    seg = strtoul(path.c_str() + at + 1, nullptr, 16);
+                    path.resize(at);
+                }
+                if (!load_dos_map(path, seg, &opts.symbols)) {
+                    return 1;
+                }
+            } break;
+            case OPT_TIMELINE:
+                opts.timeline = optarg;
+                break;
+            case OPT_BATCH:
+                batch_path = optarg;
+                break;
+            case 'j':
+                batch_threads = atoi(optarg);
+                if (batch_threads < 1) {
+                    batch_threads = 1;
+                }
+                break;
+            case OPT_PIN:
+                pin = true;
+                break;
+            case OPT_PIPELINE:
+                pipeline = true;
+                break;
+            case OPT_OUTPUT:
+                outputs.push_back(optarg);
+                break;
+            case OPT_CACHE:
+                cache_dir = optarg;
+                break;
+            case OPT_DEPS:
+                opts.deps = optarg;
+                break;
+            case OPT_DRIVE:
+                if (!isalpha((unsigned char)optarg[0]) || optarg[1] != '=' ||
+                    optarg[2] == '\0') {
+                    fprintf(stderr, "bad --drive: %s, expected X=DIR\n",
+                            optarg);
+                    return 1;
+                }
+                opts.drives[toupper((unsigned char)optarg[0])] = optarg + 2;
+                break;
+            case OPT_OVERLAY_CREATE:
+                overlay_base = optarg;
+                overlay_op = opt;
+                break;
+            case OPT_OVERLAY_COMMIT:
+            case OPT_OVERLAY_DISCARD:
+                overlay_op = opt;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
         }
     }
 
-    if (vm.run_mode == RUN_MODE::DOS_KERNEL) {
-        vm.set_floppy(argv[1]);
-        install_dos_driver(&vm);
+    if (server) {
+        return server_main(socket_path, pool_size, backend);
     }
-    vm.cpu->setup(vm.addr_config, vm.run_mode);
-
-    if (vm.run_mode == RUN_MODE::DOS_EXE) {
-        std::string dos_argv = "";
-        if (argc > 2) {
-            dos_argv = argv[2];
-        }
-
-        if (load_mz(&vm, argv[1], dos_argv) == -1) {
+    if (!batch_path.empty()) {
+        return batch_main(batch_path, batch_threads, pin, backend);
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (overlay_op == OPT_OVERLAY_CREATE) {
+        return create_overlay(argv[optind], overlay_base) ? 0 : 1;
+    }
+    if (overlay_op) {
+        auto overlay = Overlay::open(argv[optind]);
+        if (!overlay) {
             return 1;
         }
-    } else if (vm.run_mode == RUN_MODE::DOS_KERNEL) {
-        set_seg(vm.cpu->sregs.es, vm.addr_config.dos_seg);
-        set_seg(vm.cpu->sregs.ds, vm.addr_config.dos_io_seg);
-        /* dos init */
-        vm.emu_far_call(vm.addr_config.dos_seg, 0);
-
-        int addr = vm.cpu->sregs.ds.base;
+        bool ok = overlay_op == OPT_OVERLAY_COMMIT ? overlay->commit()
+                                                   : overlay->discard();
+        return ok ? 0 : 1;
+    }
+    if (pipeline) {
+        std::vector<std::string> stages(argv + optind, argv + argc);
+        return pipeline_main(stages, outputs, backend, opts);
+    }
 
-        auto command_com = vm.floppy->read("COMMAND ", "COM");
-        if (!command_com) {
-            fprintf(stderr, "unable to read COMMAND.COM");
-            exit(1);
-        }
-        memcpy(vm.full_mem + addr + 0x100, command_com->data(),
-               command_com->size());
+    std::string dos_argv = "";
+    if (argc > optind + 1) {
+        dos_argv = argv[optind + 1];
+    }
 
-        set_seg(vm.cpu->sregs.es, vm.cpu->sregs.ds.selector);
-        set_seg(vm.cpu->sregs.ss, vm.cpu->sregs.ds.selector);
-        set_seg(vm.cpu->sregs.cs, vm.cpu->sregs.ds.selector);
-        vm.cpu->regs.rsp = 0x5c;
-        vm.cpu->regs.rip = 0x100;  // command com start
+    if (client && !cache_dir.empty()) {
+        fprintf(stderr, "--cache: not passed on by --client\n");
+        return 1;
+    }
+    if (client) {
+        return client_main(socket_path, argv[optind], dos_argv, opts);
     }
 
-    run_with_handler(&vm);
+    if (!cache_dir.empty()) {
+        return cached_run(cache_dir, backend, argv[optind], dos_argv, opts);
+    }
 
-    return 0;
+    std::string error;
+    auto vm = create_vm(backend, &error);
+    if (!vm) {
+        fprintf(stderr, "%s\n", error.c_str());
+        return 1;
+    }
+    return run_program(vm.get(), argv[optind], dos_argv, opts);
 }
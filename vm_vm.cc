@@ -3,40 +3,36 @@
 void VM::emu_reti() {
     auto &regs = cpu->regs;
     auto &sregs = cpu->sregs;
-    uint16_t prev_ip = *(uint16_t *)(full_mem + (sregs.ss.base + regs.rsp));
-    uint16_t prev_cs = *(uint16_t *)(full_mem + (sregs.ss.base + regs.rsp + 2));
-    uint16_t prev_flags =
-        *(uint16_t *)(full_mem + (sregs.ss.base + regs.rsp + 4));
+    uint16_t prev_ip = peek16(stack_addr(0));
+    uint16_t prev_cs = peek16(stack_addr(2));
+    uint16_t prev_flags = peek16(stack_addr(4));
 
     sregs.cs.base = prev_cs * 16;
     sregs.cs.selector = prev_cs;
     regs.rflags = prev_flags;
     regs.rip = prev_ip;
-    regs.rsp += 6;
+    regs.rsp = (uint16_t)(regs.rsp + 6);
 }
 
 void VM::emu_far_ret() {
     auto &regs = cpu->regs;
     auto &sregs = cpu->sregs;
 
-    uint16_t prev_ip = *(uint16_t *)(full_mem + (sregs.ss.base + regs.rsp));
-    uint16_t prev_cs = *(uint16_t *)(full_mem + (sregs.ss.base + regs.rsp + 2));
+    uint16_t prev_ip = peek16(stack_addr(0));
+    uint16_t prev_cs = peek16(stack_addr(2));
 
     sregs.cs.base = prev_cs * 16;
     sregs.cs.selector = prev_cs;
 
     regs.rip = prev_ip;
-    regs.rsp += 4;
+    regs.rsp = (uint16_t)(regs.rsp + 4);
 }
 
 void VM::emu_push16(uint16_t val) {
     auto &regs = cpu->regs;
-    auto &sregs = cpu->sregs;
-
-    regs.rsp -= 2;
-    auto dest = (uint16_t *)(full_mem + sregs.ss.base + regs.rsp);
 
-    *dest = val;
+    regs.rsp = (uint16_t)(regs.rsp - 2);
+    poke16(stack_addr(0), val);
 }
 
 void VM::emu_far_call(uintptr_t cs, uintptr_t ip) {
@@ -49,6 +45,64 @@ void VM::emu_far_call(uintptr_t cs, uintptr_t ip) {
     run_with_handler(this);
 }
 
-void VM::set_floppy(const std::string &image_path) {
+bool VM::set_floppy(const std::string &image_path) {
     this->floppy = std::make_unique<Floppy>(image_path);
+    return this->floppy->ok();
+}
+
+void VM::reset() {
+    handles.close_all(this);
+    console.flush();
+    console.set_stats(nullptr);
+    console.set_timeline(nullptr);
+    trace.reset();
+    profiler.reset();
+    stats.reset();
+    timeline.reset();
+    deps.reset();
+    drives.clear();
+    floppy.reset();
+
+    /* the JIT and the interpreter drop what they decoded when run() finds
+     * memory changed behind them, as after any hypercall */
+    if (!pristine || !reset_to(*pristine)) {
+        memset(full_mem, 0xf4, MEM_SIZE);
+        setup_ivt(this);
+        addr_config = AddrConfig();
+        run_mode = RUN_MODE::MBR;
+        cpu->regs = boot_regs;
+        cpu->sregs = boot_sregs;
+        cpu->kick_pending = 0;
+        /* later resets put back only the pages a job wrote */
+        if (!pristine) {
+            pristine = take_baseline();
+        }
+    }
+    single_step = false;
+
+    stop_reason = StopReason::NONE;
+    exit_status = 0;
+    steps_left = 0;
+    deadline_ns = 0;
+    handler_depth = 0;
+}
+
+const char *stop_reason_name(StopReason r) {
+    switch (r) {
+        case StopReason::NONE:
+            return "none";
+        case StopReason::DOS_EXIT:
+            return "dos_exit";
+        case StopReason::INPUT_EOF:
+            return "input_eof";
+        case StopReason::BUDGET:
+            return "budget";
+        case StopReason::UNSUPPORTED:
+            return "unsupported";
+        case StopReason::CPU_FAULT:
+            return "cpu_fault";
+        case StopReason::HOST_ERROR:
+            return "host_error";
+    }
+    return "?";
 }
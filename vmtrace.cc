@@ -0,0 +1,150 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "trace.hpp"
+
+/* vmtrace: print, filter or summarize a trace written by vm --trace */
+
+namespace {
+
+/* indexed by ExitCode */
+const char *const code_names[8] = {"bios", "driver", "return", "int21",
+                                   "exit", "step",   "kick",   "fault"};
+constexpr int CODE_STEP = 5;
+
+void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [options] TRACE\n"
+            "  --exits          only hypercall exits, no plain steps\n"
+            "  --cs=SEG         only steps in this code segment (hex)\n"
+            "  --ip=LO-HI       only steps with LO <= IP <= HI (hex)\n"
+            "  --regs           print the full register set of each step\n"
+            "  --summary        counts per exit kind and the hottest CS:IP\n",
+            prog);
+}
+
+void print_record(const TraceRecord &rec, bool all_regs) {
+    printf("%04X:%04X  %-6s", rec.cs, rec.ip, code_names[rec.code]);
+    if (rec.has_nr) {
+        printf(" %02X", rec.nr);
+    }
+    for (int i = 0; i < TR_COUNT; i++) {
+        if (all_regs || (rec.changed & (1 << i))) {
+            printf(" %s=%04X", trace_reg_names[i], rec.regs[i]);
+        }
+    }
+    putchar('\n');
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    enum { OPT_EXITS = 256, OPT_CS, OPT_IP, OPT_REGS, OPT_SUMMARY };
+    static const struct option long_options[] = {
+        {"exits", no_argument, nullptr, OPT_EXITS},
+        {"cs", required_argument, nullptr, OPT_CS},
+        {"ip", required_argument, nullptr, OPT_IP},
+        {"regs", no_argument, nullptr, OPT_REGS},
+        {"summary", no_argument, nullptr, OPT_SUMMARY},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    bool exits_only = false;
+    int cs_filter = -1;
+    unsigned ip_lo = 0, ip_hi = 0xffff;
+    bool all_regs = false;
+    bool summary = false;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case OPT_EXITS:
+                exits_only = true;
+                break;
+            case OPT_CS:
+                cs_filter = strtoul(optarg, nullptr, 16);
+                break;
+            case OPT_IP:
+                if (sscanf(optarg, "%x-%x", &ip_lo, &ip_hi) != 2) {
+                    fprintf(stderr, "bad --ip: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_REGS:
+                all_regs = true;
+                break;
+            case OPT_SUMMARY:
+                summary = true;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind + 1 != argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    FILE *fp = fopen(argv[optind], "rb");
+    if (!fp) {
+        perror(argv[optind]);
+        return 1;
+    }
+    TraceReader reader;
+    if (!reader.open(fp)) {
+        fprintf(stderr, "%s: not a vm trace\n", argv[optind]);
+        return 1;
+    }
+
+    uint64_t per_code[8] = {};
+    std::unordered_map<uint32_t, uint64_t> hot;
+    TraceRecord rec;
+    while (reader.next(&rec)) {
+        if (exits_only && rec.code == CODE_STEP) {
+            continue;
+        }
+        if (cs_filter >= 0 && rec.cs != cs_filter) {
+            continue;
+        }
+        if (rec.ip < ip_lo || rec.ip > ip_hi) {
+            continue;
+        }
+        if (summary) {
+            per_code[rec.code]++;
+            hot[(uint32_t)rec.cs << 16 | rec.ip]++;
+        } else {
+            print_record(rec, all_regs);
+        }
+    }
+    fclose(fp);
+
+    if (summary) {
+        for (int i = 0; i < 8; i++) {
+            if (per_code[i]) {
+                printf("%-8s %12llu\n", code_names[i],
+                       (unsigned long long)per_code[i]);
+            }
+        }
+        std::vector<std::pair<uint64_t, uint32_t>> top;
+        for (auto &h : hot) {
+            top.push_back({h.second, h.first});
+        }
+        size_t n = std::min<size_t>(top.size(), 20);
+        std::partial_sort(top.begin(), top.begin() + n, top.end(),
+                          std::greater<>());
+        printf("\nhottest:\n");
+        for (size_t i = 0; i < n; i++) {
+            printf("%04X:%04X %12llu\n", top[i].second >> 16,
+                   top[i].second & 0xffff, (unsigned long long)top[i].first);
+        }
+    }
+    return 0;
+}